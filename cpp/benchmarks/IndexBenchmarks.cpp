@@ -0,0 +1,122 @@
+#include "../include/IndexSearch.h"
+#include "../include/IoUring.h"
+#include "../include/Segment.h"
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+/*
+    Random offset lookups in sealed indexes, i.e. the index probe of a fetch
+    far behind the tail. The plain index is searched with a binary search
+    over the sorted entries, the finalized one through its search tree.
+*/
+class IndexFixture : public benchmark::Fixture {
+  public:
+    void SetUp(const benchmark::State &state) override {
+        count_ = state.range(0);
+        bool finalize = state.range(1) != 0;
+        dir_ = std::filesystem::temp_directory_path() /
+               ("IndexBenchmarks" + std::to_string(count_) +
+                (finalize ? "Tree" : "Sorted"));
+        std::filesystem::remove_all(dir_);
+        {
+            Index index(dir_, 0, SegmentState::Active);
+            std::vector<IndexFileEntry> entries(count_);
+            for (uint64_t i = 0; i < count_; ++i)
+                entries[i] = {i, static_cast<uint32_t>(i * 100)};
+            IoBatch batch;
+            index.stage(batch, entries);
+            batch.execute(nullptr);
+            index.publish(entries);
+            if (finalize)
+                index.finalize();
+        }
+        index_ = std::make_unique<Index>(dir_, 0, SegmentState::Sealed);
+        std::mt19937_64 rng(42);
+        offsets_.resize(1 << 16);
+        for (auto &offset : offsets_)
+            offset = rng() % count_;
+    }
+
+    void TearDown(const benchmark::State &state) override {
+        index_.reset();
+        std::filesystem::remove_all(dir_);
+    }
+
+  protected:
+    std::filesystem::path dir_;
+    uint64_t count_;
+    std::unique_ptr<Index> index_;
+    std::vector<uint64_t> offsets_;
+};
+
+BENCHMARK_DEFINE_F(IndexFixture, DetermineClosestIndex)
+(benchmark::State &state) {
+    size_t i = 0;
+    for (auto _ : state) {
+        uint64_t offset = offsets_[i++ & (offsets_.size() - 1)];
+        auto entry = index_->determineClosestIndex(offset);
+        benchmark::DoNotOptimize(entry);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_DEFINE_F(IndexFixture, FindByFilePosition)
+(benchmark::State &state) {
+    size_t i = 0;
+    for (auto _ : state) {
+        uint64_t offset = offsets_[i++ & (offsets_.size() - 1)];
+        auto entry = index_->findByFilePosition(offset * 100 + 50);
+        benchmark::DoNotOptimize(entry);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// entries (1 KiB to 64 MiB of index) x sorted (0) or search tree (1)
+BENCHMARK_REGISTER_F(IndexFixture, DetermineClosestIndex)
+    ->ArgsProduct({{1 << 7, 1 << 13, 1 << 17, 1 << 20, 1 << 23}, {0, 1}});
+BENCHMARK_REGISTER_F(IndexFixture, FindByFilePosition)
+    ->ArgsProduct({{1 << 7, 1 << 13, 1 << 17, 1 << 20, 1 << 23}, {0, 1}});
+
+/*
+    The search kernels on sorted entries in memory, as in an active index or
+    the mapping of a version 1 sealed index: a plain binary search (0) and
+    binary search finished by SSE2 (1) or AVX2 (2) compares.
+*/
+static void SearchEntries(benchmark::State &state) {
+    uint64_t count = state.range(0);
+    auto kernel = static_cast<SearchKernel>(state.range(1));
+    if (kernel > defaultSearchKernel()) {
+        state.SkipWithError("kernel not supported by this cpu");
+        return;
+    }
+    std::vector<uint64_t> entries(count);
+    for (uint64_t i = 0; i < count; ++i)
+        entries[i] = (i * 100) << 32 | i;
+    std::mt19937_64 rng(42);
+    std::vector<uint32_t> keys(1 << 16);
+    for (auto &key : keys)
+        key = rng() % count;
+    const char *data = reinterpret_cast<const char *>(entries.data());
+    size_t i = 0;
+    for (auto _ : state) {
+        uint32_t key = keys[i++ & (keys.size() - 1)];
+        benchmark::DoNotOptimize(searchEntries(data, count, key, 0, kernel));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(SearchEntries)
+    ->ArgsProduct({{16, 64, 1 << 10, 1 << 16, 1 << 20, 1 << 23}, {0, 1, 2}});
+
+} // namespace broker
+} // namespace kafka_lite
+
+BENCHMARK_MAIN();
@@ -0,0 +1,128 @@
+#include "../include/BrokerClient.h"
+#include "../include/BrokerCore.h"
+#include "../include/BrokerServer.h"
+#include "../include/Replication.h"
+#include <benchmark/benchmark.h>
+#include <boost/asio/io_context.hpp>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+// a broker on loopback with its own io_context thread
+class LoopbackBroker {
+  public:
+    LoopbackBroker(const std::filesystem::path &dir,
+                   const ReplicationConfig &replication) {
+        auto core = std::make_unique<BrokerCore>(dir, 64 * 1024 * 1024,
+                                                 LogConfig{}, replication);
+        core_ = core.get();
+        server_ = std::make_unique<BrokerServer>(0, std::move(core),
+                                                 io_context_);
+        thread_ = std::thread([this]() { io_context_.run(); });
+    }
+    ~LoopbackBroker() {
+        io_context_.stop();
+        thread_.join();
+    }
+    unsigned int port() { return server_->port(); }
+    BrokerCore &core() { return *core_; }
+
+  private:
+    boost::asio::io_context io_context_;
+    std::unique_ptr<BrokerServer> server_;
+    BrokerCore *core_;
+    std::thread thread_;
+};
+
+/*
+    A producer pipelines a burst of appends to the leader, then we wait until
+    the follower has replicated all of them. lag_us is the time from the
+    leader acknowledging the last record of a burst until the follower has
+    it, hw_lag_us until the leader's high watermark covers it, i.e. until
+    consumers can fetch it.
+*/
+class ReplicationFixture : public benchmark::Fixture {
+  public:
+    void SetUp(const benchmark::State &state) override {
+        auto base = std::filesystem::temp_directory_path() /
+                    ("ReplicationBenchmarks" + std::to_string(state.range(0)) +
+                     "-" + std::to_string(state.range(1)));
+        leader_dir_ = base / "leader";
+        follower_dir_ = base / "follower";
+        std::filesystem::remove_all(base);
+        leader_ = std::make_unique<LoopbackBroker>(leader_dir_,
+                                                   ReplicationConfig{});
+        follower_ = std::make_unique<LoopbackBroker>(
+            follower_dir_, ReplicationConfig{.leader_port = leader_->port(),
+                                             .replica_id = 1,
+                                             .sync_max_wait_ms = 100});
+        producer_ = std::make_unique<BrokerClient>(leader_->port());
+    }
+
+    void TearDown(const benchmark::State &state) override {
+        producer_.reset();
+        follower_.reset();
+        leader_.reset();
+        std::filesystem::remove_all(leader_dir_.parent_path());
+    }
+
+  protected:
+    std::filesystem::path leader_dir_, follower_dir_;
+    std::unique_ptr<LoopbackBroker> leader_, follower_;
+    std::unique_ptr<BrokerClient> producer_;
+};
+
+BENCHMARK_DEFINE_F(ReplicationFixture, ReplicationLag)
+(benchmark::State &state) {
+    using clock = std::chrono::steady_clock;
+    size_t burst = state.range(0);
+    std::vector<uint8_t> payload(state.range(1), 0x5a);
+    std::vector<uuid> ids(burst);
+    double lag_us = 0, hw_lag_us = 0;
+    for (auto _ : state) {
+        for (auto &id : ids)
+            id = producer_->send_append(payload);
+        for (const auto &id : ids) {
+            if (producer_->receive(id).response_code != 0) {
+                state.SkipWithError("append failed");
+                return;
+            }
+        }
+        auto acked = clock::now();
+        uint64_t end_offset = leader_->core().log_end_offset();
+        while (follower_->core().log_end_offset() < end_offset)
+            std::this_thread::yield();
+        lag_us += std::chrono::duration<double, std::micro>(clock::now() -
+                                                            acked)
+                      .count();
+        while (leader_->core().high_watermark() < end_offset)
+            std::this_thread::yield();
+        hw_lag_us += std::chrono::duration<double, std::micro>(clock::now() -
+                                                               acked)
+                         .count();
+    }
+    state.counters["lag_us"] =
+        benchmark::Counter(lag_us, benchmark::Counter::kAvgIterations);
+    state.counters["hw_lag_us"] =
+        benchmark::Counter(hw_lag_us, benchmark::Counter::kAvgIterations);
+    state.SetItemsProcessed(state.iterations() * burst);
+    state.SetBytesProcessed(state.iterations() * burst * payload.size());
+}
+
+// burst size and record size
+BENCHMARK_REGISTER_F(ReplicationFixture, ReplicationLag)
+    ->ArgsProduct({{1, 64, 1024}, {100, 4096}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+} // namespace broker
+} // namespace kafka_lite
+
+BENCHMARK_MAIN();
@@ -3,6 +3,8 @@
 
 #include <condition_variable>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <queue>
 #include <system_error>
 #include <vector>
@@ -11,6 +13,8 @@ using AppendCallback = std::function<void(uint64_t offset, std::error_code ec)>;
 
 namespace kafka_lite {
 namespace broker {
+class BufferPool;
+
 struct AppendJob {
     AppendJob() = default;
     AppendJob(AppendJob &job_) = delete;
@@ -21,8 +25,14 @@ struct AppendJob {
 
     ~AppendJob() = default;
 
+    // the record starts at record_offset, see AppendData
     std::vector<uint8_t> payload;
+    size_t record_offset = 0;
     AppendCallback callback;
+    std::shared_ptr<BufferPool> buffer_pool;
+    uint8_t attributes = 0;
+    // the callback waits for the fsync (and the replicas)
+    bool durable = false;
 };
 
 class AppendQueue {
@@ -5,6 +5,8 @@
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <cstdint>
+#include <map>
+#include <mutex>
 #include <vector>
 
 namespace kafka_lite {
@@ -12,19 +14,86 @@ namespace broker {
 
 using tcp = boost::asio::ip::tcp;
 
+/*
+    Keeps a single connection to the broker open and reuses it for all
+    requests. Requests can be pipelined with send_append/send_fetch and the
+    responses collected with receive, which matches them by correlation id.
+    All fetches of a client belong to one fetch session, so sequential
+    fetches let the broker skip the index lookup. Likewise every client is an
+    idempotent producer with a random producer id.
+*/
 class BrokerClient {
   public:
     BrokerClient(unsigned int port);
-    TcpResponse append(const std::vector<uint8_t> &payload);
-    TcpResponse fetch(uint64_t offset, uint32_t max_bytes);
+    // Appends without acknowledgement (AppendAcks::None) get no response,
+    // send them with send_append, append throws std::invalid_argument.
+    TcpResponse append(const std::vector<uint8_t> &payload,
+                       AppendAcks acks = AppendAcks::Leader);
+    // appends the payloads as one compressed batch, i.e. at a single offset
+    TcpResponse append_batch(const std::vector<std::vector<uint8_t>> &payloads,
+                             CompressionCodec codec,
+                             AppendAcks acks = AppendAcks::Leader);
+    // Appends the payloads as the batch with the given sequence number of
+    // this producer. The broker writes each sequence once, a retry of a
+    // written batch fails with 0x06 and a batch after a gap with 0x07, so
+    // batches can be pipelined and resent after errors.
+    TcpResponse
+    producer_append(const std::vector<std::vector<uint8_t>> &payloads,
+                    uint32_t sequence,
+                    CompressionCodec codec = CompressionCodec::None,
+                    AppendAcks acks = AppendAcks::Leader);
+    // with min_bytes > 0 the broker holds the fetch for up to max_wait_ms
+    // until that many bytes are available
+    TcpResponse fetch(uint64_t offset, uint32_t max_bytes,
+                      uint32_t min_bytes = 0, uint32_t max_wait_ms = 0);
+    uuid send_append(const std::vector<uint8_t> &payload,
+                     AppendAcks acks = AppendAcks::Leader);
+    uuid send_append_batch(const std::vector<std::vector<uint8_t>> &payloads,
+                           CompressionCodec codec,
+                           AppendAcks acks = AppendAcks::Leader);
+    uuid send_producer_append(
+        const std::vector<std::vector<uint8_t>> &payloads, uint32_t sequence,
+        CompressionCodec codec = CompressionCodec::None,
+        AppendAcks acks = AppendAcks::Leader);
+    uuid send_fetch(uint64_t offset, uint32_t max_bytes,
+                    uint32_t min_bytes = 0, uint32_t max_wait_ms = 0);
+    // The broker pushes the records from offset on as responses with the
+    // returned correlation id, collect them with receive. At most window
+    // bytes of pushed records are queued on the broker side.
+    uuid send_subscribe(uint64_t offset, uint32_t window);
+    // For followers, offset is their log end offset. The response payload is
+    // the high watermark of the leader followed by the records.
+    TcpResponse replica_sync(uint64_t replica_id, uint64_t offset,
+                             uint32_t max_bytes, uint32_t max_wait_ms);
+    uuid send_replica_sync(uint64_t replica_id, uint64_t offset,
+                           uint32_t max_bytes, uint32_t max_wait_ms);
+    TcpResponse receive(const uuid &correlation_id);
     TcpResponse send_raw_request(const TcpRequest &request); // for testing
+    void close();
+    // Makes a request that waits for the broker in another thread fail, and
+    // every later one. Unlike everything else it may be called from another
+    // thread.
+    void shutdown();
+    uint64_t producer_id() const { return producer_id_; }
 
   private:
+    void ensure_connected();
+    void send_request(const TcpHeaders &headers,
+                      const std::vector<uint8_t> &payload);
     void send_header_len_and_magic_bytes(uint32_t len, tcp::socket &socket);
     void send_payload(tcp::socket &socket, const std::vector<uint8_t> &payload);
     TcpResponse recv_response(tcp::socket &socket);
     unsigned int port_;
     boost::asio::io_context io_context_;
+    tcp::socket socket_;
+    // guards opening and closing socket_ against shutdown
+    std::mutex socket_mutex_;
+    bool shut_down_;
+    tcp::resolver::results_type endpoints_;
+    // subscriptions receive several responses with the same correlation id
+    std::multimap<uuid, TcpResponse> pending_responses_;
+    uint64_t fetch_session_id_;
+    uint64_t producer_id_;
 };
 
 } // namespace broker
@@ -3,38 +3,115 @@
 
 #include "AppendQueue.h"
 #include "BrokerCoreIfc.h"
+#include "FanOutBuffer.h"
+#include "FetchCoalescer.h"
+#include "FetchPurgatory.h"
 #include "Log.h"
+#include "Replication.h"
 #include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <thread>
+#include <vector>
 
 namespace kafka_lite {
 namespace broker {
+class BrokerClient;
+
+// tail of the log kept in memory for subscribers
+static constexpr size_t FAN_OUT_BUFFER_SIZE = 8 * 1024 * 1024;
 
 enum class BrokerCoreStatus { Starting, Recovering, Active, Stopping, Stopped };
 
 class BrokerCore : public BrokerCoreIfc {
   public:
-    BrokerCore(const std::filesystem::path &dir, uint64_t segment_size);
+    BrokerCore(const std::filesystem::path &dir, uint64_t segment_size,
+               const LogConfig &log_config = {},
+               const ReplicationConfig &replication = {});
     ~BrokerCore();
 
-    void submit_append(const AppendData &data,
-                       AppendCallback callback) override;
+    void submit_append(AppendData data, AppendCallback callback) override;
     void submit_fetch(const FetchData &data, FetchCallback callback) override;
+    void submit_replica_sync(uint64_t replica_id, const FetchData &data,
+                             ReplicaSyncCallback callback) override;
     void start() override;
     void stop() override;
     uint64_t get_published_offset() override {
         return append_log_.getPublishedOffset();
     }
+    uint64_t add_subscriber(SubscriptionListener listener) override;
+    void remove_subscriber(uint64_t id) override;
+    uint64_t read_subscription(uint64_t offset, size_t max_bytes,
+                               FetchResult &result,
+                               std::error_code &ec) override;
+
+    size_t parked_fetches() const { return purgatory_.size(); }
+    TailCacheStats tail_cache_stats() const {
+        return append_log_.tailCacheStats();
+    }
+    uint64_t coalesced_fetches() const { return coalescer_.coalesced(); }
+    // rounds of the tiering thread that failed
+    uint64_t tiering_errors() const {
+        return tiering_errors_.load(std::memory_order_relaxed);
+    }
+    // consumers only see the records before it
+    uint64_t high_watermark();
+    // offset of the next record appended, or replicated on a follower
+    uint64_t log_end_offset() const { return append_log_.endOffset(); }
+    bool is_follower() const { return replication_.leader_port != 0; }
+    size_t in_sync_replicas() const { return replicas_.inSyncReplicas(); }
 
   private:
     void writerLoop();
+    void tieringLoop();
+    // on followers instead of the writer loop
+    void replicaLoop();
+    // lets parked fetches and subscribers read up to the new high watermark
+    // and acknowledges the durable appends below it
+    void highWatermarkMoved();
+    void completeDurableAppends(std::error_code ec = {});
+    void completeParkedFetch(ParkedFetch &fetch);
+    // hands appended records to the subscribers, as the tail cache's chunks
+    // if the log returned them
+    void publish(uint64_t first_offset, std::span<const RecordSlice> records,
+                 std::vector<std::shared_ptr<const RecordChunk>> &chunks);
+    // Log::fetch behind the single flight coalescer
+    FetchResult readLog(const FetchData &data);
 
     AppendQueue append_queue_;
     Log append_log_;
+    FetchCoalescer coalescer_;
+    FetchPurgatory purgatory_;
+    FanOutBuffer fan_out_;
     BrokerCoreStatus status_;
     std::thread writer_thread;
+    // uploads sealed segments if the log has a remote store
+    std::thread tiering_thread_;
+    std::chrono::milliseconds tiering_interval_;
+    std::atomic<uint64_t> tiering_errors_;
+    ReplicationConfig replication_;
+    // followers of a leader
+    ReplicaTracker replicas_;
+    // of the leader, as of the last ReplicaSync of a follower
+    std::atomic<uint64_t> leader_high_watermark_;
+    std::thread replica_thread_;
+    // the replica thread's connection to the leader, shut down by stop()
+    std::shared_ptr<BrokerClient> leader_;
+    std::mutex leader_mutex_;
+
+    // fsynced durable appends waiting for the high watermark, by offset
+    struct DurableAppend {
+        uint64_t offset;
+        AppendCallback callback;
+    };
+    std::deque<DurableAppend> durable_appends_;
+    std::mutex durable_appends_mutex_;
     std::atomic_bool stop_;
     volatile std::atomic_int16_t fetch_calls_counter_;
 };
@@ -3,24 +3,41 @@
 
 #include "AppendQueue.h"
 #include "Log.h"
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 
 namespace kafka_lite {
 namespace broker {
 
-using FetchCallback = std::function<void(const FetchResult &, std::error_code)>;
+using FetchCallback = std::function<void(FetchResult, std::error_code)>;
+using SubscriptionListener = std::function<void()>;
+using ReplicaSyncCallback =
+    std::function<void(FetchResult, uint64_t high_watermark, std::error_code)>;
 
 class BrokerCoreIfc {
   public:
     virtual ~BrokerCoreIfc() {}
-    virtual void submit_append(const AppendData &data,
-                               AppendCallback callback) = 0;
+    virtual void submit_append(AppendData data, AppendCallback callback) = 0;
     virtual void submit_fetch(const FetchData &data,
                               FetchCallback callback) = 0;
+    // A fetch of a follower that has every record before data.offset, the
+    // callback also gets the high watermark of the leader.
+    virtual void submit_replica_sync(uint64_t replica_id, const FetchData &data,
+                                     ReplicaSyncCallback callback) = 0;
     virtual void start() = 0;
     virtual void stop() = 0;
     virtual uint64_t get_published_offset() = 0;
+    // The listener is called from the appending thread whenever records have
+    // been appended, it must not block.
+    virtual uint64_t add_subscriber(SubscriptionListener listener) = 0;
+    virtual void remove_subscriber(uint64_t id) = 0;
+    // Reads the records from offset on for a subscriber, at least one record
+    // if there is one and otherwise up to max_bytes. Returns the offset after
+    // the last record read.
+    virtual uint64_t read_subscription(uint64_t offset, size_t max_bytes,
+                                       FetchResult &result,
+                                       std::error_code &ec) = 0;
 };
 
 } // namespace broker
@@ -2,15 +2,20 @@
 #define BROKER_SERVER_HH
 
 #include "BrokerCoreIfc.h"
+#include "BufferPool.h"
 #include "TcpProtocol.h"
 #include <array>
+#include <atomic>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <memory>
-#include <queue>
+#include <optional>
 #include <variant>
 #include <vector>
 
@@ -21,6 +26,19 @@ namespace broker {
 
 enum class BrokerServerStatus { Starting, Active, Stopping, Stopped };
 
+struct BrokerServerConfig {
+    // Requests read from a connection whose responses have not been queued
+    // yet. Once the limit is reached we stop reading until a response is sent.
+    unsigned int max_in_flight_requests = 32;
+    // Connections without in flight requests are closed after this long.
+    std::chrono::milliseconds idle_timeout = std::chrono::seconds(60);
+    // Size of the per connection read buffer. Frames that do not fit are read
+    // into their payload buffer directly.
+    size_t read_buffer_size = 64 * 1024;
+    // Connections sending larger requests are dropped.
+    uint32_t max_request_size = 64 * 1024 * 1024;
+};
+
 class TcpConnection : public std::enable_shared_from_this<TcpConnection> {
   public:
     tcp::socket &socket() { return socket_; }
@@ -28,52 +46,109 @@ class TcpConnection : public std::enable_shared_from_this<TcpConnection> {
 
     static std::shared_ptr<TcpConnection>
     create(boost::asio::io_context &io_context,
-           std::unique_ptr<BrokerCoreIfc> &core);
-    static std::variant<AppendRequest, FetchRequest>
-    parseTcpRequest(const TcpHeaders &headers,
-                    const std::vector<uint8_t> &payload_bytes);
+           std::unique_ptr<BrokerCoreIfc> &core,
+           const BrokerServerConfig &config,
+           std::shared_ptr<BufferPool> buffer_pool);
 
   private:
     TcpConnection(boost::asio::io_context &io_context,
-                  std::unique_ptr<BrokerCoreIfc> &core);
+                  std::unique_ptr<BrokerCoreIfc> &core,
+                  const BrokerServerConfig &config,
+                  std::shared_ptr<BufferPool> buffer_pool);
     void stop();
-    void doReadHeaderLength();
-    void doReadMagicBytes();
-    void doReadPayloadLength();
-    void doReadHeaders(uint32_t length);
-    void doReadPayload(uint32_t length);
-    void handleTcpRequest(std::vector<uint8_t> header_bytes,
+    void readNextRequest();
+    void touch();
+    void checkIdleTimeout();
+    void doReadSome();
+    void doReadLargePayload(const RequestFrame &frame);
+    void handleTcpRequest(const uint8_t *header_bytes, size_t header_len,
                           std::vector<uint8_t> payload_bytes);
-    void handleAppendRequest(const AppendRequest &request);
+    void handleAppendRequest(AppendRequest &request);
     void handleFetchRequest(const FetchRequest &request);
-    void sendResponse(const TcpResponse &response);
+    void handleSubscribeRequest(const SubscribeRequest &request);
+    void handleReplicaSyncRequest(const ReplicaSyncRequest &request);
+    void pumpSubscription();
+    void endSubscription();
+    // for responses to requests, frees an in flight slot
+    void sendResponse(TcpResponse response);
+    // like sendResponse, but appends without acks only free their slot
+    void finishAppend(AppendAcks acks, TcpResponse response);
+    void queueResponse(TcpResponse response);
     void doWrite();
     void handleWrite(const boost::system::error_code &ec, size_t bytes_written);
 
-    tcp::socket socket_;
     boost::asio::strand<boost::asio::io_context::executor_type> strand_;
-    std::queue<TcpResponse> write_queue_;
-    std::array<uint8_t, 4> length_buf_;
-    std::array<uint8_t, 5> magic_bytes_buf_;
-    std::vector<uint8_t> header_read_buf_;
-    std::vector<uint8_t> payload_read_buf_;
+    tcp::socket socket_;
+    boost::asio::steady_timer idle_timer_;
+    // of the last read or write, checked when the idle timer fires
+    boost::asio::steady_timer::time_point last_activity_;
+    BrokerServerConfig config_;
+    std::deque<TcpResponse> write_queue_;
+    // prefixes and buffers of the responses currently being written, these
+    // are the first write_queue_ entries
+    std::vector<std::array<uint8_t, TCP_RESPONSE_PREFIX_LEN>> write_prefixes_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    // bytes [read_begin_, read_end_) of read_buf_ have been received but not
+    // parsed yet
+    std::vector<uint8_t> read_buf_;
+    size_t read_begin_, read_end_;
+    std::vector<uint8_t> large_header_buf_;
+    std::vector<uint8_t> large_payload_buf_;
+    std::shared_ptr<BufferPool> buffer_pool_;
     std::unique_ptr<BrokerCoreIfc> &core_;
-    bool write_in_progress_, stopped_;
+    unsigned int in_flight_;
+    bool write_in_progress_, read_paused_, stopped_;
+
+    struct Subscription {
+        uuid correlation_id;
+        uint64_t subscriber_id;
+        uint64_t next_offset;
+        // pushed bytes that may be queued but not written yet
+        size_t window;
+        size_t queued_bytes;
+        bool window_full;
+    };
+    std::optional<Subscription> subscription_;
+    // set by the core's listener, avoids posting a pump per append
+    std::atomic_bool subscription_wakeup_pending_;
 };
 
+/*
+    Every io_context passed to the server gets its own acceptor. With more than
+    one io_context the acceptors bind the same port with SO_REUSEPORT, so that
+    the kernel distributes incoming connections and a connection stays on the
+    io_context (and thread) of the acceptor that accepted it.
+*/
 class BrokerServer : public std::enable_shared_from_this<BrokerServer> {
   public:
     BrokerServer(unsigned int port, std::unique_ptr<BrokerCoreIfc> core,
-                 boost::asio::io_context &io_context);
+                 boost::asio::io_context &io_context,
+                 const BrokerServerConfig &config = {});
+    BrokerServer(unsigned int port, std::unique_ptr<BrokerCoreIfc> core,
+                 const std::vector<boost::asio::io_context *> &io_contexts,
+                 const BrokerServerConfig &config = {});
     unsigned int port() { return port_; }
+    uint64_t acceptedConnections() const {
+        return accepted_connections_.load(std::memory_order_relaxed);
+    }
+
   private:
-    void startAccept();
-    void handleAccept(std::shared_ptr<TcpConnection> connection,
+    struct Shard {
+        Shard(boost::asio::io_context &io_context)
+            : iocontext(io_context), acceptor(io_context) {}
+        boost::asio::io_context &iocontext;
+        tcp::acceptor acceptor;
+    };
+
+    void startAccept(Shard &shard);
+    void handleAccept(Shard &shard, std::shared_ptr<TcpConnection> connection,
                       const boost::system::error_code &ec);
     unsigned int port_;
     std::unique_ptr<BrokerCoreIfc> core_;
-    boost::asio::io_context &iocontext_;
-    tcp::acceptor tcp_acceptor_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    BrokerServerConfig config_;
+    std::shared_ptr<BufferPool> buffer_pool_;
+    std::atomic<uint64_t> accepted_connections_;
     BrokerServerStatus status_;
 };
 } // namespace broker
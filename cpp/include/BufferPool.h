@@ -0,0 +1,47 @@
+#ifndef BUFFER_POOL_HH
+#define BUFFER_POOL_HH
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+/*
+    Thread safe pool of byte buffers in power of two size classes from
+    MIN_CLASS_SIZE to MAX_CLASS_SIZE. acquire returns a buffer of the requested
+    size whose capacity is the size class, release puts it back on the free
+    list of its class. Larger buffers are allocated and freed as usual.
+*/
+class BufferPool {
+  public:
+    static constexpr size_t MIN_CLASS_SIZE = 256;
+    static constexpr size_t MAX_CLASS_SIZE = 1 << 20;
+    static constexpr size_t NO_OF_CLASSES = 13;
+
+    BufferPool(size_t max_buffers_per_class = 64);
+    BufferPool(const BufferPool &other) = delete;
+    BufferPool &operator=(const BufferPool &other) = delete;
+
+    std::vector<uint8_t> acquire(size_t size);
+    void release(std::vector<uint8_t> &&buffer);
+    size_t cachedBuffers(size_t size);
+
+  private:
+    struct SizeClass {
+        std::mutex mutex;
+        std::vector<std::vector<uint8_t>> free_buffers;
+    };
+    static size_t classIndex(size_t size);
+
+    size_t max_buffers_per_class_;
+    std::array<SizeClass, NO_OF_CLASSES> classes_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+// ids as sent in the append flags and stored in compressed batches
+enum class CompressionCodec : uint8_t { None = 0, Lz = 1, Lz4 = 2, Zstd = 3 };
+
+static constexpr uint8_t MAX_COMPRESSION_CODEC = 3;
+
+class Codec {
+  public:
+    virtual ~Codec() {}
+    virtual CompressionCodec id() const = 0;
+    virtual std::vector<uint8_t>
+    compress(std::span<const uint8_t> data) const = 0;
+    // Throws std::runtime_error if data does not decompress to exactly
+    // uncompressed_size bytes.
+    virtual std::vector<uint8_t>
+    decompress(std::span<const uint8_t> data,
+               size_t uncompressed_size) const = 0;
+};
+
+/*
+    The codec for id, nullptr if it was not built in. None and Lz are always
+    there, Lz4 and Zstd only if the libraries were found at build time. The
+    broker stores batches without decompressing them, so it accepts every id
+    up to MAX_COMPRESSION_CODEC, only producers and consumers need the codec.
+*/
+const Codec *findCodec(CompressionCodec id);
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
@@ -2,7 +2,9 @@
 #define FAKE_BROKERCORE_HH
 
 #include "BrokerCoreIfc.h"
+#include <cstddef>
 #include <cstdint>
+#include <map>
 #include <shared_mutex>
 #include <vector>
 
@@ -12,15 +14,24 @@ namespace broker {
 class FakeBrokerCore : public BrokerCoreIfc {
   public:
     FakeBrokerCore();
-    void submit_append(const AppendData &data,
-                       AppendCallback callback) override;
+    void submit_append(AppendData data, AppendCallback callback) override;
     void submit_fetch(const FetchData &data, FetchCallback callback) override;
+    void submit_replica_sync(uint64_t replica_id, const FetchData &data,
+                             ReplicaSyncCallback callback) override;
     void start() override;
     void stop() override;
     uint64_t get_published_offset() override;
+    uint64_t add_subscriber(SubscriptionListener listener) override;
+    void remove_subscriber(uint64_t id) override;
+    uint64_t read_subscription(uint64_t offset, size_t max_bytes,
+                               FetchResult &result,
+                               std::error_code &ec) override;
 
   private:
+    // records with their length prefix, i.e. as they would be on disk
     std::vector<std::vector<uint8_t>> records_;
+    std::map<uint64_t, SubscriptionListener> listeners_;
+    uint64_t next_listener_id_;
     std::shared_mutex records_mutex_;
     bool stop_;
 };
@@ -0,0 +1,73 @@
+#ifndef FAN_OUT_BUFFER_H
+#define FAN_OUT_BUFFER_H
+
+#include "Log.h"
+#include "Segment.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+/*
+    The tail of the log as immutable, reference counted chunks. The writer
+    publishes every appended batch once and all subscribers send slices of the
+    same chunks, so serving many subscribers at the tail does not cost a read
+    and a copy per subscriber. The chunks of the tail cache are published as
+    they are, otherwise the buffer copies the records itself. Subscribers that
+    fall behind the buffered tail have to read from the log instead.
+*/
+class FanOutBuffer {
+  public:
+    using Listener = std::function<void()>;
+
+    explicit FanOutBuffer(size_t max_bytes);
+    FanOutBuffer(const FanOutBuffer &other) = delete;
+    FanOutBuffer &operator=(const FanOutBuffer &other) = delete;
+
+    // only called by the writer thread, notifies all listeners
+    void publish(uint64_t first_offset, std::span<const RecordSlice> records);
+    void publish(std::shared_ptr<const RecordChunk> chunk);
+    // Adds slices of the records from offset on, at least one record and then
+    // as long as max_bytes are not exceeded, none from end_offset on. Returns
+    // the offset after the last record added or nullopt if offset is not
+    // buffered (anymore).
+    std::optional<uint64_t>
+    read(uint64_t offset, size_t max_bytes, std::vector<PayloadSlice> &slices,
+         uint64_t end_offset = std::numeric_limits<uint64_t>::max()) const;
+    // Listeners are called from the writer thread and must not block. Once
+    // removeListener returns the listener will not be called anymore.
+    uint64_t addListener(Listener listener);
+    void removeListener(uint64_t id);
+    // calls the listeners without a publish, e.g. once more records may be
+    // read because the end offset of readers has moved
+    void notifyListeners();
+    size_t bufferedBytes() const;
+
+  private:
+    // without listeners nothing is buffered, returns whether there are any
+    bool keepChunks();
+
+    std::deque<std::shared_ptr<const RecordChunk>> chunks_;
+    uint64_t end_offset_;
+    size_t buffered_bytes_, max_bytes_;
+    mutable std::shared_mutex chunks_mutex_;
+    std::map<uint64_t, Listener> listeners_;
+    uint64_t next_listener_id_;
+    std::mutex listeners_mutex_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
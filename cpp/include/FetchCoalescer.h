@@ -0,0 +1,54 @@
+#ifndef FETCH_COALESCER_H
+#define FETCH_COALESCER_H
+
+#include "Log.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+/*
+    Single flight for fetches. The first caller for an (offset, max_bytes)
+    pair does the read, callers with the same pair arriving while it is in
+    flight wait for it instead of reading the same bytes again. If anybody
+    waited, the buffer is shared: all callers get it as a slice owned by a
+    shared pointer, which frees it once the last response has been written.
+    Without waiters the reader keeps its result_buf as is.
+*/
+class FetchCoalescer {
+  public:
+    using ReadFn = std::function<FetchResult(const FetchData &data)>;
+
+    FetchCoalescer();
+    FetchCoalescer(const FetchCoalescer &other) = delete;
+    FetchCoalescer &operator=(const FetchCoalescer &other) = delete;
+
+    // Exceptions of read are rethrown to every caller of the same flight.
+    FetchResult fetch(const FetchData &data, const ReadFn &read);
+    // number of fetches answered by somebody else's read
+    uint64_t coalesced() const;
+
+  private:
+    using SharedResult = std::shared_ptr<const FetchResult>;
+    struct Flight {
+        std::shared_future<SharedResult> result;
+        size_t waiters;
+    };
+
+    std::map<std::pair<uint64_t, size_t>, std::shared_ptr<Flight>> in_flight_;
+    uint64_t coalesced_;
+    mutable std::mutex mutex_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
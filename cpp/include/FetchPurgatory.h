@@ -0,0 +1,71 @@
+#ifndef FETCH_PURGATORY_H
+#define FETCH_PURGATORY_H
+
+#include "BrokerCoreIfc.h"
+#include "Log.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+struct ParkedFetch {
+    FetchData data;
+    FetchCallback callback;
+    std::chrono::steady_clock::time_point deadline;
+    // bytes known to be available for this fetch
+    size_t available_bytes;
+};
+
+/*
+    Holds long poll fetches that could not be answered with min_bytes yet.
+    The writer thread calls notify after every append, which adds the appended
+    bytes to all parked fetches. Fetches are handed back to the complete
+    function on the purgatory thread once enough bytes have been appended or
+    their deadline has passed. The complete function does the actual read and
+    may park the fetch again.
+*/
+class FetchPurgatory {
+  public:
+    using CompleteFn = std::function<void(ParkedFetch &fetch)>;
+
+    explicit FetchPurgatory(CompleteFn complete);
+    FetchPurgatory(const FetchPurgatory &other) = delete;
+    FetchPurgatory &operator=(const FetchPurgatory &other) = delete;
+    ~FetchPurgatory();
+
+    void start();
+    // answers all parked fetches with not_connected
+    void stop();
+    // Counts the notifications. Read it before fetching and pass it to park,
+    // so that appends in between are not missed.
+    uint64_t sequence() const;
+    void park(ParkedFetch fetch, uint64_t sequence);
+    void notify(size_t appended_bytes);
+    // lets every parked fetch read again, e.g. once the high watermark has
+    // moved without an append
+    void wake();
+    size_t size() const;
+
+  private:
+    void run();
+
+    CompleteFn complete_;
+    std::vector<ParkedFetch> parked_;
+    uint64_t sequence_;
+    bool stop_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
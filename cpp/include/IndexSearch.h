@@ -0,0 +1,29 @@
+#ifndef INDEX_SEARCH_H
+#define INDEX_SEARCH_H
+
+#include <cstdint>
+
+namespace kafka_lite {
+namespace broker {
+
+enum class SearchKernel { Scalar, Sse2, Avx2 };
+
+// the fastest kernel the cpu supports, determined once
+SearchKernel defaultSearchKernel();
+
+/*
+    Upper bound in count sorted 8 byte index entries (little endian u32 pairs
+    as in version 1 index files): the number of entries whose key is <= key.
+    The key is the relative offset for shift 0 and the file position for
+    shift 32. Binary search narrows the range down to a few cache lines, the
+    vector kernels then compare all entries left at once instead of
+    mispredicting the last probes. Scalar is a plain binary search.
+*/
+uint64_t searchEntries(const char *entries, uint64_t count, uint32_t key,
+                       unsigned int shift,
+                       SearchKernel kernel = defaultSearchKernel());
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
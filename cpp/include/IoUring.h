@@ -0,0 +1,79 @@
+#ifndef IO_URING_HH
+#define IO_URING_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+enum class IoOp { Read, Write, Fsync };
+
+struct IoRequest {
+    IoOp op;
+    int fd;
+    std::vector<iovec> iov; // empty for fsync
+    uint64_t offset;
+    size_t len;     // sum of the iovec lengths
+    int64_t result; // bytes transferred or -errno
+};
+
+/*
+    Minimal io_uring wrapper on top of the raw syscalls (no liburing). Not
+    thread safe, every thread that submits needs its own instance. Only
+    available on Linux, use isSupported() to check at runtime.
+*/
+class IoUring {
+  public:
+    explicit IoUring(unsigned int entries = 64);
+    IoUring(const IoUring &other) = delete;
+    IoUring &operator=(const IoUring &other) = delete;
+    ~IoUring();
+
+    static bool isSupported();
+    unsigned int entries() const { return entries_; }
+    // Submits the requests as linked SQEs (a request only starts once the
+    // previous one has completed successfully) and waits for all of them.
+    // count must not exceed entries().
+    void submitChain(IoRequest *requests, size_t count);
+
+  private:
+    int ring_fd_;
+    unsigned int entries_;
+    void *sq_ring_, *cq_ring_, *sqes_;
+    size_t sq_ring_size_, cq_ring_size_, sqes_size_;
+    unsigned int *sq_tail_, *sq_mask_, *sq_array_;
+    unsigned int *cq_head_, *cq_tail_, *cq_mask_;
+    void *cqes_;
+};
+
+/*
+    Ordered list of file operations that are executed one after another,
+    either as linked SQEs on an IoUring or, without a ring, with plain
+    pwritev/pread/fsync calls. Requests that the ring did not complete (short
+    transfers, cancelled links) are finished synchronously, so callers always
+    see all or nothing: execute throws std::ios_base::failure on error.
+*/
+class IoBatch {
+  public:
+    void write(int fd, const std::vector<iovec> &iov, uint64_t offset);
+    void read(int fd, void *buf, size_t len, uint64_t offset);
+    void fsync(int fd);
+    // keeps the buffer alive until the batch is destroyed
+    const uint8_t *own(std::vector<uint8_t> buffer);
+    void execute(IoUring *ring);
+    bool empty() const { return requests_.empty(); }
+
+  private:
+    static void executeSync(IoRequest &request);
+
+    std::vector<IoRequest> requests_;
+    std::vector<std::vector<uint8_t>> buffers_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
@@ -1,60 +1,233 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include "ProducerState.h"
 #include "Segment.h"
+#include "SegmentCache.h"
 #include <cstdint>
 #include <filesystem>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <span>
+#include <unordered_map>
 #include <vector>
 
 namespace kafka_lite {
 namespace broker {
 
+class BufferPool;
+class IoUring;
+class RemoteStore;
+
+struct LogConfig {
+    // submit appends, index writes and fsyncs as linked io_uring requests,
+    // falls back to plain syscalls if the kernel does not support io_uring
+    bool use_io_uring = false;
+    unsigned int io_uring_entries = 64;
+    // bytes of the most recent records kept in memory for tail fetches, 0
+    // disables the cache
+    size_t tail_cache_size = 4 * 1024 * 1024;
+    // read sealed segments through read-only mappings, fetches then send
+    // slices of the mapping instead of copies
+    bool mmap_sealed_segments = false;
+    // sealed segments with open files, the least recently read are closed
+    size_t max_open_sealed_segments = 1024;
+    // Tiered storage: sealed segments are uploaded to the remote store, and
+    // deleted locally once more than local_retention_bytes of newer sealed
+    // segments are local. nullptr keeps all segments local.
+    std::shared_ptr<RemoteStore> remote_store;
+    uint64_t local_retention_bytes = 1024ull * 1024 * 1024;
+    // remote log files are read into the local cache in chunks of this size
+    size_t remote_chunk_size = 1024 * 1024;
+    // how often BrokerCore uploads new sealed segments
+    uint32_t tiering_interval_ms = 1000;
+    // Where the segment files live, e.g. a MemoryBackend for ephemeral
+    // topics. Once the backend is full, rollovers evict the oldest sealed
+    // segments. Tiered storage needs a persistent backend.
+    std::shared_ptr<StorageBackend> storage = fileStorage();
+};
+
+/*
+    When the producer learns about its append. Leader: once the record has
+    been written (to the page cache). None: never, there is no response at
+    all. Durable: once it has been fsynced and is below the high watermark,
+    i.e. on every in sync replica as well.
+*/
+enum class AppendAcks : uint8_t { Leader = 0, None = 1, Durable = 2 };
+
 struct AppendData {
     std::vector<uint8_t> data;
+    // bytes in front of the record in data, e.g. the length prefix sent by
+    // clients, which is skipped instead of moving the record
+    size_t record_offset = 0;
+    // record attributes from the append flags, see RecordManager.h
+    uint8_t attributes = 0;
+    // pool to return data to once it has been written, may be null
+    std::shared_ptr<BufferPool> buffer_pool = nullptr;
+    // the log ignores it, the core decides when to call back
+    AppendAcks acks = AppendAcks::Leader;
+};
+
+// Bytes owned by someone else, owner keeps them alive while they are sent
+struct PayloadSlice {
+    std::shared_ptr<const void> owner;
+    const uint8_t *data;
+    size_t size;
 };
 
 struct FetchResult {
     std::vector<uint8_t> result_buf;
-    std::vector<SendfileData> sendfile_data;
+    std::vector<SendfileData> sendfile_data = {};
+    // sent after result_buf
+    std::vector<PayloadSlice> slices = {};
+
+    size_t size() const {
+        size_t size = result_buf.size();
+        for (const auto &slice : slices)
+            size += slice.size;
+        return size;
+    }
 };
 
 struct FetchData {
     uint64_t offset;
     size_t max_bytes;
+    // long poll: wait up to max_wait_ms until min_bytes are available
+    size_t min_bytes = 0;
+    uint32_t max_wait_ms = 0;
+    // fetches of a session continue where its previous fetch ended without
+    // looking up the file position, 0 for no session
+    uint64_t session_id = 0;
+    // records from end_offset on are not returned, e.g. the high watermark
+    uint64_t end_offset = std::numeric_limits<uint64_t>::max();
+    // fetches of followers are not bounded by the high watermark, 0 for
+    // consumers
+    uint64_t replica_id = 0;
 };
 
 enum class LogStatus { Open, Closed };
 
+// sealed segment, opened on its first read through the segment cache
+struct SealedSegmentInfo {
+    uint64_t base_offset;
+    uint64_t published_offset;
+    // in the remote store, remote ones have no local files anymore
+    bool uploaded = false;
+    bool remote = false;
+};
+
+// where the next fetch of a session starts
+struct FetchSessionPosition {
+    uint64_t base_offset; // of the segment file_position belongs to
+    uint64_t offset;
+    uint64_t file_position;
+};
+
+// sessions beyond this number replace an arbitrary old one
+static constexpr size_t MAX_FETCH_SESSIONS = 4096;
+
 class Log {
   public:
-    Log(const std::filesystem::path &dir, uint64_t max_segment_size);
+    Log(const std::filesystem::path &dir, uint64_t max_segment_size,
+        const LogConfig &config = {});
     Log(const Log &other) = delete;
     Log &operator=(const Log &other) = delete;
     Log(Log &&other) = delete;
     Log &operator=(Log &&other) = delete;
-    ~Log() = default; // Do I need more?
+    ~Log();
 
     void start();
     FetchResult fetch(const FetchData &data) const;
+    // The ranges of whole records a fetch returns, in order and possibly
+    // spanning several segments. The ranges keep their segments open.
+    std::vector<SendfileData> planFetch(const FetchData &data) const;
+    // stored size of the record at offset, the max_bytes a fetch of just
+    // that record needs
+    size_t recordSize(uint64_t offset) const;
     uint64_t append(const AppendData &data);
+    uint64_t append(const uint8_t *data, size_t len, uint8_t attributes = 0);
+    // Appends the records in order, rolling over where necessary, and
+    // returns the offset of the first one. With sync set the records are
+    // fsynced together with the write.
+    uint64_t append(std::span<const RecordSlice> records, bool sync);
+    // Same, appended is the number of records written and published so far.
+    // If a rollover or a later write fails the records before it stay in the
+    // log, appended tells the caller which ones. The tail cache's chunks of
+    // the written records are added to chunks, none if the cache is off.
+    uint64_t
+    append(std::span<const RecordSlice> records, bool sync, size_t &appended,
+           std::vector<std::shared_ptr<const RecordChunk>> *chunks = nullptr);
     void rollover();
     uint64_t getPublishedOffset();
+    // offset of the next record appended
+    uint64_t endOffset() const;
     void flush();
+    bool usesIoUring() const { return ring_ != nullptr; }
+    // hits and misses of the tail cache over all active segments so far
+    TailCacheStats tailCacheStats() const;
+    // fetches that started at the remembered position of their session
+    uint64_t fetchSessionHits() const;
+    size_t openSealedSegments() const { return open_segments_.size(); }
+    // Uploads the sealed segments that are not in the remote store yet,
+    // oldest first, and deletes the local files of uploaded segments beyond
+    // the local retention. Does nothing without a remote store.
+    void tierSegments();
+    // sealed segments that are only in the remote store
+    size_t remoteSegments() const;
+    // first offset that can still be fetched, later once segments are evicted
+    uint64_t firstOffset() const;
+    // last sequences of the idempotent producers in the log, for the
+    // appending thread only
+    const ProducerStateTable &producers() const { return producers_; }
 
   private:
     std::vector<std::string> determineSegmentFilepaths();
-    void recover(const std::vector<std::string> &segment_filepaths);
+    std::vector<uint64_t> determineRemoteBaseOffsets();
+    void recover(const std::vector<std::string> &segment_filepaths,
+                 const std::vector<uint64_t> &remote_base_offsets);
     bool activeSegmentIsFull();
+    std::optional<uint64_t> loadProducerSnapshot(uint64_t first_offset,
+                                                 uint64_t end_offset);
+    void recoverProducerState();
+    // base offsets of the producer snapshots, ascending
+    std::vector<uint64_t> determineProducerSnapshots();
+    void snapshotProducerState(uint64_t base_offset);
+    void evictSegments();
+    SegmentConfig segmentConfig() const;
+    std::optional<uint64_t> sessionFilePosition(uint64_t session_id,
+                                                const Segment &segment,
+                                                uint64_t offset) const;
+    void updateSession(uint64_t session_id,
+                       const FetchSessionPosition &position) const;
 
     LogStatus status_;
     std::filesystem::path dir_;
     uint64_t max_segment_size_;
+    LogConfig config_;
+    // only used by the appending thread
+    std::unique_ptr<IoUring> ring_;
+    ProducerStateTable producers_;
     std::shared_ptr<Segment> findSegment(uint64_t offset) const;
-    std::vector<std::shared_ptr<Segment>> sealed_segments_;
+    std::shared_ptr<Segment>
+    openSealedSegment(const SealedSegmentInfo &info) const;
+    std::shared_ptr<Segment>
+    openRemoteSegment(const SealedSegmentInfo &info) const;
+    std::filesystem::path remoteCacheDir() const;
+    std::vector<SealedSegmentInfo> sealed_segments_;
+    mutable SegmentCache open_segments_;
+    // held while an index is rebuilt or the local files of a tiered or an
+    // evicted segment are deleted
+    mutable std::mutex rebuild_mutex_;
     std::shared_ptr<Segment> active_segment_;
+    // stats of the tail caches of previous active segments
+    TailCacheStats retired_tail_cache_stats_;
     mutable std::shared_mutex segments_mutex_;
+    mutable std::unordered_map<uint64_t, FetchSessionPosition> sessions_;
+    mutable uint64_t session_hits_;
+    mutable std::mutex sessions_mutex_;
 };
 } // namespace broker
 } // namespace kafka_lite
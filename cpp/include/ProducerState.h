@@ -0,0 +1,61 @@
+#ifndef PRODUCER_STATE_H
+#define PRODUCER_STATE_H
+
+#include "StorageBackend.h"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+enum class SequenceCheck { InSequence, Duplicate, OutOfSequence };
+
+/*
+    Sequence numbers count the batches of a producer from 0 and wrap around.
+    The first batch of a producer that is not known yet has to be 0, the
+    next one of a known producer last + 1. A batch up to 2^31 sequence
+    numbers behind is a retry of a batch that is already in the log, anything
+    else means that batches are missing.
+*/
+SequenceCheck checkSequence(std::optional<uint32_t> last, uint32_t sequence);
+
+/*
+    The last sequence number in the log of every idempotent producer, i.e.
+    of every producer batch appended. It is rebuilt at startup from the
+    snapshot taken at the newest rollover and the records after it. Not
+    thread safe, only the appending thread of the log uses it.
+*/
+class ProducerStateTable {
+  public:
+    std::optional<uint32_t> lastSequence(uint64_t producer_id) const;
+    void update(uint64_t producer_id, uint32_t sequence);
+    // Updates the table if the record (checksum and payload) is a producer
+    // batch, i.e. has the producer attribute.
+    void observe(uint8_t attributes, const uint8_t *record, size_t len);
+    size_t size() const { return sequences_.size(); }
+    void clear() { sequences_.clear(); }
+
+    // Writes the table to path and fsyncs it.
+    void save(StorageBackend &storage,
+              const std::filesystem::path &path) const;
+    // Replaces the table, returns false (leaving it empty) if there is no
+    // intact snapshot at path.
+    bool load(StorageBackend &storage, const std::filesystem::path &path);
+    // same for a snapshot that has been read already, e.g. a remote one
+    bool load(const std::vector<uint8_t> &bytes);
+    // snapshot of the table before the record at base_offset
+    static std::filesystem::path filePath(const std::filesystem::path &dir,
+                                          uint64_t base_offset);
+
+  private:
+    std::unordered_map<uint64_t, uint32_t> sequences_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
@@ -1,14 +1,59 @@
 #ifndef RecordManager_HH
 #define RecordManager_HH
 
+#include "Codec.h"
+#include <cstddef>
 #include <cstdint>
+#include <optional>
 #include <vector>
 namespace kafka_lite {
 namespace broker {
 
+/*
+    The length header of a record holds the length of checksum and payload in
+    the low 28 bits and the attributes of the record in the high 4 bits, so
+    records written before attributes existed are plain records. Requests
+    are far below 256 MiB anyway.
+*/
+static constexpr uint32_t RECORD_LEN_MASK = 0x0FFFFFFF;
+static constexpr unsigned int RECORD_ATTRIBUTES_SHIFT = 28;
+/*
+    Attributes: the codec of a compressed batch in the low 3 bits and whether
+    the batch belongs to an idempotent producer. A record with attributes 0 is
+    a plain record, whatever its payload looks like.
+    The payload of a batch is the uncompressed size (little endian u32),
+    for producer batches followed by the producer id (u64) and the sequence
+    number (u32) of the batch, little endian, and then the compressed records,
+    each with its length and checksum as in Record::to_bytes_with_len. The
+    checksum of the batch record covers the compressed bytes, so the broker
+    verifies it without decompressing, stores the batch as it is and
+    consumers expand it. The batch takes one offset. Producer batches may use
+    the codec None.
+*/
+static constexpr uint8_t RECORD_ATTR_CODEC_MASK = 0x07;
+static constexpr uint8_t RECORD_ATTR_PRODUCER = 0x08;
+static constexpr size_t BATCH_HEADER_SIZE = 4;
+static constexpr size_t PRODUCER_BATCH_HEADER_SIZE = 16;
+
+inline uint32_t recordHeader(uint32_t len, uint8_t attributes) {
+    return len | static_cast<uint32_t>(attributes) << RECORD_ATTRIBUTES_SHIFT;
+}
+inline uint32_t recordHeaderLen(uint32_t header) {
+    return header & RECORD_LEN_MASK;
+}
+inline uint8_t recordHeaderAttributes(uint32_t header) {
+    return header >> RECORD_ATTRIBUTES_SHIFT;
+}
+
+struct ProducerSequence {
+    uint64_t producer_id;
+    uint32_t sequence;
+};
+
 struct Record {
     uint32_t checksum;
     std::vector<uint8_t> payload;
+    uint8_t attributes = 0;
 
     std::vector<uint8_t> to_bytes();
     std::vector<uint8_t> to_bytes_with_len();
@@ -20,8 +65,31 @@ class RecordManager {
     static std::vector<Record>
     extract_records(const std::vector<uint8_t> bytes);
     static bool check_integrity(const std::vector<uint8_t> &bytes);
+    // a record without its length prefix, i.e. checksum and payload
+    static bool check_integrity(const uint8_t *data, size_t size);
     static bool check_integrity_with_len(const std::vector<uint8_t> &bytes);
     static bool check_integrity(const Record &record);
+    // Compresses the records of the payloads into one batch record, throws
+    // std::invalid_argument if the codec is not built in. Batches without a
+    // producer need a codec other than None.
+    static Record
+    create_batch(const std::vector<std::vector<uint8_t>> &payloads,
+                 CompressionCodec codec);
+    static Record
+    create_batch(const std::vector<std::vector<uint8_t>> &payloads,
+                 CompressionCodec codec, const ProducerSequence &producer);
+    // codec of a record with these attributes, nullopt for a plain record
+    static std::optional<CompressionCodec> batch_codec(uint8_t attributes);
+    // producer of a batch record payload (without checksum), nullopt if the
+    // attributes are not those of a producer batch or the payload is too short
+    static std::optional<ProducerSequence>
+    batch_producer(uint8_t attributes, const uint8_t *payload, size_t size);
+    // records of a batch record, throws std::runtime_error if it is malformed
+    // or its codec is not built in
+    static std::vector<Record> decompress_batch(const Record &record);
+    // like extract_records, with batches replaced by their records
+    static std::vector<Record>
+    extract_all_records(const std::vector<uint8_t> &bytes);
 };
 
 } // namespace broker
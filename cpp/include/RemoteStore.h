@@ -0,0 +1,88 @@
+#ifndef REMOTE_STORE_H
+#define REMOTE_STORE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+/*
+    Object store for tiered segments, modelled after S3: whole objects are
+    uploaded, ranges of them are read. Implementations must be thread safe.
+*/
+class RemoteStore {
+  public:
+    virtual ~RemoteStore() {}
+    // Stores the file as object name, replacing an existing one. The object
+    // becomes visible only once it is complete.
+    virtual void upload(const std::string &name,
+                        const std::filesystem::path &file) = 0;
+    // size of the object, nullopt if there is none
+    virtual std::optional<uint64_t> size(const std::string &name) const = 0;
+    // Reads length bytes from position of the object into dest, throws
+    // std::ios_base::failure if the object is shorter.
+    virtual void read(const std::string &name, uint64_t position,
+                      size_t length, uint8_t *dest) const = 0;
+    virtual std::vector<std::string> list() const = 0;
+};
+
+// objects are files in a directory, e.g. on a network filesystem
+class DirectoryRemoteStore : public RemoteStore {
+  public:
+    explicit DirectoryRemoteStore(const std::filesystem::path &dir);
+    void upload(const std::string &name,
+                const std::filesystem::path &file) override;
+    std::optional<uint64_t> size(const std::string &name) const override;
+    void read(const std::string &name, uint64_t position, size_t length,
+              uint8_t *dest) const override;
+    std::vector<std::string> list() const override;
+
+  private:
+    std::filesystem::path dir_;
+};
+
+/*
+    Local files of a segment that lives in the remote store, in a directory
+    of their own below the cache directory. The index is downloaded as a
+    whole, it is needed for every read. The log file is created sparse with
+    the size of the remote one and filled in chunks as they are read for the
+    first time. The directory is removed with the object, i.e. once the
+    segment has been closed and all its readers are done.
+*/
+class RemoteSegmentFile {
+  public:
+    RemoteSegmentFile(std::shared_ptr<RemoteStore> store,
+                      const std::filesystem::path &cache_dir,
+                      uint64_t base_offset, size_t chunk_size);
+    RemoteSegmentFile(const RemoteSegmentFile &other) = delete;
+    RemoteSegmentFile &operator=(const RemoteSegmentFile &other) = delete;
+    ~RemoteSegmentFile();
+
+    const std::filesystem::path &dir() const { return dir_; }
+    // downloads the chunks of the range that are not local yet
+    void load(uint64_t position, size_t length);
+    uint64_t loadedChunks() const;
+
+  private:
+    std::shared_ptr<RemoteStore> store_;
+    std::filesystem::path dir_;
+    std::string log_name_;
+    uint64_t size_;
+    size_t chunk_size_;
+    int fd_;
+    std::vector<std::atomic<bool>> loaded_;
+    std::mutex mutex_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
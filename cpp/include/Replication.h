@@ -0,0 +1,66 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+namespace kafka_lite {
+namespace broker {
+
+struct ReplicationConfig {
+    // port of the leader on localhost, a broker with 0 is a leader
+    unsigned int leader_port = 0;
+    // identifies the follower to its leader, must not be 0
+    uint64_t replica_id = 1;
+    // per ReplicaSync request of a follower, the leader holds the request up
+    // to max wait if there is nothing new
+    uint32_t sync_max_bytes = 1024 * 1024;
+    uint32_t sync_max_wait_ms = 100;
+    // followers of a leader that have not synced for this long leave the in
+    // sync replicas, so that a dead follower does not stop the high watermark
+    std::chrono::milliseconds replica_lag_timeout = std::chrono::seconds(10);
+};
+
+/*
+    The leader's view of its followers. Every ReplicaSync reports the log end
+    offset of a follower, i.e. that it has every record before it. The high
+    watermark is the smallest log end offset of the in sync replicas (the
+    leader's own included) and never decreases. A follower joins the in sync
+    replicas once it has caught up with the high watermark, and leaves them
+    if it has not synced for the lag timeout. Without in sync followers the
+    high watermark is the leader's log end offset.
+*/
+class ReplicaTracker {
+  public:
+    explicit ReplicaTracker(std::chrono::milliseconds lag_timeout);
+
+    // Returns whether the high watermark has moved.
+    bool update(uint64_t replica_id, uint64_t end_offset,
+                uint64_t log_end_offset);
+    // records from the high watermark on are not on every in sync replica
+    uint64_t highWatermark(uint64_t log_end_offset);
+    size_t inSyncReplicas() const;
+
+  private:
+    struct Replica {
+        uint64_t end_offset;
+        std::chrono::steady_clock::time_point last_sync;
+        bool in_sync;
+    };
+
+    // requires mutex_
+    uint64_t advance(uint64_t log_end_offset);
+
+    std::chrono::milliseconds lag_timeout_;
+    std::unordered_map<uint64_t, Replica> replicas_;
+    uint64_t high_watermark_;
+    mutable std::mutex mutex_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
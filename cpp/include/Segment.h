@@ -1,16 +1,32 @@
 #ifndef SEGMENT_H
 #define SEGMENT_H
 
+#include "RecordManager.h"
+#include "StorageBackend.h"
 #include <atomic>
 #include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <span>
 #include <vector>
 
 namespace kafka_lite {
 namespace broker {
 
-#define INDEX_ENTRY_SIZE 12
+class IoBatch;
+class IoUring;
+class Segment;
+class TailCache;
+
+#define INDEX_HEADER_SIZE 8
+#define INDEX_ENTRY_SIZE 8
+#define INDEX_V0_ENTRY_SIZE 12
+#define INDEX_WIDE_ENTRY_SIZE 16
 #define OFFSET_SIZE 8
 #define SEGMENT_HEADER_SIZE 4
 #define FILE_POS_INDEX_SIZE 4
@@ -20,56 +36,159 @@ enum class RecoveryResult { Recovered, Truncated, Corrupted };
 
 struct IndexFileEntry {
     uint64_t offset;
-    uint32_t file_position;
+    uint64_t file_position;
+};
+
+// record as handed to the log, i.e. without the length prefix, whose
+// attributes the log writes into the high bits of the length header
+struct RecordSlice {
+    const uint8_t *data;
+    uint32_t len;
+    uint8_t attributes = 0;
+};
+
+// Records of one append batch in the on disk format (length prefixed),
+// immutable once created and shared by the tail cache and the fan out buffer
+struct RecordChunk {
+    uint64_t first_offset;
+    std::vector<size_t> record_positions;
+    std::vector<uint8_t> bytes;
 };
 
+std::shared_ptr<const RecordChunk>
+makeRecordChunk(uint64_t first_offset, std::span<const RecordSlice> records);
+
+// range of whole records in a segment file, segment keeps fd open
 struct SendfileData {
+    std::shared_ptr<const Segment> segment;
     int fd;
     int64_t length;
     int64_t file_offset;
 };
 
-struct SegmentReadResult {
+struct SegmentConfig {
+    // bytes of the most recent records kept in memory, active segments only
+    size_t tail_cache_size = 0;
+    // read sealed segments through a read-only mapping of the log file
+    bool mmap_sealed = false;
+    // where the log and index files are opened
+    std::shared_ptr<StorageBackend> storage = fileStorage();
+    // Called with a range of the log file before it is read, for files whose
+    // data is fetched on demand (segments in the remote store).
+    std::function<void(uint64_t, size_t)> load_range = nullptr;
+};
+
+// where the records a read of a segment returns are, readRange reads them
+struct SegmentReadPlan {
     uint64_t last_read_offset;
-    std::vector<uint8_t> result_buf;
-    std::vector<SendfileData> sendfile_data;
+    uint64_t file_position;
+    size_t length;
+};
+
+struct TailCacheStats {
+    uint64_t hits;
+    uint64_t misses;
 };
 
 class Index {
   public:
+    // Active indexes with wide_positions store 64 bit file positions, for
+    // segments larger than 4 GiB. Sealed ones take the format from the file.
     Index(const std::filesystem::path &dir, uint64_t base_offset,
-          SegmentState state);
+          SegmentState state, bool wide_positions = false,
+          StorageBackend &storage = *fileStorage());
     ~Index();
+    static std::filesystem::path filePath(const std::filesystem::path &dir,
+                                          uint64_t base_offset);
     std::optional<IndexFileEntry> determineClosestIndex(uint64_t offset) const;
+    // The entry of offset without a search, nullopt if it is not published
+    // yet or the index skips records (then determineClosestIndex finds it).
+    std::optional<IndexFileEntry> entryOf(uint64_t offset) const;
+    // last entry with a file position <= file_position
+    std::optional<IndexFileEntry>
+    findByFilePosition(uint64_t file_position) const;
+    uint64_t entries() const;
     void append(const IndexFileEntry &entry);
+    // Adds the write of the entries to the batch, publish them once the batch
+    // has been executed.
+    void stage(IoBatch &batch, std::span<const IndexFileEntry> entries) const;
+    void publish(std::span<const IndexFileEntry> entries);
     void flush();
+    void flush(IoBatch &batch) const;
+    // Appends the search tree to an index that gets no more entries, the
+    // sealed index opened afterwards searches the tree.
+    void finalize();
     void seal(); // use only during recovery
   private:
-    IndexFileEntry binarySearch(uint64_t offset, const char *buf,
-                                uint64_t file_size) const;
-    IndexFileEntry binarySearch(uint64_t offset, int fd,
-                                uint64_t file_size) const;
+    void writeHeader(uint32_t version);
+    void readHeader(uint64_t file_size);
+    IndexFileEntry decode(uint64_t raw) const;
+    // writes entry_size_ bytes as stored in the file
+    void encode(const IndexFileEntry &entry, uint64_t *raw) const;
+    IndexFileEntry entryAt(uint64_t i) const;
+    // last entry whose key (offset for shift 0, position for 32) is <= key
+    std::optional<IndexFileEntry> searchSorted(uint32_t key,
+                                               unsigned int shift) const;
+    std::optional<IndexFileEntry> searchTree(uint32_t key,
+                                             unsigned int shift) const;
 
     SegmentState state_;
     std::filesystem::path dir_;
+    uint64_t base_offset_;
     const char *mmap_base_offset_;
+    size_t map_size_;
+    // Eytzinger ordered copy of the entries in the mapping of a finalized
+    // index, nullptr otherwise
+    const char *search_tree_;
     int fd_;
+    // 0 and INDEX_V0_ENTRY_SIZE for indexes written in the old format,
+    // INDEX_WIDE_ENTRY_SIZE for 64 bit file positions
+    uint64_t header_size_, entry_size_;
+    // bytes of entries, without the header
     std::atomic<uint64_t> published_size_;
     uint64_t last_written_offset_;
+    // entries of an active index as written to the file, for reading
+    std::vector<uint64_t> active_entries_;
+    mutable std::shared_mutex entries_mutex_;
 };
 
 class Segment {
   public:
     Segment(const std::filesystem::path &dir, uint64_t base_offset,
-            uint64_t max_size, SegmentState state); // Empty segment
+            uint64_t max_size, SegmentState state,
+            const SegmentConfig &config = {}); // Empty segment
     Segment(const std::filesystem::path &dir, uint64_t base_offset,
-            uint64_t published_offset, uint64_t max_size,
-            SegmentState state); // Nonempty segment
+            uint64_t published_offset, uint64_t max_size, SegmentState state,
+            const SegmentConfig &config = {}); // Nonempty segment
     ~Segment();
+    static std::filesystem::path filePath(const std::filesystem::path &dir,
+                                          uint64_t base_offset);
 
-    SegmentReadResult read(uint64_t offset, size_t max_bytes) const;
-    uint64_t append(const uint8_t *data, uint32_t len);
+    // Where the records from offset are that fit into max_bytes, records
+    // from end_offset on are left out. file_position is where offset starts
+    // if the caller already knows it, e.g. from the previous read of a fetch
+    // session. Relies on every record being indexed.
+    SegmentReadPlan
+    plan(uint64_t offset, size_t max_bytes,
+         std::optional<uint64_t> file_position = std::nullopt,
+         uint64_t end_offset = std::numeric_limits<uint64_t>::max()) const;
+    void readRange(uint64_t file_position, size_t length, uint8_t *dest) const;
+    // stored size (header and record) of the record at offset, 0 if it is not
+    // published yet
+    size_t recordSize(uint64_t offset) const;
+    // The range inside the mapping of a sealed segment, nullptr if the
+    // segment is not mapped. Valid as long as the segment exists.
+    const uint8_t *mappedRange(uint64_t file_position, size_t length) const;
+    uint64_t append(const uint8_t *data, uint32_t len, uint8_t attributes = 0);
+    // Writes all records with one writev, followed by the index entries and,
+    // if sync is set, the fsyncs. Returns the offset of the first record.
+    // With a tail cache the records are copied into a chunk once, which is
+    // written, cached and returned through chunk if it is set.
+    uint64_t append(std::span<const RecordSlice> records, bool sync,
+                    IoUring *ring,
+                    std::shared_ptr<const RecordChunk> *chunk = nullptr);
     uint64_t getBaseOffset() const { return base_offset_; }
+    int getFileDescriptor() const { return log_fd_; }
     uint64_t getPublishedOffset() const {
         return published_offset_.load(std::memory_order_acquire);
     }
@@ -77,14 +196,28 @@ class Segment {
         return published_size_.load(std::memory_order_acquire);
     }
     RecoveryResult recover();
+    // Whether the index of a sealed segment has an entry for every record up
+    // to the published offset and the last record ends with the log file.
+    bool isComplete() const;
     void seal(); // use only during recovery
     void flush();
+    // see Index::finalize, call after the last append
+    void finalizeIndex();
     bool isFull() const;
+    // all zero if the segment has no tail cache
+    TailCacheStats tailCacheStats() const;
 
   private:
     void init();
-    uint32_t determineFilePosition(uint64_t offset, uint64_t file_size) const;
-    uint32_t determineFilePosition(uint64_t offset, uint64_t file_size,
+    void checkReadArguments(uint64_t offset, size_t max_bytes) const;
+    uint64_t startFilePosition(uint64_t offset, uint64_t pub_size,
+                               std::optional<uint64_t> file_position) const;
+    void initTailCache();
+    void loadRange(uint64_t file_position, size_t length) const;
+    const uint8_t *mapping() const;
+    uint32_t recordLength(uint64_t file_position) const;
+    uint64_t determineFilePosition(uint64_t offset, uint64_t file_size) const;
+    uint64_t determineFilePosition(uint64_t offset, uint64_t file_size,
                                    const IndexFileEntry &entry) const;
 
     SegmentState state_;
@@ -94,6 +227,12 @@ class Segment {
     std::atomic<uint64_t> published_offset_; // public?
     std::atomic<uint64_t> published_size_;   // public?
     uint64_t max_size_, base_offset_;
+    SegmentConfig config_;
+    std::unique_ptr<TailCache> tail_cache_;
+    // read-only mapping of a sealed log file, created by the first read
+    mutable std::atomic<const uint8_t *> map_;
+    mutable size_t map_size_;
+    mutable std::mutex map_mutex_;
 };
 } // namespace broker
 } // namespace kafka_lite
@@ -0,0 +1,52 @@
+#ifndef SEGMENT_CACHE_H
+#define SEGMENT_CACHE_H
+
+#include "Segment.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace kafka_lite {
+namespace broker {
+
+/*
+    Keeps at most capacity sealed segments open, the least recently used one
+    is closed first. Closing only drops the reference of the cache: readers
+    hold shared pointers to the segments they read (so do fetch ranges and
+    payload slices), which pins the fd and the mappings until they are done.
+*/
+class SegmentCache {
+  public:
+    using OpenFn = std::function<std::shared_ptr<Segment>()>;
+
+    explicit SegmentCache(size_t capacity);
+    SegmentCache(const SegmentCache &other) = delete;
+    SegmentCache &operator=(const SegmentCache &other) = delete;
+
+    // Returns the open segment with base_offset, opening it if necessary.
+    std::shared_ptr<Segment> get(uint64_t base_offset, const OpenFn &open);
+    // for segments that are open already, e.g. after rollover
+    void insert(std::shared_ptr<Segment> segment);
+    // closes the segment with base_offset if it is open
+    void erase(uint64_t base_offset);
+    size_t size() const;
+
+  private:
+    void insertLocked(std::shared_ptr<Segment> segment);
+
+    size_t capacity_;
+    // most recently used first
+    std::list<std::shared_ptr<Segment>> lru_;
+    std::unordered_map<uint64_t, std::list<std::shared_ptr<Segment>>::iterator>
+        entries_;
+    mutable std::mutex mutex_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef STORAGE_BACKEND_H
+#define STORAGE_BACKEND_H
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+/*
+    Where the files of segments and indexes live. Segment, Index and Log
+    open, list and remove their files through the backend, everything else
+    (preads, writes through IoBatch, mappings, sendfile) works on the file
+    descriptors it hands out, so all backends have the same read and write
+    semantics. Implementations must be thread safe.
+*/
+class StorageBackend {
+  public:
+    virtual ~StorageBackend() {}
+    // Like open(2): a new file descriptor, or -1 with errno set.
+    virtual int open(const std::filesystem::path &path, int flags,
+                     mode_t mode) = 0;
+    virtual bool exists(const std::filesystem::path &path) const = 0;
+    // Removes the file if there is one, open descriptors keep reading it.
+    virtual void remove(const std::filesystem::path &path) = 0;
+    // names of the files in dir
+    virtual std::vector<std::string>
+    list(const std::filesystem::path &dir) const = 0;
+    virtual void createDirectories(const std::filesystem::path &dir) = 0;
+    // Whether the backend holds more than it may, logs then evict their
+    // oldest sealed segments.
+    virtual bool full() const { return false; }
+    // whether the files outlive the process, e.g. to upload them
+    virtual bool persistent() const = 0;
+};
+
+class FileBackend : public StorageBackend {
+  public:
+    int open(const std::filesystem::path &path, int flags,
+             mode_t mode) override;
+    bool exists(const std::filesystem::path &path) const override;
+    void remove(const std::filesystem::path &path) override;
+    std::vector<std::string>
+    list(const std::filesystem::path &dir) const override;
+    void createDirectories(const std::filesystem::path &dir) override;
+    bool persistent() const override { return true; }
+};
+
+// the backend of logs that do not configure one
+const std::shared_ptr<StorageBackend> &fileStorage();
+
+/*
+    Files are anonymous memory files (memfd_create), registered under their
+    path. Their pages are allocated as the file grows and freed once the file
+    is removed and the last descriptor is closed. Nothing survives the
+    process, for ephemeral topics and benchmarks without disk I/O; fsyncs
+    succeed without doing anything. With a capacity the backend is full once
+    its files hold more bytes than that.
+*/
+class MemoryBackend : public StorageBackend {
+  public:
+    explicit MemoryBackend(uint64_t capacity = 0);
+    MemoryBackend(const MemoryBackend &other) = delete;
+    MemoryBackend &operator=(const MemoryBackend &other) = delete;
+    ~MemoryBackend();
+
+    int open(const std::filesystem::path &path, int flags,
+             mode_t mode) override;
+    bool exists(const std::filesystem::path &path) const override;
+    void remove(const std::filesystem::path &path) override;
+    std::vector<std::string>
+    list(const std::filesystem::path &dir) const override;
+    void createDirectories(const std::filesystem::path &) override {}
+    bool full() const override;
+    bool persistent() const override { return false; }
+    // size of all files that have not been removed
+    uint64_t usedBytes() const;
+
+  private:
+    uint64_t capacity_;
+    // lexically normal path to the descriptor owned by the backend
+    std::map<std::filesystem::path, int> files_;
+    mutable std::mutex mutex_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
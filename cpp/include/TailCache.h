@@ -0,0 +1,61 @@
+#ifndef TAIL_CACHE_H
+#define TAIL_CACHE_H
+
+#include "Segment.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+
+namespace kafka_lite {
+namespace broker {
+
+/*
+    The most recently appended records of the active segment, as references
+    to the chunks the writer wrote them from. The writer adds every chunk
+    right after writing it and before publishing it, so fetches at the tail
+    are answered from memory without a syscall. The fan out buffer shares the
+    same chunks, so the records are copied once per append. Records beyond
+    the capacity are dropped from the front, reads of those fall back to the
+    file.
+*/
+class TailCache {
+  public:
+    explicit TailCache(size_t capacity);
+
+    // file_position is the position of the chunk in the segment file
+    void append(uint64_t file_position,
+                std::shared_ptr<const RecordChunk> chunk);
+    // Same plan as for the file: whole records from offset on, as long as
+    // they fit into max_bytes. Records after published_offset are left out.
+    // Returns nullopt if offset is not cached.
+    std::optional<SegmentReadPlan> plan(uint64_t offset, size_t max_bytes,
+                                        uint64_t published_offset) const;
+    // false if the range is not (or no longer) cached completely
+    bool copy(uint64_t file_position, size_t length, uint8_t *dest) const;
+    TailCacheStats stats() const;
+
+  private:
+    // records first and later of chunk are cached
+    struct CachedChunk {
+        uint64_t file_position;
+        std::shared_ptr<const RecordChunk> chunk;
+        size_t first;
+    };
+
+    size_t capacity_;
+    // contiguous in the file, the first record has first_offset_ and starts
+    // at start_pos_
+    std::deque<CachedChunk> chunks_;
+    uint64_t first_offset_, end_offset_, start_pos_, end_pos_;
+    mutable std::shared_mutex mutex_;
+    mutable std::atomic<uint64_t> hits_, misses_;
+};
+
+} // namespace broker
+} // namespace kafka_lite
+
+#endif
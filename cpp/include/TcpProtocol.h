@@ -1,6 +1,7 @@
 #ifndef TCP_REQUEST_HH
 #define TCP_REQUEST_HH
 
+#include "../include/Codec.h"
 #include "../include/Log.h"
 #include <array>
 #include <boost/uuid.hpp>
@@ -14,16 +15,33 @@ namespace broker {
 
 using boost::uuids::uuid;
 
-static uint32_t TCP_RESPONSE_HEADER_LEN = 17;
-static uint32_t TCP_REQUEST_HEADER_LEN = 20; // Without optional headers
-static uint8_t PROTOCOL_VERSION = 0;
-static std::array<uint8_t, 5> MAGIC_BYTES = {0x6B, 0x61, 0x66, 0x6B, 0x61};
+static constexpr uint32_t TCP_RESPONSE_HEADER_LEN = 17;
+// Length prefix plus response header, i.e. everything in front of the payload
+static constexpr size_t TCP_RESPONSE_PREFIX_LEN = 4 + 17;
+static constexpr uint32_t TCP_REQUEST_HEADER_LEN = 20; // Without optional headers
+static constexpr uint8_t PROTOCOL_VERSION = 0;
+static constexpr std::array<uint8_t, 5> MAGIC_BYTES = {0x6B, 0x61, 0x66, 0x6B, 0x61};
+static constexpr size_t MAX_REQUEST_HEADER_LEN = 4096;
+// offset and max_bytes, followed by min_bytes and max_wait_ms for long polls
+// and the fetch session id
+static constexpr size_t FETCH_PAYLOAD_LEN = 12;
+static constexpr size_t LONG_POLL_FETCH_PAYLOAD_LEN = 20;
+static constexpr size_t SESSION_FETCH_PAYLOAD_LEN = 28;
+// replica id, offset, max_bytes and max_wait_ms
+static constexpr size_t REPLICA_SYNC_PAYLOAD_LEN = 24;
+// flags of appends: the codec of a compressed batch, the AppendAcks and
+// whether the batch belongs to an idempotent producer, other bits are unused
+static constexpr uint16_t APPEND_CODEC_MASK = 0x0007;
+static constexpr uint16_t APPEND_ACKS_MASK = 0x0018;
+static constexpr uint16_t APPEND_ACKS_SHIFT = 3;
+static constexpr uint16_t APPEND_PRODUCER_FLAG = 0x0020;
 
 enum class RequestType {
     Append,
     Fetch,
+    Subscribe,
     // Heartbeat,
-    // ReplicaSync,
+    ReplicaSync,
 };
 
 enum class ParseError {
@@ -37,14 +55,48 @@ enum class ParseError {
 struct AppendRequest {
     boost::uuids::uuid correlation_id;
     std::vector<uint8_t> payload;
+    // None and no producer for a plain record, see RecordManager.h
+    CompressionCodec codec;
+    AppendAcks acks;
+    bool producer;
 };
 
 struct FetchRequest {
     boost::uuids::uuid correlation_id;
     uint64_t offset;
     uint32_t max_bytes;
+    uint32_t min_bytes;
+    uint32_t max_wait_ms;
+    // 0 if the fetch does not belong to a session
+    uint64_t session_id;
 };
 
+// Same payload layout as a fetch, max_bytes is the flow control window, i.e.
+// the number of pushed bytes that may be queued for the subscriber
+struct SubscribeRequest {
+    boost::uuids::uuid correlation_id;
+    uint64_t offset;
+    uint32_t max_bytes;
+};
+
+/*
+    Fetch of a follower. offset is the log end offset of the follower, i.e.
+    it has every record before it, the leader holds the request for up to
+    max_wait_ms if there is no record from offset on yet. The response
+    payload is the high watermark (u64) followed by the records.
+*/
+struct ReplicaSyncRequest {
+    boost::uuids::uuid correlation_id;
+    uint64_t replica_id;
+    uint64_t offset;
+    uint32_t max_bytes;
+    uint32_t max_wait_ms;
+};
+
+// flags of an append request
+uint16_t appendFlags(CompressionCodec codec, AppendAcks acks,
+                     bool producer = false);
+
 struct TcpHeaders {
     TcpHeaders() = default;
     TcpHeaders(const uuid &correlation_id, uint8_t ptcl_version,
@@ -54,6 +106,7 @@ struct TcpHeaders {
     RequestType type;
     uint16_t flags;
     bool from_bytes(const std::vector<uint8_t> &bytes);
+    bool from_bytes(const uint8_t *bytes, size_t size);
     std::vector<uint8_t> to_bytes() const;
 
     ParseError getParseError() { return parse_error; }
@@ -62,21 +115,59 @@ struct TcpHeaders {
     ParseError parse_error;
 };
 
+enum class FrameStatus { Complete, Incomplete, Invalid };
+
+/*
+    Location of the parts of a request frame
+        header length (4 bytes, big endian)
+        magic bytes
+        headers
+        payload length (4 bytes, big endian)
+        payload
+    relative to the start of the frame. frame_len is 0 as long as the payload
+    length has not been received.
+*/
+struct RequestFrame {
+    size_t header_pos, header_len;
+    size_t payload_pos, payload_len;
+    size_t frame_len;
+
+    static FrameStatus parse(const uint8_t *data, size_t size,
+                             RequestFrame &frame);
+};
+
 struct TcpRequest {
     TcpHeaders headers;
-    std::vector<uint8_t> payload;
-    std::variant<AppendRequest, FetchRequest> to_specialized_type();
+    std::vector<uint8_t> payload = {};
+    // moves the payload into the specialized request
+    std::variant<AppendRequest, FetchRequest, SubscribeRequest,
+                 ReplicaSyncRequest>
+    to_specialized_type();
 
     static std::vector<uint8_t> make_payload(uint64_t offset,
                                              uint32_t max_bytes);
+    static std::vector<uint8_t> make_payload(uint64_t offset,
+                                             uint32_t max_bytes,
+                                             uint32_t min_bytes,
+                                             uint32_t max_wait_ms);
+    static std::vector<uint8_t>
+    make_payload(uint64_t offset, uint32_t max_bytes, uint32_t min_bytes,
+                 uint32_t max_wait_ms, uint64_t session_id);
+    static std::vector<uint8_t>
+    make_replica_sync_payload(uint64_t replica_id, uint64_t offset,
+                              uint32_t max_bytes, uint32_t max_wait_ms);
 };
 
 struct TcpResponse {
     boost::uuids::uuid correlation_id;
     uint8_t response_code;
     std::optional<std::vector<uint8_t>> payload;
+    // written after payload, used to send shared buffers without copying
+    std::vector<PayloadSlice> payload_slices = {};
 
+    size_t payload_size() const;
     std::vector<uint8_t> to_bytes() const;
+    std::array<uint8_t, TCP_RESPONSE_PREFIX_LEN> prefix_to_bytes() const;
     static TcpResponse from_bytes(const std::vector<uint8_t> &bytes);
     static TcpResponse
     makeErrorResponse(const boost::uuids::uuid &correlation_id,
@@ -84,7 +175,12 @@ struct TcpResponse {
     static TcpResponse makeResponse(const boost::uuids::uuid &correlation_id,
                                     uint64_t offset, const std::error_code &ec);
     static TcpResponse makeResponse(const boost::uuids::uuid &correlation_id,
-                                    const FetchResult &result,
+                                    FetchResult result,
+                                    const std::error_code &ec);
+    // response to a ReplicaSync
+    static TcpResponse makeResponse(const boost::uuids::uuid &correlation_id,
+                                    uint64_t high_watermark,
+                                    FetchResult result,
                                     const std::error_code &ec);
 };
 
@@ -8,13 +8,20 @@ namespace kafka_lite {
 namespace broker {
 
 AppendJob::AppendJob(AppendJob &&job) noexcept
-    : payload(job.payload), callback(job.callback) {}
+    : payload(std::move(job.payload)), record_offset(job.record_offset),
+      callback(std::move(job.callback)),
+      buffer_pool(std::move(job.buffer_pool)), attributes(job.attributes),
+      durable(job.durable) {}
 
 AppendJob &AppendJob::operator=(AppendJob &&job) noexcept {
     if (&job == this)
         return *this;
-    payload = job.payload;
-    callback = job.callback;
+    payload = std::move(job.payload);
+    record_offset = job.record_offset;
+    callback = std::move(job.callback);
+    buffer_pool = std::move(job.buffer_pool);
+    attributes = job.attributes;
+    durable = job.durable;
     return *this;
 }
 
@@ -26,9 +33,8 @@ void AppendQueue::push(AppendJob &job) {
 
 std::vector<AppendJob> AppendQueue::wait_and_pop() {
     std::unique_lock<std::mutex> lock(mutex_);
-    bool job_queue_nonempty =
-        cv_.wait_for(lock, std::chrono::milliseconds(5),
-                     [this] { return jobs_.size() > 10; });
+    cv_.wait_for(lock, std::chrono::milliseconds(5),
+                 [this] { return jobs_.size() > 10; });
     if (jobs_.empty())
         return {};
     std::vector<AppendJob> result;
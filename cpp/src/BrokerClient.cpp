@@ -7,7 +7,11 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <mutex>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <sys/socket.h>
 #include <vector>
 
 namespace kafka_lite {
@@ -17,54 +21,198 @@ using namespace boost::uuids;
 using namespace kafka_lite::byteswap;
 using tcp = boost::asio::ip::tcp;
 
-BrokerClient::BrokerClient(unsigned int port) : port_(port) {}
+BrokerClient::BrokerClient(unsigned int port)
+    : port_(port), socket_(io_context_), shut_down_(false) {
+    // random, so that clients do not share sessions, 0 means no session
+    std::random_device random;
+    std::uniform_int_distribution<uint64_t> distribution(1);
+    fetch_session_id_ = distribution(random);
+    producer_id_ = distribution(random);
+}
+
+TcpResponse BrokerClient::append(const std::vector<uint8_t> &payload,
+                                 AppendAcks acks) {
+    if (acks == AppendAcks::None)
+        throw std::invalid_argument("Appends without acks get no response.");
+    return receive(send_append(payload, acks));
+}
 
-TcpResponse BrokerClient::append(const std::vector<uint8_t> &payload) {
+TcpResponse BrokerClient::fetch(uint64_t offset, uint32_t max_bytes,
+                                uint32_t min_bytes, uint32_t max_wait_ms) {
+    return receive(send_fetch(offset, max_bytes, min_bytes, max_wait_ms));
+}
+
+uuid BrokerClient::send_append(const std::vector<uint8_t> &payload,
+                              AppendAcks acks) {
     random_generator generator;
     auto correlation_id = generator();
-    TcpHeaders headers(correlation_id, 0, RequestType::Append, 0);
+    TcpHeaders headers(correlation_id, 0, RequestType::Append,
+                       appendFlags(CompressionCodec::None, acks));
     auto record = RecordManager::create_record(payload);
-    auto header_bytes = headers.to_bytes();
-    tcp::socket socket(io_context_);
-    tcp::resolver resolver(io_context_);
-    tcp::resolver::results_type endpoints =
-        resolver.resolve("localhost", std::to_string(port_));
-    boost::asio::connect(socket, endpoints);
-    send_header_len_and_magic_bytes(header_bytes.size(), socket);
-    boost::asio::write(socket, boost::asio::buffer(header_bytes));
-    send_payload(socket, record.to_bytes_with_len());
-    return recv_response(socket);
-}
-
-TcpResponse BrokerClient::fetch(uint64_t offset, uint32_t max_bytes) {
+    send_request(headers, record.to_bytes_with_len());
+    return correlation_id;
+}
+
+TcpResponse
+BrokerClient::append_batch(const std::vector<std::vector<uint8_t>> &payloads,
+                           CompressionCodec codec, AppendAcks acks) {
+    if (acks == AppendAcks::None)
+        throw std::invalid_argument("Appends without acks get no response.");
+    return receive(send_append_batch(payloads, codec, acks));
+}
+
+uuid BrokerClient::send_append_batch(
+    const std::vector<std::vector<uint8_t>> &payloads, CompressionCodec codec,
+    AppendAcks acks) {
+    random_generator generator;
+    auto correlation_id = generator();
+    TcpHeaders headers(correlation_id, 0, RequestType::Append,
+                       appendFlags(codec, acks));
+    auto record = RecordManager::create_batch(payloads, codec);
+    send_request(headers, record.to_bytes_with_len());
+    return correlation_id;
+}
+
+TcpResponse
+BrokerClient::producer_append(const std::vector<std::vector<uint8_t>> &payloads,
+                              uint32_t sequence, CompressionCodec codec,
+                              AppendAcks acks) {
+    if (acks == AppendAcks::None)
+        throw std::invalid_argument("Appends without acks get no response.");
+    return receive(send_producer_append(payloads, sequence, codec, acks));
+}
+
+uuid BrokerClient::send_producer_append(
+    const std::vector<std::vector<uint8_t>> &payloads, uint32_t sequence,
+    CompressionCodec codec, AppendAcks acks) {
+    random_generator generator;
+    auto correlation_id = generator();
+    TcpHeaders headers(correlation_id, 0, RequestType::Append,
+                       appendFlags(codec, acks, true));
+    auto record = RecordManager::create_batch(
+        payloads, codec,
+        {.producer_id = producer_id_, .sequence = sequence});
+    send_request(headers, record.to_bytes_with_len());
+    return correlation_id;
+}
+
+uuid BrokerClient::send_fetch(uint64_t offset, uint32_t max_bytes,
+                              uint32_t min_bytes, uint32_t max_wait_ms) {
     random_generator generator;
     auto correlation_id = generator();
     TcpHeaders headers(correlation_id, 0, RequestType::Fetch, 0);
-    auto payload = TcpRequest::make_payload(offset, max_bytes);
-    auto header_bytes = headers.to_bytes();
-    tcp::socket socket(io_context_);
-    tcp::resolver resolver(io_context_);
-    tcp::resolver::results_type endpoints =
-        resolver.resolve("localhost", std::to_string(port_));
-    boost::asio::connect(socket, endpoints);
-    send_header_len_and_magic_bytes(header_bytes.size(), socket);
-    boost::asio::write(socket, boost::asio::buffer(header_bytes));
-    send_payload(socket, payload);
-    return recv_response(socket);
+    send_request(headers,
+                 TcpRequest::make_payload(offset, max_bytes, min_bytes,
+                                          max_wait_ms, fetch_session_id_));
+    return correlation_id;
+}
+
+uuid BrokerClient::send_subscribe(uint64_t offset, uint32_t window) {
+    random_generator generator;
+    auto correlation_id = generator();
+    TcpHeaders headers(correlation_id, 0, RequestType::Subscribe, 0);
+    send_request(headers, TcpRequest::make_payload(offset, window));
+    return correlation_id;
+}
+
+TcpResponse BrokerClient::replica_sync(uint64_t replica_id, uint64_t offset,
+                                       uint32_t max_bytes,
+                                       uint32_t max_wait_ms) {
+    return receive(
+        send_replica_sync(replica_id, offset, max_bytes, max_wait_ms));
+}
+
+uuid BrokerClient::send_replica_sync(uint64_t replica_id, uint64_t offset,
+                                     uint32_t max_bytes,
+                                     uint32_t max_wait_ms) {
+    random_generator generator;
+    auto correlation_id = generator();
+    TcpHeaders headers(correlation_id, 0, RequestType::ReplicaSync, 0);
+    send_request(headers, TcpRequest::make_replica_sync_payload(
+                              replica_id, offset, max_bytes, max_wait_ms));
+    return correlation_id;
+}
+
+TcpResponse BrokerClient::receive(const uuid &correlation_id) {
+    auto it = pending_responses_.find(correlation_id);
+    if (it != pending_responses_.end()) {
+        auto response = std::move(it->second);
+        pending_responses_.erase(it);
+        return response;
+    }
+    ensure_connected();
+    while (true) {
+        TcpResponse response;
+        try {
+            response = recv_response(socket_);
+        } catch (...) {
+            close();
+            throw;
+        }
+        if (response.correlation_id == correlation_id)
+            return response;
+        pending_responses_.emplace(response.correlation_id,
+                                   std::move(response));
+    }
 }
 
 TcpResponse BrokerClient::send_raw_request(const TcpRequest &request) {
-    tcp::socket socket(io_context_);
-    tcp::resolver resolver(io_context_);
-    tcp::resolver::results_type endpoints =
-        resolver.resolve("localhost", std::to_string(port_));
-    boost::asio::connect(socket, endpoints);
-    auto header_bytes = request.headers.to_bytes();
-    uint32_t len = header_bytes.size();
-    send_header_len_and_magic_bytes(len, socket);
-    boost::asio::write(socket, boost::asio::buffer(header_bytes));
-    send_payload(socket, request.payload);
-    return recv_response(socket);
+    send_request(request.headers, request.payload);
+    try {
+        return recv_response(socket_);
+    } catch (...) {
+        close();
+        throw;
+    }
+}
+
+void BrokerClient::close() {
+    boost::system::error_code ec;
+    {
+        std::lock_guard lock(socket_mutex_);
+        socket_.close(ec);
+    }
+    pending_responses_.clear();
+}
+
+/*
+    shutdown(2) wakes up a blocking read or write on the socket in the other
+    thread, which then fails. Closing the socket instead could hand its
+    descriptor to somebody else while the other thread still uses it.
+*/
+void BrokerClient::shutdown() {
+    std::lock_guard lock(socket_mutex_);
+    shut_down_ = true;
+    if (socket_.is_open())
+        ::shutdown(socket_.native_handle(), SHUT_RDWR);
+}
+
+void BrokerClient::ensure_connected() {
+    std::lock_guard lock(socket_mutex_);
+    if (shut_down_)
+        throw std::runtime_error("Client has been shut down.");
+    if (socket_.is_open())
+        return;
+    if (endpoints_.empty()) {
+        tcp::resolver resolver(io_context_);
+        endpoints_ = resolver.resolve("localhost", std::to_string(port_));
+    }
+    boost::asio::connect(socket_, endpoints_);
+    socket_.set_option(tcp::no_delay(true));
+}
+
+void BrokerClient::send_request(const TcpHeaders &headers,
+                                const std::vector<uint8_t> &payload) {
+    ensure_connected();
+    auto header_bytes = headers.to_bytes();
+    try {
+        send_header_len_and_magic_bytes(header_bytes.size(), socket_);
+        boost::asio::write(socket_, boost::asio::buffer(header_bytes));
+        send_payload(socket_, payload);
+    } catch (...) {
+        close();
+        throw;
+    }
 }
 
 void BrokerClient::send_header_len_and_magic_bytes(uint32_t len,
@@ -1,11 +1,24 @@
 #include "../include/BrokerCore.h"
+#include "../include/BrokerClient.h"
+#include "../include/BufferPool.h"
+#include "../include/ByteSwap.h"
+#include "../include/ProducerState.h"
 #include "../include/RecordManager.h"
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <exception>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <system_error>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 using namespace std::chrono_literals;
 using namespace std::chrono;
@@ -13,30 +26,60 @@ using namespace std::chrono;
 namespace kafka_lite {
 namespace broker {
 
-BrokerCore::BrokerCore(const std::filesystem::path &dir, uint64_t segment_size)
-    : fetch_calls_counter_(0), status_(BrokerCoreStatus::Starting),
-      stop_(false), append_log_(dir, segment_size) {}
+BrokerCore::BrokerCore(const std::filesystem::path &dir, uint64_t segment_size,
+                       const LogConfig &log_config,
+                       const ReplicationConfig &replication)
+    : append_log_(dir, segment_size, log_config),
+      purgatory_([this](ParkedFetch &fetch) { completeParkedFetch(fetch); }),
+      fan_out_(FAN_OUT_BUFFER_SIZE), status_(BrokerCoreStatus::Starting),
+      tiering_interval_(log_config.remote_store
+                            ? log_config.tiering_interval_ms
+                            : 0),
+      tiering_errors_(0), replication_(replication),
+      replicas_(replication.replica_lag_timeout), leader_high_watermark_(0),
+      stop_(false), fetch_calls_counter_(0) {}
 
 BrokerCore::~BrokerCore() { stop(); }
 
 void BrokerCore::start() {
     append_log_.start();
-    writer_thread = std::thread(&BrokerCore::writerLoop, this);
+    purgatory_.start();
+    if (is_follower())
+        replica_thread_ = std::thread(&BrokerCore::replicaLoop, this);
+    else
+        writer_thread = std::thread(&BrokerCore::writerLoop, this);
+    if (tiering_interval_.count() > 0)
+        tiering_thread_ = std::thread(&BrokerCore::tieringLoop, this);
     status_ = BrokerCoreStatus::Active;
 }
 
 void BrokerCore::stop() {
     status_ = BrokerCoreStatus::Stopping;
     stop_.store(true);
+    {
+        std::lock_guard lock(leader_mutex_);
+        if (leader_)
+            leader_->shutdown();
+    }
     if (writer_thread.joinable())
         writer_thread.join();
+    if (replica_thread_.joinable())
+        replica_thread_.join();
+    completeDurableAppends(std::make_error_code(std::errc::not_connected));
+    if (tiering_thread_.joinable())
+        tiering_thread_.join();
+    purgatory_.stop();
     while (fetch_calls_counter_.load(std::memory_order_acquire) > 0)
         std::this_thread::sleep_for(10ms);
     status_ = BrokerCoreStatus::Stopped;
 }
 
-void BrokerCore::submit_append(const AppendData &data,
-                               AppendCallback callback) {
+void BrokerCore::submit_append(AppendData data, AppendCallback callback) {
+    // followers only take records from their leader
+    if (is_follower()) {
+        callback(0, std::make_error_code(std::errc::operation_not_permitted));
+        return;
+    }
     if (status_ == BrokerCoreStatus::Stopping ||
         status_ == BrokerCoreStatus::Stopped) {
         std::error_code ec = std::make_error_code(std::errc::not_connected);
@@ -48,23 +91,30 @@ void BrokerCore::submit_append(const AppendData &data,
             std::this_thread::sleep_for(
                 50ms); // Block appends to avoid appends during recovery
     }
-    if (!RecordManager::check_integrity(data.data)) {
+    if (data.record_offset > data.data.size() ||
+        !RecordManager::check_integrity(data.data.data() + data.record_offset,
+                                        data.data.size() -
+                                            data.record_offset)) {
         callback(0, std::make_error_code(std::errc::bad_message));
         return;
     }
     AppendJob job;
-    job.payload = data.data;
-    job.callback = callback;
+    job.payload = std::move(data.data);
+    job.record_offset = data.record_offset;
+    job.callback = std::move(callback);
+    job.buffer_pool = std::move(data.buffer_pool);
+    job.attributes = data.attributes;
+    job.durable = data.acks == AppendAcks::Durable;
     append_queue_.push(job);
 }
 
 void BrokerCore::submit_fetch(const FetchData &data, FetchCallback callback) {
-    auto counter = fetch_calls_counter_.fetch_add(1, std::memory_order_acq_rel);
+    fetch_calls_counter_.fetch_add(1, std::memory_order_acq_rel);
     if (status_ == BrokerCoreStatus::Stopping ||
         status_ == BrokerCoreStatus::Stopped) {
         std::error_code ec = std::make_error_code(std::errc::not_connected);
         callback({}, ec);
-        counter = fetch_calls_counter_.fetch_sub(1, std::memory_order_release);
+        fetch_calls_counter_.fetch_sub(1, std::memory_order_release);
         return;
     } else if (status_ == BrokerCoreStatus::Starting ||
                status_ == BrokerCoreStatus::Recovering) {
@@ -72,40 +122,440 @@ void BrokerCore::submit_fetch(const FetchData &data, FetchCallback callback) {
             std::this_thread::sleep_for(
                 50ms); // Block reads to avoid appends during recovery
     }
+    // read the sequence first, an append right after the read wakes the fetch
+    uint64_t sequence = purgatory_.sequence();
     std::error_code ec;
     FetchResult result;
     try {
-        result = append_log_.fetch(data);
+        result = readLog(data);
     } catch (const std::exception &e) {
         ec = make_error_code(std::errc::io_error);
     }
-    callback(result, ec);
-    counter = fetch_calls_counter_.fetch_sub(1, std::memory_order_release);
+    size_t min_bytes = std::min(data.min_bytes, data.max_bytes);
+    if (!ec && data.max_wait_ms > 0 && result.size() < min_bytes) {
+        ParkedFetch fetch{.data = data,
+                          .callback = std::move(callback),
+                          .deadline = steady_clock::now() +
+                                      milliseconds(data.max_wait_ms),
+                          .available_bytes = result.size()};
+        fetch.data.min_bytes = min_bytes;
+        purgatory_.park(std::move(fetch), sequence);
+    } else
+        callback(std::move(result), ec);
+    fetch_calls_counter_.fetch_sub(1, std::memory_order_release);
+}
+
+/*
+    The offset of a ReplicaSync is the log end offset of the follower, so it
+    acknowledges every record before it. The high watermark in the response
+    is taken once the fetch is answered, after a long poll it may have moved.
+*/
+void BrokerCore::submit_replica_sync(uint64_t replica_id,
+                                     const FetchData &data,
+                                     ReplicaSyncCallback callback) {
+    if (is_follower()) {
+        callback({}, 0,
+                 std::make_error_code(std::errc::operation_not_permitted));
+        return;
+    }
+    if (status_ != BrokerCoreStatus::Active) {
+        callback({}, 0, std::make_error_code(std::errc::not_connected));
+        return;
+    }
+    if (replicas_.update(replica_id, data.offset, append_log_.endOffset()))
+        highWatermarkMoved();
+    FetchData replica_data = data;
+    replica_data.replica_id = replica_id;
+    submit_fetch(replica_data, [this, callback = std::move(callback)](
+                                   FetchResult result, std::error_code ec) {
+        callback(std::move(result), ec ? 0 : high_watermark(), ec);
+    });
+}
+
+uint64_t BrokerCore::high_watermark() {
+    uint64_t end_offset = append_log_.endOffset();
+    if (is_follower())
+        return std::min(leader_high_watermark_.load(), end_offset);
+    return replicas_.highWatermark(end_offset);
+}
+
+void BrokerCore::highWatermarkMoved() {
+    purgatory_.wake();
+    fan_out_.notifyListeners();
+    completeDurableAppends();
+}
+
+/*
+    Without an error only the appends below the high watermark are answered.
+    The writer thread calls this after every round as well, since the high
+    watermark also moves when a follower has fallen out of the in sync
+    replicas, which nobody is told about.
+*/
+void BrokerCore::completeDurableAppends(std::error_code ec) {
+    std::deque<DurableAppend> completed;
+    {
+        std::lock_guard lock(durable_appends_mutex_);
+        if (durable_appends_.empty())
+            return;
+        uint64_t end_offset = ec ? std::numeric_limits<uint64_t>::max()
+                                 : high_watermark();
+        while (!durable_appends_.empty() &&
+               durable_appends_.front().offset < end_offset) {
+            completed.push_back(std::move(durable_appends_.front()));
+            durable_appends_.pop_front();
+        }
+    }
+    for (auto &append : completed)
+        append.callback(append.offset, ec);
+}
+
+void BrokerCore::completeParkedFetch(ParkedFetch &fetch) {
+    uint64_t sequence = purgatory_.sequence();
+    std::error_code ec;
+    FetchResult result;
+    try {
+        result = readLog(fetch.data);
+    } catch (const std::exception &e) {
+        ec = make_error_code(std::errc::io_error);
+    }
+    // the appended bytes may have been before the requested offset
+    if (!ec && result.size() < fetch.data.min_bytes &&
+        steady_clock::now() < fetch.deadline) {
+        fetch.available_bytes = result.size();
+        purgatory_.park(std::move(fetch), sequence);
+        return;
+    }
+    fetch.callback(std::move(result), ec);
+}
+
+/*
+    Followers read up to the log end offset and consumers up to the high
+    watermark, which is taken inside the coalesced read. Since it never moves
+    back the result is valid for everybody waiting on the read.
+*/
+FetchResult BrokerCore::readLog(const FetchData &data) {
+    if (data.replica_id != 0)
+        return append_log_.fetch(data);
+    return coalescer_.fetch(data, [this](const FetchData &data) {
+        FetchData bounded = data;
+        bounded.end_offset = std::min(data.end_offset, high_watermark());
+        return append_log_.fetch(bounded);
+    });
+}
+
+uint64_t BrokerCore::add_subscriber(SubscriptionListener listener) {
+    return fan_out_.addListener(std::move(listener));
+}
+
+void BrokerCore::remove_subscriber(uint64_t id) { fan_out_.removeListener(id); }
+
+static uint64_t count_records(const uint8_t *data, size_t size) {
+    uint64_t count = 0;
+    size_t pos = 0;
+    while (pos + SEGMENT_HEADER_SIZE <= size) {
+        uint32_t len;
+        std::memcpy(&len, data + pos, SEGMENT_HEADER_SIZE);
+        if (byteswap::is_big_endian())
+            len = byteswap::byteswap32(len);
+        pos += SEGMENT_HEADER_SIZE + recordHeaderLen(len);
+        ++count;
+    }
+    return count;
+}
+
+// every part of a fetch result holds whole records
+static uint64_t count_records(const FetchResult &result) {
+    uint64_t count =
+        count_records(result.result_buf.data(), result.result_buf.size());
+    for (const auto &slice : result.slices)
+        count += count_records(slice.data, slice.size);
+    return count;
+}
+
+/*
+    Subscribers at the tail are served from the fan out buffer. Everybody else
+    reads from the log, which returns nothing if the next record is larger
+    than max_bytes. In that case that record is read alone, bounded by its
+    own size, since subscriptions should always make progress.
+*/
+uint64_t BrokerCore::read_subscription(uint64_t offset, size_t max_bytes,
+                                       FetchResult &result,
+                                       std::error_code &ec) {
+    if (status_ != BrokerCoreStatus::Active) {
+        ec = std::make_error_code(std::errc::not_connected);
+        return offset;
+    }
+    uint64_t end_offset = high_watermark();
+    if (offset >= end_offset)
+        return offset;
+    auto next_offset =
+        fan_out_.read(offset, max_bytes, result.slices, end_offset);
+    if (next_offset.has_value())
+        return next_offset.value();
+    fetch_calls_counter_.fetch_add(1, std::memory_order_acq_rel);
+    try {
+        result = append_log_.fetch({.offset = offset,
+                                    .max_bytes = max_bytes,
+                                    .end_offset = end_offset});
+        if (result.size() == 0)
+            result = append_log_.fetch({.offset = offset,
+                                        .max_bytes =
+                                            append_log_.recordSize(offset),
+                                        .end_offset = end_offset});
+    } catch (const std::exception &e) {
+        ec = make_error_code(std::errc::io_error);
+    }
+    fetch_calls_counter_.fetch_sub(1, std::memory_order_release);
+    return offset + count_records(result);
+}
+
+/*
+    Uploads take as long as the store needs, so they run on their own thread
+    instead of holding up appends. A failed round (e.g. the store being
+    unreachable) is logged, counted and simply repeated in the next one.
+*/
+void BrokerCore::tieringLoop() {
+    while (!stop_.load()) {
+        try {
+            append_log_.tierSegments();
+        } catch (const std::exception &e) {
+            tiering_errors_.fetch_add(1, std::memory_order_relaxed);
+            std::cerr << "tiering failed, retrying: " << e.what()
+                      << std::endl;
+        }
+        auto deadline = steady_clock::now() + tiering_interval_;
+        while (!stop_.load() && steady_clock::now() < deadline)
+            std::this_thread::sleep_for(50ms);
+    }
+}
+
+/*
+    Fetches the records after the log end offset from the leader and appends
+    them as they are. The follower's log only ever holds records it got from
+    the leader in order, so they land at the leader's offsets. Syncs are
+    throttled like in the writer loop. Errors (the leader being down, a
+    damaged response) drop the connection and the sync is retried. The
+    connection is shared with stop(), which shuts it down, since a leader
+    that does not answer would otherwise block the sync (and the join)
+    forever.
+*/
+void BrokerCore::replicaLoop() {
+    std::shared_ptr<BrokerClient> leader;
+    auto time = steady_clock::now();
+    std::vector<RecordSlice> records;
+    std::vector<std::shared_ptr<const RecordChunk>> chunks;
+    while (!stop_.load()) {
+        try {
+            if (!leader) {
+                std::lock_guard lock(leader_mutex_);
+                if (stop_.load())
+                    break;
+                leader = std::make_shared<BrokerClient>(
+                    replication_.leader_port);
+                leader_ = leader;
+            }
+            uint64_t end_offset = append_log_.endOffset();
+            auto response = leader->replica_sync(
+                replication_.replica_id, end_offset,
+                replication_.sync_max_bytes, replication_.sync_max_wait_ms);
+            uint64_t leader_high_watermark;
+            if (response.response_code != 0 || !response.payload ||
+                response.payload->size() < sizeof(leader_high_watermark))
+                throw std::runtime_error("ReplicaSync failed.");
+            const auto &payload = response.payload.value();
+            std::memcpy(&leader_high_watermark, payload.data(),
+                        sizeof(leader_high_watermark));
+            if (!byteswap::is_big_endian())
+                leader_high_watermark =
+                    byteswap::byteswap64(leader_high_watermark);
+            records.clear();
+            size_t pos = sizeof(leader_high_watermark);
+            while (pos < payload.size()) {
+                uint32_t header;
+                if (payload.size() - pos < SEGMENT_HEADER_SIZE)
+                    throw std::runtime_error("Truncated replicated record.");
+                std::memcpy(&header, payload.data() + pos,
+                            SEGMENT_HEADER_SIZE);
+                if (byteswap::is_big_endian())
+                    header = byteswap::byteswap32(header);
+                uint32_t len = recordHeaderLen(header);
+                pos += SEGMENT_HEADER_SIZE;
+                if (payload.size() - pos < len ||
+                    !RecordManager::check_integrity(payload.data() + pos, len))
+                    throw std::runtime_error("Damaged replicated record.");
+                records.push_back({payload.data() + pos, len,
+                                   recordHeaderAttributes(header)});
+                pos += len;
+            }
+            uint64_t previous = high_watermark();
+            bool sync = steady_clock::now() - time > 500ms;
+            if (!records.empty()) {
+                size_t appended;
+                chunks.clear();
+                append_log_.append(records, sync, appended, &chunks);
+                publish(end_offset, records, chunks);
+                purgatory_.notify(payload.size() -
+                                  sizeof(leader_high_watermark));
+            } else if (sync) {
+                append_log_.flush();
+            }
+            if (sync)
+                time = steady_clock::now();
+            leader_high_watermark_.store(std::max(
+                leader_high_watermark_.load(), leader_high_watermark));
+            if (high_watermark() != previous)
+                highWatermarkMoved();
+        } catch (const std::exception &e) {
+            {
+                std::lock_guard lock(leader_mutex_);
+                leader_.reset();
+            }
+            leader.reset();
+            auto deadline = steady_clock::now() + 100ms;
+            while (!stop_.load() && steady_clock::now() < deadline)
+                std::this_thread::sleep_for(10ms);
+        }
+    }
+}
+
+/*
+    A batch of an idempotent producer is checked against the producer's
+    previous batch, which is either in this round or the last one in the log.
+    Returns std::errc::file_exists for a duplicate and
+    std::errc::result_out_of_range for a batch after a gap.
+*/
+static std::error_code
+checkProducerSequence(const ProducerStateTable &producers,
+                      std::unordered_map<uint64_t, uint32_t> &round_sequences,
+                      const AppendJob &job) {
+    const uint8_t *record = job.payload.data() + job.record_offset;
+    size_t len = job.payload.size() - job.record_offset;
+    if (len < sizeof(uint32_t))
+        return {};
+    auto producer = RecordManager::batch_producer(
+        job.attributes, record + sizeof(uint32_t), len - sizeof(uint32_t));
+    if (!producer.has_value())
+        return {};
+    auto it = round_sequences.find(producer->producer_id);
+    auto last = it != round_sequences.end()
+                    ? std::optional<uint32_t>(it->second)
+                    : producers.lastSequence(producer->producer_id);
+    switch (checkSequence(last, producer->sequence)) {
+    case SequenceCheck::Duplicate:
+        return std::make_error_code(std::errc::file_exists);
+    case SequenceCheck::OutOfSequence:
+        return std::make_error_code(std::errc::result_out_of_range);
+    default:
+        round_sequences[producer->producer_id] = producer->sequence;
+        return {};
+    }
+}
+
+// the chunks cover exactly the written records, or there are none
+void BrokerCore::publish(
+    uint64_t first_offset, std::span<const RecordSlice> records,
+    std::vector<std::shared_ptr<const RecordChunk>> &chunks) {
+    if (chunks.empty()) {
+        fan_out_.publish(first_offset, records);
+        return;
+    }
+    for (auto &chunk : chunks)
+        fan_out_.publish(std::move(chunk));
+    chunks.clear();
 }
 
 void BrokerCore::writerLoop() {
     auto time = steady_clock::now();
     unsigned int no_of_appends = 0;
+    std::vector<RecordSlice> records;
+    std::vector<std::shared_ptr<const RecordChunk>> chunks;
+    std::vector<AppendJob *> accepted;
+    std::unordered_map<uint64_t, uint32_t> round_sequences;
     while (!stop_.load()) {
         auto jobs = append_queue_.wait_and_pop();
-        for (const auto &job : jobs) {
-            AppendData append_data{job.payload};
+        /*
+            All jobs popped together are written as one batch. Whether we flush
+            is decided up front, so that the fsync can be submitted together
+            with the writes.
+        */
+        auto elapsed = steady_clock::now() - time;
+        bool durable = std::any_of(jobs.begin(), jobs.end(),
+                                   [](const auto &job) { return job.durable; });
+        bool sync = durable || elapsed > 500ms ||
+                    no_of_appends + jobs.size() > 100;
+        if (!jobs.empty()) {
+            // rejected batches of idempotent producers are not written
+            records.clear();
+            accepted.clear();
+            round_sequences.clear();
+            for (auto &job : jobs) {
+                auto ec = checkProducerSequence(append_log_.producers(),
+                                                round_sequences, job);
+                if (ec) {
+                    job.callback(0, ec);
+                    if (job.buffer_pool)
+                        job.buffer_pool->release(std::move(job.payload));
+                    continue;
+                }
+                accepted.push_back(&job);
+                records.push_back(
+                    {job.payload.data() + job.record_offset,
+                     static_cast<uint32_t>(job.payload.size() -
+                                           job.record_offset),
+                     job.attributes});
+            }
+            /*
+                A batch that spans a rollover is written in parts. If a later
+                part fails, the earlier ones are in the log already and get
+                their offsets, only the rest is answered with an error, so
+                producers do not resend records that were written.
+            */
             std::error_code ec;
-            uint64_t offset;
+            uint64_t offset = 0;
+            size_t appended = 0;
+            chunks.clear();
             try {
-                offset = append_log_.append(append_data);
-                ++no_of_appends;
+                offset = append_log_.endOffset();
+                if (!records.empty())
+                    append_log_.append(records, sync, appended, &chunks);
+                else if (sync)
+                    append_log_.flush();
             } catch (const std::exception &e) {
                 ec = make_error_code(std::errc::io_error);
             }
-            job.callback(offset, ec);
-        }
-        auto elapsed = steady_clock::now() - time;
-        if (elapsed > 500ms || no_of_appends > 100) {
+            no_of_appends += appended;
+            if (appended > 0) {
+                auto written = std::span(records).first(appended);
+                publish(offset, written, chunks);
+                size_t appended_bytes = 0;
+                for (const auto &record : written)
+                    appended_bytes += SEGMENT_HEADER_SIZE + record.len;
+                purgatory_.notify(appended_bytes);
+            }
+            for (size_t i = 0; i < accepted.size(); ++i) {
+                auto *job = accepted[i];
+                if (i < appended && job->durable) {
+                    std::lock_guard lock(durable_appends_mutex_);
+                    durable_appends_.push_back(
+                        {.offset = offset,
+                         .callback = std::move(job->callback)});
+                } else if (i < appended) {
+                    job->callback(offset, {});
+                } else {
+                    job->callback(0, ec);
+                }
+                ++offset;
+                if (job->buffer_pool)
+                    job->buffer_pool->release(std::move(job->payload));
+            }
+        } else if (sync) {
             append_log_.flush();
+        }
+        if (sync) {
             no_of_appends = 0;
             time = steady_clock::now();
         }
+        completeDurableAppends();
     }
 }
 } // namespace broker
@@ -1,6 +1,8 @@
 #include "../include/BrokerServer.h"
 #include "../include/ByteSwap.h"
+#include "../include/RecordManager.h"
 #include "../include/TcpProtocol.h"
+#include <algorithm>
 #include <array>
 #include <boost/asio.hpp>
 #include <cstddef>
@@ -9,6 +11,8 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <system_error>
 #include <variant>
 #include <vector>
@@ -18,161 +22,429 @@ namespace broker {
 
 using namespace kafka_lite::byteswap;
 
-uint32_t parseLength(std::array<uint8_t, 4> len_header_buf) {
-    uint32_t len;
-    std::memcpy(&len, len_header_buf.data(), sizeof(len));
-    if (!byteswap::is_big_endian())
-        len = byteswap32(len);
-    return len;
-}
+static constexpr size_t MAX_COALESCED_RESPONSES = 64;
 
-std::variant<AppendRequest, FetchRequest>
-TcpConnection::parseTcpRequest(const TcpHeaders &headers,
-                               const std::vector<uint8_t> &payload_bytes) {
-    TcpRequest request{headers, payload_bytes};
-    return request.to_specialized_type();
-}
+using reuse_port_option =
+    boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
 
 std::shared_ptr<TcpConnection>
 TcpConnection::create(boost::asio::io_context &io_context,
-                      std::unique_ptr<BrokerCoreIfc> &core) {
-    return std::shared_ptr<TcpConnection>(new TcpConnection(io_context, core));
+                      std::unique_ptr<BrokerCoreIfc> &core,
+                      const BrokerServerConfig &config,
+                      std::shared_ptr<BufferPool> buffer_pool) {
+    return std::shared_ptr<TcpConnection>(
+        new TcpConnection(io_context, core, config, std::move(buffer_pool)));
 }
 
 TcpConnection::TcpConnection(boost::asio::io_context &io_context,
-                             std::unique_ptr<BrokerCoreIfc> &core)
-    : strand_(boost::asio::make_strand(io_context)), socket_(io_context),
-      core_(core) {}
+                             std::unique_ptr<BrokerCoreIfc> &core,
+                             const BrokerServerConfig &config,
+                             std::shared_ptr<BufferPool> buffer_pool)
+    : strand_(boost::asio::make_strand(io_context)), socket_(strand_),
+      idle_timer_(strand_), config_(config), read_begin_(0), read_end_(0),
+      buffer_pool_(std::move(buffer_pool)), core_(core), in_flight_(0),
+      write_in_progress_(false), read_paused_(false), stopped_(false),
+      subscription_wakeup_pending_(false) {
+    if (config_.max_in_flight_requests == 0)
+        config_.max_in_flight_requests = 1;
+    config_.read_buffer_size =
+        std::max(config_.read_buffer_size,
+                 sizeof(uint32_t) + MAGIC_BYTES.size() +
+                     MAX_REQUEST_HEADER_LEN + sizeof(uint32_t));
+}
 
 void TcpConnection::start() {
-    boost::asio::post(
-        strand_, [self = shared_from_this()]() { self->doReadHeaderLength(); });
+    read_buf_.resize(config_.read_buffer_size);
+    boost::asio::post(strand_, [self = shared_from_this()]() {
+        self->touch();
+        self->checkIdleTimeout();
+        self->readNextRequest();
+    });
 }
 
-void TcpConnection::doReadHeaderLength() {
-    boost::asio::async_read(
-        socket_, boost::asio::buffer(length_buf_),
-        [self = shared_from_this()](boost::system::error_code ec,
-                                    size_t bytes_read) {
-            if (ec) {
-                self->stop();
-                return;
-            }
-            self->doReadMagicBytes();
-        });
-}
+/*
+    The connection keeps reading requests until the client closes it, the idle
+    timer fires or the in flight limit is hit. In the latter case reading is
+    resumed from sendResponse once a response has been queued. Responses are
+    written in the order in which they complete, clients match them to their
+    requests through the correlation id.
 
-void TcpConnection::doReadMagicBytes() {
-    boost::asio::async_read(
-        socket_, boost::asio::buffer(magic_bytes_buf_),
-        [self = shared_from_this()](boost::system::error_code ec,
-                                    size_t bytes_read) {
-            if (ec || self->magic_bytes_buf_ != MAGIC_BYTES) {
-                self->stop();
-                return;
-            }
-            uint32_t length = parseLength(self->length_buf_);
-            self->doReadHeaders(length);
-        });
+    Requests are read with async_read_some into read_buf_ and every complete
+    frame in the buffer is handled before reading again, so a burst of small
+    requests costs a single read. Frames larger than the read buffer are
+    finished with one async_read straight into the payload buffer.
+*/
+void TcpConnection::readNextRequest() {
+    while (!stopped_) {
+        if (in_flight_ >= config_.max_in_flight_requests) {
+            read_paused_ = true;
+            return;
+        }
+        read_paused_ = false;
+        RequestFrame frame;
+        auto status = RequestFrame::parse(read_buf_.data() + read_begin_,
+                                          read_end_ - read_begin_, frame);
+        if (status == FrameStatus::Invalid ||
+            frame.frame_len > config_.max_request_size) {
+            stop();
+            return;
+        }
+        if (status == FrameStatus::Incomplete) {
+            if (frame.frame_len > read_buf_.size())
+                doReadLargePayload(frame);
+            else
+                doReadSome();
+            return;
+        }
+        const uint8_t *frame_begin = read_buf_.data() + read_begin_;
+        auto payload = buffer_pool_->acquire(frame.payload_len);
+        std::memcpy(payload.data(), frame_begin + frame.payload_pos,
+                    frame.payload_len);
+        read_begin_ += frame.frame_len;
+        handleTcpRequest(frame_begin + frame.header_pos, frame.header_len,
+                         std::move(payload));
+    }
 }
 
-void TcpConnection::doReadPayloadLength() {
-    boost::asio::async_read(
-        socket_, boost::asio::buffer(length_buf_),
+void TcpConnection::doReadSome() {
+    // move the start of an incomplete frame to the front of the buffer
+    if (read_begin_ == read_end_) {
+        read_begin_ = read_end_ = 0;
+    } else if (read_begin_ > 0) {
+        std::memmove(read_buf_.data(), read_buf_.data() + read_begin_,
+                     read_end_ - read_begin_);
+        read_end_ -= read_begin_;
+        read_begin_ = 0;
+    }
+    socket_.async_read_some(
+        boost::asio::buffer(read_buf_.data() + read_end_,
+                            read_buf_.size() - read_end_),
         [self = shared_from_this()](boost::system::error_code ec,
                                     size_t bytes_read) {
             if (ec) {
                 self->stop();
                 return;
             }
-            uint32_t length = parseLength(self->length_buf_);
-            self->doReadPayload(length);
+            self->read_end_ += bytes_read;
+            self->touch();
+            self->readNextRequest();
         });
 }
 
-void TcpConnection::doReadHeaders(uint32_t length) {
-    header_read_buf_.resize(length);
+void TcpConnection::doReadLargePayload(const RequestFrame &frame) {
+    const uint8_t *frame_begin = read_buf_.data() + read_begin_;
+    large_header_buf_.assign(frame_begin + frame.header_pos,
+                             frame_begin + frame.header_pos + frame.header_len);
+    large_payload_buf_ = buffer_pool_->acquire(frame.payload_len);
+    size_t available = read_end_ - read_begin_ - frame.payload_pos;
+    std::memcpy(large_payload_buf_.data(), frame_begin + frame.payload_pos,
+                available);
+    read_begin_ = read_end_ = 0;
     boost::asio::async_read(
-        socket_, boost::asio::buffer(header_read_buf_),
-        [self = shared_from_this()](boost::system::error_code ec,
-                                    size_t bytes_read) {
+        socket_,
+        boost::asio::buffer(large_payload_buf_.data() + available,
+                            large_payload_buf_.size() - available),
+        [self = shared_from_this()](boost::system::error_code ec, size_t) {
             if (ec) {
                 self->stop();
                 return;
             }
-            self->doReadPayloadLength();
+            self->touch();
+            self->handleTcpRequest(self->large_header_buf_.data(),
+                                   self->large_header_buf_.size(),
+                                   std::move(self->large_payload_buf_));
+            self->readNextRequest();
         });
 }
 
-void TcpConnection::doReadPayload(uint32_t length) {
-    payload_read_buf_.resize(length);
-    boost::asio::async_read(
-        socket_, boost::asio::buffer(payload_read_buf_),
-        [self = shared_from_this()](boost::system::error_code ec,
-                                    size_t bytes_read) {
-            if (ec) {
-                self->stop();
+void TcpConnection::touch() {
+    last_activity_ = boost::asio::steady_timer::clock_type::now();
+}
+
+/*
+    Reads and writes only record the time, rearming the timer on each of them
+    would cancel and requeue its wait every time. When the timer fires it
+    checks how long the connection has been idle and waits for the rest of
+    the timeout if there was activity in the meantime.
+*/
+void TcpConnection::checkIdleTimeout() {
+    idle_timer_.expires_at(last_activity_ + config_.idle_timeout);
+    idle_timer_.async_wait(
+        [self = shared_from_this()](boost::system::error_code ec) {
+            if (ec || self->stopped_)
                 return;
+            if (self->last_activity_ + self->config_.idle_timeout <=
+                boost::asio::steady_timer::clock_type::now()) {
+                if (self->in_flight_ == 0 && !self->write_in_progress_ &&
+                    !self->subscription_) {
+                    self->stop();
+                    return;
+                }
+                self->touch();
             }
-            self->handleTcpRequest(std::move(self->header_read_buf_),
-                                   std::move(self->payload_read_buf_));
+            self->checkIdleTimeout();
         });
 }
 
-void TcpConnection::handleTcpRequest(std::vector<uint8_t> header_bytes,
+void TcpConnection::handleTcpRequest(const uint8_t *header_bytes,
+                                     size_t header_len,
                                      std::vector<uint8_t> payload_bytes) {
+    ++in_flight_;
     TcpHeaders headers;
-    if (!headers.from_bytes(header_bytes)) {
+    if (!headers.from_bytes(header_bytes, header_len)) {
+        buffer_pool_->release(std::move(payload_bytes));
         auto response = TcpResponse::makeErrorResponse(headers.correlation_id,
                                                        headers.getParseError());
-        sendResponse(response);
+        sendResponse(std::move(response));
         return;
     }
-    auto request = parseTcpRequest(headers, payload_bytes);
+    TcpRequest tcp_request{headers, std::move(payload_bytes)};
+    auto request = tcp_request.to_specialized_type();
     if (std::holds_alternative<AppendRequest>(request)) {
         handleAppendRequest(std::get<AppendRequest>(request));
-    } else {
+    } else if (std::holds_alternative<FetchRequest>(request)) {
+        buffer_pool_->release(std::move(tcp_request.payload));
         handleFetchRequest(std::get<FetchRequest>(request));
+    } else if (std::holds_alternative<SubscribeRequest>(request)) {
+        buffer_pool_->release(std::move(tcp_request.payload));
+        handleSubscribeRequest(std::get<SubscribeRequest>(request));
+    } else {
+        buffer_pool_->release(std::move(tcp_request.payload));
+        handleReplicaSyncRequest(std::get<ReplicaSyncRequest>(request));
     }
 }
 
-void TcpConnection::handleAppendRequest(const AppendRequest &request) {
-    AppendData data{request.payload};
+void TcpConnection::handleAppendRequest(AppendRequest &request) {
+    /*
+        Clients send the record with its length prefix, the core takes it
+        without, since the log writes the prefix itself. The prefix is skipped
+        through the record offset, the payload is not moved.
+    */
+    auto &payload = request.payload;
+    uint32_t len = 0;
+    if (payload.size() >= sizeof(len))
+        std::memcpy(&len, payload.data(), sizeof(len));
+    if (is_big_endian())
+        len = byteswap32(len);
+    /*
+        The attributes come from the flags, the client writes them into the
+        length header as well, like the log does. A batch is never guessed
+        from its payload, so a plain record may start with any bytes.
+    */
+    uint8_t attributes = static_cast<uint8_t>(request.codec);
+    if (request.producer)
+        attributes |= RECORD_ATTR_PRODUCER;
+    size_t min_size = sizeof(uint32_t);
+    if (attributes & RECORD_ATTR_PRODUCER)
+        min_size += PRODUCER_BATCH_HEADER_SIZE;
+    else if (attributes != 0)
+        min_size += BATCH_HEADER_SIZE;
+    if (payload.size() < sizeof(len) + min_size ||
+        recordHeaderLen(len) != payload.size() - sizeof(len) ||
+        recordHeaderAttributes(len) != attributes) {
+        buffer_pool_->release(std::move(payload));
+        finishAppend(request.acks,
+                     TcpResponse::makeResponse(
+                         request.correlation_id, 0,
+                         std::make_error_code(std::errc::bad_message)));
+        return;
+    }
+    /*
+        Appends without acks keep their in flight slot until they have been
+        written, so a producer that never waits is still slowed down to the
+        speed of the writer instead of filling the append queue.
+    */
+    AppendData data{.data = std::move(payload),
+                    .record_offset = sizeof(len),
+                    .attributes = attributes,
+                    .buffer_pool = buffer_pool_,
+                    .acks = request.acks};
     core_->submit_append(
-        data, [self = shared_from_this(), cor_id = request.correlation_id](
-                  uint64_t offset, std::error_code ec) {
-            boost::asio::post(self->strand_, [self, cor_id, offset, ec]() {
-                TcpResponse response =
-                    TcpResponse::makeResponse(cor_id, offset, ec);
-                self->sendResponse(response);
+        std::move(data),
+        [self = shared_from_this(), cor_id = request.correlation_id,
+         acks = request.acks](uint64_t offset, std::error_code ec) {
+            boost::asio::post(self->strand_, [self, cor_id, acks, offset,
+                                              ec]() {
+                self->finishAppend(
+                    acks, TcpResponse::makeResponse(cor_id, offset, ec));
             });
         });
 }
 
 void TcpConnection::handleFetchRequest(const FetchRequest &request) {
     // TODO: handle max_bytes too large
-    FetchData data{.offset = request.offset, .max_bytes = request.max_bytes};
+    FetchData data{.offset = request.offset,
+                   .max_bytes = request.max_bytes,
+                   .min_bytes = request.min_bytes,
+                   .max_wait_ms = request.max_wait_ms,
+                   .session_id = request.session_id};
     core_->submit_fetch(
         data, [self = shared_from_this(), cor_id = request.correlation_id](
-                  const FetchResult &result, std::error_code ec) {
-            boost::asio::post(self->strand_, [self, cor_id, result, ec]() {
-                TcpResponse response =
-                    TcpResponse::makeResponse(cor_id, result, ec);
-                self->sendResponse(response);
+                  FetchResult result, std::error_code ec) {
+            boost::asio::post(self->strand_, [self, cor_id,
+                                              result = std::move(result),
+                                              ec]() mutable {
+                self->sendResponse(
+                    TcpResponse::makeResponse(cor_id, std::move(result), ec));
+            });
+        });
+}
+
+void TcpConnection::handleReplicaSyncRequest(
+    const ReplicaSyncRequest &request) {
+    if (request.replica_id == 0) {
+        sendResponse(TcpResponse::makeResponse(
+            request.correlation_id, 0,
+            std::make_error_code(std::errc::bad_message)));
+        return;
+    }
+    FetchData data{.offset = request.offset,
+                   .max_bytes = request.max_bytes,
+                   .min_bytes = 1,
+                   .max_wait_ms = request.max_wait_ms};
+    core_->submit_replica_sync(
+        request.replica_id, data,
+        [self = shared_from_this(), cor_id = request.correlation_id](
+            FetchResult result, uint64_t high_watermark, std::error_code ec) {
+            boost::asio::post(self->strand_, [self, cor_id,
+                                              result = std::move(result),
+                                              high_watermark, ec]() mutable {
+                self->sendResponse(TcpResponse::makeResponse(
+                    cor_id, high_watermark, std::move(result), ec));
             });
         });
 }
 
-void TcpConnection::sendResponse(const TcpResponse &response) {
-    write_queue_.push(response);
+/*
+    A subscription turns the connection into a push stream: every record from
+    the requested offset on is sent as a response with the correlation id of
+    the subscribe request. Records at the tail come as slices of the core's
+    shared fan out chunks. We stop pushing while window bytes are queued and
+    continue once they have been written, so a slow subscriber only falls
+    behind (and then reads from disk) instead of piling up memory.
+*/
+void TcpConnection::handleSubscribeRequest(const SubscribeRequest &request) {
+    if (subscription_) {
+        sendResponse(TcpResponse::makeResponse(
+            request.correlation_id, 0,
+            std::make_error_code(std::errc::already_connected)));
+        return;
+    }
+    subscription_.emplace(Subscription{.correlation_id = request.correlation_id,
+                                       .subscriber_id = 0,
+                                       .next_offset = request.offset,
+                                       .window = std::max<size_t>(
+                                           request.max_bytes, 1),
+                                       .queued_bytes = 0,
+                                       .window_full = false});
+    subscription_->subscriber_id = core_->add_subscriber(
+        [weak = std::weak_ptr<TcpConnection>(shared_from_this())]() {
+            auto self = weak.lock();
+            if (!self ||
+                self->subscription_wakeup_pending_.exchange(
+                    true, std::memory_order_acq_rel))
+                return;
+            boost::asio::post(self->strand_,
+                              [self]() { self->pumpSubscription(); });
+        });
+    // pushes are not responses to in flight requests, this one is done
+    if (in_flight_ > 0)
+        --in_flight_;
+    pumpSubscription();
+    if (read_paused_ && in_flight_ < config_.max_in_flight_requests)
+        readNextRequest();
+}
+
+void TcpConnection::pumpSubscription() {
+    subscription_wakeup_pending_.store(false, std::memory_order_release);
+    if (stopped_ || !subscription_)
+        return;
+    auto &subscription = *subscription_;
+    subscription.window_full = false;
+    while (subscription.queued_bytes < subscription.window) {
+        FetchResult result;
+        std::error_code ec;
+        uint64_t next_offset = core_->read_subscription(
+            subscription.next_offset,
+            subscription.window - subscription.queued_bytes, result, ec);
+        if (ec) {
+            queueResponse(TcpResponse::makeResponse(
+                subscription.correlation_id, FetchResult{}, ec));
+            endSubscription();
+            return;
+        }
+        // nothing new, wait for the listener
+        if (next_offset == subscription.next_offset)
+            return;
+        auto response = TcpResponse::makeResponse(subscription.correlation_id,
+                                                  std::move(result), ec);
+        subscription.queued_bytes += response.payload_size();
+        subscription.next_offset = next_offset;
+        queueResponse(std::move(response));
+    }
+    subscription.window_full = true;
+}
+
+void TcpConnection::endSubscription() {
+    if (!subscription_)
+        return;
+    core_->remove_subscriber(subscription_->subscriber_id);
+    subscription_.reset();
+}
+
+void TcpConnection::sendResponse(TcpResponse response) {
+    if (in_flight_ > 0)
+        --in_flight_;
+    queueResponse(std::move(response));
+    if (!stopped_ && read_paused_ &&
+        in_flight_ < config_.max_in_flight_requests)
+        readNextRequest();
+}
+
+void TcpConnection::finishAppend(AppendAcks acks, TcpResponse response) {
+    if (acks != AppendAcks::None) {
+        sendResponse(std::move(response));
+        return;
+    }
+    if (in_flight_ > 0)
+        --in_flight_;
+    if (!stopped_ && read_paused_ &&
+        in_flight_ < config_.max_in_flight_requests)
+        readNextRequest();
+}
+
+void TcpConnection::queueResponse(TcpResponse response) {
+    if (stopped_)
+        return;
+    touch();
+    write_queue_.push_back(std::move(response));
     if (!write_in_progress_)
         doWrite();
 }
 
+/*
+    Writes all queued responses (up to MAX_COALESCED_RESPONSES) with a single
+    gather write. Every response contributes its prefix and a reference to its
+    payload, the payload itself stays in the queue until the write completes.
+*/
 void TcpConnection::doWrite() {
     write_in_progress_ = true;
+    size_t count = std::min(write_queue_.size(), MAX_COALESCED_RESPONSES);
+    write_prefixes_.clear();
+    write_buffers_.clear();
+    for (size_t i = 0; i < count; ++i)
+        write_prefixes_.push_back(write_queue_[i].prefix_to_bytes());
+    for (size_t i = 0; i < count; ++i) {
+        write_buffers_.push_back(boost::asio::buffer(write_prefixes_[i]));
+        const auto &payload = write_queue_[i].payload;
+        if (payload.has_value() && !payload->empty())
+            write_buffers_.push_back(boost::asio::buffer(*payload));
+        for (const auto &slice : write_queue_[i].payload_slices)
+            write_buffers_.push_back(
+                boost::asio::buffer(slice.data, slice.size));
+    }
     boost::asio::async_write(
-        socket_, boost::asio::buffer(write_queue_.front().to_bytes()),
+        socket_, write_buffers_,
         boost::asio::bind_executor(
             strand_, [self = shared_from_this()](boost::system::error_code ec,
                                                  size_t bytes_written) {
@@ -181,23 +453,38 @@ void TcpConnection::doWrite() {
 }
 
 void TcpConnection::handleWrite(const boost::system::error_code &ec,
-                                size_t bytes_written) {
+                                size_t) {
     if (ec) {
         stop();
         return;
     }
-    write_queue_.pop();
+    touch();
+    if (subscription_) {
+        for (size_t i = 0; i < write_prefixes_.size(); ++i) {
+            if (write_queue_[i].correlation_id == subscription_->correlation_id)
+                subscription_->queued_bytes -= std::min(
+                    subscription_->queued_bytes,
+                    write_queue_[i].payload_size());
+        }
+    }
+    write_queue_.erase(write_queue_.begin(),
+                       write_queue_.begin() + write_prefixes_.size());
     if (!write_queue_.empty()) {
         doWrite();
     } else {
         write_in_progress_ = false;
     }
+    if (subscription_ && subscription_->window_full &&
+        subscription_->queued_bytes < subscription_->window)
+        pumpSubscription();
 }
 
 void TcpConnection::stop() {
     if (stopped_)
         return;
     stopped_ = true;
+    idle_timer_.cancel();
+    endSubscription();
     boost::system::error_code ec;
     auto rc = socket_.shutdown(tcp::socket::shutdown_receive, ec);
     rc = socket_.shutdown(tcp::socket::shutdown_send, ec);
@@ -206,33 +493,60 @@ void TcpConnection::stop() {
 
 BrokerServer::BrokerServer(unsigned int port,
                            std::unique_ptr<BrokerCoreIfc> core,
-                           boost::asio::io_context &io_context)
-    : port_(port), status_(BrokerServerStatus::Starting),
-      core_(std::move(core)), iocontext_(io_context),
-      tcp_acceptor_(iocontext_, tcp::endpoint(tcp::v4(), port_)) {
-    if (port_ == 0)
-        port_ = tcp_acceptor_.local_endpoint().port();
-    std::cout << "listening on port " << port_ << std::endl;
+                           boost::asio::io_context &io_context,
+                           const BrokerServerConfig &config)
+    : BrokerServer(port, std::move(core),
+                   std::vector<boost::asio::io_context *>{&io_context},
+                   config) {}
+
+BrokerServer::BrokerServer(
+    unsigned int port, std::unique_ptr<BrokerCoreIfc> core,
+    const std::vector<boost::asio::io_context *> &io_contexts,
+    const BrokerServerConfig &config)
+    : port_(port), core_(std::move(core)), config_(config),
+      buffer_pool_(std::make_shared<BufferPool>()), accepted_connections_(0),
+      status_(BrokerServerStatus::Starting) {
+    if (io_contexts.empty())
+        throw std::invalid_argument("BrokerServer requires an io_context.");
+    bool reuse_port = io_contexts.size() > 1;
+    for (auto *io_context : io_contexts) {
+        auto shard = std::make_unique<Shard>(*io_context);
+        shard->acceptor.open(tcp::v4());
+        shard->acceptor.set_option(tcp::acceptor::reuse_address(true));
+        if (reuse_port)
+            shard->acceptor.set_option(reuse_port_option(true));
+        // the first acceptor determines the port if we were given port 0
+        shard->acceptor.bind(tcp::endpoint(tcp::v4(), port_));
+        shard->acceptor.listen();
+        if (port_ == 0)
+            port_ = shard->acceptor.local_endpoint().port();
+        shards_.push_back(std::move(shard));
+    }
+    std::cout << "listening on port " << port_ << " with " << shards_.size()
+              << " acceptor(s)" << std::endl;
     core_->start();
     status_ = BrokerServerStatus::Active;
-    startAccept();
+    for (auto &shard : shards_)
+        startAccept(*shard);
 }
 
-void BrokerServer::startAccept() {
+void BrokerServer::startAccept(Shard &shard) {
     std::shared_ptr<TcpConnection> connection =
-        TcpConnection::create(iocontext_, core_);
-    tcp_acceptor_.async_accept(connection->socket(),
-                               std::bind(&BrokerServer::handleAccept, this,
-                                         connection,
-                                         boost::asio::placeholders::error));
+        TcpConnection::create(shard.iocontext, core_, config_, buffer_pool_);
+    shard.acceptor.async_accept(
+        connection->socket(),
+        std::bind(&BrokerServer::handleAccept, this, std::ref(shard),
+                  connection, boost::asio::placeholders::error));
 }
 
-void BrokerServer::handleAccept(std::shared_ptr<TcpConnection> connection,
+void BrokerServer::handleAccept(Shard &shard,
+                                std::shared_ptr<TcpConnection> connection,
                                 const boost::system::error_code &ec) {
     if (!ec) {
+        accepted_connections_.fetch_add(1, std::memory_order_relaxed);
         connection->start();
     }
-    startAccept();
+    startAccept(shard);
 }
 
 } // namespace broker
@@ -0,0 +1,65 @@
+#include "../include/BufferPool.h"
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+static_assert(BufferPool::MIN_CLASS_SIZE << (BufferPool::NO_OF_CLASSES - 1) ==
+              BufferPool::MAX_CLASS_SIZE);
+
+BufferPool::BufferPool(size_t max_buffers_per_class)
+    : max_buffers_per_class_(max_buffers_per_class) {}
+
+size_t BufferPool::classIndex(size_t size) {
+    if (size <= MIN_CLASS_SIZE)
+        return 0;
+    return std::bit_width(size - 1) - std::bit_width(MIN_CLASS_SIZE - 1);
+}
+
+std::vector<uint8_t> BufferPool::acquire(size_t size) {
+    if (size > MAX_CLASS_SIZE)
+        return std::vector<uint8_t>(size);
+    auto index = classIndex(size);
+    std::vector<uint8_t> buffer;
+    {
+        std::lock_guard lock(classes_[index].mutex);
+        auto &free_buffers = classes_[index].free_buffers;
+        if (!free_buffers.empty()) {
+            buffer = std::move(free_buffers.back());
+            free_buffers.pop_back();
+        }
+    }
+    if (buffer.capacity() == 0)
+        buffer.reserve(MIN_CLASS_SIZE << index);
+    buffer.resize(size);
+    return buffer;
+}
+
+void BufferPool::release(std::vector<uint8_t> &&buffer) {
+    auto capacity = buffer.capacity();
+    // only take back buffers whose capacity is exactly a size class, anything
+    // else was not handed out by us or has been reallocated
+    if (capacity < MIN_CLASS_SIZE || capacity > MAX_CLASS_SIZE ||
+        !std::has_single_bit(capacity))
+        return;
+    auto index = classIndex(capacity);
+    buffer.clear();
+    std::lock_guard lock(classes_[index].mutex);
+    auto &free_buffers = classes_[index].free_buffers;
+    if (free_buffers.size() < max_buffers_per_class_)
+        free_buffers.push_back(std::move(buffer));
+}
+
+size_t BufferPool::cachedBuffers(size_t size) {
+    auto index = classIndex(size);
+    std::lock_guard lock(classes_[index].mutex);
+    return classes_[index].free_buffers.size();
+}
+
+} // namespace broker
+} // namespace kafka_lite
@@ -0,0 +1,285 @@
+#include "../include/Codec.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#ifdef KAFKA_LITE_HAS_LZ4
+#include <lz4.h>
+#endif
+#ifdef KAFKA_LITE_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+namespace kafka_lite {
+namespace broker {
+
+class NoneCodec : public Codec {
+  public:
+    CompressionCodec id() const override { return CompressionCodec::None; }
+    std::vector<uint8_t>
+    compress(std::span<const uint8_t> data) const override {
+        return {data.begin(), data.end()};
+    }
+    std::vector<uint8_t>
+    decompress(std::span<const uint8_t> data,
+               size_t uncompressed_size) const override {
+        if (data.size() != uncompressed_size)
+            throw std::runtime_error("Uncompressed size does not match.");
+        return {data.begin(), data.end()};
+    }
+};
+
+/*
+    Byte oriented LZ77 in the style of LZ4 blocks, without a dependency. The
+    input is a list of sequences, each a token (literal count in the high,
+    match length - 4 in the low nibble, 15 meaning that bytes of 255 and a
+    last smaller one follow), the literals, the distance of the match as a
+    little endian u16 and the rest of the match length. The last sequence has
+    literals only. Matches are found through a table of the last position of
+    every 4 byte hash, there is no chain, which keeps compression at a few
+    hundred MB/s at the cost of some ratio.
+*/
+class LzCodec : public Codec {
+  public:
+    CompressionCodec id() const override { return CompressionCodec::Lz; }
+    std::vector<uint8_t>
+    compress(std::span<const uint8_t> data) const override;
+    std::vector<uint8_t>
+    decompress(std::span<const uint8_t> data,
+               size_t uncompressed_size) const override;
+
+  private:
+    static constexpr unsigned int HASH_BITS = 14;
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t MAX_DISTANCE = 65535;
+
+    static uint32_t load32(const uint8_t *p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    static uint32_t hash(uint32_t v) {
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    }
+    static void writeLength(std::vector<uint8_t> &out, size_t len);
+    static void writeSequence(std::vector<uint8_t> &out,
+                              const uint8_t *literals, size_t literal_count,
+                              size_t distance, size_t match_len);
+};
+
+void LzCodec::writeLength(std::vector<uint8_t> &out, size_t len) {
+    for (; len >= 255; len -= 255)
+        out.push_back(255);
+    out.push_back(static_cast<uint8_t>(len));
+}
+
+// distance 0 is the last sequence, which has no match
+void LzCodec::writeSequence(std::vector<uint8_t> &out,
+                            const uint8_t *literals, size_t literal_count,
+                            size_t distance, size_t match_len) {
+    size_t match_code = distance == 0 ? 0 : match_len - MIN_MATCH;
+    out.push_back(static_cast<uint8_t>(std::min<size_t>(literal_count, 15)
+                                           << 4 |
+                                       std::min<size_t>(match_code, 15)));
+    if (literal_count >= 15)
+        writeLength(out, literal_count - 15);
+    out.insert(out.end(), literals, literals + literal_count);
+    if (distance == 0)
+        return;
+    out.push_back(static_cast<uint8_t>(distance));
+    out.push_back(static_cast<uint8_t>(distance >> 8));
+    if (match_code >= 15)
+        writeLength(out, match_code - 15);
+}
+
+std::vector<uint8_t>
+LzCodec::compress(std::span<const uint8_t> data) const {
+    const uint8_t *in = data.data();
+    size_t size = data.size();
+    std::vector<uint8_t> out;
+    out.reserve(size / 2 + 16);
+    // position + 1 of the last occurrence of each hash, 0 for none
+    std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+    size_t anchor = 0, i = 0;
+    while (i + MIN_MATCH <= size) {
+        uint32_t v = load32(in + i);
+        uint32_t &slot = table[hash(v)];
+        size_t candidate = slot;
+        slot = static_cast<uint32_t>(i + 1);
+        if (candidate == 0 || i + 1 - candidate > MAX_DISTANCE ||
+            load32(in + candidate - 1) != v) {
+            // skip faster through data that does not compress
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        --candidate;
+        size_t len = MIN_MATCH;
+        while (i + len < size && in[candidate + len] == in[i + len])
+            ++len;
+        writeSequence(out, in + anchor, i - anchor, i - candidate, len);
+        i += len;
+        anchor = i;
+    }
+    writeSequence(out, in + anchor, size - anchor, 0, 0);
+    return out;
+}
+
+std::vector<uint8_t>
+LzCodec::decompress(std::span<const uint8_t> data,
+                    size_t uncompressed_size) const {
+    const uint8_t *in = data.data();
+    size_t size = data.size(), pos = 0, written = 0;
+    std::vector<uint8_t> out(uncompressed_size);
+    auto readLength = [&](size_t len) {
+        uint8_t b;
+        do {
+            if (pos == size)
+                throw std::runtime_error("Compressed data is truncated.");
+            b = in[pos++];
+            len += b;
+        } while (b == 255 && len <= uncompressed_size);
+        return len;
+    };
+    while (pos < size) {
+        uint8_t token = in[pos++];
+        size_t literal_count = token >> 4;
+        if (literal_count == 15)
+            literal_count = readLength(literal_count);
+        if (literal_count > size - pos ||
+            literal_count > uncompressed_size - written)
+            throw std::runtime_error("Compressed literals out of bounds.");
+        std::memcpy(out.data() + written, in + pos, literal_count);
+        pos += literal_count;
+        written += literal_count;
+        if (pos == size)
+            break;
+        if (size - pos < 2)
+            throw std::runtime_error("Compressed data is truncated.");
+        size_t distance = in[pos] | static_cast<size_t>(in[pos + 1]) << 8;
+        pos += 2;
+        size_t len = token & 15;
+        if (len == 15)
+            len = readLength(len);
+        len += MIN_MATCH;
+        if (distance == 0 || distance > written ||
+            len > uncompressed_size - written)
+            throw std::runtime_error("Compressed match out of bounds.");
+        uint8_t *dest = out.data() + written;
+        const uint8_t *src = dest - distance;
+        if (distance >= len)
+            std::memcpy(dest, src, len);
+        else // overlapping, repeats the last distance bytes
+            for (size_t k = 0; k < len; ++k)
+                dest[k] = src[k];
+        written += len;
+    }
+    if (written != uncompressed_size)
+        throw std::runtime_error("Uncompressed size does not match.");
+    return out;
+}
+
+#ifdef KAFKA_LITE_HAS_LZ4
+class Lz4Codec : public Codec {
+  public:
+    CompressionCodec id() const override { return CompressionCodec::Lz4; }
+    std::vector<uint8_t>
+    compress(std::span<const uint8_t> data) const override {
+        if (data.size() > LZ4_MAX_INPUT_SIZE)
+            throw std::runtime_error("Input too large for lz4.");
+        int size = static_cast<int>(data.size());
+        std::vector<uint8_t> out(LZ4_compressBound(size));
+        int n = LZ4_compress_default(
+            reinterpret_cast<const char *>(data.data()),
+            reinterpret_cast<char *>(out.data()), size,
+            static_cast<int>(out.size()));
+        if (n <= 0)
+            throw std::runtime_error("lz4 compression failed.");
+        out.resize(n);
+        return out;
+    }
+    std::vector<uint8_t>
+    decompress(std::span<const uint8_t> data,
+               size_t uncompressed_size) const override {
+        if (data.size() > std::numeric_limits<int>::max() ||
+            uncompressed_size > std::numeric_limits<int>::max())
+            throw std::runtime_error("Input too large for lz4.");
+        std::vector<uint8_t> out(uncompressed_size);
+        int n = LZ4_decompress_safe(
+            reinterpret_cast<const char *>(data.data()),
+            reinterpret_cast<char *>(out.data()),
+            static_cast<int>(data.size()), static_cast<int>(out.size()));
+        if (n < 0 || static_cast<size_t>(n) != uncompressed_size)
+            throw std::runtime_error("lz4 decompression failed.");
+        return out;
+    }
+};
+#endif
+
+#ifdef KAFKA_LITE_HAS_ZSTD
+class ZstdCodec : public Codec {
+  public:
+    CompressionCodec id() const override { return CompressionCodec::Zstd; }
+    std::vector<uint8_t>
+    compress(std::span<const uint8_t> data) const override {
+        std::vector<uint8_t> out(ZSTD_compressBound(data.size()));
+        size_t n = ZSTD_compress(out.data(), out.size(), data.data(),
+                                 data.size(), ZSTD_LEVEL);
+        if (ZSTD_isError(n))
+            throw std::runtime_error(ZSTD_getErrorName(n));
+        out.resize(n);
+        return out;
+    }
+    std::vector<uint8_t>
+    decompress(std::span<const uint8_t> data,
+               size_t uncompressed_size) const override {
+        std::vector<uint8_t> out(uncompressed_size);
+        size_t n = ZSTD_decompress(out.data(), out.size(), data.data(),
+                                   data.size());
+        if (ZSTD_isError(n))
+            throw std::runtime_error(ZSTD_getErrorName(n));
+        if (n != uncompressed_size)
+            throw std::runtime_error("Uncompressed size does not match.");
+        return out;
+    }
+
+  private:
+    // fast levels, producers compress on their hot path
+    static constexpr int ZSTD_LEVEL = 1;
+};
+#endif
+
+const Codec *findCodec(CompressionCodec id) {
+    static const NoneCodec none;
+    static const LzCodec lz;
+    switch (id) {
+    case CompressionCodec::None:
+        return &none;
+    case CompressionCodec::Lz:
+        return &lz;
+    case CompressionCodec::Lz4: {
+#ifdef KAFKA_LITE_HAS_LZ4
+        static const Lz4Codec lz4;
+        return &lz4;
+#else
+        return nullptr;
+#endif
+    }
+    case CompressionCodec::Zstd: {
+#ifdef KAFKA_LITE_HAS_ZSTD
+        static const ZstdCodec zstd;
+        return &zstd;
+#else
+        return nullptr;
+#endif
+    }
+    }
+    return nullptr;
+}
+
+} // namespace broker
+} // namespace kafka_lite
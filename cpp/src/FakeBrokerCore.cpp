@@ -1,4 +1,5 @@
 #include "../include/FakeBrokerCore.h"
+#include "../include/ByteSwap.h"
 #include "../include/RecordManager.h"
 #include <cstddef>
 #include <cstring>
@@ -9,7 +10,7 @@
 namespace kafka_lite {
 namespace broker {
 
-FakeBrokerCore::FakeBrokerCore() : stop_(true) {}
+FakeBrokerCore::FakeBrokerCore() : next_listener_id_(0), stop_(true) {}
 
 void FakeBrokerCore::start() { stop_ = false; }
 void FakeBrokerCore::stop() {
@@ -22,20 +23,62 @@ uint64_t FakeBrokerCore::get_published_offset() {
     return records_.size();
 }
 
-void FakeBrokerCore::submit_append(const AppendData &data,
-                                   AppendCallback callback) {
+void FakeBrokerCore::submit_append(AppendData data, AppendCallback callback) {
     std::unique_lock<std::shared_mutex> lock(records_mutex_);
     if (stop_) {
         callback(0, std::make_error_code(std::errc::not_connected));
         return;
     }
-    if (!RecordManager::check_integrity_with_len(data.data)) {
+    const uint8_t *payload = data.data.data() + data.record_offset;
+    size_t size = data.data.size() - data.record_offset;
+    if (data.record_offset > data.data.size() ||
+        !RecordManager::check_integrity(payload, size)) {
         callback(0, std::make_error_code(std::errc::bad_message));
         return;
     }
-    records_.push_back(data.data);
+    uint32_t len = recordHeader(size, data.attributes);
+    if (byteswap::is_big_endian())
+        len = byteswap::byteswap32(len);
+    std::vector<uint8_t> record(sizeof(len) + size);
+    std::memcpy(record.data(), &len, sizeof(len));
+    std::memcpy(record.data() + sizeof(len), payload, size);
+    records_.push_back(std::move(record));
     std::error_code ec;
     callback(records_.size() - 1, ec);
+    for (auto &[id, listener] : listeners_)
+        listener();
+}
+
+uint64_t FakeBrokerCore::add_subscriber(SubscriptionListener listener) {
+    std::unique_lock<std::shared_mutex> lock(records_mutex_);
+    uint64_t id = next_listener_id_++;
+    listeners_.emplace(id, std::move(listener));
+    return id;
+}
+
+void FakeBrokerCore::remove_subscriber(uint64_t id) {
+    std::unique_lock<std::shared_mutex> lock(records_mutex_);
+    listeners_.erase(id);
+}
+
+uint64_t FakeBrokerCore::read_subscription(uint64_t offset, size_t max_bytes,
+                                           FetchResult &result,
+                                           std::error_code &ec) {
+    std::shared_lock<std::shared_mutex> lock(records_mutex_);
+    if (stop_) {
+        ec = std::make_error_code(std::errc::not_connected);
+        return offset;
+    }
+    while (offset < records_.size()) {
+        if (!result.result_buf.empty() &&
+            result.result_buf.size() + records_[offset].size() > max_bytes)
+            break;
+        result.result_buf.insert(result.result_buf.end(),
+                                 records_[offset].begin(),
+                                 records_[offset].end());
+        ++offset;
+    }
+    return offset;
 }
 
 void FakeBrokerCore::submit_fetch(const FetchData &data,
@@ -59,7 +102,21 @@ void FakeBrokerCore::submit_fetch(const FetchData &data,
             ++i;
         }
     }
-    callback(result, ec);
+    callback(std::move(result), ec);
+}
+
+// every record is replicated as soon as it is appended, by any replica
+void FakeBrokerCore::submit_replica_sync(uint64_t,
+                                         const FetchData &data,
+                                         ReplicaSyncCallback callback) {
+    uint64_t high_watermark;
+    {
+        std::shared_lock<std::shared_mutex> lock(records_mutex_);
+        high_watermark = records_.size();
+    }
+    submit_fetch(data, [&](FetchResult result, std::error_code ec) {
+        callback(std::move(result), high_watermark, ec);
+    });
 }
 
 } // namespace broker
@@ -0,0 +1,137 @@
+#include "../include/FanOutBuffer.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+FanOutBuffer::FanOutBuffer(size_t max_bytes)
+    : end_offset_(0), buffered_bytes_(0), max_bytes_(max_bytes),
+      next_listener_id_(0) {}
+
+void FanOutBuffer::publish(uint64_t first_offset,
+                           std::span<const RecordSlice> records) {
+    if (records.empty() || !keepChunks())
+        return;
+    publish(makeRecordChunk(first_offset, records));
+}
+
+void FanOutBuffer::publish(std::shared_ptr<const RecordChunk> chunk) {
+    if (chunk->record_positions.empty() || !keepChunks())
+        return;
+    {
+        std::unique_lock lock(chunks_mutex_);
+        // a gap in the offsets makes the buffered chunks useless
+        if (!chunks_.empty() && chunk->first_offset != end_offset_) {
+            chunks_.clear();
+            buffered_bytes_ = 0;
+        }
+        buffered_bytes_ += chunk->bytes.size();
+        end_offset_ = chunk->first_offset + chunk->record_positions.size();
+        chunks_.push_back(std::move(chunk));
+        // always keep the newest chunk, even if it is larger than max_bytes_
+        while (chunks_.size() > 1 && buffered_bytes_ > max_bytes_) {
+            buffered_bytes_ -= chunks_.front()->bytes.size();
+            chunks_.pop_front();
+        }
+    }
+
+    std::lock_guard lock(listeners_mutex_);
+    for (auto &[id, listener] : listeners_)
+        listener();
+}
+
+/*
+    Only subscribers read the chunks, without any the copy is skipped. The
+    buffered chunks are dropped then, since they would end before the log
+    does, and a subscriber that comes along reads from the log until the next
+    publish.
+*/
+bool FanOutBuffer::keepChunks() {
+    {
+        std::lock_guard lock(listeners_mutex_);
+        if (!listeners_.empty())
+            return true;
+    }
+    std::unique_lock lock(chunks_mutex_);
+    chunks_.clear();
+    buffered_bytes_ = 0;
+    return false;
+}
+
+std::optional<uint64_t>
+FanOutBuffer::read(uint64_t offset, size_t max_bytes,
+                   std::vector<PayloadSlice> &slices,
+                   uint64_t end_offset) const {
+    std::shared_lock lock(chunks_mutex_);
+    if (chunks_.empty() || offset < chunks_.front()->first_offset)
+        return std::nullopt;
+    if (offset >= std::min(end_offset_, end_offset))
+        return offset;
+    // the first chunk that starts after offset, we need the one before
+    auto it = std::upper_bound(
+        chunks_.begin(), chunks_.end(), offset,
+        [](uint64_t offset, const std::shared_ptr<const RecordChunk> &chunk) {
+            return offset < chunk->first_offset;
+        });
+    --it;
+    size_t bytes = 0;
+    for (; it != chunks_.end() && offset < end_offset; ++it) {
+        const auto &chunk = *it;
+        size_t first = offset - chunk->first_offset, last = first;
+        size_t begin = chunk->record_positions[first], end = begin;
+        size_t count = std::min<uint64_t>(chunk->record_positions.size(),
+                                          end_offset - chunk->first_offset);
+        while (last < count) {
+            size_t record_end = last + 1 < chunk->record_positions.size()
+                                    ? chunk->record_positions[last + 1]
+                                    : chunk->bytes.size();
+            if (bytes + record_end - begin > max_bytes &&
+                (bytes > 0 || last > first))
+                break;
+            end = record_end;
+            ++last;
+        }
+        if (last > first) {
+            slices.push_back({chunk, chunk->bytes.data() + begin, end - begin});
+            bytes += end - begin;
+            offset += last - first;
+        }
+        if (last < chunk->record_positions.size())
+            break;
+    }
+    return offset;
+}
+
+uint64_t FanOutBuffer::addListener(Listener listener) {
+    std::lock_guard lock(listeners_mutex_);
+    uint64_t id = next_listener_id_++;
+    listeners_.emplace(id, std::move(listener));
+    return id;
+}
+
+void FanOutBuffer::removeListener(uint64_t id) {
+    std::lock_guard lock(listeners_mutex_);
+    listeners_.erase(id);
+}
+
+void FanOutBuffer::notifyListeners() {
+    std::lock_guard lock(listeners_mutex_);
+    for (auto &[id, listener] : listeners_)
+        listener();
+}
+
+size_t FanOutBuffer::bufferedBytes() const {
+    std::shared_lock lock(chunks_mutex_);
+    return buffered_bytes_;
+}
+
+} // namespace broker
+} // namespace kafka_lite
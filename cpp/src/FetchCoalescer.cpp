@@ -0,0 +1,76 @@
+#include "../include/FetchCoalescer.h"
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+FetchCoalescer::FetchCoalescer() : coalesced_(0) {}
+
+// the result_buf of the shared result is handed out as a slice
+static FetchResult
+share_result(const std::shared_ptr<const FetchResult> &shared) {
+    FetchResult result;
+    if (!shared->result_buf.empty())
+        result.slices.push_back({shared, shared->result_buf.data(),
+                                 shared->result_buf.size()});
+    result.slices.insert(result.slices.end(), shared->slices.begin(),
+                         shared->slices.end());
+    return result;
+}
+
+FetchResult FetchCoalescer::fetch(const FetchData &data, const ReadFn &read) {
+    auto key = std::make_pair(data.offset, data.max_bytes);
+    std::unique_lock lock(mutex_);
+    auto it = in_flight_.find(key);
+    if (it != in_flight_.end()) {
+        ++it->second->waiters;
+        ++coalesced_;
+        auto future = it->second->result;
+        lock.unlock();
+        // get rethrows the exception of the reader
+        return share_result(future.get());
+    }
+    std::promise<SharedResult> promise;
+    auto flight = std::make_shared<Flight>(
+        Flight{.result = promise.get_future().share(), .waiters = 0});
+    in_flight_.emplace(key, flight);
+    lock.unlock();
+
+    FetchResult result;
+    try {
+        result = read(data);
+    } catch (...) {
+        lock.lock();
+        in_flight_.erase(key);
+        lock.unlock();
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+    // nobody can join once the flight is erased, so waiters is final
+    lock.lock();
+    in_flight_.erase(key);
+    size_t waiters = flight->waiters;
+    lock.unlock();
+    if (waiters == 0) {
+        promise.set_value(nullptr);
+        return result;
+    }
+    auto shared = std::make_shared<const FetchResult>(std::move(result));
+    promise.set_value(shared);
+    return share_result(shared);
+}
+
+uint64_t FetchCoalescer::coalesced() const {
+    std::lock_guard lock(mutex_);
+    return coalesced_;
+}
+
+} // namespace broker
+} // namespace kafka_lite
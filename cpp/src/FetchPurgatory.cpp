@@ -0,0 +1,127 @@
+#include "../include/FetchPurgatory.h"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+using namespace std::chrono;
+
+namespace kafka_lite {
+namespace broker {
+
+FetchPurgatory::FetchPurgatory(CompleteFn complete)
+    : complete_(std::move(complete)), sequence_(0), stop_(true) {}
+
+FetchPurgatory::~FetchPurgatory() { stop(); }
+
+void FetchPurgatory::start() {
+    std::lock_guard lock(mutex_);
+    if (!stop_)
+        return;
+    stop_ = false;
+    thread_ = std::thread(&FetchPurgatory::run, this);
+}
+
+void FetchPurgatory::stop() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+    std::vector<ParkedFetch> parked;
+    {
+        std::lock_guard lock(mutex_);
+        parked.swap(parked_);
+    }
+    for (auto &fetch : parked)
+        fetch.callback({}, std::make_error_code(std::errc::not_connected));
+}
+
+uint64_t FetchPurgatory::sequence() const {
+    std::lock_guard lock(mutex_);
+    return sequence_;
+}
+
+void FetchPurgatory::park(ParkedFetch fetch, uint64_t sequence) {
+    std::unique_lock lock(mutex_);
+    if (stop_) {
+        lock.unlock();
+        fetch.callback({}, std::make_error_code(std::errc::not_connected));
+        return;
+    }
+    // something was appended since the fetch read the log, let it read again
+    if (sequence != sequence_)
+        fetch.available_bytes = fetch.data.min_bytes;
+    parked_.push_back(std::move(fetch));
+    cv_.notify_one();
+}
+
+void FetchPurgatory::notify(size_t appended_bytes) {
+    {
+        std::lock_guard lock(mutex_);
+        ++sequence_;
+        if (parked_.empty())
+            return;
+        for (auto &fetch : parked_)
+            fetch.available_bytes += appended_bytes;
+    }
+    cv_.notify_one();
+}
+
+void FetchPurgatory::wake() {
+    {
+        std::lock_guard lock(mutex_);
+        ++sequence_;
+        if (parked_.empty())
+            return;
+        for (auto &fetch : parked_)
+            fetch.available_bytes = fetch.data.min_bytes;
+    }
+    cv_.notify_one();
+}
+
+size_t FetchPurgatory::size() const {
+    std::lock_guard lock(mutex_);
+    return parked_.size();
+}
+
+void FetchPurgatory::run() {
+    std::vector<ParkedFetch> ready;
+    std::unique_lock lock(mutex_);
+    while (!stop_) {
+        auto now = steady_clock::now();
+        auto next_deadline = steady_clock::time_point::max();
+        auto it = std::partition(
+            parked_.begin(), parked_.end(), [&](const ParkedFetch &fetch) {
+                return fetch.available_bytes < fetch.data.min_bytes &&
+                       fetch.deadline > now;
+            });
+        for (auto ready_it = it; ready_it != parked_.end(); ++ready_it)
+            ready.push_back(std::move(*ready_it));
+        parked_.erase(it, parked_.end());
+        if (!ready.empty()) {
+            // complete may park the fetch again, so do not hold the lock
+            lock.unlock();
+            for (auto &fetch : ready)
+                complete_(fetch);
+            ready.clear();
+            lock.lock();
+            continue;
+        }
+        for (const auto &fetch : parked_)
+            next_deadline = std::min(next_deadline, fetch.deadline);
+        if (next_deadline == steady_clock::time_point::max())
+            cv_.wait(lock);
+        else
+            cv_.wait_until(lock, next_deadline);
+    }
+}
+
+} // namespace broker
+} // namespace kafka_lite
@@ -0,0 +1,125 @@
+#include "../include/IndexSearch.h"
+#include "../include/ByteSwap.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define KAFKA_LITE_HAS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace kafka_lite {
+namespace broker {
+
+// entries left for the kernels, 4 cache lines
+static constexpr uint64_t KERNEL_ENTRIES = 32;
+
+static uint32_t keyAt(const char *entries, uint64_t i, unsigned int shift) {
+    uint64_t raw;
+    std::memcpy(&raw, entries + 8 * i, sizeof(raw));
+    if (byteswap::is_big_endian())
+        raw = byteswap::byteswap64(raw);
+    return static_cast<uint32_t>(raw >> shift);
+}
+
+#ifdef KAFKA_LITE_HAS_X86_SIMD
+
+/*
+    There is no unsigned 32 bit compare before AVX-512, so both sides are
+    biased by 2^31 and compared signed. Every entry covers two lanes, only
+    the lane of the key is counted. The compares yield -1 per greater key,
+    which is summed up in the vector and added across lanes once at the end
+    (no popcnt in baseline x86-64).
+*/
+static uint64_t countSse2(const char *entries, uint64_t count, uint32_t key,
+                          unsigned int shift) {
+    const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000));
+    const __m128i target =
+        _mm_xor_si128(_mm_set1_epi32(static_cast<int>(key)), bias);
+    const __m128i lanes = _mm_set1_epi64x(
+        static_cast<int64_t>(shift == 0 ? 0xFFFFFFFFull : 0xFFFFFFFFull << 32));
+    __m128i greater = _mm_setzero_si128();
+    uint64_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(entries + 8 * i));
+        __m128i gt = _mm_cmpgt_epi32(_mm_xor_si128(v, bias), target);
+        greater = _mm_sub_epi32(greater, _mm_and_si128(gt, lanes));
+    }
+    alignas(16) uint32_t sums[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(sums), greater);
+    uint64_t n = sums[0] + sums[1] + sums[2] + sums[3];
+    if (i < count)
+        n += keyAt(entries, i, shift) > key;
+    return count - n;
+}
+
+__attribute__((target("avx2"))) static uint64_t
+countAvx2(const char *entries, uint64_t count, uint32_t key,
+          unsigned int shift) {
+    const __m256i bias = _mm256_set1_epi32(static_cast<int>(0x80000000));
+    const __m256i target =
+        _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(key)), bias);
+    const __m256i lanes = _mm256_set1_epi64x(
+        static_cast<int64_t>(shift == 0 ? 0xFFFFFFFFull : 0xFFFFFFFFull << 32));
+    __m256i greater = _mm256_setzero_si256();
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(entries + 8 * i));
+        __m256i gt = _mm256_cmpgt_epi32(_mm256_xor_si256(v, bias), target);
+        greater = _mm256_sub_epi32(greater, _mm256_and_si256(gt, lanes));
+    }
+    alignas(32) uint32_t sums[8];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(sums), greater);
+    uint64_t n = 0;
+    for (uint32_t sum : sums)
+        n += sum;
+    for (; i < count; ++i)
+        n += keyAt(entries, i, shift) > key;
+    return count - n;
+}
+
+SearchKernel defaultSearchKernel() {
+    static const SearchKernel kernel = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return SearchKernel::Avx2;
+        // part of x86-64
+        return SearchKernel::Sse2;
+    }();
+    return kernel;
+}
+
+#else
+
+SearchKernel defaultSearchKernel() { return SearchKernel::Scalar; }
+
+#endif
+
+uint64_t searchEntries(const char *entries, uint64_t count, uint32_t key,
+                       unsigned int shift, SearchKernel kernel) {
+#ifndef KAFKA_LITE_HAS_X86_SIMD
+    kernel = SearchKernel::Scalar;
+#endif
+    // entries before L are <= key, entries from R on are > key
+    uint64_t L = 0, R = count;
+    uint64_t rest = kernel == SearchKernel::Scalar ? 0 : KERNEL_ENTRIES;
+    while (R - L > rest) {
+        uint64_t M = L + (R - L) / 2;
+        if (keyAt(entries, M, shift) <= key)
+            L = M + 1;
+        else
+            R = M;
+    }
+#ifdef KAFKA_LITE_HAS_X86_SIMD
+    if (kernel == SearchKernel::Avx2)
+        return L + countAvx2(entries + 8 * L, R - L, key, shift);
+    if (kernel == SearchKernel::Sse2)
+        return L + countSse2(entries + 8 * L, R - L, key, shift);
+#endif
+    return L;
+}
+
+} // namespace broker
+} // namespace kafka_lite
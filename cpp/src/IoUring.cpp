@@ -0,0 +1,320 @@
+#include "../include/IoUring.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ios>
+#include <sstream>
+#include <stdexcept>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define KAFKA_LITE_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace kafka_lite {
+namespace broker {
+
+#ifdef KAFKA_LITE_HAS_IO_URING
+
+static int io_uring_setup(unsigned int entries, io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int ring_fd, unsigned int to_submit,
+                          unsigned int min_complete, unsigned int flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+bool IoUring::isSupported() {
+    static const bool supported = []() {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = io_uring_setup(2, &params);
+        if (fd < 0)
+            return false;
+        ::close(fd);
+        // we rely on a single mmap for both rings
+        return (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    }();
+    return supported;
+}
+
+IoUring::IoUring(unsigned int entries)
+    : ring_fd_(-1), sq_ring_(nullptr), cq_ring_(nullptr), sqes_(nullptr) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd_ = io_uring_setup(entries, &params);
+    if (ring_fd_ < 0) {
+        std::stringstream msg;
+        msg << "io_uring_setup failed, errno = " << errno;
+        throw std::runtime_error(msg.str());
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ::close(ring_fd_);
+        throw std::runtime_error("io_uring without IORING_FEAT_SINGLE_MMAP.");
+    }
+    entries_ = params.sq_entries;
+    sq_ring_size_ =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        ::close(ring_fd_);
+        throw std::runtime_error("Failure of mmap for io_uring rings.");
+    }
+    cq_ring_ = sq_ring_;
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        munmap(sq_ring_, sq_ring_size_);
+        ::close(ring_fd_);
+        throw std::runtime_error("Failure of mmap for io_uring sqes.");
+    }
+    auto *sq = static_cast<char *>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+    auto *cq = static_cast<char *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+}
+
+IoUring::~IoUring() {
+    if (sqes_ != nullptr)
+        munmap(sqes_, sqes_size_);
+    if (sq_ring_ != nullptr)
+        munmap(sq_ring_, sq_ring_size_);
+    if (ring_fd_ != -1)
+        ::close(ring_fd_);
+}
+
+void IoUring::submitChain(IoRequest *requests, size_t count) {
+    if (count > entries_)
+        throw std::logic_error("io_uring chain longer than the ring.");
+    auto *sqes = static_cast<io_uring_sqe *>(sqes_);
+    // we are the only submitter, so the tail is ours to read without sync
+    unsigned int tail = *sq_tail_;
+    for (size_t i = 0; i < count; ++i) {
+        unsigned int index = tail & *sq_mask_;
+        io_uring_sqe &sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.fd = requests[i].fd;
+        sqe.user_data = i;
+        switch (requests[i].op) {
+        case IoOp::Read:
+            sqe.opcode = IORING_OP_READV;
+            break;
+        case IoOp::Write:
+            sqe.opcode = IORING_OP_WRITEV;
+            break;
+        case IoOp::Fsync:
+            sqe.opcode = IORING_OP_FSYNC;
+            break;
+        }
+        if (requests[i].op != IoOp::Fsync) {
+            sqe.addr = reinterpret_cast<uint64_t>(requests[i].iov.data());
+            sqe.len = requests[i].iov.size();
+            sqe.off = requests[i].offset;
+        }
+        if (i + 1 < count)
+            sqe.flags |= IOSQE_IO_LINK;
+        sq_array_[index] = index;
+        ++tail;
+    }
+    std::atomic_ref<unsigned int>(*sq_tail_).store(tail,
+                                                   std::memory_order_release);
+
+    size_t submitted = 0, completed = 0;
+    while (completed < count) {
+        int rc = io_uring_enter(ring_fd_, count - submitted, 1,
+                                IORING_ENTER_GETEVENTS);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            std::stringstream msg;
+            msg << "io_uring_enter failed, errno = " << errno;
+            throw std::ios_base::failure(msg.str());
+        }
+        submitted += rc;
+        unsigned int head = *cq_head_;
+        unsigned int cq_tail = std::atomic_ref<unsigned int>(*cq_tail_).load(
+            std::memory_order_acquire);
+        auto *cqes = static_cast<io_uring_cqe *>(cqes_);
+        while (head != cq_tail) {
+            const io_uring_cqe &cqe = cqes[head & *cq_mask_];
+            requests[cqe.user_data].result = cqe.res;
+            ++completed;
+            ++head;
+        }
+        std::atomic_ref<unsigned int>(*cq_head_).store(
+            head, std::memory_order_release);
+    }
+}
+
+#else
+
+bool IoUring::isSupported() { return false; }
+
+IoUring::IoUring(unsigned int entries) {
+    throw std::runtime_error("io_uring is not available on this platform.");
+}
+
+IoUring::~IoUring() {}
+
+void IoUring::submitChain(IoRequest *requests, size_t count) {
+    throw std::runtime_error("io_uring is not available on this platform.");
+}
+
+#endif
+
+void IoBatch::write(int fd, const std::vector<iovec> &iov, uint64_t offset) {
+    // a single writev takes at most IOV_MAX buffers
+    for (size_t i = 0; i < iov.size(); i += IOV_MAX) {
+        IoRequest request{.op = IoOp::Write,
+                          .fd = fd,
+                          .iov = {},
+                          .offset = offset,
+                          .len = 0,
+                          .result = 0};
+        auto end = std::min(iov.size(), i + IOV_MAX);
+        request.iov.assign(iov.begin() + i, iov.begin() + end);
+        for (const auto &buf : request.iov)
+            request.len += buf.iov_len;
+        offset += request.len;
+        requests_.push_back(std::move(request));
+    }
+}
+
+void IoBatch::read(int fd, void *buf, size_t len, uint64_t offset) {
+    requests_.push_back({.op = IoOp::Read,
+                         .fd = fd,
+                         .iov = {{.iov_base = buf, .iov_len = len}},
+                         .offset = offset,
+                         .len = len,
+                         .result = 0});
+}
+
+void IoBatch::fsync(int fd) {
+    requests_.push_back({.op = IoOp::Fsync,
+                         .fd = fd,
+                         .iov = {},
+                         .offset = 0,
+                         .len = 0,
+                         .result = 0});
+}
+
+const uint8_t *IoBatch::own(std::vector<uint8_t> buffer) {
+    buffers_.push_back(std::move(buffer));
+    return buffers_.back().data();
+}
+
+void IoBatch::execute(IoUring *ring) {
+    size_t done = 0;
+    if (ring != nullptr) {
+        // every chunk is waited for before the next one is submitted, so the
+        // order is kept across chunks as well
+        while (done < requests_.size()) {
+            size_t count = std::min<size_t>(requests_.size() - done,
+                                            ring->entries());
+            ring->submitChain(requests_.data() + done, count);
+            size_t chunk_end = done + count;
+            while (done < chunk_end &&
+                   requests_[done].result ==
+                       static_cast<int64_t>(requests_[done].len))
+                ++done;
+            if (done < chunk_end)
+                break;
+        }
+    }
+    // finish whatever the ring did not (or everything without a ring)
+    for (size_t i = done; i < requests_.size(); ++i) {
+        auto &request = requests_[i];
+        if (request.result < 0 && request.result != -ECANCELED &&
+            request.result != -EINTR && request.result != -EAGAIN) {
+            std::stringstream msg;
+            msg << "io request failed, fd = " << request.fd
+                << ", errno = " << -request.result;
+            throw std::ios_base::failure(msg.str());
+        }
+        if (request.result < 0)
+            request.result = 0;
+        executeSync(request);
+    }
+}
+
+void IoBatch::executeSync(IoRequest &request) {
+    if (request.op == IoOp::Fsync) {
+        int rc;
+        do {
+            rc = ::fsync(request.fd);
+        } while (rc == -1 && errno == EINTR);
+        if (rc == -1) {
+            std::stringstream msg;
+            msg << "fsync failed, fd = " << request.fd << ", errno = " << errno;
+            throw std::ios_base::failure(msg.str());
+        }
+        return;
+    }
+    size_t done = request.result;
+    // skip the buffers that have been transferred already
+    size_t first = 0, skip = done;
+    while (first < request.iov.size() && skip >= request.iov[first].iov_len) {
+        skip -= request.iov[first].iov_len;
+        ++first;
+    }
+    while (done < request.len) {
+        std::vector<iovec> iov(request.iov.begin() + first, request.iov.end());
+        iov.front().iov_base = static_cast<char *>(iov.front().iov_base) + skip;
+        iov.front().iov_len -= skip;
+        ssize_t rc;
+        if (request.op == IoOp::Write)
+            rc = pwritev(request.fd, iov.data(),
+                         std::min<size_t>(iov.size(), IOV_MAX),
+                         request.offset + done);
+        else
+            rc = preadv(request.fd, iov.data(),
+                        std::min<size_t>(iov.size(), IOV_MAX),
+                        request.offset + done);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            std::stringstream msg;
+            msg << "io request failed, fd = " << request.fd
+                << ", errno = " << errno;
+            throw std::ios_base::failure(msg.str());
+        }
+        if (rc == 0) {
+            std::stringstream msg;
+            msg << "io request made no progress, fd = " << request.fd
+                << ", bytes done = " << done << ", len = " << request.len;
+            throw std::ios_base::failure(msg.str());
+        }
+        done += rc;
+        skip += rc;
+        while (first < request.iov.size() &&
+               skip >= request.iov[first].iov_len) {
+            skip -= request.iov[first].iov_len;
+            ++first;
+        }
+    }
+    request.result = done;
+}
+
+} // namespace broker
+} // namespace kafka_lite
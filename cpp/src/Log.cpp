@@ -1,118 +1,580 @@
 #include "../include/Log.h"
+#include "../include/ByteSwap.h"
+#include "../include/IoUring.h"
+#include "../include/RemoteStore.h"
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <span>
 #include <stdexcept>
+#include <string>
 
 namespace kafka_lite {
 namespace broker {
 
-Log::Log(const std::filesystem::path &dir, uint64_t max_segment_size)
+// producer state recovery reads the log in chunks of this size
+static constexpr size_t PRODUCER_REPLAY_CHUNK_SIZE = 1024 * 1024;
+
+Log::Log(const std::filesystem::path &dir, uint64_t max_segment_size,
+         const LogConfig &config)
     : status_(LogStatus::Closed), dir_(dir),
-      max_segment_size_(max_segment_size) {}
+      max_segment_size_(max_segment_size), config_(config),
+      open_segments_(config.max_open_sealed_segments),
+      retired_tail_cache_stats_{0, 0}, session_hits_(0) {}
+
+Log::~Log() = default;
 
 void Log::start() {
-    std::filesystem::create_directories(dir_);
+    if (config_.remote_store && !config_.storage->persistent())
+        throw std::invalid_argument(
+            "Tiered storage needs a persistent storage backend.");
+    config_.storage->createDirectories(dir_);
+    if (config_.use_io_uring && IoUring::isSupported())
+        ring_ = std::make_unique<IoUring>(config_.io_uring_entries);
+    std::vector<uint64_t> remote_base_offsets;
+    if (config_.remote_store) {
+        // nobody knows the chunks cached by a previous run
+        std::filesystem::remove_all(remoteCacheDir());
+        remote_base_offsets = determineRemoteBaseOffsets();
+    }
     auto paths = determineSegmentFilepaths();
-    if (!paths.empty())
-        recover(paths);
+    if (!paths.empty() || !remote_base_offsets.empty())
+        recover(paths, remote_base_offsets);
     else {
-        active_segment_ = std::make_shared<Segment>(dir_, 0, max_segment_size_,
-                                                    SegmentState::Active);
+        active_segment_ =
+            std::make_shared<Segment>(dir_, 0, max_segment_size_,
+                                      SegmentState::Active,
+                                      segmentConfig());
     }
     status_ = LogStatus::Open;
+    recoverProducerState();
 }
 
 std::vector<std::string> Log::determineSegmentFilepaths() {
     std::vector<std::string> segment_filenames;
-    for (const auto &entry : std::filesystem::directory_iterator(dir_)) {
-        if (entry.path().string().compare(entry.path().string().size() - 4, 4,
-                                          ".log") == 0)
-            segment_filenames.push_back(entry.path().filename());
+    for (auto &name : config_.storage->list(dir_)) {
+        if (name.ends_with(".log"))
+            segment_filenames.push_back(std::move(name));
     }
     return segment_filenames;
 }
 
-void Log::recover(const std::vector<std::string> &segment_filenames) {
+static std::vector<uint64_t>
+producerSnapshotOffsets(const std::vector<std::string> &names) {
+    static const std::string suffix = ".producers";
+    std::vector<uint64_t> base_offsets;
+    for (const auto &name : names) {
+        if (name.ends_with(suffix))
+            base_offsets.push_back(std::stoull(
+                name.substr(0, name.size() - suffix.size()), nullptr, 10));
+    }
+    std::sort(base_offsets.begin(), base_offsets.end());
+    return base_offsets;
+}
+
+std::vector<uint64_t> Log::determineProducerSnapshots() {
+    return producerSnapshotOffsets(config_.storage->list(dir_));
+}
+
+std::vector<uint64_t> Log::determineRemoteBaseOffsets() {
+    std::vector<uint64_t> base_offsets;
+    // the log file is uploaded after the index, it completes the segment
+    for (const auto &name : config_.remote_store->list()) {
+        if (name.ends_with(".log"))
+            base_offsets.push_back(
+                std::stoull(name.substr(0, name.size() - 4), nullptr, 10));
+    }
+    std::sort(base_offsets.begin(), base_offsets.end());
+    return base_offsets;
+}
+
+/*
+    Only the last segment is recovered at startup, it becomes the active one.
+    Every other segment has been flushed by the rollover that sealed it, so
+    its published offset is the base offset of the next one minus one and the
+    directory listing is all we need until it is read (see
+    openSealedSegment). Startup does not depend on the number of segments.
+    Segments in the remote store are sealed, the active one is never
+    uploaded. If the newest segment is remote only (the local directory was
+    lost), a new active segment follows it.
+*/
+void Log::recover(const std::vector<std::string> &segment_filenames,
+                  const std::vector<uint64_t> &remote_base_offsets) {
     std::vector<uint64_t> base_offsets(segment_filenames.size());
-    for (int i = 0; i < base_offsets.size(); ++i) {
+    for (size_t i = 0; i < base_offsets.size(); ++i) {
         base_offsets[i] = std::stoll(
             segment_filenames[i].substr(0, segment_filenames[i].size() - 4),
             nullptr, 10);
     }
     std::sort(base_offsets.begin(), base_offsets.end());
-    std::shared_ptr<Segment> segment;
-    for (auto it = base_offsets.begin(); it != base_offsets.end(); ++it) {
-        // delete index file, since we rebuild it during segment recovery
-        auto index_fp = dir_ / (std::to_string(*it) + ".index");
-        std::filesystem::remove(index_fp);
-        segment = std::make_shared<Segment>(dir_, *it, max_segment_size_,
-                                            SegmentState::Active);
-        auto result = segment->recover();
-        if (it + 1 == base_offsets.end() ||
-            result != RecoveryResult::Recovered) {
-            active_segment_ = segment;
-            if (result != RecoveryResult::Recovered)
-                break;
-        } else {
-            segment->seal();
-            sealed_segments_.push_back(segment);
+    std::vector<uint64_t> all_base_offsets;
+    std::set_union(base_offsets.begin(), base_offsets.end(),
+                   remote_base_offsets.begin(), remote_base_offsets.end(),
+                   std::back_inserter(all_base_offsets));
+    for (size_t i = 0; i + 1 < all_base_offsets.size(); ++i) {
+        uint64_t base_offset = all_base_offsets[i];
+        sealed_segments_.push_back(
+            {.base_offset = base_offset,
+             .published_offset = all_base_offsets[i + 1] - 1,
+             .uploaded = std::binary_search(remote_base_offsets.begin(),
+                                            remote_base_offsets.end(),
+                                            base_offset),
+             .remote = !std::binary_search(base_offsets.begin(),
+                                           base_offsets.end(), base_offset)});
+    }
+    if (base_offsets.empty() ||
+        base_offsets.back() != all_base_offsets.back()) {
+        uint64_t base_offset = all_base_offsets.back();
+        uint64_t next_offset;
+        {
+            // every record is indexed
+            RemoteSegmentFile file(config_.remote_store, remoteCacheDir(),
+                                   base_offset, config_.remote_chunk_size);
+            Index index(file.dir(), base_offset, SegmentState::Sealed);
+            next_offset = base_offset + index.entries();
         }
+        sealed_segments_.push_back({.base_offset = base_offset,
+                                    .published_offset = next_offset - 1,
+                                    .uploaded = true,
+                                    .remote = true});
+        active_segment_ = std::make_shared<Segment>(
+            dir_, next_offset, max_segment_size_, SegmentState::Active,
+            segmentConfig());
+        return;
     }
+    // delete index file, since we rebuild it during segment recovery
+    config_.storage->remove(Index::filePath(dir_, base_offsets.back()));
+    active_segment_ = std::make_shared<Segment>(dir_, base_offsets.back(),
+                                                max_segment_size_,
+                                                SegmentState::Active,
+                                                segmentConfig());
+    active_segment_->recover();
 }
 
+/*
+    First read of a sealed segment since startup (or since it was closed).
+    An index that does not cover the segment, e.g. because the broker died
+    before the rollover flush finished, is rebuilt from the log file the same
+    way the active segment is recovered. Only a rebuild checks the checksums
+    of a sealed segment. If it does not get back every record up to the
+    published offset the segment is damaged: the reads fail instead of
+    leaving a hole in the offsets that consumers would wait at forever.
+*/
+std::shared_ptr<Segment>
+Log::openSealedSegment(const SealedSegmentInfo &info) const {
+    if (info.remote)
+        return openRemoteSegment(info);
+    auto open = [this, &info]() -> std::shared_ptr<Segment> {
+        if (!config_.storage->exists(Index::filePath(dir_, info.base_offset)))
+            return nullptr;
+        try {
+            auto segment = std::make_shared<Segment>(
+                dir_, info.base_offset, info.published_offset,
+                max_segment_size_, SegmentState::Sealed, segmentConfig());
+            return segment->isComplete() ? segment : nullptr;
+        } catch (const std::runtime_error &) {
+            // index in an unknown format, rebuild it as well
+            return nullptr;
+        }
+    };
+    if (auto segment = open())
+        return segment;
+    // several readers may find the same broken index, rebuild it only once
+    std::lock_guard lock(rebuild_mutex_);
+    if (auto segment = open())
+        return segment;
+    // tiering deleted the local files since the segment was looked up, or
+    // the segment was evicted
+    if (!config_.storage->exists(Segment::filePath(dir_, info.base_offset))) {
+        if (config_.remote_store)
+            return openRemoteSegment(info);
+        throw std::out_of_range("Segment has been evicted.");
+    }
+    config_.storage->remove(Index::filePath(dir_, info.base_offset));
+    auto config = segmentConfig();
+    config.tail_cache_size = 0;
+    auto segment =
+        std::make_shared<Segment>(dir_, info.base_offset, max_segment_size_,
+                                  SegmentState::Active, config);
+    if (segment->recover() != RecoveryResult::Recovered ||
+        segment->getPublishedOffset() != info.published_offset)
+        throw std::runtime_error("Sealed segment is damaged.");
+    segment->seal();
+    return segment;
+}
+
+/*
+    The segment reads its files from the cache directory, chunks of the log
+    file are downloaded by the reads that need them first. The cached files
+    are removed with the segment, so the cache holds at most the open sealed
+    segments.
+*/
+std::shared_ptr<Segment>
+Log::openRemoteSegment(const SealedSegmentInfo &info) const {
+    auto file = std::make_shared<RemoteSegmentFile>(
+        config_.remote_store, remoteCacheDir(), info.base_offset,
+        config_.remote_chunk_size);
+    auto config = segmentConfig();
+    config.tail_cache_size = 0;
+    config.storage = fileStorage();
+    config.load_range = [file](uint64_t file_position, size_t length) {
+        file->load(file_position, length);
+    };
+    auto segment = std::make_shared<Segment>(
+        file->dir(), info.base_offset, info.published_offset,
+        max_segment_size_, SegmentState::Sealed, config);
+    // uploads are complete, this would be a bug or a tampered store
+    if (!segment->isComplete())
+        throw std::runtime_error("Remote segment is incomplete.");
+    return segment;
+}
+
+std::filesystem::path Log::remoteCacheDir() const {
+    return dir_ / "remote-cache";
+}
+
+SegmentConfig Log::segmentConfig() const {
+    return {.tail_cache_size = config_.tail_cache_size,
+            .mmap_sealed = config_.mmap_sealed_segments,
+            .storage = config_.storage};
+}
+
+/*
+    Ranges in mapped sealed segments are returned as slices of the mapping,
+    which keep their segment alive until the response has been written. All
+    other ranges are read into one buffer, allocated once for the whole fetch
+    even if it spans several segments.
+*/
 FetchResult Log::fetch(const FetchData &data) const {
+    auto ranges = planFetch(data);
+    std::vector<const uint8_t *> mapped(ranges.size());
+    size_t len = 0;
+    bool any_mapped = false;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        mapped[i] = ranges[i].segment->mappedRange(ranges[i].file_offset,
+                                                   ranges[i].length);
+        if (mapped[i] == nullptr)
+            len += ranges[i].length;
+        else
+            any_mapped = true;
+    }
+    FetchResult result;
+    if (!any_mapped) {
+        result.result_buf.resize(len);
+        uint8_t *dest = result.result_buf.data();
+        for (const auto &range : ranges) {
+            range.segment->readRange(range.file_offset, range.length, dest);
+            dest += range.length;
+        }
+        return result;
+    }
+    auto buffer = std::make_shared<std::vector<uint8_t>>(len);
+    uint8_t *dest = buffer->data();
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        size_t length = ranges[i].length;
+        if (mapped[i] != nullptr) {
+            result.slices.push_back({ranges[i].segment, mapped[i], length});
+            continue;
+        }
+        ranges[i].segment->readRange(ranges[i].file_offset, length, dest);
+        result.slices.push_back({buffer, dest, length});
+        dest += length;
+    }
+    return result;
+}
+
+std::vector<SendfileData> Log::planFetch(const FetchData &data) const {
     if (status_ != LogStatus::Open)
         throw std::logic_error("Reading from log requires status open.");
-    FetchResult result;
-    SegmentReadResult temp_result;
+    std::vector<SendfileData> ranges;
     uint64_t curr_offset = data.offset;
-    size_t curr_result_size, curr_max_bytes = data.max_bytes;
+    size_t curr_max_bytes = data.max_bytes;
     std::shared_ptr<Segment> segment;
+    std::optional<FetchSessionPosition> session_position;
+    SegmentReadPlan plan;
     do {
         segment = findSegment(curr_offset);
-        temp_result = segment->read(curr_offset, curr_max_bytes);
-        curr_result_size = result.result_buf.size();
-        curr_max_bytes -= temp_result.result_buf.size();
-        result.result_buf.resize(curr_result_size +
-                                 temp_result.result_buf.size());
-        std::memcpy(result.result_buf.data() + curr_result_size,
-                    temp_result.result_buf.data(),
-                    temp_result.result_buf.size());
-        curr_offset = temp_result.last_read_offset + 1;
-    } while (result.result_buf.size() < data.max_bytes &&
-             segment != active_segment_ && !temp_result.result_buf.empty());
-    return result;
+        // the start of a segment is known without asking the index
+        std::optional<uint64_t> file_position;
+        if (curr_offset == segment->getBaseOffset())
+            file_position = 0;
+        else if (data.session_id != 0 && curr_offset == data.offset)
+            file_position =
+                sessionFilePosition(data.session_id, *segment, curr_offset);
+        plan = segment->plan(curr_offset, curr_max_bytes, file_position,
+                             data.end_offset);
+        if (plan.length == 0)
+            break;
+        ranges.push_back({.segment = segment,
+                          .fd = segment->getFileDescriptor(),
+                          .length = static_cast<int64_t>(plan.length),
+                          .file_offset =
+                              static_cast<int64_t>(plan.file_position)});
+        session_position = {.base_offset = segment->getBaseOffset(),
+                            .offset = plan.last_read_offset + 1,
+                            .file_position =
+                                plan.file_position + plan.length};
+        curr_max_bytes -= plan.length;
+        curr_offset = plan.last_read_offset + 1;
+    } while (curr_max_bytes > 0 && curr_offset < data.end_offset &&
+             segment != active_segment_);
+    if (data.session_id != 0 && session_position.has_value())
+        updateSession(data.session_id, session_position.value());
+    return ranges;
+}
+
+size_t Log::recordSize(uint64_t offset) const {
+    if (status_ != LogStatus::Open)
+        throw std::logic_error("Reading from log requires status open.");
+    return findSegment(offset)->recordSize(offset);
+}
+
+/*
+    The remembered position is only used if the fetch continues exactly where
+    the previous one of the session ended, in the same segment. A record
+    never moves inside its segment: files are only appended to while the log
+    is open (recovery truncates before any fetch), a reader keeps the
+    descriptor of its segment open even after the segment was evicted from
+    the cache or its local file deleted, and a reopened segment, local or
+    remote, has the same bytes. So the position stays valid.
+*/
+std::optional<uint64_t> Log::sessionFilePosition(uint64_t session_id,
+                                                 const Segment &segment,
+                                                 uint64_t offset) const {
+    std::lock_guard lock(sessions_mutex_);
+    auto it = sessions_.find(session_id);
+    if (it == sessions_.end() ||
+        it->second.base_offset != segment.getBaseOffset() ||
+        it->second.offset != offset)
+        return std::nullopt;
+    ++session_hits_;
+    return it->second.file_position;
+}
+
+void Log::updateSession(uint64_t session_id,
+                        const FetchSessionPosition &position) const {
+    std::lock_guard lock(sessions_mutex_);
+    auto it = sessions_.find(session_id);
+    if (it != sessions_.end()) {
+        it->second = position;
+        return;
+    }
+    if (sessions_.size() >= MAX_FETCH_SESSIONS)
+        sessions_.erase(sessions_.begin());
+    sessions_.emplace(session_id, position);
+}
+
+// observes the records of a fetch result part and returns their number
+static uint64_t observeRecords(ProducerStateTable &producers,
+                               const uint8_t *data, size_t size) {
+    uint64_t count = 0;
+    size_t pos = 0;
+    while (pos + SEGMENT_HEADER_SIZE <= size) {
+        uint32_t header;
+        std::memcpy(&header, data + pos, SEGMENT_HEADER_SIZE);
+        if (byteswap::is_big_endian())
+            header = byteswap::byteswap32(header);
+        uint32_t len = recordHeaderLen(header);
+        pos += SEGMENT_HEADER_SIZE;
+        producers.observe(recordHeaderAttributes(header), data + pos, len);
+        pos += len;
+        ++count;
+    }
+    return count;
+}
+
+/*
+    Loads the newest intact snapshot from first_offset to end_offset, the
+    local ones first, then those uploaded with the tiered segments. Returns
+    its offset, nullopt leaves the table empty.
+*/
+std::optional<uint64_t> Log::loadProducerSnapshot(uint64_t first_offset,
+                                                  uint64_t end_offset) {
+    auto snapshots = determineProducerSnapshots();
+    for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+        if (*it < first_offset || *it > end_offset)
+            continue;
+        if (producers_.load(*config_.storage,
+                            ProducerStateTable::filePath(dir_, *it)))
+            return *it;
+        std::cerr << "producer state snapshot at " << *it
+                  << " could not be loaded, skipping it"
+                  << std::endl;
+    }
+    if (!config_.remote_store)
+        return std::nullopt;
+    snapshots = producerSnapshotOffsets(config_.remote_store->list());
+    for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+        if (*it < first_offset || *it > end_offset)
+            continue;
+        auto name = ProducerStateTable::filePath("", *it).string();
+        auto size = config_.remote_store->size(name);
+        if (!size)
+            continue;
+        std::vector<uint8_t> bytes(*size);
+        try {
+            config_.remote_store->read(name, 0, bytes.size(), bytes.data());
+            if (producers_.load(bytes))
+                return *it;
+        } catch (const std::exception &) {
+        }
+        std::cerr << "remote producer state snapshot at " << *it
+                  << " could not be loaded, skipping it"
+                  << std::endl;
+    }
+    return std::nullopt;
+}
+
+/*
+    Rollovers snapshot the producer state, so only the records after the
+    newest intact snapshot are replayed, usually those of the active segment.
+    Without one (e.g. a log written before snapshots existed) every record
+    that can still be fetched is replayed, remote ones included, and the
+    result is snapshotted so that the next startup does not do it again.
+    Producers whose batches have all been evicted are forgotten either way.
+*/
+void Log::recoverProducerState() {
+    uint64_t offset = firstOffset(), end_offset = endOffset();
+    producers_.clear();
+    if (auto snapshot = loadProducerSnapshot(offset, end_offset))
+        offset = *snapshot;
+    const bool replays_sealed = offset < active_segment_->getBaseOffset();
+    if (replays_sealed)
+        std::cerr << "no producer state snapshot of the active segment, "
+                  << "replaying the log from " << offset << std::endl;
+    size_t max_bytes = PRODUCER_REPLAY_CHUNK_SIZE;
+    while (offset < end_offset) {
+        auto result = fetch({.offset = offset, .max_bytes = max_bytes});
+        uint64_t count = observeRecords(producers_, result.result_buf.data(),
+                                        result.result_buf.size());
+        for (const auto &slice : result.slices)
+            count += observeRecords(producers_, slice.data, slice.size);
+        if (count > 0) {
+            offset += count;
+            max_bytes = PRODUCER_REPLAY_CHUNK_SIZE;
+            continue;
+        }
+        // the next record is larger than max bytes
+        if (max_bytes > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("Failed to replay producer state.");
+        max_bytes *= 2;
+    }
+    if (replays_sealed)
+        snapshotProducerState(end_offset);
+}
+
+/*
+    The snapshot holds the state before the record at base_offset. The
+    newest two are kept, the older one in case the newest is damaged.
+    Snapshots only speed up startup, a failed one is logged and left to
+    recovery. It is written and fsynced by the rollover, i.e. on the writer
+    thread, so the append that rolls over waits for it. The table has one
+    entry of 12 bytes per producer, which is cheap next to the rollover's
+    own fsyncs.
+*/
+void Log::snapshotProducerState(uint64_t base_offset) {
+    try {
+        producers_.save(*config_.storage,
+                        ProducerStateTable::filePath(dir_, base_offset));
+        auto snapshots = determineProducerSnapshots();
+        for (size_t i = 0; i + 2 < snapshots.size(); ++i)
+            config_.storage->remove(
+                ProducerStateTable::filePath(dir_, snapshots[i]));
+    } catch (const std::exception &e) {
+        std::cerr << "producer state snapshot at " << base_offset
+                  << " failed: " << e.what() << std::endl;
+    }
+}
+
+uint64_t Log::fetchSessionHits() const {
+    std::lock_guard lock(sessions_mutex_);
+    return session_hits_;
 }
 
 uint64_t Log::append(const AppendData &data) {
+    return append(data.data.data() + data.record_offset,
+                  data.data.size() - data.record_offset, data.attributes);
+}
+
+uint64_t Log::append(const uint8_t *data, size_t len, uint8_t attributes) {
     if (status_ != LogStatus::Open)
         throw std::logic_error("Writing to log requires status open.");
     if (activeSegmentIsFull())
         rollover();
-    uint64_t offset =
-        active_segment_->append(data.data.data(), data.data.size());
+    uint64_t offset = active_segment_->append(data, len, attributes);
+    producers_.observe(attributes, data, len);
     return offset;
 }
 
+uint64_t Log::append(std::span<const RecordSlice> records, bool sync) {
+    size_t appended;
+    return append(records, sync, appended);
+}
+
+uint64_t Log::append(std::span<const RecordSlice> records, bool sync,
+                     size_t &appended,
+                     std::vector<std::shared_ptr<const RecordChunk>> *chunks) {
+    appended = 0;
+    if (status_ != LogStatus::Open)
+        throw std::logic_error("Writing to log requires status open.");
+    uint64_t first_offset = 0;
+    size_t i = 0;
+    while (i < records.size()) {
+        if (activeSegmentIsFull())
+            rollover();
+        // same rule as for single appends: a record still goes into the
+        // segment as long as the segment is not full before writing it
+        uint64_t size = active_segment_->getPublishedSize();
+        size_t end = i;
+        while (end < records.size() && size < max_segment_size_) {
+            size += SEGMENT_HEADER_SIZE + records[end].len;
+            ++end;
+        }
+        std::shared_ptr<const RecordChunk> chunk;
+        uint64_t offset = active_segment_->append(
+            records.subspan(i, end - i), sync, ring_.get(), &chunk);
+        if (i == 0)
+            first_offset = offset;
+        if (chunks != nullptr && chunk)
+            chunks->push_back(std::move(chunk));
+        for (; i < end; ++i)
+            producers_.observe(records[i].attributes, records[i].data,
+                               records[i].len);
+        appended = end;
+    }
+    return first_offset;
+}
+
 void Log::rollover() {
     uint64_t old_base_offset = active_segment_->getBaseOffset(),
              new_base_offset = active_segment_->getPublishedOffset() + 1;
 
+    active_segment_->flush();
+    // readers of the old active segment keep using the sorted entries
+    active_segment_->finalizeIndex();
     auto next_active_segment = std::make_shared<Segment>(
-             dir_, new_base_offset, max_segment_size_, SegmentState::Active),
+             dir_, new_base_offset, max_segment_size_, SegmentState::Active,
+             segmentConfig()),
          sealed_segment = std::make_shared<Segment>(
              dir_, old_base_offset, new_base_offset - 1, max_segment_size_,
-             SegmentState::Sealed);
-    active_segment_->flush();
+             SegmentState::Sealed, segmentConfig());
 
     {
         std::unique_lock<std::shared_mutex> lock(segments_mutex_);
-        sealed_segments_.push_back(sealed_segment);
+        sealed_segments_.push_back({old_base_offset, new_base_offset - 1});
+        // lagging consumers are likely to read it soon
+        open_segments_.insert(sealed_segment);
+        auto stats = active_segment_->tailCacheStats();
+        retired_tail_cache_stats_.hits += stats.hits;
+        retired_tail_cache_stats_.misses += stats.misses;
         /*
             Let previous active segment go out of scope. Once all reader threads
             are done no shared ptr with a reference to it will exist and the
@@ -122,18 +584,133 @@ void Log::rollover() {
         */
         active_segment_.swap(next_active_segment);
     }
+    snapshotProducerState(new_base_offset);
+    evictSegments();
+}
+
+/*
+    Whole sealed segments are dropped, oldest first, so that the log keeps a
+    contiguous range of offsets; the active segment is never evicted, a full
+    backend may therefore hold up to one segment more than its capacity.
+    Readers of an evicted segment keep their reference until they are done,
+    fetches starting before the first segment fail with std::out_of_range.
+*/
+void Log::evictSegments() {
+    while (config_.storage->full()) {
+        SealedSegmentInfo info;
+        {
+            std::unique_lock<std::shared_mutex> lock(segments_mutex_);
+            if (sealed_segments_.empty())
+                return;
+            info = sealed_segments_.front();
+            sealed_segments_.erase(sealed_segments_.begin());
+        }
+        open_segments_.erase(info.base_offset);
+        // an open that found the index still checks the log under the lock
+        std::lock_guard lock(rebuild_mutex_);
+        config_.storage->remove(Segment::filePath(dir_, info.base_offset));
+        config_.storage->remove(Index::filePath(dir_, info.base_offset));
+    }
 }
 
 std::shared_ptr<Segment> Log::findSegment(uint64_t offset) const {
-    std::shared_lock<std::shared_mutex> lock(segments_mutex_);
-    if (sealed_segments_.empty() || active_segment_->getBaseOffset() <= offset)
-        return active_segment_;
-    auto it = sealed_segments_.begin();
-    while (it != sealed_segments_.end() &&
-           it->get()->getBaseOffset() <= offset) {
-        ++it;
+    SealedSegmentInfo info;
+    {
+        std::shared_lock<std::shared_mutex> lock(segments_mutex_);
+        if (active_segment_->getBaseOffset() <= offset)
+            return active_segment_;
+        auto it = std::upper_bound(
+            sealed_segments_.begin(), sealed_segments_.end(), offset,
+            [](uint64_t offset, const SealedSegmentInfo &info) {
+                return offset < info.base_offset;
+            });
+        if (it == sealed_segments_.begin())
+            throw std::out_of_range("Offset has been evicted from the log.");
+        info = *(it - 1);
     }
-    return *(it - 1);
+    // opening may rebuild an index, do not hold up rollovers meanwhile
+    return open_segments_.get(
+        info.base_offset, [this, &info]() { return openSealedSegment(info); });
+}
+
+/*
+    Runs next to the writer, which may append sealed segments meanwhile, so
+    the uploads work on a copy and only the flags are updated under the lock.
+    Segments are opened before the upload, which rebuilds an incomplete
+    index, the remote copy is never rebuilt. Deleting takes the rebuild lock,
+    so that an open that found the files gone retries in the remote store.
+*/
+void Log::tierSegments() {
+    if (!config_.remote_store)
+        return;
+    std::vector<SealedSegmentInfo> segments;
+    {
+        std::shared_lock<std::shared_mutex> lock(segments_mutex_);
+        segments = sealed_segments_;
+    }
+    auto update = [this](const SealedSegmentInfo &info) {
+        std::unique_lock<std::shared_mutex> lock(segments_mutex_);
+        auto it = std::lower_bound(
+            sealed_segments_.begin(), sealed_segments_.end(),
+            info.base_offset,
+            [](const SealedSegmentInfo &info, uint64_t base_offset) {
+                return info.base_offset < base_offset;
+            });
+        it->uploaded = info.uploaded;
+        it->remote = info.remote;
+    };
+    // oldest first, so that the remote store has no gaps
+    for (auto &info : segments) {
+        if (info.uploaded)
+            continue;
+        auto segment = openSealedSegment(info);
+        auto index_path = Index::filePath(dir_, info.base_offset),
+             log_path = Segment::filePath(dir_, info.base_offset);
+        config_.remote_store->upload(index_path.filename(), index_path);
+        config_.remote_store->upload(log_path.filename(), log_path);
+        info.uploaded = true;
+        update(info);
+    }
+    // the newest snapshot goes with the tiered segments, a log that lost
+    // the local ones does not replay the remote history. One uploaded while
+    // the rollover writes it fails its checksum and a later one replaces it.
+    auto snapshots = determineProducerSnapshots();
+    if (!snapshots.empty()) {
+        auto path = ProducerStateTable::filePath(dir_, snapshots.back());
+        if (!config_.remote_store->size(path.filename()))
+            config_.remote_store->upload(path.filename(), path);
+    }
+    uint64_t local_bytes = 0;
+    for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+        if (it->remote)
+            continue;
+        auto log_path = Segment::filePath(dir_, it->base_offset);
+        local_bytes += std::filesystem::file_size(log_path);
+        if (local_bytes <= config_.local_retention_bytes || !it->uploaded)
+            continue;
+        std::lock_guard lock(rebuild_mutex_);
+        it->remote = true;
+        update(*it);
+        // later reads open the remote segment, fetches that still hold the
+        // local one keep reading the unlinked files until they release it
+        open_segments_.erase(it->base_offset);
+        config_.storage->remove(log_path);
+        config_.storage->remove(Index::filePath(dir_, it->base_offset));
+    }
+}
+
+size_t Log::remoteSegments() const {
+    std::shared_lock<std::shared_mutex> lock(segments_mutex_);
+    return std::count_if(
+        sealed_segments_.begin(), sealed_segments_.end(),
+        [](const SealedSegmentInfo &info) { return info.remote; });
+}
+
+uint64_t Log::firstOffset() const {
+    std::shared_lock<std::shared_mutex> lock(segments_mutex_);
+    if (sealed_segments_.empty())
+        return active_segment_->getBaseOffset();
+    return sealed_segments_.front().base_offset;
 }
 
 uint64_t Log::getPublishedOffset() {
@@ -143,6 +720,27 @@ uint64_t Log::getPublishedOffset() {
     return active_segment_->getPublishedOffset();
 }
 
+/*
+    The published offset of an empty segment is its base offset, so it does
+    not tell whether the record at the base offset exists.
+*/
+uint64_t Log::endOffset() const {
+    if (status_ != LogStatus::Open)
+        throw std::logic_error(
+            "Getting end offset from log requires status open.");
+    std::shared_lock<std::shared_mutex> lock(segments_mutex_);
+    if (active_segment_->getPublishedSize() == 0)
+        return active_segment_->getBaseOffset();
+    return active_segment_->getPublishedOffset() + 1;
+}
+
+TailCacheStats Log::tailCacheStats() const {
+    std::shared_lock<std::shared_mutex> lock(segments_mutex_);
+    auto stats = active_segment_->tailCacheStats();
+    return {retired_tail_cache_stats_.hits + stats.hits,
+            retired_tail_cache_stats_.misses + stats.misses};
+}
+
 bool Log::activeSegmentIsFull() { return active_segment_->isFull(); }
 
 void Log::flush() { active_segment_->flush(); }
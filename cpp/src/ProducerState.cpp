@@ -0,0 +1,164 @@
+#include "../include/ProducerState.h"
+#include "../include/ByteSwap.h"
+#include "../include/IoUring.h"
+#include "../include/RecordManager.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+// producer id (u64) and last sequence (u32)
+static constexpr size_t SNAPSHOT_ENTRY_SIZE = 12;
+
+SequenceCheck checkSequence(std::optional<uint32_t> last, uint32_t sequence) {
+    if (!last.has_value())
+        return sequence == 0 ? SequenceCheck::InSequence
+                             : SequenceCheck::OutOfSequence;
+    if (sequence == static_cast<uint32_t>(last.value() + 1))
+        return SequenceCheck::InSequence;
+    if (static_cast<uint32_t>(last.value() - sequence) < (1u << 31))
+        return SequenceCheck::Duplicate;
+    return SequenceCheck::OutOfSequence;
+}
+
+std::optional<uint32_t>
+ProducerStateTable::lastSequence(uint64_t producer_id) const {
+    auto it = sequences_.find(producer_id);
+    if (it == sequences_.end())
+        return std::nullopt;
+    return it->second;
+}
+
+void ProducerStateTable::update(uint64_t producer_id, uint32_t sequence) {
+    sequences_[producer_id] = sequence;
+}
+
+void ProducerStateTable::observe(uint8_t attributes, const uint8_t *record,
+                                 size_t len) {
+    if (len < sizeof(uint32_t))
+        return;
+    auto producer = RecordManager::batch_producer(
+        attributes, record + sizeof(uint32_t), len - sizeof(uint32_t));
+    if (producer.has_value())
+        update(producer->producer_id, producer->sequence);
+}
+
+/*
+    A snapshot is a record (length, checksum and payload) whose payload holds
+    the entries, so that a torn or damaged snapshot is detected like a
+    damaged record.
+*/
+void ProducerStateTable::save(StorageBackend &storage,
+                              const std::filesystem::path &path) const {
+    std::vector<uint8_t> entries(sequences_.size() * SNAPSHOT_ENTRY_SIZE);
+    size_t pos = 0;
+    for (const auto &entry : sequences_) {
+        uint64_t producer_id = entry.first;
+        uint32_t sequence = entry.second;
+        if (byteswap::is_big_endian()) {
+            producer_id = byteswap::byteswap64(producer_id);
+            sequence = byteswap::byteswap32(sequence);
+        }
+        std::memcpy(entries.data() + pos, &producer_id, sizeof(producer_id));
+        std::memcpy(entries.data() + pos + sizeof(producer_id), &sequence,
+                    sizeof(sequence));
+        pos += SNAPSHOT_ENTRY_SIZE;
+    }
+    auto bytes = RecordManager::create_record(entries).to_bytes_with_len();
+    int fd;
+    do {
+        fd = storage.open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1) {
+        std::stringstream msg;
+        msg << "Failed to open producer snapshot " << path
+            << ", errno = " << errno;
+        throw std::runtime_error(msg.str());
+    }
+    try {
+        IoBatch batch;
+        batch.write(fd, {{bytes.data(), bytes.size()}}, 0);
+        batch.fsync(fd);
+        batch.execute(nullptr);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+bool ProducerStateTable::load(StorageBackend &storage,
+                              const std::filesystem::path &path) {
+    sequences_.clear();
+    int fd = storage.open(path, O_RDONLY, 0);
+    if (fd == -1)
+        return false;
+    std::vector<uint8_t> bytes;
+    struct stat st;
+    try {
+        if (fstat(fd, &st) == -1)
+            throw std::runtime_error("Failure of fstat.");
+        bytes.resize(st.st_size);
+        IoBatch batch;
+        batch.read(fd, bytes.data(), bytes.size(), 0);
+        batch.execute(nullptr);
+    } catch (const std::exception &e) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return load(bytes);
+}
+
+bool ProducerStateTable::load(const std::vector<uint8_t> &bytes) {
+    sequences_.clear();
+    // length and checksum before the entries
+    size_t header_size = 2 * sizeof(uint32_t);
+    if (bytes.size() < header_size ||
+        (bytes.size() - header_size) % SNAPSHOT_ENTRY_SIZE != 0)
+        return false;
+    uint32_t len;
+    std::memcpy(&len, bytes.data(), sizeof(len));
+    if (byteswap::is_big_endian())
+        len = byteswap::byteswap32(len);
+    if (len != bytes.size() - sizeof(len) ||
+        !RecordManager::check_integrity(bytes.data() + sizeof(len), len))
+        return false;
+    for (size_t pos = header_size; pos < bytes.size();
+         pos += SNAPSHOT_ENTRY_SIZE) {
+        uint64_t producer_id;
+        uint32_t sequence;
+        std::memcpy(&producer_id, bytes.data() + pos, sizeof(producer_id));
+        std::memcpy(&sequence, bytes.data() + pos + sizeof(producer_id),
+                    sizeof(sequence));
+        if (byteswap::is_big_endian()) {
+            producer_id = byteswap::byteswap64(producer_id);
+            sequence = byteswap::byteswap32(sequence);
+        }
+        sequences_[producer_id] = sequence;
+    }
+    return true;
+}
+
+std::filesystem::path
+ProducerStateTable::filePath(const std::filesystem::path &dir,
+                             uint64_t base_offset) {
+    auto filename = std::to_string(base_offset) + ".producers";
+    std::string filler(68 - filename.size(), '0');
+    return dir / (filler + filename);
+}
+
+} // namespace broker
+} // namespace kafka_lite
@@ -4,6 +4,10 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <vector>
@@ -27,7 +31,7 @@ std::vector<uint8_t> Record::to_bytes() {
 }
 
 std::vector<uint8_t> Record::to_bytes_with_len() {
-    uint32_t len = payload.size() + sizeof(checksum);
+    uint32_t len = recordHeader(payload.size() + sizeof(checksum), attributes);
     size_t pos = 0;
     std::vector<uint8_t> bytes(payload.size() + sizeof(checksum) + sizeof(len));
     if (byteswap::is_big_endian()) {
@@ -55,6 +59,8 @@ RecordManager::extract_records(const std::vector<uint8_t> bytes) {
     std::vector<Record> result;
     while (pos < bytes.size()) {
         uint32_t len = 0, checksum = 0;
+        if (bytes.size() - pos < sizeof(len) + sizeof(checksum))
+            throw std::runtime_error("Truncated record header.");
         std::memcpy(&len, bytes.data() + pos, sizeof(len));
         pos += sizeof(len);
         std::memcpy(&checksum, bytes.data() + pos, sizeof(checksum));
@@ -63,28 +69,39 @@ RecordManager::extract_records(const std::vector<uint8_t> bytes) {
             len = byteswap::byteswap32(len);
             checksum = byteswap::byteswap32(checksum);
         }
+        uint8_t attributes = recordHeaderAttributes(len);
+        len = recordHeaderLen(len);
         if (len < sizeof(checksum)) {
             std::stringstream ss;
             ss << "Invalid len " << len << ", must be at least "
                << sizeof(checksum);
             throw std::runtime_error(ss.str());
         }
+        if (len - sizeof(checksum) > bytes.size() - pos)
+            throw std::runtime_error("Truncated record payload.");
         std::vector<uint8_t> payload(len - sizeof(checksum));
         std::memcpy(payload.data(), bytes.data() + pos, payload.size());
         pos += payload.size();
-        result.push_back({.checksum = checksum, .payload = payload});
+        result.push_back({.checksum = checksum,
+                          .payload = payload,
+                          .attributes = attributes});
     }
     return result;
 }
 
 bool RecordManager::check_integrity(const std::vector<uint8_t> &bytes) {
+    return check_integrity(bytes.data(), bytes.size());
+}
+
+bool RecordManager::check_integrity(const uint8_t *data, size_t size) {
     uint32_t record_checksum = 0;
-    std::memcpy(&record_checksum, bytes.data(), sizeof(record_checksum));
+    if (size < sizeof(record_checksum))
+        return false;
+    std::memcpy(&record_checksum, data, sizeof(record_checksum));
     if (byteswap::is_big_endian())
         record_checksum = byteswap::byteswap32(record_checksum);
     crc32c_type crc32c;
-    crc32c.process_bytes(bytes.data() + sizeof(uint32_t),
-                         bytes.size() - sizeof(uint32_t));
+    crc32c.process_bytes(data + sizeof(uint32_t), size - sizeof(uint32_t));
     auto computed_checksum = crc32c.checksum();
     return record_checksum == computed_checksum;
 }
@@ -103,5 +120,132 @@ bool RecordManager::check_integrity(const Record &record) {
     return checksum == record.checksum;
 }
 
+/*
+    Plain batches leave out the producer, the header then ends after the
+    uncompressed size.
+*/
+static Record
+createBatch(const std::vector<std::vector<uint8_t>> &payloads,
+            CompressionCodec codec,
+            const std::optional<ProducerSequence> &producer) {
+    const Codec *impl = findCodec(codec);
+    if (impl == nullptr)
+        throw std::invalid_argument("Compression codec is not built in.");
+    if (codec == CompressionCodec::None && !producer)
+        throw std::invalid_argument("Batch needs a compression codec.");
+    std::vector<uint8_t> records;
+    for (const auto &payload : payloads) {
+        auto bytes = RecordManager::create_record(payload).to_bytes_with_len();
+        records.insert(records.end(), bytes.begin(), bytes.end());
+    }
+    if (records.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("Batch is too large.");
+    uint32_t uncompressed_size = records.size();
+    auto compressed = impl->compress(records);
+    if (byteswap::is_big_endian())
+        uncompressed_size = byteswap::byteswap32(uncompressed_size);
+
+    size_t header_size =
+        producer ? PRODUCER_BATCH_HEADER_SIZE : BATCH_HEADER_SIZE;
+    std::vector<uint8_t> payload(header_size + compressed.size());
+    std::memcpy(payload.data(), &uncompressed_size, sizeof(uncompressed_size));
+    if (producer) {
+        uint64_t producer_id = producer->producer_id;
+        uint32_t sequence = producer->sequence;
+        if (byteswap::is_big_endian()) {
+            producer_id = byteswap::byteswap64(producer_id);
+            sequence = byteswap::byteswap32(sequence);
+        }
+        std::memcpy(payload.data() + BATCH_HEADER_SIZE, &producer_id,
+                    sizeof(producer_id));
+        std::memcpy(payload.data() + BATCH_HEADER_SIZE + sizeof(producer_id),
+                    &sequence, sizeof(sequence));
+    }
+    std::memcpy(payload.data() + header_size, compressed.data(),
+                compressed.size());
+    auto record = RecordManager::create_record(payload);
+    record.attributes = static_cast<uint8_t>(codec);
+    if (producer)
+        record.attributes |= RECORD_ATTR_PRODUCER;
+    return record;
+}
+
+Record
+RecordManager::create_batch(const std::vector<std::vector<uint8_t>> &payloads,
+                            CompressionCodec codec) {
+    return createBatch(payloads, codec, std::nullopt);
+}
+
+Record
+RecordManager::create_batch(const std::vector<std::vector<uint8_t>> &payloads,
+                            CompressionCodec codec,
+                            const ProducerSequence &producer) {
+    return createBatch(payloads, codec, producer);
+}
+
+std::optional<CompressionCodec>
+RecordManager::batch_codec(uint8_t attributes) {
+    if (attributes == 0 ||
+        (attributes & RECORD_ATTR_CODEC_MASK) > MAX_COMPRESSION_CODEC)
+        return std::nullopt;
+    return static_cast<CompressionCodec>(attributes & RECORD_ATTR_CODEC_MASK);
+}
+
+std::optional<ProducerSequence>
+RecordManager::batch_producer(uint8_t attributes, const uint8_t *payload,
+                              size_t size) {
+    if (!(attributes & RECORD_ATTR_PRODUCER) ||
+        size < PRODUCER_BATCH_HEADER_SIZE)
+        return std::nullopt;
+    ProducerSequence producer;
+    std::memcpy(&producer.producer_id, payload + BATCH_HEADER_SIZE,
+                sizeof(producer.producer_id));
+    std::memcpy(&producer.sequence,
+                payload + BATCH_HEADER_SIZE + sizeof(producer.producer_id),
+                sizeof(producer.sequence));
+    if (byteswap::is_big_endian()) {
+        producer.producer_id = byteswap::byteswap64(producer.producer_id);
+        producer.sequence = byteswap::byteswap32(producer.sequence);
+    }
+    return producer;
+}
+
+std::vector<Record> RecordManager::decompress_batch(const Record &record) {
+    const auto &payload = record.payload;
+    auto codec = batch_codec(record.attributes);
+    if (!codec.has_value())
+        throw std::runtime_error("Record is not a compressed batch.");
+    const Codec *impl = findCodec(codec.value());
+    if (impl == nullptr)
+        throw std::runtime_error("Compression codec is not built in.");
+    size_t header_size = record.attributes & RECORD_ATTR_PRODUCER
+                             ? PRODUCER_BATCH_HEADER_SIZE
+                             : BATCH_HEADER_SIZE;
+    if (payload.size() < header_size)
+        throw std::runtime_error("Truncated batch header.");
+    uint32_t uncompressed_size;
+    std::memcpy(&uncompressed_size, payload.data(), sizeof(uncompressed_size));
+    if (byteswap::is_big_endian())
+        uncompressed_size = byteswap::byteswap32(uncompressed_size);
+    auto records = impl->decompress(
+        std::span<const uint8_t>(payload).subspan(header_size),
+        uncompressed_size);
+    return extract_records(records);
+}
+
+std::vector<Record>
+RecordManager::extract_all_records(const std::vector<uint8_t> &bytes) {
+    std::vector<Record> result;
+    for (auto &record : extract_records(bytes)) {
+        if (batch_codec(record.attributes)) {
+            auto batch = decompress_batch(record);
+            result.insert(result.end(), std::make_move_iterator(batch.begin()),
+                          std::make_move_iterator(batch.end()));
+        } else
+            result.push_back(std::move(record));
+    }
+    return result;
+}
+
 } // namespace broker
 } // namespace kafka_lite
@@ -0,0 +1,211 @@
+#include "../include/RemoteStore.h"
+#include "../include/Segment.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+static const std::string UPLOAD_SUFFIX = ".upload";
+
+static int openFile(const std::filesystem::path &path, int flags) {
+    int fd;
+    do {
+        fd = open(path.c_str(), flags, 0644);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1) {
+        std::stringstream msg;
+        msg << "Failed to open " << path << ", errno = " << errno;
+        throw std::ios_base::failure(msg.str());
+    }
+    return fd;
+}
+
+static void readFully(int fd, uint64_t position, size_t length,
+                      uint8_t *dest) {
+    size_t bytes_read = 0;
+    while (bytes_read < length) {
+        ssize_t rc = pread(fd, dest + bytes_read, length - bytes_read,
+                           position + bytes_read);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            throw std::ios_base::failure("Failed to read remote object.");
+        bytes_read += rc;
+    }
+}
+
+static void writeFully(int fd, uint64_t position, size_t length,
+                       const uint8_t *src) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t rc = pwrite(fd, src + written, length - written,
+                            position + written);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            throw std::ios_base::failure("Failed to write cached chunk.");
+        written += rc;
+    }
+}
+
+DirectoryRemoteStore::DirectoryRemoteStore(const std::filesystem::path &dir)
+    : dir_(dir) {
+    std::filesystem::create_directories(dir_);
+}
+
+/*
+    Copied under a temporary name and synced before the rename, so a crash
+    leaves either the old object or the complete new one. The local copy may
+    be deleted right after the upload.
+*/
+void DirectoryRemoteStore::upload(const std::string &name,
+                                  const std::filesystem::path &file) {
+    auto tmp = dir_ / (name + UPLOAD_SUFFIX);
+    std::filesystem::copy_file(
+        file, tmp, std::filesystem::copy_options::overwrite_existing);
+    int fd = openFile(tmp, O_RDONLY);
+    int rc;
+    do {
+        rc = fsync(fd);
+    } while (rc == -1 && errno == EINTR);
+    close(fd);
+    if (rc == -1)
+        throw std::ios_base::failure("Failed to sync uploaded object.");
+    std::filesystem::rename(tmp, dir_ / name);
+}
+
+std::optional<uint64_t>
+DirectoryRemoteStore::size(const std::string &name) const {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(dir_ / name, ec);
+    if (ec)
+        return std::nullopt;
+    return size;
+}
+
+void DirectoryRemoteStore::read(const std::string &name, uint64_t position,
+                                size_t length, uint8_t *dest) const {
+    int fd = openFile(dir_ / name, O_RDONLY);
+    try {
+        readFully(fd, position, length, dest);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+std::vector<std::string> DirectoryRemoteStore::list() const {
+    std::vector<std::string> names;
+    for (const auto &entry : std::filesystem::directory_iterator(dir_)) {
+        auto name = entry.path().filename().string();
+        if (!name.ends_with(UPLOAD_SUFFIX))
+            names.push_back(std::move(name));
+    }
+    return names;
+}
+
+// several files of the same segment may be open at the same time
+static std::atomic<uint64_t> remote_segment_files{0};
+
+RemoteSegmentFile::RemoteSegmentFile(std::shared_ptr<RemoteStore> store,
+                                     const std::filesystem::path &cache_dir,
+                                     uint64_t base_offset, size_t chunk_size)
+    : store_(std::move(store)),
+      dir_(cache_dir / (std::to_string(base_offset) + "-" +
+                        std::to_string(remote_segment_files.fetch_add(1)))),
+      log_name_(Segment::filePath(dir_, base_offset).filename()),
+      chunk_size_(std::max<size_t>(chunk_size, 1)), fd_(-1) {
+    auto index_name = Index::filePath(dir_, base_offset).filename().string();
+    auto index_size = store_->size(index_name);
+    auto log_size = store_->size(log_name_);
+    if (!index_size.has_value() || !log_size.has_value())
+        throw std::runtime_error("Segment is missing in the remote store.");
+    size_ = log_size.value();
+    std::filesystem::create_directories(dir_);
+    try {
+        std::vector<uint8_t> index(index_size.value());
+        store_->read(index_name, 0, index.size(), index.data());
+        int index_fd = openFile(dir_ / index_name, O_WRONLY | O_CREAT);
+        try {
+            writeFully(index_fd, 0, index.size(), index.data());
+        } catch (...) {
+            close(index_fd);
+            throw;
+        }
+        close(index_fd);
+        fd_ = openFile(dir_ / log_name_, O_RDWR | O_CREAT);
+        if (ftruncate(fd_, size_) == -1)
+            throw std::ios_base::failure("Failed to size cached log file.");
+    } catch (...) {
+        if (fd_ != -1)
+            close(fd_);
+        std::error_code ec;
+        std::filesystem::remove_all(dir_, ec);
+        throw;
+    }
+    loaded_ = std::vector<std::atomic<bool>>((size_ + chunk_size_ - 1) /
+                                             chunk_size_);
+}
+
+RemoteSegmentFile::~RemoteSegmentFile() {
+    if (fd_ != -1)
+        close(fd_);
+    std::error_code ec;
+    std::filesystem::remove_all(dir_, ec);
+}
+
+/*
+    Readers of loaded chunks only check the flags. Downloads are serialized,
+    so a chunk is fetched once even if several readers want it.
+*/
+void RemoteSegmentFile::load(uint64_t position, size_t length) {
+    if (length == 0 || position >= size_)
+        return;
+    uint64_t first = position / chunk_size_;
+    uint64_t last = (std::min<uint64_t>(position + length, size_) - 1) /
+                    chunk_size_;
+    uint64_t chunk = first;
+    while (chunk <= last && loaded_[chunk].load(std::memory_order_acquire))
+        ++chunk;
+    if (chunk > last)
+        return;
+    std::lock_guard lock(mutex_);
+    std::vector<uint8_t> buf;
+    for (; chunk <= last; ++chunk) {
+        if (loaded_[chunk].load(std::memory_order_relaxed))
+            continue;
+        uint64_t start = chunk * chunk_size_;
+        size_t len = std::min<uint64_t>(chunk_size_, size_ - start);
+        buf.resize(len);
+        store_->read(log_name_, start, len, buf.data());
+        writeFully(fd_, start, len, buf.data());
+        loaded_[chunk].store(true, std::memory_order_release);
+    }
+}
+
+uint64_t RemoteSegmentFile::loadedChunks() const {
+    return std::count_if(loaded_.begin(), loaded_.end(),
+                         [](const std::atomic<bool> &loaded) {
+                             return loaded.load(std::memory_order_relaxed);
+                         });
+}
+
+} // namespace broker
+} // namespace kafka_lite
@@ -0,0 +1,54 @@
+#include "../include/Replication.h"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+using namespace std::chrono;
+
+namespace kafka_lite {
+namespace broker {
+
+ReplicaTracker::ReplicaTracker(milliseconds lag_timeout)
+    : lag_timeout_(lag_timeout), high_watermark_(0) {}
+
+bool ReplicaTracker::update(uint64_t replica_id, uint64_t end_offset,
+                            uint64_t log_end_offset) {
+    std::lock_guard lock(mutex_);
+    uint64_t previous = advance(log_end_offset);
+    auto &replica = replicas_[replica_id];
+    replica.end_offset = end_offset;
+    replica.last_sync = steady_clock::now();
+    if (!replica.in_sync && end_offset >= high_watermark_)
+        replica.in_sync = true;
+    return advance(log_end_offset) != previous;
+}
+
+uint64_t ReplicaTracker::highWatermark(uint64_t log_end_offset) {
+    std::lock_guard lock(mutex_);
+    return advance(log_end_offset);
+}
+
+size_t ReplicaTracker::inSyncReplicas() const {
+    std::lock_guard lock(mutex_);
+    return std::count_if(
+        replicas_.begin(), replicas_.end(),
+        [](const auto &entry) { return entry.second.in_sync; });
+}
+
+uint64_t ReplicaTracker::advance(uint64_t log_end_offset) {
+    auto now = steady_clock::now();
+    uint64_t high_watermark = log_end_offset;
+    for (auto &[id, replica] : replicas_) {
+        if (replica.in_sync && now - replica.last_sync > lag_timeout_)
+            replica.in_sync = false;
+        if (replica.in_sync)
+            high_watermark = std::min(high_watermark, replica.end_offset);
+    }
+    high_watermark_ = std::max(high_watermark_, high_watermark);
+    return high_watermark_;
+}
+
+} // namespace broker
+} // namespace kafka_lite
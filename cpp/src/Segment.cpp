@@ -1,6 +1,12 @@
 #include "../include/Segment.h"
 #include "../include/ByteSwap.h"
+#include "../include/IndexSearch.h"
+#include "../include/IoUring.h"
+#include "../include/StorageBackend.h"
+#include "../include/TailCache.h"
+#include <algorithm>
 #include <atomic>
+#include <bit>
 #include <boost/crc.hpp>
 #include <cerrno>
 #include <cstddef>
@@ -12,84 +18,24 @@
 #include <iostream>
 #include <limits>
 #include <optional>
+#include <shared_mutex>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <vector>
 
-bool write_u32_le(int fd, uint32_t value) {
-    if (kafka_lite::byteswap::is_big_endian())
-        value = kafka_lite::byteswap::byteswap32(value);
-
-    ssize_t curr_write, bytes_written = 0;
-    while (bytes_written < sizeof(value)) {
-        curr_write =
-            write(fd, &value + bytes_written, sizeof(value) - bytes_written);
-        if (curr_write < 0) {
-            if (errno == EINTR)
-                continue;
-            break;
-        }
-        if (curr_write == 0)
-            break;
-        bytes_written += curr_write;
-    }
-    return bytes_written == sizeof(value);
-}
-
-bool write_u64_le(int fd, uint64_t value) {
-    if (kafka_lite::byteswap::is_big_endian())
-        value = kafka_lite::byteswap::byteswap64(value);
-
-    ssize_t curr_write, bytes_written = 0;
-    while (bytes_written < sizeof(value)) {
-        curr_write =
-            write(fd, &value + bytes_written, sizeof(value) - bytes_written);
-        if (curr_write < 0) {
-            if (errno == EINTR)
-                continue;
-            break;
-        }
-        if (curr_write == 0)
-            break;
-        bytes_written += curr_write;
-    }
-    return bytes_written == sizeof(value);
-}
-
-uint64_t read_u64_le(int fd, uint32_t pos) {
-    uint64_t res;
-    ssize_t curr_read, bytes_read = 0;
-    while (bytes_read < sizeof(res)) {
-        curr_read = pread(fd, &res + bytes_read, sizeof(res) - bytes_read, pos);
-        if (curr_read < 0) {
-            if (errno == EINTR)
-                continue;
-            std::stringstream msg;
-            msg << "pread fail, fd = " << fd << ", errno = " << errno;
-            throw std::ios_base::failure(msg.str());
-        }
-        if (curr_read == 0) {
-            std::stringstream msg;
-            msg << "read_u32_le: pread fail, fd = " << fd
-                << ", 0 bytes read, total bytes read = " << bytes_read;
-            throw std::ios_base::failure(msg.str());
-        }
-        bytes_read += curr_read;
-    }
-    if (kafka_lite::byteswap::is_big_endian())
-        res = kafka_lite::byteswap::byteswap64(res);
-    return res;
-}
-
-uint32_t read_u32_le(int fd, uint32_t pos) {
+uint32_t read_u32_le(int fd, uint64_t pos) {
     uint32_t res;
-    ssize_t curr_read, bytes_read = 0;
+    ssize_t curr_read;
+    size_t bytes_read = 0;
     while (bytes_read < sizeof(res)) {
-        curr_read = pread(fd, &res + bytes_read, sizeof(res) - bytes_read, pos);
+        curr_read = pread(fd, reinterpret_cast<uint8_t *>(&res) + bytes_read,
+                          sizeof(res) - bytes_read, pos + bytes_read);
         if (curr_read < 0) {
             if (errno == EINTR)
                 continue;
@@ -100,7 +46,7 @@ uint32_t read_u32_le(int fd, uint32_t pos) {
         }
         if (curr_read == 0) {
             std::stringstream msg;
-            msg << "read_u64_le: pread fail, fd = " << fd
+            msg << "read_u32_le: pread fail, fd = " << fd
                 << ", 0 bytes read, total bytes read = " << bytes_read;
             throw std::ios_base::failure(msg.str());
         }
@@ -116,41 +62,143 @@ namespace broker {
 
 using namespace kafka_lite::byteswap;
 
+std::shared_ptr<const RecordChunk>
+makeRecordChunk(uint64_t first_offset, std::span<const RecordSlice> records) {
+    auto chunk = std::make_shared<RecordChunk>();
+    chunk->first_offset = first_offset;
+    chunk->record_positions.reserve(records.size());
+    size_t size = 0;
+    for (const auto &record : records)
+        size += SEGMENT_HEADER_SIZE + record.len;
+    chunk->bytes.resize(size);
+    uint8_t *pos = chunk->bytes.data();
+    for (const auto &record : records) {
+        chunk->record_positions.push_back(pos - chunk->bytes.data());
+        uint32_t len = recordHeader(record.len, record.attributes);
+        if (is_big_endian())
+            len = byteswap32(len);
+        std::memcpy(pos, &len, SEGMENT_HEADER_SIZE);
+        std::memcpy(pos + SEGMENT_HEADER_SIZE, record.data, record.len);
+        pos += SEGMENT_HEADER_SIZE + record.len;
+    }
+    return chunk;
+}
+
 Segment::Segment(const std::filesystem::path &dir, uint64_t base_offset,
-                 uint64_t max_size, SegmentState state)
-    : dir_(dir), base_offset_(base_offset), max_size_(max_size), log_fd_(-1),
-      state_(state), published_size_(0), published_offset_(base_offset),
-      index_file_(dir, base_offset, state) {
+                 uint64_t max_size, SegmentState state,
+                 const SegmentConfig &config)
+    : state_(state), log_fd_(-1),
+      index_file_(dir, base_offset, state,
+                  max_size > std::numeric_limits<uint32_t>::max(),
+                  *config.storage),
+      dir_(dir), published_offset_(base_offset), published_size_(0),
+      max_size_(max_size), base_offset_(base_offset), config_(config),
+      map_(nullptr), map_size_(0) {
     init();
+    initTailCache();
 }
 
 Segment::Segment(const std::filesystem::path &dir, uint64_t base_offset,
                  uint64_t published_offset, uint64_t max_size,
-                 SegmentState state)
-    : dir_(dir), base_offset_(base_offset), max_size_(max_size), log_fd_(-1),
-      state_(state), published_size_(0), published_offset_(published_offset),
-      index_file_(dir, base_offset, state) {
+                 SegmentState state, const SegmentConfig &config)
+    : state_(state), log_fd_(-1),
+      index_file_(dir, base_offset, state,
+                  max_size > std::numeric_limits<uint32_t>::max(),
+                  *config.storage),
+      dir_(dir), published_offset_(published_offset), published_size_(0),
+      max_size_(max_size), base_offset_(base_offset), config_(config),
+      map_(nullptr), map_size_(0) {
     init();
+    initTailCache();
+}
+
+void Segment::initTailCache() {
+    // sealed segments are never appended to, a full cache of a small segment
+    // only needs the segment size (plus the record going over it)
+    if (state_ != SegmentState::Active || config_.tail_cache_size == 0)
+        return;
+    tail_cache_ = std::make_unique<TailCache>(
+        std::min<uint64_t>(config_.tail_cache_size, 2 * max_size_));
+}
+
+/*
+    Sealed segments do not change anymore, so they can be mapped once and
+    read with plain loads. The mapping is created lazily, most sealed segments
+    are never read again after catching up.
+*/
+const uint8_t *Segment::mapping() const {
+    if (!config_.mmap_sealed || state_ != SegmentState::Sealed)
+        return nullptr;
+    const uint8_t *map = map_.load(std::memory_order_acquire);
+    if (map != nullptr)
+        return map;
+    std::lock_guard lock(map_mutex_);
+    map = map_.load(std::memory_order_relaxed);
+    if (map != nullptr)
+        return map;
+    uint64_t size = published_size_.load(std::memory_order_acquire);
+    if (size == 0)
+        return nullptr;
+    void *mrc = mmap(NULL, size, PROT_READ, MAP_SHARED, log_fd_, 0);
+    if (mrc == MAP_FAILED)
+        throw std::runtime_error("Failure of mmap.");
+    // consumers read segments front to back
+    madvise(mrc, size, MADV_SEQUENTIAL);
+    map_size_ = size;
+    map = static_cast<const uint8_t *>(mrc);
+    map_.store(map, std::memory_order_release);
+    return map;
+}
+
+const uint8_t *Segment::mappedRange(uint64_t file_position,
+                                    size_t length) const {
+    const uint8_t *map = mapping();
+    if (map == nullptr || file_position + length > map_size_)
+        return nullptr;
+    return map + file_position;
+}
+
+void Segment::loadRange(uint64_t file_position, size_t length) const {
+    if (config_.load_range)
+        config_.load_range(file_position, length);
+}
+
+uint32_t Segment::recordLength(uint64_t file_position) const {
+    loadRange(file_position, SEGMENT_HEADER_SIZE);
+    const uint8_t *map = mapping();
+    if (map == nullptr)
+        return recordHeaderLen(read_u32_le(log_fd_, file_position));
+    if (file_position + SEGMENT_HEADER_SIZE > map_size_)
+        throw std::runtime_error("tried to read past segment file boundary.");
+    uint32_t len;
+    std::memcpy(&len, map + file_position, SEGMENT_HEADER_SIZE);
+    if (is_big_endian())
+        len = byteswap32(len);
+    return recordHeaderLen(len);
+}
+
+std::filesystem::path Segment::filePath(const std::filesystem::path &dir,
+                                        uint64_t base_offset) {
+    auto filename = std::to_string(base_offset) + ".log";
+    std::string filler(68 - filename.size(), '0');
+    return dir / (filler + filename);
 }
 
 void Segment::init() {
     // maybe check if published offset < base offset and throw exception if true
-    auto filename = std::to_string(base_offset_) + ".log";
-    std::string filler(68 - filename.size(), '0');
-    filename = filler + filename;
-    std::filesystem::create_directories(dir_);
-    auto log_file = dir_ / filename;
+    config_.storage->createDirectories(dir_);
+    auto log_file = filePath(dir_, base_offset_);
     mode_t mode;
     int flags, rc;
     if (state_ == SegmentState::Active) {
         flags = O_RDWR | O_CREAT;
         mode = 0644;
-    } else if (state_ == SegmentState::Sealed) {
+    } else {
         flags = O_RDONLY;
         mode = 0;
     }
     do {
-        log_fd_ = open(log_file.c_str(), flags, mode);
+        log_fd_ = config_.storage->open(log_file, flags, mode);
     } while (log_fd_ == -1 && errno == EINTR);
 
     if (log_fd_ == -1)
@@ -166,11 +214,14 @@ void Segment::init() {
 }
 
 Segment::~Segment() {
-    if (log_fd_ != 1)
+    const uint8_t *map = map_.load(std::memory_order_acquire);
+    if (map != nullptr)
+        munmap(const_cast<uint8_t *>(map), map_size_);
+    if (log_fd_ != -1)
         ::close(log_fd_);
 }
 
-SegmentReadResult Segment::read(uint64_t offset, size_t max_bytes) const {
+void Segment::checkReadArguments(uint64_t offset, size_t max_bytes) const {
     if (offset < base_offset_) {
         std::stringstream msg;
         msg << "offset smaller than base offset, offset = " << offset
@@ -183,24 +234,23 @@ SegmentReadResult Segment::read(uint64_t offset, size_t max_bytes) const {
         msg << "max bytes exceeds numerical limits, max bytes = " << max_bytes;
         throw std::runtime_error(msg.str());
     }
+}
 
-    // use acquire semantics to ensure synchronization with append
-    uint64_t current_offset = offset,
-             pub_offset = published_offset_.load(std::memory_order_acquire);
-    uint64_t pub_size = published_size_.load(std::memory_order_acquire);
-
-    if (offset > pub_offset || pub_size == 0)
-        return {}; // May need to be changed if I want to use sendfile() in the
-                   // future
-
-    SegmentReadResult result;
+uint64_t
+Segment::startFilePosition(uint64_t offset, uint64_t pub_size,
+                           std::optional<uint64_t> file_position) const {
     /*
         len: 32 bits
         checksum: 32 bits (once we include it)
         payload: variable length
     */
-    const uint32_t offset_file_position =
-        determineFilePosition(offset, pub_size);
+    uint64_t offset_file_position;
+    if (file_position.has_value())
+        offset_file_position = file_position.value();
+    else if (auto entry = index_file_.entryOf(offset))
+        offset_file_position = entry->file_position;
+    else
+        offset_file_position = determineFilePosition(offset, pub_size);
     if (offset_file_position > pub_size) {
         std::stringstream msg;
         msg << "offset file pos beyond published size, offset file pos "
@@ -208,61 +258,103 @@ SegmentReadResult Segment::read(uint64_t offset, size_t max_bytes) const {
             << ", base offset = " << base_offset_ << ", offset = " << offset;
         throw std::runtime_error(msg.str());
     }
+    return offset_file_position;
+}
 
-    size_t len;
-    if (pub_size - offset_file_position > max_bytes) {
-        uint64_t current_offset = pub_offset;
-        IndexFileEntry entry;
-        do {
-            auto entry_opt = index_file_.determineClosestIndex(current_offset);
-            if (entry_opt.has_value()) {
-                entry = entry_opt.value();
-                current_offset = entry.offset - 1;
-            } else {
-                entry.offset = offset;
-                entry.file_position = offset_file_position;
-            }
-        } while ((entry.file_position > offset_file_position) &&
-                 (entry.file_position - offset_file_position > max_bytes));
-
-        uint32_t next_file_position =
-                     determineFilePosition(entry.offset + 1, pub_size),
-                 current_file_position = entry.file_position;
-        current_offset = entry.offset;
-        while (next_file_position - offset_file_position < max_bytes) {
-            ++current_offset;
-            current_file_position = next_file_position;
-            next_file_position =
-                determineFilePosition(current_offset + 1, pub_size, entry);
-        }
-        len = current_file_position - offset_file_position;
-        // read does not include current_offset
-        result.last_read_offset = current_offset - 1;
-    } else {
-        // read until published EOF, put published offset might lag behind
-        // published size, therefore we must increase last_read_offset so that
-        // it corresponds to the last written offset inside the published size
-        len = pub_size - offset_file_position;
-        result.last_read_offset = pub_offset;
-        uint32_t record_len,
-            current_file_pos = determineFilePosition(pub_offset, pub_size);
-        record_len = read_u32_le(log_fd_, current_file_pos);
-        uint32_t next_file_pos =
-            current_file_pos + record_len + sizeof(record_len);
-        while (next_file_pos < pub_size) {
-            ++result.last_read_offset;
-            current_file_pos = next_file_pos;
-            record_len = read_u32_le(log_fd_, current_file_pos);
-            next_file_pos = current_file_pos + record_len + SEGMENT_HEADER_SIZE;
-        }
+/*
+    The end is found in the index instead of the data: the last entry at or
+    before start + max_bytes is the first record that does not fit (or ends
+    exactly there). Index entries are published before the
+    size, so every record inside the published size can be found. An
+    end_offset inside the segment moves the end of the range to the position
+    of that record.
+    The offset and the size are loaded one after the other, while the writer
+    publishes the size first, so the size may already include records after
+    the published offset. The end is therefore never taken from the size
+    alone: it is the position of the record after the last one that may be
+    read, min(published offset + 1, end_offset). Only if that record is not
+    in the index yet, the size cannot be ahead of the offset and is the end.
+    Either way the range ends with the record before that one. The start and
+    the end are entries at known positions of the index, so a plan searches
+    the index only if max_bytes cuts the range short.
+*/
+SegmentReadPlan Segment::plan(uint64_t offset, size_t max_bytes,
+                              std::optional<uint64_t> file_position,
+                              uint64_t end_offset) const {
+    checkReadArguments(offset, max_bytes);
+
+    uint64_t pub_offset = published_offset_.load(std::memory_order_acquire);
+    uint64_t pub_size = published_size_.load(std::memory_order_acquire);
+
+    if (offset > pub_offset || pub_size == 0 || offset >= end_offset)
+        return {
+            .last_read_offset = offset - 1, .file_position = 0, .length = 0};
+    if (tail_cache_) {
+        auto plan = tail_cache_->plan(offset, max_bytes,
+                                      std::min(pub_offset, end_offset - 1));
+        if (plan.has_value())
+            return plan.value();
     }
+    const uint64_t start = startFilePosition(offset, pub_size, file_position);
+    const uint64_t bound = std::min(pub_offset + 1, end_offset);
+    uint64_t end;
+    if (auto bound_entry = index_file_.entryOf(bound))
+        end = bound_entry->file_position;
+    else if (bound <= pub_offset)
+        end = determineFilePosition(bound, pub_size);
+    else
+        end = pub_size;
+    if (end <= start)
+        return {.last_read_offset = offset - 1,
+                .file_position = start,
+                .length = 0};
 
+    if (end - start <= max_bytes) {
+        loadRange(start, end - start);
+        return {.last_read_offset = bound - 1,
+                .file_position = start,
+                .length = end - start};
+    }
+    auto next = index_file_.findByFilePosition(start + max_bytes);
+    if (!next.has_value() || next->offset <= offset)
+        return {.last_read_offset = offset - 1,
+                .file_position = start,
+                .length = 0};
+    // the range may be sent from the file or the mapping directly
+    loadRange(start, next->file_position - start);
+    return {.last_read_offset = next->offset - 1,
+            .file_position = start,
+            .length = next->file_position - start};
+}
+
+size_t Segment::recordSize(uint64_t offset) const {
+    checkReadArguments(offset, 0);
+    uint64_t pub_offset = published_offset_.load(std::memory_order_acquire);
+    uint64_t pub_size = published_size_.load(std::memory_order_acquire);
+    if (offset > pub_offset || pub_size == 0)
+        return 0;
+    uint64_t file_position = startFilePosition(offset, pub_size, std::nullopt);
+    return SEGMENT_HEADER_SIZE + recordLength(file_position);
+}
+
+void Segment::readRange(uint64_t file_position, size_t length,
+                        uint8_t *dest) const {
+    // the tail cache may have dropped the range in the meantime, the file
+    // has the same bytes
+    if (tail_cache_ && tail_cache_->copy(file_position, length, dest))
+        return;
+    loadRange(file_position, length);
+    const uint8_t *map = mappedRange(file_position, length);
+    if (map != nullptr) {
+        std::memcpy(dest, map, length);
+        return;
+    }
     // use pread for thread safety
-    result.result_buf.resize(len);
-    size_t curr_read, bytes_read = 0;
-    while (bytes_read < len) {
-        curr_read = pread(log_fd_, result.result_buf.data() + bytes_read,
-                          len - bytes_read, offset_file_position + bytes_read);
+    ssize_t curr_read;
+    size_t bytes_read = 0;
+    while (bytes_read < length) {
+        curr_read = pread(log_fd_, dest + bytes_read, length - bytes_read,
+                          file_position + bytes_read);
         if (curr_read < 0) {
             if (errno == EINTR)
                 continue;
@@ -272,58 +364,94 @@ SegmentReadResult Segment::read(uint64_t offset, size_t max_bytes) const {
             break;
         bytes_read += curr_read;
     }
-    if (bytes_read < len)
+    if (bytes_read < length)
         throw std::ios_base::failure("Failed to read offset from log file.");
-    return result;
 }
 
-uint64_t Segment::append(const uint8_t *data, uint32_t len) {
-    // Write to log files, maybe need to handle write errors
-    off_t pos = lseek(log_fd_, 0, SEEK_CUR);
-    // lseek might fail, check error and reopen file if necessary or throw
-    // exception
-
-    if (pos > static_cast<off_t>(std::numeric_limits<uint32_t>::max())) {
-        throw std::overflow_error("File position does not fit in uint32_t.");
-    }
+uint64_t Segment::append(const uint8_t *data, uint32_t len,
+                         uint8_t attributes) {
+    RecordSlice record{data, len, attributes};
+    return append(std::span<const RecordSlice>(&record, 1), false, nullptr);
+}
 
-    if (!write_u32_le(log_fd_, len))
-        throw std::ios_base::failure("Failed to write length to log file.");
+uint64_t Segment::append(std::span<const RecordSlice> records, bool sync,
+                         IoUring *ring,
+                         std::shared_ptr<const RecordChunk> *chunk) {
+    if (records.empty())
+        throw std::logic_error("Cannot append empty batch to segment.");
+    /*
+        Writes go to the published size instead of the fd offset, so that
+        appending after recovery does not depend on where the file offset was
+        left. Only the writer thread appends, therefore nobody else can change
+        the size in between.
+    */
+    uint64_t pos = published_size_.load(std::memory_order_acquire);
+    uint64_t offset;
+    if (pos == 0)
+        offset = base_offset_;
+    else
+        offset = published_offset_.load(std::memory_order_acquire) + 1;
 
-    uint64_t curr_write, bytes_written = 0;
-    while (bytes_written < len) {
-        curr_write = write(log_fd_, data, len - bytes_written);
-        if (curr_write < 0) {
-            if (errno == EINTR)
-                continue;
-            break;
+    std::vector<IndexFileEntry> index_entries(records.size());
+    uint64_t size = pos;
+    // positions beyond 4 GiB are rejected by compact indexes when staged
+    for (size_t i = 0; i < records.size(); ++i) {
+        index_entries[i].offset = offset + i;
+        index_entries[i].file_position = size;
+        if (records[i].len > RECORD_LEN_MASK)
+            throw std::invalid_argument("Record is too large.");
+        size += SEGMENT_HEADER_SIZE + records[i].len;
+    }
+    /*
+        With a tail cache the records are copied once into a chunk in the on
+        disk format, which is then written as a whole and kept by the cache
+        (and the fan out buffer). Without one they are gathered from where
+        they are.
+    */
+    std::shared_ptr<const RecordChunk> cached;
+    std::vector<uint32_t> lengths;
+    std::vector<iovec> iov;
+    if (tail_cache_) {
+        cached = makeRecordChunk(offset, records);
+        iov.push_back({const_cast<uint8_t *>(cached->bytes.data()),
+                       cached->bytes.size()});
+    } else {
+        lengths.resize(records.size());
+        iov.reserve(2 * records.size());
+        for (size_t i = 0; i < records.size(); ++i) {
+            lengths[i] = recordHeader(records[i].len, records[i].attributes);
+            if (is_big_endian())
+                lengths[i] = byteswap32(lengths[i]);
+            iov.push_back({&lengths[i], SEGMENT_HEADER_SIZE});
+            iov.push_back(
+                {const_cast<uint8_t *>(records[i].data), records[i].len});
         }
-        if (curr_write == 0)
-            break;
-        bytes_written += curr_write;
-        data += curr_write;
     }
 
-    if (bytes_written < len)
-        throw std::ios_base::failure("Failed to write data to log file.");
+    IoBatch batch;
+    batch.write(log_fd_, iov, pos);
+    index_file_.stage(batch, index_entries);
+    if (sync) {
+        batch.fsync(log_fd_);
+        index_file_.flush(batch);
+    }
+    batch.execute(ring);
 
-    // Increase published offset in thread safe way and write to index file
-    uint64_t offset;
-    if (published_size_.load(std::memory_order_acquire) == 0) {
-        offset = base_offset_;
-    } else
-        offset = published_offset_.load(std::memory_order_acquire) + 1;
-    uint64_t new_size = published_size_.fetch_add(
-        bytes_written + SEGMENT_HEADER_SIZE, std::memory_order_release);
-    published_offset_.store(offset, std::memory_order_release);
-    IndexFileEntry index_data;
-    index_data.offset = offset;
-    index_data.file_position = static_cast<uint32_t>(pos);
-    index_file_.append(index_data);
+    // fill the cache before publishing, so readers of the new records find
+    // them there
+    if (cached) {
+        tail_cache_->append(pos, cached);
+        if (chunk != nullptr)
+            *chunk = std::move(cached);
+    }
+    index_file_.publish(index_entries);
+    published_size_.store(size, std::memory_order_release);
+    published_offset_.store(offset + records.size() - 1,
+                            std::memory_order_release);
     return offset;
 }
 
-uint32_t Segment::determineFilePosition(uint64_t offset,
+uint64_t Segment::determineFilePosition(uint64_t offset,
                                         uint64_t file_size) const {
     auto entry_opt = index_file_.determineClosestIndex(offset);
     if (entry_opt.has_value()) {
@@ -333,14 +461,14 @@ uint32_t Segment::determineFilePosition(uint64_t offset,
     return determineFilePosition(offset, file_size, {base_offset_, 0});
 }
 
-uint32_t Segment::determineFilePosition(uint64_t offset, uint64_t file_size,
+uint64_t Segment::determineFilePosition(uint64_t offset, uint64_t file_size,
                                         const IndexFileEntry &entry) const {
     uint64_t current_offset = entry.offset;
-    uint32_t record_len, current_file_pos = entry.file_position;
+    uint32_t record_len;
+    uint64_t current_file_pos = entry.file_position;
     while (current_offset < offset && current_file_pos < file_size) {
         ++current_offset;
-        size_t curr_read, bytes_read = 0;
-        record_len = read_u32_le(log_fd_, current_file_pos);
+        record_len = recordLength(current_file_pos);
         current_file_pos += record_len + SEGMENT_HEADER_SIZE;
         if (current_file_pos > file_size) {
             throw std::runtime_error(
@@ -350,26 +478,55 @@ uint32_t Segment::determineFilePosition(uint64_t offset, uint64_t file_size,
     return current_file_pos;
 }
 
+/*
+    Index files start with a header of 8 bytes, the magic "KLIX" and the
+    version as a little endian u32 with the high bit set. The entries that
+    follow have 8 bytes: the offset relative to the base offset of the segment
+    and the file position, both little endian u32, so they are aligned in the
+    mapping and twice as many fit into a cache line as before.
+    Version 0 files have no header and 12 byte entries with the absolute 64 bit
+    offset. They start with the offset of the first record, whose high bit is
+    never set, so the two cannot be confused. Version 0 is only read, for
+    sealed segments written by older brokers.
+    Version 2 is version 1 plus a search tree: after the sorted entries the
+    finalized index has the same entries in Eytzinger order (node k at k,
+    its children at 2k and 2k + 1, slot 0 unused). The header is rewritten
+    only after the tree has been synced, so a version 2 header always comes
+    with a complete tree.
+    Version 3 is for segments larger than 4 GiB, whose positions do not fit
+    into the high half. Its entries have 16 bytes, the relative offset and
+    the file position as little endian u64. They are searched with a plain
+    binary search like version 0 and get no tree: large segments have few
+    records per byte of log, so their indexes are comparatively small.
+*/
+static constexpr char INDEX_MAGIC[4] = {'K', 'L', 'I', 'X'};
+static constexpr uint32_t INDEX_VERSION = 0x80000001;
+static constexpr uint32_t INDEX_VERSION_TREE = 0x80000002;
+static constexpr uint32_t INDEX_VERSION_WIDE = 0x80000003;
+
 Index::Index(const std::filesystem::path &dir, uint64_t base_offset,
-             SegmentState state)
-    : dir_(dir), published_size_(0), fd_(-1), state_(state),
+             SegmentState state, bool wide_positions,
+             StorageBackend &storage)
+    : state_(state), dir_(dir), base_offset_(base_offset),
+      mmap_base_offset_(nullptr), map_size_(0), search_tree_(nullptr),
+      fd_(-1),
+      header_size_(INDEX_HEADER_SIZE),
+      entry_size_(wide_positions ? INDEX_WIDE_ENTRY_SIZE : INDEX_ENTRY_SIZE),
+      published_size_(0),
       last_written_offset_(std::numeric_limits<uint64_t>::max()) {
-    auto filename = std::to_string(base_offset) + ".index";
-    std::string filler(70 - filename.size(), '0');
-    filename = filler + filename;
-    std::filesystem::create_directories(dir);
-    std::filesystem::path index_file = dir_ / filename;
+    storage.createDirectories(dir);
+    std::filesystem::path index_file = filePath(dir_, base_offset);
     mode_t mode;
     int flags;
     if (state_ == SegmentState::Active) {
         flags = O_RDWR | O_CREAT;
         mode = 0644;
-    } else if (state_ == SegmentState::Sealed) {
+    } else {
         flags = O_RDONLY;
         mode = 0;
     }
     do {
-        fd_ = open(index_file.c_str(), flags, mode);
+        fd_ = storage.open(index_file, flags, mode);
     } while (fd_ == -1 && errno == EINTR);
 
     if (fd_ == -1) {
@@ -386,161 +543,333 @@ Index::Index(const std::filesystem::path &dir, uint64_t base_offset,
         } while (rc == -1 && errno == EINTR);
         if (rc == -1)
             throw std::runtime_error("Failure of fstat.");
-        void *mrc = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
-        if (mrc == MAP_FAILED)
-            throw ::std::runtime_error("Failure of mmap.");
-        mmap_base_offset_ = reinterpret_cast<const char *>(mrc);
-        published_size_.store(st.st_size, std::memory_order_release);
+        if (st.st_size > 0) {
+            void *mrc = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (mrc == MAP_FAILED)
+                throw ::std::runtime_error("Failure of mmap.");
+            mmap_base_offset_ = reinterpret_cast<const char *>(mrc);
+            map_size_ = st.st_size;
+        }
+        readHeader(st.st_size);
         close(fd_);
-    } else
+        fd_ = -1;
+    } else {
+        writeHeader(wide_positions ? INDEX_VERSION_WIDE : INDEX_VERSION);
         published_size_.store(0, std::memory_order_release);
+    }
 }
 
-Index::~Index() {
-    if (state_ == SegmentState::Sealed) {
-        size_t size = published_size_.load(std::memory_order_acquire);
-        munmap(const_cast<char *>(mmap_base_offset_), size);
+void Index::writeHeader(uint32_t version) {
+    std::vector<uint8_t> header(INDEX_HEADER_SIZE);
+    if (byteswap::is_big_endian())
+        version = byteswap::byteswap32(version);
+    std::memcpy(header.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    std::memcpy(header.data() + sizeof(INDEX_MAGIC), &version,
+                sizeof(version));
+    IoBatch batch;
+    batch.write(fd_, {{header.data(), header.size()}}, 0);
+    batch.execute(nullptr);
+}
+
+void Index::readHeader(uint64_t file_size) {
+    if (file_size >= INDEX_HEADER_SIZE &&
+        std::memcmp(mmap_base_offset_, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0) {
+        uint32_t version;
+        std::memcpy(&version, mmap_base_offset_ + sizeof(INDEX_MAGIC),
+                    sizeof(version));
+        if (byteswap::is_big_endian())
+            version = byteswap::byteswap32(version);
+        if (version == INDEX_VERSION) {
+            published_size_.store(file_size - header_size_,
+                                  std::memory_order_release);
+            return;
+        }
+        if (version == INDEX_VERSION_TREE) {
+            // sorted entries, then the tree with one more slot
+            uint64_t size = file_size - header_size_ - INDEX_ENTRY_SIZE;
+            if (size % (2 * INDEX_ENTRY_SIZE) != 0)
+                throw std::runtime_error("Index search tree is incomplete.");
+            published_size_.store(size / 2, std::memory_order_release);
+            search_tree_ = mmap_base_offset_ + header_size_ + size / 2;
+            return;
+        }
+        if (version == INDEX_VERSION_WIDE) {
+            if ((file_size - header_size_) % INDEX_WIDE_ENTRY_SIZE != 0)
+                throw std::runtime_error("Index entry is incomplete.");
+            entry_size_ = INDEX_WIDE_ENTRY_SIZE;
+            published_size_.store(file_size - header_size_,
+                                  std::memory_order_release);
+            return;
+        }
+        if (version & 0x80000000)
+            throw std::runtime_error("Unsupported index file version.");
     }
+    if (file_size % INDEX_V0_ENTRY_SIZE != 0)
+        throw std::runtime_error("Unknown index file format.");
+    header_size_ = 0;
+    entry_size_ = INDEX_V0_ENTRY_SIZE;
+    published_size_.store(file_size, std::memory_order_release);
+}
+
+std::filesystem::path Index::filePath(const std::filesystem::path &dir,
+                                      uint64_t base_offset) {
+    auto filename = std::to_string(base_offset) + ".index";
+    std::string filler(70 - filename.size(), '0');
+    return dir / (filler + filename);
+}
+
+Index::~Index() {
+    if (mmap_base_offset_ != nullptr)
+        munmap(const_cast<char *>(mmap_base_offset_), map_size_);
     if (fd_ != -1)
         close(fd_);
 }
 
+uint64_t Index::entries() const {
+    return published_size_.load(std::memory_order_acquire) / entry_size_;
+}
+
 std::optional<IndexFileEntry>
 Index::determineClosestIndex(uint64_t offset) const {
-    uint64_t file_size = published_size_.load(std::memory_order_acquire);
-    if (file_size == 0)
+    uint64_t count = entries();
+    if (count == 0)
         return std::nullopt;
-    if (state_ == SegmentState::Active)
-        return binarySearch(offset, fd_, file_size);
-    return binarySearch(offset, mmap_base_offset_, file_size);
+    if (entry_size_ != INDEX_ENTRY_SIZE) {
+        // last entry with an offset <= offset, the first one if there is none
+        uint64_t L = 0, R = count;
+        while (L < R) {
+            uint64_t M = L + (R - L) / 2;
+            if (entryAt(M).offset <= offset)
+                L = M + 1;
+            else
+                R = M;
+        }
+        return entryAt(L == 0 ? 0 : L - 1);
+    }
+    // the offset is made relative once, offsets are in the low half
+    if (offset < base_offset_)
+        return entryAt(0);
+    uint32_t key = std::min<uint64_t>(offset - base_offset_,
+                                      std::numeric_limits<uint32_t>::max());
+    auto entry = search_tree_ != nullptr ? searchTree(key, 0)
+                                         : searchSorted(key, 0);
+    if (entry.has_value())
+        return entry;
+    return entryAt(0);
 }
 
-void Index::append(const IndexFileEntry &data) {
+/*
+    Sorted version 1 entries, mapped for sealed indexes and in memory for
+    active ones. The writer appends to the entries in memory, so readers of
+    an active index search them under the shared lock.
+*/
+std::optional<IndexFileEntry> Index::searchSorted(uint32_t key,
+                                                  unsigned int shift) const {
+    auto search = [this, key, shift](const char *entries, uint64_t count)
+        -> std::optional<IndexFileEntry> {
+        uint64_t n = searchEntries(entries, count, key, shift);
+        if (n == 0)
+            return std::nullopt;
+        uint64_t raw;
+        std::memcpy(&raw, entries + (n - 1) * INDEX_ENTRY_SIZE, sizeof(raw));
+        if (byteswap::is_big_endian())
+            raw = byteswap::byteswap64(raw);
+        return decode(raw);
+    };
     if (state_ == SegmentState::Sealed)
-        throw std::runtime_error("Cannot write to sealed index.");
-    if (data.offset < last_written_offset_ &&
-        last_written_offset_ != std::numeric_limits<uint64_t>::max())
-        throw std::runtime_error(
-            "Tried to write smaller offset than published to index.");
-    if (!write_u64_le(fd_, data.offset))
-        throw std::ios_base::failure("Failed to write offset to index file.");
-    uint64_t value = data.offset;
-    if (byteswap::is_big_endian())
-        value = byteswap::byteswap64(value);
-    if (!write_u32_le(fd_, data.file_position))
-        throw std::ios_base::failure(
-            "Failed to write file position to index file.");
-    uint32_t fpos_index = data.file_position;
-    /*
-      In binary search we do a byteswap and for active segments we search data_,
-      therefore do a byteswap here as well
-    */
-    if (byteswap::is_big_endian())
-        fpos_index = byteswap::byteswap32(fpos_index);
-    last_written_offset_ = data.offset;
-    uint64_t size =
-        published_size_.fetch_add(INDEX_ENTRY_SIZE, std::memory_order_release);
-}
-
-IndexFileEntry Index::binarySearch(uint64_t offset, const char *buf,
-                                   uint64_t file_size) const {
-    // Entries have 12 bytes, 8 for the offset and 4 for the file position
-    IndexFileEntry entry{0, 0};
-    uint64_t current_offset = 0, L_pos = 0,
-             R_pos = file_size - INDEX_ENTRY_SIZE,
-             diff = file_size / INDEX_ENTRY_SIZE - 1;
-    const char *L = buf;
-    const char *R = L + file_size - INDEX_ENTRY_SIZE;
-
-    // Check if the offset we are seeking is indexed at the start or end
-    std::memcpy(&current_offset, L, OFFSET_SIZE);
-    if (byteswap::is_big_endian())
-        current_offset = byteswap::byteswap64(current_offset);
-    if (current_offset == offset) {
-        entry.offset = current_offset;
-        std::memcpy(&entry.file_position, L + OFFSET_SIZE,
-                    sizeof(entry.file_position));
+        return search(mmap_base_offset_ + header_size_, entries());
+    std::shared_lock lock(entries_mutex_);
+    return search(reinterpret_cast<const char *>(active_entries_.data()),
+                  active_entries_.size());
+}
+
+/*
+    The nodes three levels below k are the 8 entries from 8k on, one cache
+    line which is prefetched while k is compared. The loop has no branch that
+    depends on the data: every step appends a bit (1 for going right) to k,
+    and the last node we went right from is the result.
+*/
+std::optional<IndexFileEntry> Index::searchTree(uint32_t key,
+                                                unsigned int shift) const {
+    uint64_t count = entries(), k = 1;
+    while (k <= count) {
+#if defined(__GNUC__)
+        __builtin_prefetch(search_tree_ + 8 * k * INDEX_ENTRY_SIZE);
+#endif
+        uint64_t raw;
+        std::memcpy(&raw, search_tree_ + k * INDEX_ENTRY_SIZE, sizeof(raw));
         if (byteswap::is_big_endian())
-            entry.file_position = byteswap::byteswap32(entry.file_position);
-        return entry;
+            raw = byteswap::byteswap64(raw);
+        k = 2 * k + (static_cast<uint32_t>(raw >> shift) <= key);
     }
-
-    std::memcpy(&current_offset, R, sizeof(current_offset));
+    // drop the trailing left turns and the last right turn
+    k >>= std::countr_zero(k) + 1;
+    if (k == 0)
+        return std::nullopt;
+    uint64_t raw;
+    std::memcpy(&raw, search_tree_ + k * INDEX_ENTRY_SIZE, sizeof(raw));
     if (byteswap::is_big_endian())
-        current_offset = byteswap::byteswap64(current_offset);
-    if (current_offset == offset) {
-        entry.offset = current_offset;
-        std::memcpy(&entry.file_position, R + OFFSET_SIZE,
-                    sizeof(entry.file_position));
-        if (byteswap::is_big_endian())
-            entry.file_position = byteswap::byteswap32(entry.file_position);
-        return entry;
+        raw = byteswap::byteswap64(raw);
+    return decode(raw);
+}
+
+// every record has an entry, the one of offset is at offset - base offset
+std::optional<IndexFileEntry> Index::entryOf(uint64_t offset) const {
+    if (offset < base_offset_ || offset - base_offset_ >= entries())
+        return std::nullopt;
+    auto entry = entryAt(offset - base_offset_);
+    if (entry.offset != offset)
+        return std::nullopt;
+    return entry;
+}
+
+std::optional<IndexFileEntry>
+Index::findByFilePosition(uint64_t file_position) const {
+    if (entry_size_ != INDEX_ENTRY_SIZE) {
+        // file positions grow with the offsets, the entries are sorted by both
+        uint64_t L = 0, R = entries();
+        while (L < R) {
+            uint64_t M = L + (R - L) / 2;
+            if (entryAt(M).file_position <= file_position)
+                L = M + 1;
+            else
+                R = M;
+        }
+        if (L == 0)
+            return std::nullopt;
+        return entryAt(L - 1);
     }
+    uint32_t key = std::min<uint64_t>(file_position,
+                                      std::numeric_limits<uint32_t>::max());
+    if (search_tree_ != nullptr)
+        return searchTree(key, 32);
+    return searchSorted(key, 32);
+}
 
-    // If not, do binary search
-    const char *M;
-    while (L < R) {
-        M = L + INDEX_ENTRY_SIZE * (diff / 2 + 1);
-        std::memcpy(&current_offset, M, sizeof(current_offset));
-        if (byteswap::is_big_endian())
-            current_offset = byteswap::byteswap64(current_offset);
-        if (current_offset <= offset) {
-            L = M;
-            diff -= (diff / 2 + 1);
+IndexFileEntry Index::entryAt(uint64_t i) const {
+    uint64_t pos = header_size_ + i * entry_size_;
+    IndexFileEntry entry;
+    if (entry_size_ == INDEX_V0_ENTRY_SIZE) {
+        // version 0 positions are u32, file_position is wider
+        uint32_t file_position;
+        std::memcpy(&entry.offset, mmap_base_offset_ + pos, OFFSET_SIZE);
+        std::memcpy(&file_position, mmap_base_offset_ + pos + OFFSET_SIZE,
+                    FILE_POS_INDEX_SIZE);
+        if (byteswap::is_big_endian()) {
+            entry.offset = byteswap::byteswap64(entry.offset);
+            file_position = byteswap::byteswap32(file_position);
+        }
+        entry.file_position = file_position;
+        return entry;
+    }
+    if (entry_size_ == INDEX_WIDE_ENTRY_SIZE) {
+        uint64_t raw[2];
+        if (state_ == SegmentState::Active) {
+            std::shared_lock lock(entries_mutex_);
+            raw[0] = active_entries_[2 * i];
+            raw[1] = active_entries_[2 * i + 1];
         } else {
-            R = M - INDEX_ENTRY_SIZE;
-            diff /= 2;
+            std::memcpy(raw, mmap_base_offset_ + pos, sizeof(raw));
+        }
+        if (byteswap::is_big_endian()) {
+            raw[0] = byteswap::byteswap64(raw[0]);
+            raw[1] = byteswap::byteswap64(raw[1]);
         }
+        return {.offset = base_offset_ + raw[0], .file_position = raw[1]};
     }
-
-    std::memcpy(&entry.offset, L, sizeof(entry.offset));
-    std::memcpy(&entry.file_position, L + OFFSET_SIZE, FILE_POS_INDEX_SIZE);
-    if (byteswap::is_big_endian()) {
-        entry.offset = byteswap::byteswap64(entry.offset);
-        entry.file_position = byteswap::byteswap32(entry.file_position);
+    uint64_t raw;
+    if (state_ == SegmentState::Active) {
+        std::shared_lock lock(entries_mutex_);
+        raw = active_entries_[i];
+    } else {
+        std::memcpy(&raw, mmap_base_offset_ + pos, sizeof(raw));
     }
-    return entry;
+    if (byteswap::is_big_endian())
+        raw = byteswap::byteswap64(raw);
+    return decode(raw);
 }
 
-IndexFileEntry Index::binarySearch(uint64_t offset, int fd,
-                                   uint64_t file_size) const {
-    // Entries have 12 bytes, 8 for the offset and 4 for the file position
-    IndexFileEntry entry{0, 0};
-    uint64_t current_offset = 0, L = 0, R = L + file_size - INDEX_ENTRY_SIZE,
-             diff = file_size / INDEX_ENTRY_SIZE - 1;
+// relative offset in the low, file position in the high half
+IndexFileEntry Index::decode(uint64_t raw) const {
+    return {.offset = base_offset_ + static_cast<uint32_t>(raw),
+            .file_position = static_cast<uint32_t>(raw >> 32)};
+}
 
-    // Check if the offset we are seeking is indexed at the start or end
-    current_offset = read_u64_le(fd, 0);
-    if (current_offset == offset) {
-        entry.offset = current_offset;
-        entry.file_position = read_u32_le(fd, sizeof(current_offset));
-        return entry;
+// as stored in the file, i.e. little endian
+void Index::encode(const IndexFileEntry &entry, uint64_t *raw) const {
+    if (entry_size_ == INDEX_WIDE_ENTRY_SIZE) {
+        raw[0] = entry.offset - base_offset_;
+        raw[1] = entry.file_position;
+        if (byteswap::is_big_endian()) {
+            raw[0] = byteswap::byteswap64(raw[0]);
+            raw[1] = byteswap::byteswap64(raw[1]);
+        }
+        return;
     }
+    if (entry.file_position > std::numeric_limits<uint32_t>::max())
+        throw std::overflow_error("File position does not fit in uint32_t.");
+    raw[0] = entry.file_position << 32 |
+             static_cast<uint32_t>(entry.offset - base_offset_);
+    if (byteswap::is_big_endian())
+        raw[0] = byteswap::byteswap64(raw[0]);
+}
 
-    current_offset = read_u64_le(fd, R);
-    if (current_offset == offset) {
-        entry.offset = current_offset;
-        entry.file_position = read_u32_le(fd, R + OFFSET_SIZE);
-        return entry;
+void Index::append(const IndexFileEntry &data) {
+    IoBatch batch;
+    std::span<const IndexFileEntry> entries(&data, 1);
+    stage(batch, entries);
+    batch.execute(nullptr);
+    publish(entries);
+}
+
+void Index::stage(IoBatch &batch,
+                  std::span<const IndexFileEntry> entries) const {
+    if (state_ == SegmentState::Sealed)
+        throw std::runtime_error("Cannot write to sealed index.");
+    uint64_t last_offset = last_written_offset_;
+    std::vector<uint8_t> buf(entries.size() * entry_size_);
+    uint8_t *entry_buf = buf.data();
+    for (const auto &entry : entries) {
+        if (entry.offset < last_offset &&
+            last_offset != std::numeric_limits<uint64_t>::max())
+            throw std::runtime_error(
+                "Tried to write smaller offset than published to index.");
+        if (entry.offset < base_offset_ ||
+            entry.offset - base_offset_ > std::numeric_limits<uint32_t>::max())
+            throw std::overflow_error("Offset is out of range of the index.");
+        last_offset = entry.offset;
+        uint64_t raw[2];
+        encode(entry, raw);
+        std::memcpy(entry_buf, raw, entry_size_);
+        entry_buf += entry_size_;
     }
+    size_t len = buf.size();
+    const uint8_t *data = batch.own(std::move(buf));
+    batch.write(fd_, {{const_cast<uint8_t *>(data), len}},
+                header_size_ + published_size_.load(std::memory_order_acquire));
+}
 
-    // If not, do binary search
-    uint64_t M;
-    while (L < R) {
-        M = L + INDEX_ENTRY_SIZE * (diff / 2 + 1);
-        current_offset = read_u64_le(fd, M);
-        if (current_offset <= offset) {
-            L = M;
-            diff -= (diff / 2 + 1);
-        } else {
-            R = M - INDEX_ENTRY_SIZE;
-            diff /= 2;
+void Index::publish(std::span<const IndexFileEntry> entries) {
+    if (entries.empty())
+        return;
+    last_written_offset_ = entries.back().offset;
+    {
+        std::unique_lock lock(entries_mutex_);
+        uint64_t words = entry_size_ / sizeof(uint64_t);
+        for (const auto &entry : entries) {
+            uint64_t raw[2];
+            encode(entry, raw);
+            active_entries_.insert(active_entries_.end(), raw, raw + words);
         }
     }
+    published_size_.fetch_add(entries.size() * entry_size_,
+                              std::memory_order_release);
+}
 
-    entry.offset = read_u64_le(fd, L);
-    entry.file_position = read_u32_le(fd, L + OFFSET_SIZE);
-    return entry;
+TailCacheStats Segment::tailCacheStats() const {
+    if (!tail_cache_)
+        return {0, 0};
+    return tail_cache_->stats();
 }
 
 bool Segment::isFull() const {
@@ -548,19 +877,81 @@ bool Segment::isFull() const {
     return (size >= max_size_);
 }
 
+bool Segment::isComplete() const {
+    uint64_t size = published_size_.load(std::memory_order_acquire);
+    if (size == 0)
+        return false;
+    uint64_t pub_offset = published_offset_.load(std::memory_order_acquire);
+    if (index_file_.entries() != pub_offset - base_offset_ + 1)
+        return false;
+    auto last = index_file_.findByFilePosition(size - 1);
+    if (!last || last->offset != pub_offset ||
+        last->file_position + SEGMENT_HEADER_SIZE > size)
+        return false;
+    return last->file_position + SEGMENT_HEADER_SIZE +
+               recordLength(last->file_position) ==
+           size;
+}
+
+void Segment::finalizeIndex() { index_file_.finalize(); }
+
 void Segment::seal() {
     state_ = SegmentState::Sealed;
     index_file_.seal();
 }
 
+// in order walk of the tree, which visits the sorted entries one by one
+static void fillTree(const std::vector<uint64_t> &sorted,
+                     std::vector<uint64_t> &tree, uint64_t &next, uint64_t k) {
+    if (k >= tree.size())
+        return;
+    fillTree(sorted, tree, next, 2 * k);
+    tree[k] = sorted[next++];
+    fillTree(sorted, tree, next, 2 * k + 1);
+}
+
+void Index::finalize() {
+    if (state_ == SegmentState::Sealed)
+        throw std::runtime_error("Cannot finalize sealed index.");
+    // wide indexes are searched without a tree
+    if (entry_size_ == INDEX_WIDE_ENTRY_SIZE)
+        return;
+    uint64_t size = published_size_.load(std::memory_order_acquire);
+    // entries are permuted as a whole, no need to decode them
+    std::vector<uint64_t> tree(size / INDEX_ENTRY_SIZE + 1, 0);
+    {
+        std::shared_lock lock(entries_mutex_);
+        uint64_t next = 0;
+        fillTree(active_entries_, tree, next, 1);
+    }
+
+    IoBatch batch;
+    batch.write(fd_,
+                {{tree.data(), tree.size() * INDEX_ENTRY_SIZE}},
+                header_size_ + size);
+    batch.fsync(fd_);
+    batch.execute(nullptr);
+    writeHeader(INDEX_VERSION_TREE);
+    flush();
+}
+
 void Index::seal() {
+    finalize();
     state_ = SegmentState::Sealed;
-    auto size = published_size_.load();
+    uint64_t entries_size = published_size_.load();
+    bool tree = entry_size_ == INDEX_ENTRY_SIZE;
+    auto size = header_size_ + entries_size;
+    if (tree)
+        size += entries_size + INDEX_ENTRY_SIZE;
     void *mrc = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd_, 0);
     if (mrc == MAP_FAILED)
         throw ::std::runtime_error("Failure of mmap.");
     mmap_base_offset_ = reinterpret_cast<const char *>(mrc);
+    map_size_ = size;
+    if (tree)
+        search_tree_ = mmap_base_offset_ + header_size_ + entries_size;
     close(fd_);
+    fd_ = -1;
 }
 
 using crc32c_type =
@@ -578,23 +969,29 @@ RecoveryResult Segment::recover() {
     if (rc == -1)
         throw std::runtime_error("Failure of fstat.");
 
-    if (st.st_size == 0) {
+    const uint64_t file_size = st.st_size;
+    if (file_size == 0) {
         published_size_.store(0);
         published_offset_.store(base_offset_ - 1);
         return RecoveryResult::Truncated;
     }
 
-    uint32_t record_len = 0, curr_file_pos = 0;
-    size_t curr_read, bytes_read = 0;
+    uint32_t record_len = 0;
+    uint64_t curr_file_pos = 0;
+    ssize_t curr_read;
+    size_t bytes_read = 0;
     crc32c_type crc32;
     std::vector<uint8_t> record_payload;
-    while (curr_file_pos < st.st_size) {
+    while (curr_file_pos < file_size) {
         index_entry.offset = curr_offset;
         index_entry.file_position = curr_file_pos;
 
         // read record length
+        bytes_read = 0;
         while (bytes_read < sizeof(uint32_t)) {
-            curr_read = pread(log_fd_, &record_len + bytes_read,
+            curr_read = pread(log_fd_,
+                              reinterpret_cast<uint8_t *>(&record_len) +
+                                  bytes_read,
                               sizeof(uint32_t) - bytes_read,
                               curr_file_pos + bytes_read);
             if (curr_read < 0) {
@@ -607,7 +1004,7 @@ RecoveryResult Segment::recover() {
             bytes_read += curr_read;
         }
         if (bytes_read < sizeof(uint32_t)) {
-            if (curr_file_pos + bytes_read >= st.st_size) {
+            if (curr_file_pos + bytes_read >= file_size) {
                 truncate = true;
                 break;
             }
@@ -615,13 +1012,20 @@ RecoveryResult Segment::recover() {
                 "Failed to read record length from log file.");
         }
         if (byteswap::is_big_endian())
-            byteswap::byteswap32(record_len);
+            record_len = byteswap::byteswap32(record_len);
+        record_len = recordHeaderLen(record_len);
+        if (record_len < sizeof(uint32_t)) {
+            truncate = true;
+            break;
+        }
 
         // read record checksum
         uint32_t read_checksum;
         bytes_read = 0;
         while (bytes_read < sizeof(uint32_t)) {
-            curr_read = pread(log_fd_, &read_checksum + bytes_read,
+            curr_read = pread(log_fd_,
+                              reinterpret_cast<uint8_t *>(&read_checksum) +
+                                  bytes_read,
                               sizeof(uint32_t) - bytes_read,
                               curr_file_pos + sizeof(uint32_t) + bytes_read);
             if (curr_read < 0) {
@@ -634,7 +1038,7 @@ RecoveryResult Segment::recover() {
             bytes_read += curr_read;
         }
         if (bytes_read < sizeof(uint32_t)) {
-            if (curr_file_pos + bytes_read + sizeof(uint32_t) >= st.st_size) {
+            if (curr_file_pos + bytes_read + sizeof(uint32_t) >= file_size) {
                 truncate = true;
                 break;
             }
@@ -642,7 +1046,7 @@ RecoveryResult Segment::recover() {
                 "Failed to read record checksum from log file.");
         }
         if (byteswap::is_big_endian())
-            byteswap::byteswap32(read_checksum);
+            read_checksum = byteswap::byteswap32(read_checksum);
 
         // read record payload
         record_payload.resize(record_len - sizeof(uint32_t));
@@ -664,7 +1068,7 @@ RecoveryResult Segment::recover() {
         }
         if (bytes_read < record_len - sizeof(uint32_t)) {
             if (curr_file_pos + bytes_read + 2 * sizeof(uint32_t) >=
-                st.st_size) {
+                file_size) {
                 truncate = true;
                 break;
             }
@@ -711,6 +1115,8 @@ void Segment::flush() {
     index_file_.flush();
 }
 
+void Index::flush(IoBatch &batch) const { batch.fsync(fd_); }
+
 void Index::flush() {
     int rc;
     do {
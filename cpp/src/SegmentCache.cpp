@@ -0,0 +1,72 @@
+#include "../include/SegmentCache.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace kafka_lite {
+namespace broker {
+
+SegmentCache::SegmentCache(size_t capacity)
+    : capacity_(std::max<size_t>(capacity, 1)) {}
+
+std::shared_ptr<Segment> SegmentCache::get(uint64_t base_offset,
+                                           const OpenFn &open) {
+    {
+        std::lock_guard lock(mutex_);
+        auto it = entries_.find(base_offset);
+        if (it != entries_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return *it->second;
+        }
+    }
+    // opening takes a few syscalls, do not block other readers meanwhile
+    auto segment = open();
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(base_offset);
+    if (it != entries_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return *it->second;
+    }
+    insertLocked(segment);
+    return segment;
+}
+
+void SegmentCache::insert(std::shared_ptr<Segment> segment) {
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(segment->getBaseOffset());
+    if (it != entries_.end()) {
+        lru_.erase(it->second);
+        entries_.erase(it);
+    }
+    insertLocked(std::move(segment));
+}
+
+void SegmentCache::erase(uint64_t base_offset) {
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(base_offset);
+    if (it == entries_.end())
+        return;
+    lru_.erase(it->second);
+    entries_.erase(it);
+}
+
+void SegmentCache::insertLocked(std::shared_ptr<Segment> segment) {
+    uint64_t base_offset = segment->getBaseOffset();
+    lru_.push_front(std::move(segment));
+    entries_[base_offset] = lru_.begin();
+    while (lru_.size() > capacity_) {
+        entries_.erase(lru_.back()->getBaseOffset());
+        lru_.pop_back();
+    }
+}
+
+size_t SegmentCache::size() const {
+    std::lock_guard lock(mutex_);
+    return lru_.size();
+}
+
+} // namespace broker
+} // namespace kafka_lite
@@ -0,0 +1,130 @@
+#include "../include/StorageBackend.h"
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+int FileBackend::open(const std::filesystem::path &path, int flags,
+                      mode_t mode) {
+    return ::open(path.c_str(), flags, mode);
+}
+
+bool FileBackend::exists(const std::filesystem::path &path) const {
+    return std::filesystem::exists(path);
+}
+
+void FileBackend::remove(const std::filesystem::path &path) {
+    std::filesystem::remove(path);
+}
+
+std::vector<std::string>
+FileBackend::list(const std::filesystem::path &dir) const {
+    std::vector<std::string> names;
+    for (const auto &entry : std::filesystem::directory_iterator(dir))
+        names.push_back(entry.path().filename());
+    return names;
+}
+
+void FileBackend::createDirectories(const std::filesystem::path &dir) {
+    std::filesystem::create_directories(dir);
+}
+
+const std::shared_ptr<StorageBackend> &fileStorage() {
+    static const std::shared_ptr<StorageBackend> storage =
+        std::make_shared<FileBackend>();
+    return storage;
+}
+
+MemoryBackend::MemoryBackend(uint64_t capacity) : capacity_(capacity) {}
+
+MemoryBackend::~MemoryBackend() {
+    for (const auto &[path, fd] : files_)
+        close(fd);
+}
+
+/*
+    Every open returns a duplicate of the descriptor of the file. Duplicates
+    share the file offset, which is fine since segments and indexes only use
+    positional reads and writes. The access mode of flags is not enforced and
+    there are no permissions, the mode is ignored.
+*/
+int MemoryBackend::open(const std::filesystem::path &path, int flags,
+                        mode_t) {
+    std::lock_guard lock(mutex_);
+    auto it = files_.find(path.lexically_normal());
+    if (it == files_.end()) {
+        if (!(flags & O_CREAT)) {
+            errno = ENOENT;
+            return -1;
+        }
+        int fd = memfd_create(path.filename().c_str(), MFD_CLOEXEC);
+        if (fd == -1)
+            return -1;
+        it = files_.emplace(path.lexically_normal(), fd).first;
+    } else if ((flags & O_CREAT) && (flags & O_EXCL)) {
+        errno = EEXIST;
+        return -1;
+    } else if ((flags & O_TRUNC) && ftruncate(it->second, 0) == -1) {
+        return -1;
+    }
+    return dup(it->second);
+}
+
+bool MemoryBackend::exists(const std::filesystem::path &path) const {
+    std::lock_guard lock(mutex_);
+    return files_.contains(path.lexically_normal());
+}
+
+void MemoryBackend::remove(const std::filesystem::path &path) {
+    std::lock_guard lock(mutex_);
+    auto it = files_.find(path.lexically_normal());
+    if (it == files_.end())
+        return;
+    close(it->second);
+    files_.erase(it);
+}
+
+std::vector<std::string>
+MemoryBackend::list(const std::filesystem::path &dir) const {
+    auto normal_dir = dir.lexically_normal();
+    // "dir/" names the same directory
+    if (!normal_dir.has_filename())
+        normal_dir = normal_dir.parent_path();
+    std::vector<std::string> names;
+    std::lock_guard lock(mutex_);
+    for (const auto &[path, fd] : files_) {
+        if (path.parent_path() == normal_dir)
+            names.push_back(path.filename());
+    }
+    return names;
+}
+
+bool MemoryBackend::full() const {
+    return capacity_ != 0 && usedBytes() > capacity_;
+}
+
+uint64_t MemoryBackend::usedBytes() const {
+    uint64_t used = 0;
+    std::lock_guard lock(mutex_);
+    for (const auto &[path, fd] : files_) {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            throw std::runtime_error("Failure of fstat.");
+        used += st.st_size;
+    }
+    return used;
+}
+
+} // namespace broker
+} // namespace kafka_lite
@@ -0,0 +1,125 @@
+#include "../include/TailCache.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+
+namespace kafka_lite {
+namespace broker {
+
+TailCache::TailCache(size_t capacity)
+    : capacity_(capacity), first_offset_(0), end_offset_(0), start_pos_(0),
+      end_pos_(0), hits_(0), misses_(0) {}
+
+void TailCache::append(uint64_t file_position,
+                       std::shared_ptr<const RecordChunk> chunk) {
+    if (capacity_ == 0 || chunk->record_positions.empty())
+        return;
+    std::unique_lock lock(mutex_);
+    // only contiguous records can be cached, start over otherwise
+    if (file_position != end_pos_ || chunk->first_offset != end_offset_) {
+        chunks_.clear();
+        first_offset_ = chunk->first_offset;
+        start_pos_ = file_position;
+    }
+    end_offset_ = chunk->first_offset + chunk->record_positions.size();
+    end_pos_ = file_position + chunk->bytes.size();
+    chunks_.push_back({file_position, std::move(chunk), 0});
+    /*
+        Records are dropped one by one, a chunk stays referenced as long as
+        one of its records is cached. A record larger than the capacity
+        empties the cache.
+    */
+    while (end_pos_ - start_pos_ > capacity_) {
+        auto &front = chunks_.front();
+        ++front.first;
+        ++first_offset_;
+        if (front.first == front.chunk->record_positions.size()) {
+            chunks_.pop_front();
+            start_pos_ = chunks_.empty() ? end_pos_
+                                         : chunks_.front().file_position;
+        } else {
+            start_pos_ = front.file_position +
+                         front.chunk->record_positions[front.first];
+        }
+    }
+}
+
+std::optional<SegmentReadPlan>
+TailCache::plan(uint64_t offset, size_t max_bytes,
+                uint64_t published_offset) const {
+    std::shared_lock lock(mutex_);
+    if (chunks_.empty() || offset < first_offset_ || offset >= end_offset_ ||
+        published_offset < offset) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+    // the first chunk that starts after offset, we need the one before
+    auto it = std::upper_bound(
+        chunks_.begin(), chunks_.end(), offset,
+        [](uint64_t offset, const CachedChunk &cached) {
+            return offset < cached.chunk->first_offset;
+        });
+    --it;
+    uint64_t begin =
+        it->file_position +
+        it->chunk->record_positions[offset - it->chunk->first_offset];
+    uint64_t end = begin, next = offset;
+    for (; it != chunks_.end(); ++it) {
+        const auto &positions = it->chunk->record_positions;
+        size_t i = next - it->chunk->first_offset;
+        for (; i < positions.size() && next <= published_offset; ++i) {
+            uint64_t record_end =
+                it->file_position + (i + 1 < positions.size()
+                                         ? positions[i + 1]
+                                         : it->chunk->bytes.size());
+            if (record_end - begin > max_bytes)
+                break;
+            end = record_end;
+            ++next;
+        }
+        if (i < positions.size())
+            break;
+    }
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return SegmentReadPlan{.last_read_offset = next - 1,
+                           .file_position = begin,
+                           .length = end - begin};
+}
+
+bool TailCache::copy(uint64_t file_position, size_t length,
+                     uint8_t *dest) const {
+    std::shared_lock lock(mutex_);
+    if (chunks_.empty() || file_position < start_pos_ ||
+        file_position + length > end_pos_)
+        return false;
+    auto it = std::upper_bound(
+        chunks_.begin(), chunks_.end(), file_position,
+        [](uint64_t position, const CachedChunk &cached) {
+            return position < cached.file_position;
+        });
+    --it;
+    while (length > 0) {
+        size_t pos = file_position - it->file_position;
+        size_t n = std::min(length, it->chunk->bytes.size() - pos);
+        std::memcpy(dest, it->chunk->bytes.data() + pos, n);
+        dest += n;
+        file_position += n;
+        length -= n;
+        ++it;
+    }
+    return true;
+}
+
+TailCacheStats TailCache::stats() const {
+    return {hits_.load(std::memory_order_relaxed),
+            misses_.load(std::memory_order_relaxed)};
+}
+
+} // namespace broker
+} // namespace kafka_lite
@@ -14,17 +14,27 @@ namespace broker {
 
 using namespace kafka_lite::byteswap;
 
+uint16_t appendFlags(CompressionCodec codec, AppendAcks acks, bool producer) {
+    return static_cast<uint16_t>(codec) |
+           static_cast<uint16_t>(acks) << APPEND_ACKS_SHIFT |
+           (producer ? APPEND_PRODUCER_FLAG : 0);
+}
+
 TcpHeaders::TcpHeaders(const uuid &correlation_id, uint8_t ptcl_version,
                        RequestType type, uint16_t flags)
     : correlation_id(correlation_id), protocol_version(ptcl_version),
       type(type), flags(flags), parse_error(ParseError::NO_ERROR) {}
 
 bool TcpHeaders::from_bytes(const std::vector<uint8_t> &bytes) {
-    if (bytes.size() < correlation_id.size() + 4) {
+    return from_bytes(bytes.data(), bytes.size());
+}
+
+bool TcpHeaders::from_bytes(const uint8_t *bytes, size_t size) {
+    if (size < correlation_id.size() + 4) {
         parse_error = ParseError::ERR_MISSING_CORRELATION_ID;
         return false;
     }
-    std::memcpy(correlation_id.begin(), bytes.data(), correlation_id.size());
+    std::memcpy(correlation_id.begin(), bytes, correlation_id.size());
     protocol_version = bytes[correlation_id.size()];
     if (protocol_version > PROTOCOL_VERSION) {
         parse_error = ParseError::ERR_UNSUPPORTED_VERSION;
@@ -37,6 +47,13 @@ bool TcpHeaders::from_bytes(const std::vector<uint8_t> &bytes) {
     case 1:
         type = RequestType::Fetch;
         break;
+    case 2:
+        type = RequestType::Subscribe;
+        break;
+    // 3 is kept for heartbeats
+    case 4:
+        type = RequestType::ReplicaSync;
+        break;
     default:
         parse_error = ParseError::ERR_UNKNOWN_TYPE;
         return false;
@@ -50,7 +67,14 @@ bool TcpHeaders::from_bytes(const std::vector<uint8_t> &bytes) {
         flag_bytes[1] = bytes[correlation_id.size() + 2];
     }
     std::memcpy(&flags, &flag_bytes, sizeof(flags));
-    if (flags != 0) {
+    uint16_t known_flags =
+        type == RequestType::Append
+            ? APPEND_CODEC_MASK | APPEND_ACKS_MASK | APPEND_PRODUCER_FLAG
+            : 0;
+    if ((flags & ~known_flags) != 0 ||
+        (flags & APPEND_CODEC_MASK) > MAX_COMPRESSION_CODEC ||
+        (flags & APPEND_ACKS_MASK) >> APPEND_ACKS_SHIFT >
+            static_cast<uint16_t>(AppendAcks::Durable)) {
         parse_error = ParseError::ERR_UNSUPPORTED_FLAGS;
         return false;
     }
@@ -74,6 +98,12 @@ std::vector<uint8_t> TcpHeaders::to_bytes() const {
     case RequestType::Fetch:
         type_byte = 1;
         break;
+    case RequestType::Subscribe:
+        type_byte = 2;
+        break;
+    case RequestType::ReplicaSync:
+        type_byte = 4;
+        break;
     }
     std::memcpy(bytes.data() + pos, &type_byte, sizeof(type_byte));
     pos += sizeof(type_byte);
@@ -89,24 +119,129 @@ std::vector<uint8_t> TcpHeaders::to_bytes() const {
     return bytes;
 }
 
-std::variant<AppendRequest, FetchRequest> TcpRequest::to_specialized_type() {
+std::variant<AppendRequest, FetchRequest, SubscribeRequest, ReplicaSyncRequest>
+TcpRequest::to_specialized_type() {
     switch (headers.type) {
     case RequestType::Append:
         return AppendRequest{.correlation_id = headers.correlation_id,
-                             .payload = payload};
-    case RequestType::Fetch:
+                             .payload = std::move(payload),
+                             .codec = static_cast<CompressionCodec>(
+                                 headers.flags & APPEND_CODEC_MASK),
+                             .acks = static_cast<AppendAcks>(
+                                 (headers.flags & APPEND_ACKS_MASK) >>
+                                 APPEND_ACKS_SHIFT),
+                             .producer =
+                                 (headers.flags & APPEND_PRODUCER_FLAG) != 0};
+    case RequestType::Fetch: {
         FetchRequest request{.correlation_id = headers.correlation_id,
                              .offset = 0,
-                             .max_bytes = 0};
+                             .max_bytes = 0,
+                             .min_bytes = 0,
+                             .max_wait_ms = 0,
+                             .session_id = 0};
         std::memcpy(&request.offset, payload.data(), sizeof(request.offset));
         std::memcpy(&request.max_bytes, payload.data() + sizeof(request.offset),
                     sizeof(request.max_bytes));
+        // older clients send only offset and max_bytes
+        if (payload.size() >= LONG_POLL_FETCH_PAYLOAD_LEN) {
+            std::memcpy(&request.min_bytes, payload.data() + FETCH_PAYLOAD_LEN,
+                        sizeof(request.min_bytes));
+            std::memcpy(&request.max_wait_ms,
+                        payload.data() + FETCH_PAYLOAD_LEN +
+                            sizeof(request.min_bytes),
+                        sizeof(request.max_wait_ms));
+        }
+        if (payload.size() >= SESSION_FETCH_PAYLOAD_LEN)
+            std::memcpy(&request.session_id,
+                        payload.data() + LONG_POLL_FETCH_PAYLOAD_LEN,
+                        sizeof(request.session_id));
         if (byteswap::is_big_endian()) {
             request.offset = byteswap::byteswap64(request.offset);
             request.max_bytes = byteswap32(request.max_bytes);
+            request.min_bytes = byteswap32(request.min_bytes);
+            request.max_wait_ms = byteswap32(request.max_wait_ms);
+            request.session_id = byteswap64(request.session_id);
         }
         return request;
     }
+    case RequestType::Subscribe: {
+        SubscribeRequest request{.correlation_id = headers.correlation_id,
+                                 .offset = 0,
+                                 .max_bytes = 0};
+        if (payload.size() < FETCH_PAYLOAD_LEN)
+            return request;
+        std::memcpy(&request.offset, payload.data(), sizeof(request.offset));
+        std::memcpy(&request.max_bytes, payload.data() + sizeof(request.offset),
+                    sizeof(request.max_bytes));
+        if (byteswap::is_big_endian()) {
+            request.offset = byteswap::byteswap64(request.offset);
+            request.max_bytes = byteswap32(request.max_bytes);
+        }
+        return request;
+    }
+    case RequestType::ReplicaSync: {
+        // replica id 0 is rejected by the server
+        ReplicaSyncRequest request{.correlation_id = headers.correlation_id,
+                                   .replica_id = 0,
+                                   .offset = 0,
+                                   .max_bytes = 0,
+                                   .max_wait_ms = 0};
+        if (payload.size() < REPLICA_SYNC_PAYLOAD_LEN)
+            return request;
+        size_t pos = 0;
+        std::memcpy(&request.replica_id, payload.data(),
+                    sizeof(request.replica_id));
+        pos += sizeof(request.replica_id);
+        std::memcpy(&request.offset, payload.data() + pos,
+                    sizeof(request.offset));
+        pos += sizeof(request.offset);
+        std::memcpy(&request.max_bytes, payload.data() + pos,
+                    sizeof(request.max_bytes));
+        pos += sizeof(request.max_bytes);
+        std::memcpy(&request.max_wait_ms, payload.data() + pos,
+                    sizeof(request.max_wait_ms));
+        if (byteswap::is_big_endian()) {
+            request.replica_id = byteswap64(request.replica_id);
+            request.offset = byteswap64(request.offset);
+            request.max_bytes = byteswap32(request.max_bytes);
+            request.max_wait_ms = byteswap32(request.max_wait_ms);
+        }
+        return request;
+    }
+    }
+    throw std::logic_error("Unknown request type.");
+}
+
+static uint32_t read_u32_be(const uint8_t *data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    if (!byteswap::is_big_endian())
+        value = byteswap32(value);
+    return value;
+}
+
+FrameStatus RequestFrame::parse(const uint8_t *data, size_t size,
+                                RequestFrame &frame) {
+    frame.frame_len = 0;
+    size_t pos = sizeof(uint32_t) + MAGIC_BYTES.size();
+    if (size < pos)
+        return FrameStatus::Incomplete;
+    if (std::memcmp(data + sizeof(uint32_t), MAGIC_BYTES.data(),
+                    MAGIC_BYTES.size()) != 0)
+        return FrameStatus::Invalid;
+    frame.header_len = read_u32_be(data);
+    if (frame.header_len > MAX_REQUEST_HEADER_LEN)
+        return FrameStatus::Invalid;
+    frame.header_pos = pos;
+    pos += frame.header_len;
+    if (size < pos + sizeof(uint32_t))
+        return FrameStatus::Incomplete;
+    frame.payload_len = read_u32_be(data + pos);
+    frame.payload_pos = pos + sizeof(uint32_t);
+    frame.frame_len = frame.payload_pos + frame.payload_len;
+    if (size < frame.frame_len)
+        return FrameStatus::Incomplete;
+    return FrameStatus::Complete;
 }
 
 std::vector<uint8_t> TcpRequest::make_payload(uint64_t offset,
@@ -121,11 +256,85 @@ std::vector<uint8_t> TcpRequest::make_payload(uint64_t offset,
     return payload;
 }
 
+std::vector<uint8_t> TcpRequest::make_payload(uint64_t offset,
+                                              uint32_t max_bytes,
+                                              uint32_t min_bytes,
+                                              uint32_t max_wait_ms) {
+    auto payload = make_payload(offset, max_bytes);
+    payload.resize(LONG_POLL_FETCH_PAYLOAD_LEN);
+    if (byteswap::is_big_endian()) {
+        min_bytes = byteswap32(min_bytes);
+        max_wait_ms = byteswap32(max_wait_ms);
+    }
+    std::memcpy(payload.data() + FETCH_PAYLOAD_LEN, &min_bytes,
+                sizeof(min_bytes));
+    std::memcpy(payload.data() + FETCH_PAYLOAD_LEN + sizeof(min_bytes),
+                &max_wait_ms, sizeof(max_wait_ms));
+    return payload;
+}
+
+std::vector<uint8_t> TcpRequest::make_payload(uint64_t offset,
+                                              uint32_t max_bytes,
+                                              uint32_t min_bytes,
+                                              uint32_t max_wait_ms,
+                                              uint64_t session_id) {
+    auto payload = make_payload(offset, max_bytes, min_bytes, max_wait_ms);
+    payload.resize(SESSION_FETCH_PAYLOAD_LEN);
+    if (byteswap::is_big_endian())
+        session_id = byteswap64(session_id);
+    std::memcpy(payload.data() + LONG_POLL_FETCH_PAYLOAD_LEN, &session_id,
+                sizeof(session_id));
+    return payload;
+}
+
+std::vector<uint8_t>
+TcpRequest::make_replica_sync_payload(uint64_t replica_id, uint64_t offset,
+                                      uint32_t max_bytes,
+                                      uint32_t max_wait_ms) {
+    std::vector<uint8_t> payload(REPLICA_SYNC_PAYLOAD_LEN);
+    if (byteswap::is_big_endian()) {
+        replica_id = byteswap64(replica_id);
+        offset = byteswap64(offset);
+        max_bytes = byteswap32(max_bytes);
+        max_wait_ms = byteswap32(max_wait_ms);
+    }
+    size_t pos = 0;
+    std::memcpy(payload.data(), &replica_id, sizeof(replica_id));
+    pos += sizeof(replica_id);
+    std::memcpy(payload.data() + pos, &offset, sizeof(offset));
+    pos += sizeof(offset);
+    std::memcpy(payload.data() + pos, &max_bytes, sizeof(max_bytes));
+    pos += sizeof(max_bytes);
+    std::memcpy(payload.data() + pos, &max_wait_ms, sizeof(max_wait_ms));
+    return payload;
+}
+
+size_t TcpResponse::payload_size() const {
+    size_t size = payload.has_value() ? payload->size() : 0;
+    for (const auto &slice : payload_slices)
+        size += slice.size;
+    return size;
+}
+
 std::vector<uint8_t> TcpResponse::to_bytes() const {
-    uint32_t len = TCP_RESPONSE_HEADER_LEN;
+    auto prefix = prefix_to_bytes();
+    std::vector<uint8_t> bytes(prefix.begin(), prefix.end());
     if (payload.has_value())
-        len += payload.value().size();
-    std::vector<uint8_t> bytes(len + sizeof(len));
+        bytes.insert(bytes.end(), payload->begin(), payload->end());
+    for (const auto &slice : payload_slices)
+        bytes.insert(bytes.end(), slice.data, slice.data + slice.size);
+    return bytes;
+}
+
+/*
+    Everything in front of the payload. The network layer writes this
+    followed by the payload itself as one gather write, so that the payload is
+    never copied into a contiguous buffer.
+*/
+std::array<uint8_t, TCP_RESPONSE_PREFIX_LEN>
+TcpResponse::prefix_to_bytes() const {
+    std::array<uint8_t, TCP_RESPONSE_PREFIX_LEN> bytes;
+    uint32_t len = TCP_RESPONSE_HEADER_LEN + payload_size();
     if (!byteswap::is_big_endian())
         len = byteswap::byteswap32(len);
     std::memcpy(bytes.data(), &len, sizeof(len));
@@ -134,11 +343,6 @@ std::vector<uint8_t> TcpResponse::to_bytes() const {
                 correlation_id.size());
     pos += correlation_id.size();
     std::memcpy(bytes.data() + pos, &response_code, sizeof(response_code));
-    if (payload.has_value()) {
-        pos += sizeof(response_code);
-        std::memcpy(bytes.data() + pos, payload.value().data(),
-                    payload.value().size());
-    }
     return bytes;
 }
 
@@ -205,9 +409,19 @@ TcpResponse TcpResponse::makeResponse(const boost::uuids::uuid &correlation_id,
         else if (ec.value() ==
                  std::make_error_code(std::errc::io_error).value())
             response.response_code = 0x81;
+        else if (ec.value() ==
+                 std::make_error_code(std::errc::operation_not_permitted)
+                     .value())
+            response.response_code = 0x82;
         else if (ec.value() ==
                  std::make_error_code(std::errc::bad_message).value())
             response.response_code = 0x05;
+        else if (ec.value() ==
+                 std::make_error_code(std::errc::file_exists).value())
+            response.response_code = 0x06;
+        else if (ec.value() ==
+                 std::make_error_code(std::errc::result_out_of_range).value())
+            response.response_code = 0x07;
         else
             response.response_code = 0xFF;
         response.payload.reset();
@@ -222,7 +436,7 @@ TcpResponse TcpResponse::makeResponse(const boost::uuids::uuid &correlation_id,
 }
 
 TcpResponse TcpResponse::makeResponse(const boost::uuids::uuid &correlation_id,
-                                      const FetchResult &result,
+                                      FetchResult result,
                                       const std::error_code &ec) {
     TcpResponse response;
     response.correlation_id = correlation_id;
@@ -233,13 +447,39 @@ TcpResponse TcpResponse::makeResponse(const boost::uuids::uuid &correlation_id,
         else if (ec.value() ==
                  std::make_error_code(std::errc::io_error).value())
             response.response_code = 0x81;
+        else if (ec.value() ==
+                 std::make_error_code(std::errc::operation_not_permitted)
+                     .value())
+            response.response_code = 0x82;
         else
             response.response_code = 0xFF;
         response.payload.reset();
     } else {
         response.response_code = 0;
-        response.payload.emplace(result.result_buf);
+        response.payload.emplace(std::move(result.result_buf));
+        response.payload_slices = std::move(result.slices);
+    }
+    return response;
+}
+
+/*
+    The records follow the high watermark as slices, the buffer of the
+    result is moved into one instead of being copied behind it.
+*/
+TcpResponse TcpResponse::makeResponse(const boost::uuids::uuid &correlation_id,
+                                      uint64_t high_watermark,
+                                      FetchResult result,
+                                      const std::error_code &ec) {
+    if (ec)
+        return makeResponse(correlation_id, std::move(result), ec);
+    auto response = makeResponse(correlation_id, high_watermark, ec);
+    if (!result.result_buf.empty()) {
+        auto buf = std::make_shared<std::vector<uint8_t>>(
+            std::move(result.result_buf));
+        response.payload_slices.push_back({buf, buf->data(), buf->size()});
     }
+    response.payload_slices.insert(response.payload_slices.end(),
+                                   result.slices.begin(), result.slices.end());
     return response;
 }
 
@@ -1,13 +1,22 @@
 #include "../include/BrokerCore.h"
 #include "../include/BrokerServer.h"
+#include "../include/RemoteStore.h"
+#include "../include/StorageBackend.h"
 #include "boost/asio/io_context.hpp"
 #include "boost/asio/signal_set.hpp"
+#include <algorithm>
 #include <csignal>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <memory>
 #include <thread>
 #include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 using BrokerCoreIfc = kafka_lite::broker::BrokerCoreIfc;
 using BrokerCore = kafka_lite::broker::BrokerCore;
@@ -19,24 +28,133 @@ void print_exit_message(int sig) {
         std::cout << "received signal SIGTERM, shutting down..." << std::endl;
 }
 
-int main() {
+void pin_current_thread(unsigned int core) {
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(core % std::thread::hardware_concurrency(), &cpu_set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) !=
+        0)
+        std::cout << "failed to pin thread to core " << core << std::endl;
+#endif
+}
+
+/*
+    Usage: Broker [--shards N] [--io-uring] [--tail-cache BYTES]
+                  [--mmap-sealed] [--max-open-segments N]
+                  [--remote-dir DIR] [--local-retention BYTES]
+                  [--in-memory BYTES] [--port N] [--dir DIR]
+                  [--follow PORT] [--replica-id N]
+
+    Without --shards a single io_context is run by five threads. With
+    --shards N the broker runs N io_contexts, each with its own acceptor
+    (SO_REUSEPORT) and a single thread pinned to a core. --io-uring makes the
+    log submit its writes through io_uring if the kernel supports it.
+    --tail-cache sets the size of the in-memory cache of the most recent
+    records, 0 turns it off. --mmap-sealed reads sealed segments through
+    read-only mappings. --max-open-segments caps the number of sealed
+    segments kept open, the least recently used ones are closed.
+    --remote-dir turns on tiered storage with DIR as the remote store, sealed
+    segments are uploaded there and deleted locally once more than
+    --local-retention bytes of newer sealed segments are local.
+    --in-memory keeps the log in memory instead of files, e.g. to benchmark
+    the network and queue layers without the disk. Once the segments hold
+    more than BYTES the oldest are evicted, 0 keeps all of them.
+    --port sets the port to listen on, by default any free one. --dir is
+    where the log lives, BrokerDir in the working directory by default.
+    --follow makes the broker a follower of the leader on localhost:PORT, it
+    replicates the leader's log and rejects appends. --replica-id identifies
+    the follower to the leader, every follower needs its own.
+*/
+int main(int argc, char *argv[]) {
     // todo: make this configurable as well as no of threads
-    auto dir = std::filesystem::current_path() / "BrokerDir";
-    std::unique_ptr<BrokerCoreIfc> core =
-        std::make_unique<BrokerCore>(dir, 16 * 1024);
+    unsigned int shards = 0;
     unsigned int port = 0;
-    boost::asio::io_context io_context;
-    kafka_lite::broker::BrokerServer server(port, std ::move(core), io_context);
-    boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+    auto dir = std::filesystem::current_path() / "BrokerDir";
+    kafka_lite::broker::LogConfig log_config;
+    kafka_lite::broker::ReplicationConfig replication;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shards = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--io-uring") == 0) {
+            log_config.use_io_uring = true;
+        } else if (std::strcmp(argv[i], "--tail-cache") == 0 && i + 1 < argc) {
+            log_config.tail_cache_size = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--mmap-sealed") == 0) {
+            log_config.mmap_sealed_segments = true;
+        } else if (std::strcmp(argv[i], "--max-open-segments") == 0 &&
+                   i + 1 < argc) {
+            log_config.max_open_sealed_segments =
+                std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--remote-dir") == 0 && i + 1 < argc) {
+            log_config.remote_store =
+                std::make_shared<kafka_lite::broker::DirectoryRemoteStore>(
+                    argv[++i]);
+        } else if (std::strcmp(argv[i], "--local-retention") == 0 &&
+                   i + 1 < argc) {
+            log_config.local_retention_bytes =
+                std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--in-memory") == 0 && i + 1 < argc) {
+            log_config.storage =
+                std::make_shared<kafka_lite::broker::MemoryBackend>(
+                    std::strtoull(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (std::strcmp(argv[i], "--follow") == 0 && i + 1 < argc) {
+            replication.leader_port = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--replica-id") == 0 && i + 1 < argc) {
+            replication.replica_id = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            std::cout << "usage: " << argv[0]
+                      << " [--shards N] [--io-uring] [--tail-cache BYTES]"
+                         " [--mmap-sealed] [--max-open-segments N]"
+                         " [--remote-dir DIR] [--local-retention BYTES]"
+                         " [--in-memory BYTES] [--port N] [--dir DIR]"
+                         " [--follow PORT] [--replica-id N]"
+                      << std::endl;
+            return 1;
+        }
+    }
+    std::unique_ptr<BrokerCoreIfc> core = std::make_unique<BrokerCore>(
+        dir, 16 * 1024, log_config, replication);
+
+    std::vector<std::unique_ptr<boost::asio::io_context>> io_contexts;
+    std::vector<boost::asio::io_context *> io_context_ptrs;
+    for (unsigned int i = 0; i < std::max(shards, 1u); ++i) {
+        // every shard is run by exactly one thread
+        if (shards > 0)
+            io_contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        else
+            io_contexts.push_back(std::make_unique<boost::asio::io_context>());
+        io_context_ptrs.push_back(io_contexts.back().get());
+    }
+    kafka_lite::broker::BrokerServer server(port, std ::move(core),
+                                            io_context_ptrs);
+    boost::asio::signal_set signals(*io_contexts.front(), SIGINT, SIGTERM);
     signals.async_wait([&](const boost::system::error_code &, int sig) {
         print_exit_message(sig);
-        io_context.stop();
+        for (auto &io_context : io_contexts)
+            io_context->stop();
     });
     std::vector<std::thread> threads;
-    for (unsigned int i = 0; i < 4; ++i) {
-        threads.push_back(std::thread([&]() { io_context.run(); }));
+    if (shards > 0) {
+        for (unsigned int i = 1; i < shards; ++i) {
+            auto &io_context = *io_contexts[i];
+            threads.push_back(std::thread([&io_context, i]() {
+                pin_current_thread(i);
+                io_context.run();
+            }));
+        }
+        pin_current_thread(0);
+    } else {
+        for (unsigned int i = 0; i < 4; ++i) {
+            threads.push_back(
+                std::thread([&]() { io_contexts.front()->run(); }));
+        }
     }
-    io_context.run();
+    io_contexts.front()->run();
     for (auto &thread : threads) {
         if (thread.joinable())
             thread.join();
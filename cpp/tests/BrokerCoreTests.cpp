@@ -1,13 +1,23 @@
 #include "../include/BrokerCore.h"
+#include "../include/FanOutBuffer.h"
+#include "../include/FetchCoalescer.h"
 #include "../include/RecordManager.h"
+#include "../include/RemoteStore.h"
+#include "../include/Replication.h"
 #include "gtest/gtest.h"
 #include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <filesystem>
+#include <future>
 #include <gtest/gtest.h>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <span>
+#include <stdexcept>
+#include <string>
 #include <system_error>
 #include <thread>
 #include <utility>
@@ -18,6 +28,14 @@ namespace broker {
 
 using namespace std::chrono_literals;
 
+// coalesced fetches carry their bytes in slices
+static std::vector<uint8_t> payload_bytes(const FetchResult &result) {
+    std::vector<uint8_t> bytes = result.result_buf;
+    for (const auto &slice : result.slices)
+        bytes.insert(bytes.end(), slice.data, slice.data + slice.size);
+    return bytes;
+}
+
 struct AppendedRecord {
     uint64_t offset;
     Record record;
@@ -26,7 +44,7 @@ struct AppendedRecord {
 class TestMtAppender : public std::enable_shared_from_this<TestMtAppender> {
   public:
     TestMtAppender(std::unique_ptr<BrokerCore> &core)
-        : stopped_(false), core_(core) {}
+        : core_(core), stopped_(false) {}
     ~TestMtAppender() { stop(); }
     void stop() {
         if (!stopped_) {
@@ -91,8 +109,8 @@ class TestMtFetcher : public std::enable_shared_from_this<TestMtFetcher> {
   public:
     TestMtFetcher(std::unique_ptr<BrokerCore> &core, unsigned int no_of_threads,
                   unsigned int no_of_records)
-        : stopped_(false), no_of_threads_(no_of_threads),
-          no_of_records_(no_of_records), core_(core) {}
+        : no_of_threads_(no_of_threads), no_of_records_(no_of_records),
+          core_(core), stopped_(false) {}
     ~TestMtFetcher() { stop(); }
     void stop() {
         if (!stopped_.load()) {
@@ -150,7 +168,7 @@ void TestMtFetcher::fetch_loop() {
                     if (ec)
                         result_buf.clear();
                     else
-                        result_buf = result.result_buf;
+                        result_buf = payload_bytes(result);
                 });
             auto fetch_result = RecordManager::extract_records(result_buf);
             last_offset += fetch_result.size();
@@ -251,7 +269,7 @@ TEST_P(MtAppendStFetchTests, MtAppendReadResultAfter) {
     }
     std::vector<uint8_t> result_buf;
     core->submit_fetch({.offset = 0, .max_bytes = 1000000},
-                       [&](const FetchResult &result, std::error_code ec) {
+                       [&](const FetchResult &result, std::error_code) {
                            result_buf = result.result_buf;
                        });
     auto fetched_records = RecordManager::extract_records(result_buf);
@@ -303,6 +321,296 @@ TEST_P(MtAppendMtFetchTests, MtAppendMtFetchDuring) {
     core->stop();
 }
 
+class BrokerCoreLongPollTests : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        dir_ = std::filesystem::current_path() / "CoreLongPoll";
+        std::filesystem::remove_all(dir_);
+        core_ = std::make_unique<BrokerCore>(dir_, 2048);
+        core_->start();
+    }
+    void TearDown() override {
+        core_->stop();
+        std::filesystem::remove_all(dir_);
+    }
+    std::filesystem::path dir_;
+    std::unique_ptr<BrokerCore> core_;
+};
+
+TEST_F(BrokerCoreLongPollTests, WokenByAppend) {
+    std::promise<std::pair<FetchResult, std::error_code>> promise;
+    auto future = promise.get_future();
+    auto start = std::chrono::steady_clock::now();
+    core_->submit_fetch(
+        {.offset = 0, .max_bytes = 4096, .min_bytes = 1, .max_wait_ms = 5000},
+        [&](FetchResult result, std::error_code ec) {
+            promise.set_value({std::move(result), ec});
+        });
+    ASSERT_EQ(future.wait_for(50ms), std::future_status::timeout);
+    EXPECT_EQ(core_->parked_fetches(), 1);
+
+    auto record = RecordManager::create_record({1, 2, 3, 4});
+    core_->submit_append({.data = record.to_bytes(), .buffer_pool = nullptr},
+                         [](uint64_t, std::error_code) {});
+    ASSERT_EQ(future.wait_for(2s), std::future_status::ready);
+    auto [result, ec] = future.get();
+    EXPECT_FALSE(ec);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 5000ms);
+    auto records = RecordManager::extract_records(result.result_buf);
+    ASSERT_EQ(records.size(), 1);
+    EXPECT_EQ(records[0].payload, record.payload);
+    EXPECT_EQ(core_->parked_fetches(), 0);
+}
+
+TEST_F(BrokerCoreLongPollTests, Timeout) {
+    std::promise<std::pair<FetchResult, std::error_code>> promise;
+    auto future = promise.get_future();
+    auto start = std::chrono::steady_clock::now();
+    core_->submit_fetch(
+        {.offset = 0, .max_bytes = 4096, .min_bytes = 1, .max_wait_ms = 100},
+        [&](FetchResult result, std::error_code ec) {
+            promise.set_value({std::move(result), ec});
+        });
+    ASSERT_EQ(future.wait_for(2s), std::future_status::ready);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 100ms);
+    auto [result, ec] = future.get();
+    EXPECT_FALSE(ec);
+    EXPECT_TRUE(result.result_buf.empty());
+}
+
+TEST_F(BrokerCoreLongPollTests, StopAnswersParkedFetches) {
+    std::promise<std::error_code> promise;
+    auto future = promise.get_future();
+    core_->submit_fetch(
+        {.offset = 0, .max_bytes = 4096, .min_bytes = 1, .max_wait_ms = 60000},
+        [&](FetchResult, std::error_code ec) { promise.set_value(ec); });
+    core_->stop();
+    ASSERT_EQ(future.wait_for(2s), std::future_status::ready);
+    EXPECT_EQ(future.get(), std::make_error_code(std::errc::not_connected));
+}
+
+TEST_F(BrokerCoreLongPollTests, SubscriptionReadsOversizedRecordAlone) {
+    std::vector<uint8_t> large(100, 7);
+    std::promise<void> promise;
+    auto future = promise.get_future();
+    int pending = 2;
+    for (const auto &payload : {large, std::vector<uint8_t>{1}}) {
+        // the record behind a prefix, as the server passes it on
+        auto data = RecordManager::create_record(payload).to_bytes();
+        data.insert(data.begin(), {0, 0, 0, 0});
+        core_->submit_append(
+            {.data = std::move(data),
+             .record_offset = 4,
+             .buffer_pool = nullptr},
+            [&](uint64_t, std::error_code ec) {
+                EXPECT_FALSE(ec);
+                if (--pending == 0)
+                    promise.set_value();
+            });
+    }
+    ASSERT_EQ(future.wait_for(2s), std::future_status::ready);
+    FetchResult result;
+    std::error_code ec;
+    // the first record does not fit, it is read alone instead of nothing
+    EXPECT_EQ(core_->read_subscription(0, 16, result, ec), 1);
+    EXPECT_FALSE(ec);
+    auto records = RecordManager::extract_records(payload_bytes(result));
+    ASSERT_EQ(records.size(), 1);
+    EXPECT_EQ(records[0].payload, large);
+    result = {};
+    EXPECT_EQ(core_->read_subscription(1, 16, result, ec), 2);
+}
+
+// a store that cannot be reached
+class FailingRemoteStore : public DirectoryRemoteStore {
+  public:
+    using DirectoryRemoteStore::DirectoryRemoteStore;
+    void upload(const std::string &, const std::filesystem::path &) override {
+        throw std::runtime_error("Remote store is unreachable.");
+    }
+};
+
+TEST(BrokerCoreTieringTests, FailedRoundsAreCounted) {
+    auto dir = std::filesystem::current_path() / "CoreTieringErrors";
+    std::filesystem::remove_all(dir);
+    LogConfig config;
+    config.remote_store = std::make_shared<FailingRemoteStore>(dir / "Remote");
+    config.tiering_interval_ms = 10;
+    BrokerCore core(dir / "Log", 64, config);
+    core.start();
+    // small segments, so that there are sealed segments to upload
+    std::promise<void> promise;
+    auto future = promise.get_future();
+    std::atomic<int> pending = 20;
+    for (int i = 0; i < 20; ++i)
+        core.submit_append(
+            {.data = RecordManager::create_record({1, 2, 3, 4}).to_bytes(),
+             .buffer_pool = nullptr},
+            [&](uint64_t, std::error_code) {
+                if (--pending == 0)
+                    promise.set_value();
+            });
+    ASSERT_EQ(future.wait_for(2s), std::future_status::ready);
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (core.tiering_errors() < 2 &&
+           std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(10ms);
+    EXPECT_GE(core.tiering_errors(), 2);
+    core.stop();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(FetchCoalescerTests, ConcurrentFetchesShareOneRead) {
+    FetchCoalescer coalescer;
+    std::atomic<int> reads = 0;
+    auto read = [&](const FetchData &data) {
+        ++reads;
+        // keep the flight open until the other fetches joined it
+        while (coalescer.coalesced() < 3)
+            std::this_thread::sleep_for(1ms);
+        FetchResult result;
+        result.result_buf.assign(data.max_bytes, 7);
+        return result;
+    };
+    std::vector<std::future<FetchResult>> futures;
+    for (int i = 0; i < 4; ++i)
+        futures.push_back(std::async(std::launch::async, [&]() {
+            return coalescer.fetch({.offset = 5, .max_bytes = 16}, read);
+        }));
+    std::vector<FetchResult> results;
+    for (auto &future : futures)
+        results.push_back(future.get());
+    EXPECT_EQ(reads.load(), 1);
+    for (const auto &result : results) {
+        EXPECT_TRUE(result.result_buf.empty());
+        ASSERT_EQ(result.slices.size(), 1);
+        EXPECT_EQ(result.slices[0].data, results[0].slices[0].data);
+        EXPECT_EQ(payload_bytes(result), std::vector<uint8_t>(16, 7));
+    }
+    // the buffer lives as long as the last result
+    std::weak_ptr<const void> owner = results[0].slices[0].owner;
+    results.clear();
+    EXPECT_TRUE(owner.expired());
+
+    // a fetch without company keeps its own buffer, other keys do not wait
+    auto result = coalescer.fetch({.offset = 5, .max_bytes = 16},
+                                  [](const FetchData &) {
+                                      FetchResult result;
+                                      result.result_buf.assign(4, 1);
+                                      return result;
+                                  });
+    EXPECT_EQ(result.result_buf, std::vector<uint8_t>(4, 1));
+    EXPECT_TRUE(result.slices.empty());
+    EXPECT_EQ(coalescer.coalesced(), 3);
+}
+
+TEST(FetchCoalescerTests, ReadErrorReachesAllWaiters) {
+    FetchCoalescer coalescer;
+    auto read = [&](const FetchData &) -> FetchResult {
+        while (coalescer.coalesced() < 1)
+            std::this_thread::sleep_for(1ms);
+        throw std::runtime_error("read failed");
+    };
+    auto first = std::async(std::launch::async, [&]() {
+        return coalescer.fetch({.offset = 0, .max_bytes = 8}, read);
+    });
+    auto second = std::async(std::launch::async, [&]() {
+        return coalescer.fetch({.offset = 0, .max_bytes = 8}, read);
+    });
+    EXPECT_THROW(first.get(), std::runtime_error);
+    EXPECT_THROW(second.get(), std::runtime_error);
+}
+
+TEST(FanOutBufferTests, PublishRead) {
+    FanOutBuffer buffer(64);
+    std::atomic<int> notifications = 0;
+    auto id = buffer.addListener([&]() { ++notifications; });
+    std::vector<uint8_t> data{0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    std::vector<RecordSlice> records;
+    for (auto &byte : data)
+        records.push_back({&byte, 1});
+    std::vector<PayloadSlice> slices;
+    EXPECT_FALSE(buffer.read(0, 100, slices).has_value());
+
+    buffer.publish(0, std::span(records).first(4));
+    buffer.publish(4, std::span(records).subspan(4));
+    EXPECT_EQ(notifications.load(), 2);
+    // everything from offset 2 on, spread over both chunks
+    ASSERT_EQ(buffer.read(2, 100, slices), 10);
+    ASSERT_EQ(slices.size(), 2);
+    EXPECT_EQ(slices[0].size + slices[1].size, 8 * (SEGMENT_HEADER_SIZE + 1));
+    EXPECT_EQ(slices[0].data[SEGMENT_HEADER_SIZE], 2);
+    // at least one record, then only what fits
+    slices.clear();
+    ASSERT_EQ(buffer.read(5, 1, slices), 6);
+    slices.clear();
+    ASSERT_EQ(buffer.read(5, 2 * (SEGMENT_HEADER_SIZE + 1), slices), 7);
+    // nothing new at the tail
+    slices.clear();
+    ASSERT_EQ(buffer.read(10, 100, slices), 10);
+    EXPECT_TRUE(slices.empty());
+
+    // the first chunk is evicted once the buffer is over its limit
+    buffer.publish(10, std::span(records).first(4));
+    EXPECT_FALSE(buffer.read(0, 100, slices).has_value());
+    EXPECT_TRUE(buffer.read(4, 100, slices).has_value());
+    buffer.removeListener(id);
+    buffer.publish(14, std::span(records).first(1));
+    EXPECT_EQ(notifications.load(), 3);
+    // without listeners nothing is copied and the stale chunks are dropped
+    EXPECT_EQ(buffer.bufferedBytes(), 0);
+    slices.clear();
+    EXPECT_FALSE(buffer.read(10, 100, slices).has_value());
+}
+
+TEST(FanOutBufferTests, PublishSharedChunk) {
+    FanOutBuffer buffer(64);
+    auto id = buffer.addListener([]() {});
+    std::vector<uint8_t> data{0, 1, 2};
+    std::vector<RecordSlice> records;
+    for (auto &byte : data)
+        records.push_back({&byte, 1});
+    // e.g. the tail cache's chunk, subscribers read it without a copy
+    auto chunk = makeRecordChunk(0, records);
+    buffer.publish(chunk);
+    std::vector<PayloadSlice> slices;
+    ASSERT_EQ(buffer.read(1, 100, slices), 3);
+    ASSERT_EQ(slices.size(), 1);
+    EXPECT_EQ(slices[0].data, chunk->bytes.data() + SEGMENT_HEADER_SIZE + 1);
+    EXPECT_EQ(slices[0].size, 2 * (SEGMENT_HEADER_SIZE + 1));
+    buffer.removeListener(id);
+}
+
+TEST(ReplicaTrackerTests, HighWatermark) {
+    ReplicaTracker tracker(200ms);
+    // without followers the whole log is committed
+    EXPECT_EQ(tracker.highWatermark(10), 10);
+    EXPECT_EQ(tracker.inSyncReplicas(), 0);
+    // followers join once they have caught up with the high watermark
+    EXPECT_FALSE(tracker.update(1, 4, 12));
+    EXPECT_EQ(tracker.inSyncReplicas(), 0);
+    EXPECT_FALSE(tracker.update(1, 12, 12));
+    EXPECT_FALSE(tracker.update(2, 12, 12));
+    EXPECT_EQ(tracker.inSyncReplicas(), 2);
+    // the slowest in sync replica holds it back
+    EXPECT_EQ(tracker.highWatermark(20), 12);
+    EXPECT_FALSE(tracker.update(1, 20, 20));
+    EXPECT_TRUE(tracker.update(2, 18, 20));
+    EXPECT_EQ(tracker.highWatermark(20), 18);
+    // a follower that stops syncing leaves the in sync replicas
+    std::this_thread::sleep_for(100ms);
+    EXPECT_TRUE(tracker.update(2, 20, 20));
+    std::this_thread::sleep_for(150ms);
+    EXPECT_EQ(tracker.highWatermark(25), 20);
+    EXPECT_EQ(tracker.inSyncReplicas(), 1);
+    std::this_thread::sleep_for(100ms);
+    EXPECT_EQ(tracker.highWatermark(25), 25);
+    EXPECT_EQ(tracker.inSyncReplicas(), 0);
+    // and it never moves back
+    EXPECT_FALSE(tracker.update(3, 5, 25));
+    EXPECT_EQ(tracker.highWatermark(25), 25);
+}
+
 /* struct MtAppendStFetchParam {
     size_t record_len;
     unsigned int no_of_records, no_of_appending_threads;
@@ -1,24 +1,39 @@
 #include "../include/BrokerClient.h"
+#include "../include/BrokerCore.h"
 #include "../include/BrokerServer.h"
+#include "../include/BufferPool.h"
 #include "../include/ByteSwap.h"
 #include "../include/FakeBrokerCore.h"
 #include "../include/RecordManager.h"
+#include <atomic>
+#include <boost/asio/read.hpp>
 #include <boost/uuid/random_generator.hpp>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <filesystem>
 #include <gtest/gtest.h>
 #include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <vector>
 
 namespace kafka_lite {
 namespace broker {
 
+using namespace std::chrono_literals;
+
 class TestServer {
   public:
-    TestServer()
-        : server_(0, std::make_unique<FakeBrokerCore>(), io_context_) {}
+    TestServer(const BrokerServerConfig &config = {})
+        : server_(0, std::make_unique<FakeBrokerCore>(), io_context_,
+                  config) {}
+    TestServer(std::unique_ptr<BrokerCoreIfc> core,
+               const BrokerServerConfig &config = {})
+        : server_(0, std::move(core), io_context_, config) {}
     void start() {
         io_context_thread = std::thread([this]() { io_context_.run(); });
     };
@@ -27,6 +42,7 @@ class TestServer {
         io_context_thread.join();
     }
     unsigned int port() { return server_.port(); }
+    uint64_t acceptedConnections() { return server_.acceptedConnections(); }
 
   private:
     boost::asio::io_context io_context_;
@@ -34,6 +50,15 @@ class TestServer {
     std::thread io_context_thread;
 };
 
+static std::vector<Record> fetch_records(BrokerClient &client,
+                                         uint64_t offset) {
+    auto response = client.fetch(offset, 1 << 20);
+    EXPECT_EQ(response.response_code, 0);
+    if (response.response_code != 0 || !response.payload.has_value())
+        return {};
+    return RecordManager::extract_records(*response.payload);
+}
+
 class BrokerServerTests : public ::testing::Test {
   private:
   protected:
@@ -96,7 +121,7 @@ TEST_F(BrokerServerTests, AppendUnsupportedFlags) {
     payload = RecordManager::create_record(payload).to_bytes_with_len();
     boost::uuids::random_generator generator;
     auto correlation_id = generator();
-    TcpHeaders headers(correlation_id, 0, RequestType::Append, 1);
+    TcpHeaders headers(correlation_id, 0, RequestType::Append, 0x0100);
     TcpRequest request{.headers = headers, .payload = payload};
     auto response = client.send_raw_request(request);
     ASSERT_EQ(response.response_code, 4);
@@ -183,5 +208,552 @@ TEST_F(BrokerServerTests, AppendWrongChecksum) {
     ASSERT_FALSE(response.payload.has_value());
 }
 
+TEST_F(BrokerServerTests, AppendCompressedBatch) {
+    BrokerClient client(server_.port());
+    std::vector<std::vector<uint8_t>> payloads;
+    for (unsigned int i = 0; i < 50; ++i) {
+        std::string json = "{\"sensor\": \"temperature\", \"value\": " +
+                           std::to_string(i) + "}";
+        payloads.emplace_back(json.begin(), json.end());
+    }
+    auto response = client.append_batch(payloads, CompressionCodec::Lz);
+    ASSERT_EQ(response.response_code, 0);
+    response = client.append({1, 2, 3});
+    ASSERT_EQ(response.response_code, 0);
+
+    // the batch takes one offset and is fetched as it was sent
+    auto fetch_response = client.fetch(0, 4096);
+    ASSERT_EQ(fetch_response.response_code, 0);
+    auto records = RecordManager::extract_records(*fetch_response.payload);
+    ASSERT_EQ(records.size(), 2);
+    EXPECT_EQ(RecordManager::batch_codec(records[0].attributes),
+              CompressionCodec::Lz);
+    records = RecordManager::extract_all_records(*fetch_response.payload);
+    ASSERT_EQ(records.size(), 51);
+    for (unsigned int i = 0; i < 50; ++i) {
+        EXPECT_TRUE(RecordManager::check_integrity(records[i]));
+        EXPECT_EQ(records[i].payload, payloads[i]);
+    }
+
+    // the flags have to match the codec of the batch
+    boost::uuids::random_generator generator;
+    TcpHeaders headers(generator(), 0, RequestType::Append, 0);
+    TcpRequest request{
+        .headers = headers,
+        .payload = RecordManager::create_batch(payloads, CompressionCodec::Lz)
+                       .to_bytes_with_len()};
+    response = client.send_raw_request(request);
+    EXPECT_EQ(response.response_code, 0x5);
+}
+
+TEST_F(BrokerServerTests, AppendPlainRecordsThatLookLikeBatches) {
+    BrokerClient client(server_.port());
+    // payloads starting like the batch headers of older versions
+    std::vector<std::vector<uint8_t>> payloads = {
+        {'K', 'L', 'C', 'B', 0, 1, 2, 3, 4},
+        {'K', 'L', 'C', 'B', 1, 9, 0, 0, 0, 7},
+        {'K', 'L', 'P', 'B', 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+         15, 16, 17, 18}};
+    for (const auto &payload : payloads)
+        ASSERT_EQ(client.append(payload).response_code, 0);
+    // the plain "KLPB" record did not register a producer sequence
+    EXPECT_EQ(client.producer_append({{1}}, 0).response_code, 0);
+
+    auto records = RecordManager::extract_all_records(
+        client.fetch(0, 4096).payload.value_or({}));
+    ASSERT_EQ(records.size(), payloads.size() + 1);
+    for (size_t i = 0; i < payloads.size(); ++i) {
+        EXPECT_EQ(records[i].attributes, 0);
+        EXPECT_EQ(records[i].payload, payloads[i]);
+    }
+
+    // attributes in the length header that the flags do not have
+    auto batch = RecordManager::create_batch(payloads, CompressionCodec::Lz);
+    boost::uuids::random_generator generator;
+    TcpRequest request{
+        .headers = TcpHeaders(generator(), 0, RequestType::Append,
+                              appendFlags(CompressionCodec::Lz4,
+                                          AppendAcks::Leader)),
+        .payload = batch.to_bytes_with_len()};
+    EXPECT_EQ(client.send_raw_request(request).response_code, 0x5);
+
+    // a producer batch needs the producer flag
+    batch = RecordManager::create_batch(payloads, CompressionCodec::Lz,
+                                        {.producer_id = 1, .sequence = 0});
+    request.headers = TcpHeaders(
+        generator(), 0, RequestType::Append,
+        appendFlags(CompressionCodec::Lz, AppendAcks::Leader));
+    request.payload = batch.to_bytes_with_len();
+    EXPECT_EQ(client.send_raw_request(request).response_code, 0x5);
+}
+
+TEST_F(BrokerServerTests, AppendWithoutAcks) {
+    BrokerClient client(server_.port());
+    EXPECT_THROW(client.append({1}, AppendAcks::None), std::invalid_argument);
+    for (uint8_t i = 0; i < 10; ++i)
+        client.send_append({i}, AppendAcks::None);
+    // the first response on the connection is the one of the acked append
+    auto response = client.append({10});
+    ASSERT_EQ(response.response_code, 0);
+    uint64_t offset = -1;
+    std::memcpy(&offset, response.payload->data(), sizeof(offset));
+    if (!byteswap::is_big_endian())
+        offset = byteswap::byteswap64(offset);
+    EXPECT_EQ(offset, 10);
+    EXPECT_EQ(fetch_records(client, 0).size(), 11);
+}
+
+TEST_F(BrokerServerTests, ReuseConnection) {
+    BrokerClient client(server_.port());
+    for (uint8_t i = 0; i < 20; ++i) {
+        auto response = client.append({i, 2, 3, 4});
+        ASSERT_EQ(response.response_code, 0);
+    }
+    auto fetch_response = client.fetch(0, 4096);
+    ASSERT_EQ(fetch_response.response_code, 0);
+    ASSERT_TRUE(fetch_response.payload.has_value());
+    auto records = RecordManager::extract_records(*fetch_response.payload);
+    EXPECT_EQ(records.size(), 20);
+    EXPECT_EQ(server_.acceptedConnections(), 1);
+}
+
+TEST_F(BrokerServerTests, PipelinedRequests) {
+    BrokerClient client(server_.port());
+    std::vector<boost::uuids::uuid> correlation_ids;
+    for (uint8_t i = 0; i < 100; ++i)
+        correlation_ids.push_back(client.send_append({i, i, i}));
+    auto fetch_id = client.send_fetch(0, 1);
+    // collect the responses in reverse order to exercise the matching
+    auto fetch_response = client.receive(fetch_id);
+    EXPECT_EQ(fetch_response.correlation_id, fetch_id);
+    EXPECT_EQ(fetch_response.response_code, 0);
+    std::set<uint64_t> offsets;
+    for (auto it = correlation_ids.rbegin(); it != correlation_ids.rend();
+         ++it) {
+        auto response = client.receive(*it);
+        ASSERT_EQ(response.correlation_id, *it);
+        ASSERT_EQ(response.response_code, 0);
+        ASSERT_TRUE(response.payload.has_value());
+        uint64_t offset = 0;
+        std::memcpy(&offset, response.payload->data(), sizeof(offset));
+        if (!byteswap::is_big_endian())
+            offset = byteswap::byteswap64(offset);
+        offsets.insert(offset);
+    }
+    EXPECT_EQ(offsets.size(), 100);
+    EXPECT_EQ(*offsets.rbegin(), 99);
+    EXPECT_EQ(server_.acceptedConnections(), 1);
+}
+
+// collects pushed responses until count records have been received
+static std::vector<Record> receive_records(BrokerClient &client,
+                                           const boost::uuids::uuid &id,
+                                           size_t count) {
+    std::vector<Record> records;
+    while (records.size() < count) {
+        auto response = client.receive(id);
+        EXPECT_EQ(response.response_code, 0);
+        if (response.response_code != 0 || !response.payload.has_value())
+            break;
+        for (auto &record : RecordManager::extract_records(*response.payload))
+            records.push_back(std::move(record));
+    }
+    return records;
+}
+
+TEST_F(BrokerServerTests, Subscribe) {
+    BrokerClient subscriber(server_.port()), producer(server_.port());
+    ASSERT_EQ(producer.append({0, 1}).response_code, 0);
+    auto id = subscriber.send_subscribe(0, 4096);
+    for (uint8_t i = 1; i < 10; ++i)
+        ASSERT_EQ(producer.append({i, 1}).response_code, 0);
+    auto records = receive_records(subscriber, id, 10);
+    ASSERT_EQ(records.size(), 10);
+    for (uint8_t i = 0; i < 10; ++i)
+        EXPECT_EQ(records[i].payload, std::vector<uint8_t>({i, 1}));
+}
+
+TEST(BrokerServerSubscribeTests, TailAndLaggingSubscribers) {
+    auto dir = std::filesystem::current_path() / "ServerSubscribe";
+    std::filesystem::remove_all(dir);
+    // records written before the core starts are only on disk
+    {
+        Log log(dir, 1024);
+        log.start();
+        for (uint8_t i = 0; i < 50; ++i) {
+            AppendData data{
+                .data = RecordManager::create_record({i}).to_bytes(),
+                .buffer_pool = nullptr};
+            log.append(data);
+        }
+    }
+    TestServer server(std::make_unique<BrokerCore>(dir, 1024));
+    server.start();
+    {
+        BrokerClient producer(server.port());
+        std::vector<std::unique_ptr<BrokerClient>> subscribers;
+        std::vector<boost::uuids::uuid> ids;
+        // small windows force several pushes and reads from disk
+        for (uint32_t window : {16u, 256u, 1u << 16}) {
+            subscribers.push_back(
+                std::make_unique<BrokerClient>(server.port()));
+            ids.push_back(subscribers.back()->send_subscribe(0, window));
+        }
+        for (uint8_t i = 50; i < 100; ++i)
+            ASSERT_EQ(producer.append({i}).response_code, 0);
+        for (size_t i = 0; i < subscribers.size(); ++i) {
+            auto records = receive_records(*subscribers[i], ids[i], 100);
+            ASSERT_EQ(records.size(), 100);
+            for (uint8_t j = 0; j < 100; ++j)
+                EXPECT_EQ(records[j].payload, std::vector<uint8_t>({j}));
+        }
+    }
+    server.stop();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(BrokerServerProducerTests, IdempotentProducer) {
+    auto dir = std::filesystem::current_path() / "IdempotentProducer";
+    std::filesystem::remove_all(dir);
+    // small segments, so that the producer state is snapshotted
+    auto server = std::make_unique<TestServer>(
+        std::make_unique<BrokerCore>(dir, 256));
+    server->start();
+    {
+        BrokerClient client(server->port());
+        std::vector<boost::uuids::uuid> correlation_ids;
+        for (uint32_t sequence = 0; sequence < 20; ++sequence)
+            correlation_ids.push_back(client.send_producer_append(
+                {{static_cast<uint8_t>(sequence)}}, sequence));
+        for (const auto &correlation_id : correlation_ids)
+            ASSERT_EQ(client.receive(correlation_id).response_code, 0);
+        // retries of written batches and batches after a gap are not written
+        EXPECT_EQ(client.producer_append({{5}}, 5).response_code, 0x06);
+        EXPECT_EQ(client.producer_append({{19}}, 19).response_code, 0x06);
+        EXPECT_EQ(client.producer_append({{21}}, 21).response_code, 0x07);
+        auto first = client.send_producer_append({{20}}, 20);
+        auto retry = client.send_producer_append({{20}}, 20);
+        EXPECT_EQ(client.receive(first).response_code, 0);
+        EXPECT_EQ(client.receive(retry).response_code, 0x06);
+        // a new producer starts at 0
+        BrokerClient other(server->port());
+        ASSERT_NE(other.producer_id(), client.producer_id());
+        EXPECT_EQ(other.producer_append({{1}}, 1).response_code, 0x07);
+        EXPECT_EQ(other.producer_append({{0}}, 0).response_code, 0);
+
+        // the sequences are recovered from the log after a restart
+        server->stop();
+        server.reset();
+        server = std::make_unique<TestServer>(
+            std::make_unique<BrokerCore>(dir, 256));
+        server->start();
+        BrokerClient restarted(server->port());
+        // the same producer id on a new connection
+        auto producer_append = [&](uint32_t sequence) {
+            boost::uuids::random_generator generator;
+            TcpRequest request{
+                .headers = TcpHeaders(generator(), 0, RequestType::Append,
+                                      appendFlags(CompressionCodec::None,
+                                                  AppendAcks::Leader, true)),
+                .payload = RecordManager::create_batch(
+                               {{static_cast<uint8_t>(sequence)}},
+                               CompressionCodec::None,
+                               {.producer_id = client.producer_id(),
+                                .sequence = sequence})
+                               .to_bytes_with_len()};
+            return restarted.send_raw_request(request).response_code;
+        };
+        EXPECT_EQ(producer_append(20), 0x06);
+        EXPECT_EQ(producer_append(21), 0);
+
+        auto records = RecordManager::extract_all_records(
+            restarted.fetch(0, 4096).payload.value_or({}));
+        ASSERT_EQ(records.size(), 23);
+        for (uint8_t i = 0; i < 21; ++i)
+            EXPECT_EQ(records[i].payload, std::vector<uint8_t>{i});
+        EXPECT_EQ(records[22].payload, std::vector<uint8_t>{21});
+    }
+    server->stop();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(BrokerServerReplicationTests, FollowerReplicatesLeader) {
+    auto leader_dir = std::filesystem::current_path() / "ReplicationLeader";
+    auto follower_dir =
+        std::filesystem::current_path() / "ReplicationFollower";
+    std::filesystem::remove_all(leader_dir);
+    std::filesystem::remove_all(follower_dir);
+    // small segments, so that the follower rolls over as well
+    TestServer leader(std::make_unique<BrokerCore>(
+        leader_dir, 1024, LogConfig{},
+        ReplicationConfig{.replica_lag_timeout = 500ms}));
+    leader.start();
+    auto follower = std::make_unique<TestServer>(std::make_unique<BrokerCore>(
+        follower_dir, 1024, LogConfig{},
+        ReplicationConfig{.leader_port = leader.port(),
+                          .replica_id = 1,
+                          .sync_max_wait_ms = 50}));
+    follower->start();
+    {
+        BrokerClient producer(leader.port());
+        for (uint8_t i = 0; i < 100; ++i)
+            ASSERT_EQ(producer.append(std::vector<uint8_t>(i + 1, i))
+                          .response_code,
+                      0);
+        // the follower serves the records once the leader's high watermark
+        // has reached it
+        BrokerClient consumer(follower->port());
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (fetch_records(consumer, 0).size() < 100 &&
+               std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(10ms);
+        for (uint64_t offset : {0, 37, 99}) {
+            auto from_leader = producer.fetch(offset, 1 << 20);
+            auto from_follower = consumer.fetch(offset, 1 << 20);
+            ASSERT_EQ(from_follower.response_code, 0);
+            EXPECT_EQ(from_follower.payload, from_leader.payload);
+            auto records = RecordManager::extract_records(
+                from_follower.payload.value_or({}));
+            ASSERT_EQ(records.size(), 100 - offset);
+            EXPECT_EQ(records.front().payload,
+                      std::vector<uint8_t>(offset + 1, offset));
+        }
+        EXPECT_EQ(consumer.append({1}).response_code, 0x82);
+        EXPECT_EQ(BrokerClient(follower->port())
+                      .replica_sync(2, 0, 1024, 0)
+                      .response_code,
+                  0x82);
+        // the leader holds back records until the follower has them, or
+        // until the follower has left the in sync replicas
+        follower->stop();
+        follower.reset();
+        ASSERT_EQ(producer.append({100}).response_code, 0);
+        EXPECT_TRUE(fetch_records(producer, 100).empty());
+        deadline = std::chrono::steady_clock::now() + 10s;
+        while (fetch_records(producer, 100).empty() &&
+               std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(50ms);
+        auto records = fetch_records(producer, 100);
+        ASSERT_EQ(records.size(), 1);
+        EXPECT_EQ(records.front().payload, std::vector<uint8_t>({100}));
+    }
+    leader.stop();
+    std::filesystem::remove_all(leader_dir);
+    std::filesystem::remove_all(follower_dir);
+}
+
+TEST(BrokerServerReplicationTests, StopWithSilentLeader) {
+    auto dir = std::filesystem::current_path() / "SilentLeaderFollower";
+    std::filesystem::remove_all(dir);
+    // accepts the follower's connection and never answers
+    boost::asio::io_context io_context;
+    tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 0));
+    tcp::socket connection(io_context);
+    std::thread accept_thread([&]() { acceptor.accept(connection); });
+    auto follower = std::make_unique<BrokerCore>(
+        dir, 1024, LogConfig{},
+        ReplicationConfig{.leader_port = acceptor.local_endpoint().port(),
+                          .replica_id = 1,
+                          .sync_max_wait_ms = 50});
+    follower->start();
+    accept_thread.join();
+    // the replica thread is waiting for the ReplicaSync response by now
+    std::this_thread::sleep_for(100ms);
+    auto start = std::chrono::steady_clock::now();
+    follower->stop();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 1s);
+    follower.reset();
+    std::filesystem::remove_all(dir);
+}
+
+TEST(BrokerServerReplicationTests, DurableAcksWaitForFollower) {
+    auto leader_dir = std::filesystem::current_path() / "DurableAcksLeader";
+    auto follower_dir =
+        std::filesystem::current_path() / "DurableAcksFollower";
+    std::filesystem::remove_all(leader_dir);
+    std::filesystem::remove_all(follower_dir);
+    TestServer leader(std::make_unique<BrokerCore>(
+        leader_dir, 1024, LogConfig{},
+        ReplicationConfig{.replica_lag_timeout = 300ms}));
+    leader.start();
+    auto follower_core = std::make_unique<BrokerCore>(
+        follower_dir, 1024, LogConfig{},
+        ReplicationConfig{.leader_port = leader.port(),
+                          .replica_id = 1,
+                          .sync_max_wait_ms = 50});
+    auto *follower_ptr = follower_core.get();
+    auto follower = std::make_unique<TestServer>(std::move(follower_core));
+    follower->start();
+    {
+        BrokerClient producer(leader.port());
+        // wait for the follower to join the in sync replicas
+        ASSERT_EQ(producer.append({0}).response_code, 0);
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (follower_ptr->high_watermark() < 1 &&
+               std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(10ms);
+        for (uint8_t i = 1; i < 20; ++i) {
+            ASSERT_EQ(producer.append({i}, AppendAcks::Durable).response_code,
+                      0);
+            EXPECT_GT(follower_ptr->log_end_offset(), i);
+        }
+        // until the stopped follower leaves the in sync replicas, durable
+        // appends are not acknowledged, leader acks are
+        follower->stop();
+        follower.reset();
+        auto start = std::chrono::steady_clock::now();
+        auto durable = producer.send_append({20}, AppendAcks::Durable);
+        ASSERT_EQ(producer.append({21}).response_code, 0);
+        EXPECT_LT(std::chrono::steady_clock::now() - start, 200ms);
+        ASSERT_EQ(producer.receive(durable).response_code, 0);
+        EXPECT_GE(std::chrono::steady_clock::now() - start, 200ms);
+    }
+    leader.stop();
+    std::filesystem::remove_all(leader_dir);
+    std::filesystem::remove_all(follower_dir);
+}
+
+TEST(BrokerServerConfigTests, MaxInFlightOne) {
+    TestServer server({.max_in_flight_requests = 1});
+    server.start();
+    {
+        BrokerClient client(server.port());
+        std::vector<boost::uuids::uuid> correlation_ids;
+        for (uint8_t i = 0; i < 50; ++i)
+            correlation_ids.push_back(client.send_append({i}));
+        for (const auto &correlation_id : correlation_ids) {
+            auto response = client.receive(correlation_id);
+            ASSERT_EQ(response.response_code, 0);
+        }
+    }
+    server.stop();
+}
+
+TEST(BrokerServerConfigTests, IdleTimeoutClosesConnection) {
+    TestServer server({.idle_timeout = 100ms});
+    server.start();
+    {
+        boost::asio::io_context io_context;
+        tcp::socket socket(io_context);
+        socket.connect(
+            tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+                          static_cast<unsigned short>(server.port())));
+        std::array<uint8_t, 1> buf;
+        boost::system::error_code ec;
+        auto start = std::chrono::steady_clock::now();
+        boost::asio::read(socket, boost::asio::buffer(buf), ec);
+        EXPECT_EQ(ec, boost::asio::error::eof);
+        EXPECT_GE(std::chrono::steady_clock::now() - start, 100ms);
+
+        // a request on a connection closed by the server fails, the next one
+        // reconnects
+        BrokerClient client(server.port());
+        ASSERT_EQ(client.append({1, 2}).response_code, 0);
+        std::this_thread::sleep_for(300ms);
+        EXPECT_THROW(client.append({3, 4}), boost::system::system_error);
+        ASSERT_EQ(client.append({5, 6}).response_code, 0);
+        // activity keeps the connection open past the timeout
+        for (uint8_t i = 0; i < 6; ++i) {
+            std::this_thread::sleep_for(50ms);
+            ASSERT_EQ(client.append({7, i}).response_code, 0);
+        }
+    }
+    server.stop();
+}
+
+TEST(BrokerServerShardTests, AppendFetchSharded) {
+    std::vector<std::unique_ptr<boost::asio::io_context>> io_contexts;
+    std::vector<boost::asio::io_context *> io_context_ptrs;
+    for (int i = 0; i < 4; ++i) {
+        io_contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        io_context_ptrs.push_back(io_contexts.back().get());
+    }
+    BrokerServer server(0, std::make_unique<FakeBrokerCore>(),
+                        io_context_ptrs);
+    std::vector<std::thread> threads;
+    for (auto &io_context : io_contexts)
+        threads.push_back(std::thread([&]() { io_context->run(); }));
+
+    std::vector<std::thread> clients;
+    std::atomic<int> successful_appends = 0;
+    for (int i = 0; i < 8; ++i) {
+        clients.push_back(std::thread([&, i]() {
+            BrokerClient client(server.port());
+            for (uint8_t j = 0; j < 25; ++j) {
+                auto response = client.append({static_cast<uint8_t>(i), j});
+                if (response.response_code == 0)
+                    ++successful_appends;
+            }
+        }));
+    }
+    for (auto &client : clients)
+        client.join();
+    EXPECT_EQ(successful_appends.load(), 200);
+    EXPECT_EQ(server.acceptedConnections(), 8);
+
+    BrokerClient client(server.port());
+    auto response = client.fetch(0, 1 << 16);
+    ASSERT_EQ(response.response_code, 0);
+    EXPECT_EQ(RecordManager::extract_records(*response.payload).size(), 200);
+
+    for (auto &io_context : io_contexts)
+        io_context->stop();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+TEST(BrokerServerConfigTests, RequestLargerThanReadBuffer) {
+    TestServer server({.read_buffer_size = 0});
+    server.start();
+    {
+        BrokerClient client(server.port());
+        std::vector<uint8_t> payload(100000);
+        for (size_t i = 0; i < payload.size(); ++i)
+            payload[i] = i % 251;
+        ASSERT_EQ(client.append({1, 2, 3}).response_code, 0);
+        ASSERT_EQ(client.append(payload).response_code, 0);
+        ASSERT_EQ(client.append({4, 5, 6}).response_code, 0);
+        auto response = client.fetch(0, 1 << 20);
+        ASSERT_EQ(response.response_code, 0);
+        auto records = RecordManager::extract_records(*response.payload);
+        ASSERT_EQ(records.size(), 3);
+        EXPECT_EQ(records[1].payload, payload);
+        EXPECT_EQ(records[2].payload, std::vector<uint8_t>({4, 5, 6}));
+    }
+    server.stop();
+}
+
+TEST(BufferPoolTests, AcquireRelease) {
+    BufferPool pool(2);
+    auto buffer = pool.acquire(300);
+    EXPECT_EQ(buffer.size(), 300);
+    EXPECT_EQ(buffer.capacity(), 512);
+    auto data = buffer.data();
+    pool.release(std::move(buffer));
+    EXPECT_EQ(pool.cachedBuffers(512), 1);
+    // any size of the same class reuses the buffer
+    auto reused = pool.acquire(257);
+    EXPECT_EQ(reused.data(), data);
+    EXPECT_EQ(reused.size(), 257);
+    EXPECT_EQ(pool.cachedBuffers(512), 0);
+
+    auto small = pool.acquire(1);
+    EXPECT_EQ(small.capacity(), BufferPool::MIN_CLASS_SIZE);
+    auto large = pool.acquire(BufferPool::MAX_CLASS_SIZE + 1);
+    EXPECT_EQ(large.size(), BufferPool::MAX_CLASS_SIZE + 1);
+    pool.release(std::move(large));
+    EXPECT_EQ(pool.cachedBuffers(BufferPool::MAX_CLASS_SIZE), 0);
+
+    // at most two buffers per class are kept
+    for (int i = 0; i < 3; ++i)
+        pool.release(pool.acquire(1000));
+    std::vector<std::vector<uint8_t>> buffers;
+    for (int i = 0; i < 3; ++i)
+        buffers.push_back(pool.acquire(1000));
+    for (auto &buffer : buffers)
+        pool.release(std::move(buffer));
+    EXPECT_EQ(pool.cachedBuffers(1024), 2);
+}
+
 } // namespace broker
 } // namespace kafka_lite
@@ -0,0 +1,122 @@
+#include "../include/Codec.h"
+#include "../include/RecordManager.h"
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace kafka_lite {
+namespace broker {
+
+static std::vector<uint8_t> jsonLines(size_t count) {
+    std::string text;
+    for (size_t i = 0; i < count; ++i)
+        text += "{\"host\": \"broker-" + std::to_string(i % 8) +
+                "\", \"metric\": \"bytes_in\", \"value\": " +
+                std::to_string(i * 37 % 1000) + "}\n";
+    return {text.begin(), text.end()};
+}
+
+TEST(CodecTests, RoundTrip) {
+    std::mt19937 rng(7);
+    std::vector<uint8_t> random(100000);
+    for (auto &byte : random)
+        byte = rng();
+    std::vector<std::vector<uint8_t>> inputs = {
+        {}, {1}, {1, 2, 3}, std::vector<uint8_t>(70000, 'a'), random,
+        jsonLines(2000)};
+    for (uint8_t id = 0; id <= MAX_COMPRESSION_CODEC; ++id) {
+        const Codec *codec = findCodec(static_cast<CompressionCodec>(id));
+        if (codec == nullptr)
+            continue;
+        EXPECT_EQ(codec->id(), static_cast<CompressionCodec>(id));
+        for (const auto &input : inputs) {
+            auto compressed = codec->compress(input);
+            EXPECT_EQ(codec->decompress(compressed, input.size()), input);
+        }
+    }
+    ASSERT_NE(findCodec(CompressionCodec::Lz), nullptr);
+    auto json = jsonLines(2000);
+    EXPECT_LT(findCodec(CompressionCodec::Lz)->compress(json).size(),
+              json.size() / 4);
+}
+
+TEST(CodecTests, LzRejectsMalformedInput) {
+    const Codec *codec = findCodec(CompressionCodec::Lz);
+    auto input = jsonLines(100);
+    auto compressed = codec->compress(input);
+    EXPECT_THROW(codec->decompress(compressed, input.size() - 1),
+                 std::runtime_error);
+    EXPECT_THROW(codec->decompress(compressed, input.size() + 1),
+                 std::runtime_error);
+    compressed.resize(compressed.size() / 2);
+    EXPECT_THROW(codec->decompress(compressed, input.size()),
+                 std::runtime_error);
+    // a match before the start of the output
+    std::vector<uint8_t> bad = {0x10, 'a', 0x05, 0x00};
+    EXPECT_THROW(codec->decompress(bad, 5), std::runtime_error);
+}
+
+TEST(CodecTests, Batch) {
+    std::vector<std::vector<uint8_t>> payloads = {{1, 2, 3}, {}, {4}};
+    auto batch = RecordManager::create_batch(payloads, CompressionCodec::Lz);
+    EXPECT_TRUE(RecordManager::check_integrity(batch));
+    EXPECT_EQ(RecordManager::batch_codec(batch.attributes),
+              CompressionCodec::Lz);
+    auto records = RecordManager::decompress_batch(batch);
+    ASSERT_EQ(records.size(), payloads.size());
+    for (size_t i = 0; i < records.size(); ++i)
+        EXPECT_EQ(records[i].payload, payloads[i]);
+
+    // the attributes travel in the length header
+    auto bytes = batch.to_bytes_with_len();
+    auto extracted = RecordManager::extract_all_records(bytes);
+    ASSERT_EQ(extracted.size(), payloads.size());
+    EXPECT_EQ(extracted[2].payload, payloads[2]);
+
+    EXPECT_EQ(RecordManager::batch_codec(0), std::nullopt);
+    EXPECT_THROW(RecordManager::create_batch(payloads, CompressionCodec::None),
+                 std::invalid_argument);
+    batch.payload.resize(batch.payload.size() - 1);
+    EXPECT_THROW(RecordManager::decompress_batch(batch), std::runtime_error);
+}
+
+TEST(CodecTests, PlainRecordLikeBatch) {
+    // a plain record is never expanded, whatever its payload starts with
+    std::vector<uint8_t> payload = {'K', 'L', 'C', 'B', 0, 4, 0, 0, 0};
+    auto bytes = RecordManager::create_record(payload).to_bytes_with_len();
+    auto records = RecordManager::extract_all_records(bytes);
+    ASSERT_EQ(records.size(), 1);
+    EXPECT_EQ(records[0].payload, payload);
+    EXPECT_EQ(RecordManager::batch_producer(0, payload.data(), payload.size()),
+              std::nullopt);
+}
+
+TEST(CodecTests, ProducerBatch) {
+    std::vector<std::vector<uint8_t>> payloads = {{1, 2, 3}, {4}};
+    for (auto codec : {CompressionCodec::None, CompressionCodec::Lz}) {
+        auto batch = RecordManager::create_batch(
+            payloads, codec, {.producer_id = 42, .sequence = 7});
+        EXPECT_TRUE(RecordManager::check_integrity(batch));
+        EXPECT_EQ(RecordManager::batch_codec(batch.attributes), codec);
+        auto producer = RecordManager::batch_producer(
+            batch.attributes, batch.payload.data(), batch.payload.size());
+        ASSERT_TRUE(producer.has_value());
+        EXPECT_EQ(producer->producer_id, 42);
+        EXPECT_EQ(producer->sequence, 7);
+        auto records = RecordManager::decompress_batch(batch);
+        ASSERT_EQ(records.size(), payloads.size());
+        for (size_t i = 0; i < records.size(); ++i)
+            EXPECT_EQ(records[i].payload, payloads[i]);
+    }
+    auto plain = RecordManager::create_batch(payloads, CompressionCodec::Lz);
+    EXPECT_EQ(RecordManager::batch_producer(
+                  plain.attributes, plain.payload.data(), plain.payload.size()),
+              std::nullopt);
+}
+
+} // namespace broker
+} // namespace kafka_lite
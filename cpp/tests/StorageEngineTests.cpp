@@ -1,16 +1,26 @@
 #include "../include/ByteSwap.h"
+#include "../include/IndexSearch.h"
+#include "../include/IoUring.h"
 #include "../include/Log.h"
+#include "../include/ProducerState.h"
 #include "../include/RecordManager.h"
+#include "../include/RemoteStore.h"
 #include "../include/Segment.h"
+#include "../include/StorageBackend.h"
 #include <algorithm>
+#include <atomic>
 #include <boost/crc.hpp>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <limits>
 #include <optional>
+#include <random>
+#include <span>
+#include <thread>
 #include <vector>
 
 namespace kafka_lite {
@@ -31,6 +41,40 @@ std::vector<Record> generate_records(size_t record_len,
     return records;
 }
 
+std::vector<uint64_t> getSortedBaseOffsets(const std::filesystem::path &dir) {
+    std::vector<uint64_t> base_offsets;
+    std::string filename;
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+        filename = entry.path().filename().string();
+        if (filename.compare(filename.size() - 4, 4, ".log") == 0)
+            base_offsets.push_back(std::stoll(
+                filename.substr(0, filename.size() - 4), nullptr, 10));
+    }
+    std::sort(base_offsets.begin(), base_offsets.end());
+    return base_offsets;
+}
+
+// a plan of the segment and the records it points to
+struct SegmentRead {
+    uint64_t last_read_offset;
+    std::vector<uint8_t> result_buf;
+    // file position of last_read_offset + 1
+    uint64_t next_file_position;
+};
+
+SegmentRead readSegment(const Segment &segment, uint64_t offset,
+                        size_t max_bytes,
+                        std::optional<uint64_t> file_position = std::nullopt) {
+    auto plan = segment.plan(offset, max_bytes, file_position);
+    SegmentRead result{.last_read_offset = plan.last_read_offset,
+                       .result_buf = std::vector<uint8_t>(plan.length),
+                       .next_file_position = plan.file_position + plan.length};
+    if (plan.length > 0)
+        segment.readRange(plan.file_position, plan.length,
+                          result.result_buf.data());
+    return result;
+}
+
 class StorageEngineTests : public ::testing::Test {
   private:
     std::filesystem::path dir_;
@@ -51,7 +95,7 @@ void StorageEngineTests::TearDown() { std::filesystem::remove_all(dir_); }
 TEST_F(StorageEngineTests, SegmentRW) {
     std::filesystem::path dir = getDir() / "SegmentRW";
     Segment segment(dir, 0, 32, SegmentState::Active);
-    SegmentReadResult result = segment.read(0, 32);
+    SegmentRead result = readSegment(segment, 0, 32);
     ASSERT_TRUE(result.result_buf.empty());
     std::vector<uint8_t> data, result_buf;
     data.reserve(4);
@@ -60,7 +104,7 @@ TEST_F(StorageEngineTests, SegmentRW) {
     }
     uint64_t offset =
         segment.append(data.data(), data.size() * sizeof(uint8_t));
-    result = segment.read(offset, 32);
+    result = readSegment(segment, offset, 32);
     result_buf.reserve(data.size());
     for (auto it = result.result_buf.begin() + SEGMENT_HEADER_SIZE;
          it != result.result_buf.end(); ++it) {
@@ -79,7 +123,7 @@ TEST_F(StorageEngineTests, SegmentRWMultiple) {
     datav.reserve(8);
     data.resize(4);
     std::vector<uint64_t> offsets;
-    SegmentReadResult result;
+    SegmentRead result;
     {
         Segment segment(dir, 0, 32, SegmentState::Active);
 
@@ -98,14 +142,14 @@ TEST_F(StorageEngineTests, SegmentRWMultiple) {
         }
         EXPECT_EQ(segment.getPublishedOffset(), 7);
         EXPECT_TRUE(segment.isFull());
-        result = segment.read(7, 256);
+        result = readSegment(segment, 7, 256);
         EXPECT_EQ(result.last_read_offset, 7);
         ASSERT_EQ(result.result_buf.size(), 4 + SEGMENT_HEADER_SIZE);
         EXPECT_EQ(0, std::memcmp(datav[7].data(),
                                  result.result_buf.data() + SEGMENT_HEADER_SIZE,
                                  4 * sizeof(uint8_t)));
 
-        result = segment.read(4, 256);
+        result = readSegment(segment, 4, 256);
         EXPECT_EQ(result.last_read_offset, 7);
         ASSERT_EQ(result.result_buf.size(), 4 * (4 + SEGMENT_HEADER_SIZE));
         for (int i = 4; i < 8; ++i) {
@@ -118,8 +162,9 @@ TEST_F(StorageEngineTests, SegmentRWMultiple) {
                                4 * sizeof(uint8_t)));
         }
 
-        result = segment.read(8, 256);
-        EXPECT_EQ(result.last_read_offset, 0);
+        result = readSegment(segment, 8, 256);
+        // nothing read, the offset before
+        EXPECT_EQ(result.last_read_offset, 7);
         EXPECT_TRUE(result.result_buf.empty());
     }
 
@@ -127,14 +172,14 @@ TEST_F(StorageEngineTests, SegmentRWMultiple) {
     EXPECT_TRUE(segment.isFull());
     EXPECT_EQ(segment.getPublishedOffset(), 7);
     EXPECT_TRUE(segment.getPublishedSize() > 0);
-    result = segment.read(7, 256);
+    result = readSegment(segment, 7, 256);
     EXPECT_EQ(result.last_read_offset, 7);
     ASSERT_EQ(result.result_buf.size(), 4 + SEGMENT_HEADER_SIZE);
     EXPECT_EQ(0, std::memcmp(datav[7].data(),
                              result.result_buf.data() + SEGMENT_HEADER_SIZE,
                              4 * sizeof(uint8_t)));
 
-    result = segment.read(4, 256);
+    result = readSegment(segment, 4, 256);
     EXPECT_EQ(result.last_read_offset, 7);
     ASSERT_EQ(result.result_buf.size(), 4 * (4 + SEGMENT_HEADER_SIZE));
     for (int i = 4; i < 8; ++i) {
@@ -147,8 +192,8 @@ TEST_F(StorageEngineTests, SegmentRWMultiple) {
                               4 * sizeof(uint8_t)));
     }
 
-    result = segment.read(8, 256);
-    EXPECT_EQ(result.last_read_offset, 0);
+    result = readSegment(segment, 8, 256);
+    EXPECT_EQ(result.last_read_offset, 7);
     EXPECT_TRUE(result.result_buf.empty());
 }
 
@@ -158,7 +203,8 @@ TEST_F(StorageEngineTests, IsFull) {
     std::vector<uint8_t> data;
     data.push_back(1);
     uint64_t offset = segment.append(data.data(), sizeof(uint8_t));
-    SegmentReadResult result = segment.read(0, 100);
+    EXPECT_EQ(offset, 0);
+    SegmentRead result = readSegment(segment, 0, 100);
     ASSERT_EQ(result.result_buf.size(), SEGMENT_HEADER_SIZE + 1);
     EXPECT_TRUE(segment.isFull());
     EXPECT_EQ(data[0], result.result_buf[SEGMENT_HEADER_SIZE]);
@@ -185,7 +231,7 @@ TEST_F(StorageEngineTests, LastReadOffset) {
         ASSERT_EQ(*it, it - offsets.begin());
     }
 
-    SegmentReadResult result = segment.read(0, 5 * (record_size + 4));
+    SegmentRead result = readSegment(segment, 0, 5 * (record_size + 4));
     EXPECT_TRUE(result.result_buf.size() <= 5 * (record_size + 4));
     auto read_records = RecordManager::extract_records(result.result_buf);
     for (auto &record : read_records) {
@@ -193,14 +239,14 @@ TEST_F(StorageEngineTests, LastReadOffset) {
     }
     EXPECT_EQ(result.last_read_offset, 4);
 
-    result = segment.read(2, 5 * (record_size + 4));
+    result = readSegment(segment, 2, 5 * (record_size + 4));
     EXPECT_TRUE(result.result_buf.size() <= 5 * (record_size + 4));
     read_records = RecordManager::extract_records(result.result_buf);
     for (auto &record : read_records) {
         EXPECT_EQ(record.payload, rec_payload);
     }
     EXPECT_EQ(result.last_read_offset, 6);
-    result = segment.read(0, 4096);
+    result = readSegment(segment, 0, 4096);
     EXPECT_EQ(result.last_read_offset, 9);
 }
 
@@ -259,6 +305,818 @@ TEST_F(StorageEngineTests, LogReadWriteNonActive) {
     EXPECT_ANY_THROW(log.fetch({0, 32}));
 }
 
+TEST_F(StorageEngineTests, LogBatchAppendRollover) {
+    for (bool use_io_uring : {false, true}) {
+        std::filesystem::path dir = getDir() / "LogBatchAppendRollover";
+        std::filesystem::remove_all(dir);
+        LogConfig config;
+        config.use_io_uring = use_io_uring;
+        Log log(dir, 4 * (SEGMENT_HEADER_SIZE + 1), config);
+        log.start();
+        if (use_io_uring) {
+            EXPECT_EQ(log.usesIoUring(), IoUring::isSupported());
+        }
+
+        std::vector<uint8_t> data(98);
+        std::vector<RecordSlice> records;
+        for (int i = 0; i < 98; ++i) {
+            data[i] = i;
+            records.push_back({&data[i], 1});
+        }
+        // two batches, the first one ends in the middle of a segment
+        ASSERT_EQ(log.append(std::span(records).first(10), false), 0);
+        ASSERT_EQ(log.append(std::span(records).subspan(10), true), 10);
+        EXPECT_EQ(log.getPublishedOffset(), 97);
+
+        FetchData fetch_data;
+        for (int i = 0; i < 98; ++i) {
+            fetch_data.offset = i;
+            fetch_data.max_bytes = 100 * (SEGMENT_HEADER_SIZE + 1);
+            auto result = log.fetch(fetch_data);
+            ASSERT_EQ(result.result_buf.size(),
+                      (98 - i) * (SEGMENT_HEADER_SIZE + 1));
+            for (int j = 0; j < 98 - i; ++j) {
+                ASSERT_EQ(
+                    result.result_buf[(j + 1) * (SEGMENT_HEADER_SIZE + 1) - 1],
+                    i + j);
+            }
+        }
+    }
+}
+
+// fails to open files once fail is set, e.g. the files of a new segment
+class FailingBackend : public FileBackend {
+  public:
+    int open(const std::filesystem::path &path, int flags,
+             mode_t mode) override {
+        if (fail) {
+            errno = EIO;
+            return -1;
+        }
+        return FileBackend::open(path, flags, mode);
+    }
+    bool fail = false;
+};
+
+TEST_F(StorageEngineTests, LogBatchAppendRolloverFails) {
+    std::filesystem::path dir = getDir() / "LogBatchAppendRolloverFails";
+    auto backend = std::make_shared<FailingBackend>();
+    LogConfig config;
+    config.storage = backend;
+    Log log(dir, 4 * (SEGMENT_HEADER_SIZE + 1), config);
+    log.start();
+    std::vector<uint8_t> data(10);
+    std::vector<RecordSlice> records;
+    for (int i = 0; i < 10; ++i) {
+        data[i] = i;
+        records.push_back({&data[i], 1});
+    }
+    ASSERT_EQ(log.append(std::span(records).first(2), false), 0);
+    // the rest of the active segment is written, the rollover fails
+    backend->fail = true;
+    size_t appended = 0;
+    EXPECT_ANY_THROW(log.append(std::span(records).subspan(2), false, appended));
+    EXPECT_EQ(appended, 2);
+    EXPECT_EQ(log.endOffset(), 4);
+    auto result = log.fetch({.offset = 0, .max_bytes = 1024});
+    ASSERT_EQ(result.result_buf.size(), 4 * (SEGMENT_HEADER_SIZE + 1));
+}
+
+TEST_F(StorageEngineTests, LogBatchAppendAfterRecovery) {
+    std::filesystem::path dir = getDir() / "LogBatchAppendAfterRecovery";
+    auto records = generate_records(8, 20);
+    std::vector<std::vector<uint8_t>> bytes;
+    std::vector<RecordSlice> slices;
+    for (auto &record : records)
+        bytes.push_back(record.to_bytes());
+    for (auto &buf : bytes)
+        slices.push_back({buf.data(), static_cast<uint32_t>(buf.size())});
+    LogConfig config;
+    config.use_io_uring = true;
+    {
+        Log log(dir, 1024, config);
+        log.start();
+        ASSERT_EQ(log.append(std::span(slices).first(10), true), 0);
+    }
+    // appends after recovery have to continue at the end of the segment
+    Log log(dir, 1024, config);
+    log.start();
+    ASSERT_EQ(log.getPublishedOffset(), 9);
+    ASSERT_EQ(log.append(std::span(slices).subspan(10), true), 10);
+
+    auto result = log.fetch({0, 4096});
+    auto read_records = RecordManager::extract_records(result.result_buf);
+    ASSERT_EQ(read_records.size(), records.size());
+    for (size_t i = 0; i < records.size(); ++i)
+        EXPECT_EQ(read_records[i].payload, records[i].payload);
+}
+
+TEST_F(StorageEngineTests, SegmentReadTrimsPartialRecords) {
+    std::filesystem::path dir = getDir() / "SegmentReadTrimsPartialRecords";
+    Segment segment(dir, 0, 1024, SegmentState::Active);
+    // records of 1, 2, ..., 10 bytes
+    std::vector<uint8_t> data(10, 9);
+    for (uint32_t i = 1; i <= 10; ++i)
+        segment.append(data.data(), i);
+    auto record_end = [](uint32_t records) {
+        return records * SEGMENT_HEADER_SIZE + records * (records + 1) / 2;
+    };
+
+    for (size_t max_bytes = 0; max_bytes < record_end(10) + 5; ++max_bytes) {
+        auto result = readSegment(segment, 0, max_bytes);
+        uint32_t records = 0;
+        while (records < 10 && record_end(records + 1) <= max_bytes)
+            ++records;
+        ASSERT_EQ(result.result_buf.size(), record_end(records)) << max_bytes;
+        ASSERT_EQ(result.last_read_offset + 1, records) << max_bytes;
+        ASSERT_EQ(result.next_file_position, record_end(records));
+    }
+    // starting in the middle, at the position of a previous read
+    auto result = readSegment(
+        segment, 4, 3 * SEGMENT_HEADER_SIZE + 5 + 6 + 7, record_end(4));
+    EXPECT_EQ(result.last_read_offset, 6);
+    EXPECT_EQ(result.result_buf.size(), 3 * SEGMENT_HEADER_SIZE + 5 + 6 + 7);
+    EXPECT_EQ(result.result_buf[SEGMENT_HEADER_SIZE], 9);
+}
+
+TEST_F(StorageEngineTests, SegmentTailCache) {
+    std::filesystem::path dir = getDir() / "SegmentTailCache";
+    auto records = generate_records(8, 20);
+    std::vector<std::vector<uint8_t>> bytes;
+    std::vector<RecordSlice> slices;
+    std::vector<uint8_t> expected;
+    for (auto &record : records) {
+        bytes.push_back(record.to_bytes());
+        auto with_len = record.to_bytes_with_len();
+        expected.insert(expected.end(), with_len.begin(), with_len.end());
+    }
+    for (auto &buf : bytes)
+        slices.push_back({buf.data(), static_cast<uint32_t>(buf.size())});
+    const size_t record_size = SEGMENT_HEADER_SIZE + bytes[0].size();
+
+    // room for the last five records, the ring wraps several times
+    Segment segment(dir, 0, 1024, SegmentState::Active,
+                    {.tail_cache_size = 5 * record_size});
+    std::shared_ptr<const RecordChunk> chunk;
+    ASSERT_EQ(segment.append(std::span(slices).first(7), false, nullptr), 0);
+    ASSERT_EQ(
+        segment.append(std::span(slices).subspan(7), false, nullptr, &chunk),
+        7);
+    // the chunk the segment wrote and caches, in the on disk format
+    ASSERT_TRUE(chunk);
+    EXPECT_EQ(chunk->first_offset, 7);
+    EXPECT_EQ(chunk->record_positions.size(), 13);
+    EXPECT_EQ(chunk->bytes, std::vector<uint8_t>(
+                                expected.begin() + 7 * record_size,
+                                expected.end()));
+
+    for (size_t max_records : {1, 2, 5, 30}) {
+        for (uint64_t offset = 0; offset < 20; ++offset) {
+            // one byte short of max_records + 1 records
+            size_t max_bytes = (max_records + 1) * record_size - 1;
+            auto result = readSegment(segment, offset, max_bytes);
+            size_t no_of_records = std::min<size_t>(max_records, 20 - offset);
+            ASSERT_EQ(result.last_read_offset, offset + no_of_records - 1);
+            ASSERT_EQ(result.result_buf,
+                      std::vector<uint8_t>(
+                          expected.begin() + offset * record_size,
+                          expected.begin() +
+                              (offset + no_of_records) * record_size));
+        }
+    }
+    auto stats = segment.tailCacheStats();
+    EXPECT_EQ(stats.hits, 4 * 5);
+    EXPECT_EQ(stats.misses, 4 * 15);
+
+    // a record larger than the cache empties it
+    std::vector<uint8_t> large(6 * record_size, 42);
+    segment.append(large.data(), large.size());
+    auto result = readSegment(segment, 19, 1024);
+    EXPECT_EQ(result.last_read_offset, 20);
+    EXPECT_EQ(result.result_buf.size(),
+              record_size + SEGMENT_HEADER_SIZE + large.size());
+    EXPECT_EQ(segment.tailCacheStats().misses, 4 * 15 + 1);
+    segment.append(slices[0].data, slices[0].len);
+    result = readSegment(segment, 21, 1024);
+    EXPECT_EQ(result.last_read_offset, 21);
+    EXPECT_EQ(segment.tailCacheStats().hits, 4 * 5 + 1);
+}
+
+TEST_F(StorageEngineTests, SegmentPlanEndOffsetDuringAppend) {
+    std::filesystem::path dir = getDir() / "SegmentPlanEndOffsetDuringAppend";
+    const uint64_t no_of_records = 20000;
+    Segment segment(dir, 0, no_of_records * (SEGMENT_HEADER_SIZE + 1),
+                    SegmentState::Active);
+    uint8_t byte = 0;
+    segment.append(&byte, 1);
+    std::atomic<bool> done = false;
+    std::thread writer([&]() {
+        for (uint64_t i = 1; i < no_of_records; ++i)
+            segment.append(&byte, 1);
+        done = true;
+    });
+    // the end offset is the published offset + 1 a reader saw, the plan
+    // may see a size that already includes the next append
+    while (!done) {
+        uint64_t end_offset = segment.getPublishedOffset() + 1;
+        auto plan = segment.plan(0, no_of_records * (SEGMENT_HEADER_SIZE + 1),
+                                 std::nullopt, end_offset);
+        ASSERT_LT(plan.last_read_offset, end_offset);
+        ASSERT_EQ(plan.length,
+                  (plan.last_read_offset + 1) * (SEGMENT_HEADER_SIZE + 1));
+    }
+    writer.join();
+}
+
+TEST_F(StorageEngineTests, LogFetchSession) {
+    std::filesystem::path dir = getDir() / "LogFetchSession";
+    LogConfig config;
+    // the file path has to be taken for the sessions to matter
+    config.tail_cache_size = 0;
+    auto records = generate_records(8, 40);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    Log log(dir, 10 * record_size, config);
+    log.start();
+    for (auto &record : records) {
+        auto bytes = record.to_bytes();
+        log.append(bytes.data(), bytes.size());
+    }
+
+    // sequential consumer reading three records at a time across segments
+    std::vector<Record> read_records;
+    uint64_t offset = 0;
+    while (offset < records.size()) {
+        auto result = log.fetch(
+            {.offset = offset, .max_bytes = 3 * record_size, .session_id = 7});
+        auto fetched = RecordManager::extract_records(result.result_buf);
+        ASSERT_FALSE(fetched.empty());
+        offset += fetched.size();
+        read_records.insert(read_records.end(), fetched.begin(),
+                            fetched.end());
+    }
+    ASSERT_EQ(read_records.size(), records.size());
+    for (size_t i = 0; i < records.size(); ++i)
+        EXPECT_EQ(read_records[i].payload, records[i].payload);
+    // every fetch not starting at a segment boundary (0 and 30) used the
+    // session
+    EXPECT_EQ(log.fetchSessionHits(), 12);
+
+    // another session or a jump falls back to the index
+    log.fetch({.offset = 5, .max_bytes = 2 * record_size, .session_id = 8});
+    log.fetch({.offset = 8, .max_bytes = 2 * record_size, .session_id = 8});
+    log.fetch({.offset = 10, .max_bytes = 2 * record_size, .session_id = 8});
+    EXPECT_EQ(log.fetchSessionHits(), 12);
+    auto result = log.fetch(
+        {.offset = 12, .max_bytes = 2 * record_size, .session_id = 8});
+    EXPECT_EQ(log.fetchSessionHits(), 13);
+    auto fetched = RecordManager::extract_records(result.result_buf);
+    ASSERT_EQ(fetched.size(), 2);
+    EXPECT_EQ(fetched[0].payload, records[12].payload);
+    EXPECT_EQ(fetched[1].payload, records[13].payload);
+}
+
+TEST_F(StorageEngineTests, LogPlanFetchAcrossSegments) {
+    std::filesystem::path dir = getDir() / "LogPlanFetchAcrossSegments";
+    LogConfig config;
+    config.tail_cache_size = 0;
+    auto records = generate_records(8, 25);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    Log log(dir, 10 * record_size, config);
+    log.start();
+    for (auto &record : records) {
+        auto bytes = record.to_bytes();
+        log.append(bytes.data(), bytes.size());
+    }
+
+    // from the middle of the first segment into the active one
+    auto ranges = log.planFetch({.offset = 7, .max_bytes = 15 * record_size});
+    ASSERT_EQ(ranges.size(), 3);
+    EXPECT_EQ(ranges[0].segment->getBaseOffset(), 0);
+    EXPECT_EQ(ranges[0].file_offset, 7 * record_size);
+    EXPECT_EQ(ranges[0].length, 3 * record_size);
+    EXPECT_EQ(ranges[1].segment->getBaseOffset(), 10);
+    EXPECT_EQ(ranges[1].file_offset, 0);
+    EXPECT_EQ(ranges[1].length, 10 * record_size);
+    EXPECT_EQ(ranges[2].segment->getBaseOffset(), 20);
+    EXPECT_EQ(ranges[2].length, 2 * record_size);
+    EXPECT_EQ(ranges[2].fd, ranges[2].segment->getFileDescriptor());
+
+    // a partial record at the end is not planned
+    auto result = log.fetch({.offset = 7, .max_bytes = 15 * record_size - 1});
+    auto fetched = RecordManager::extract_records(result.result_buf);
+    ASSERT_EQ(fetched.size(), 14);
+    for (size_t i = 0; i < fetched.size(); ++i)
+        EXPECT_EQ(fetched[i].payload, records[7 + i].payload);
+    result = log.fetch({.offset = 7, .max_bytes = 1024 * record_size});
+    EXPECT_EQ(result.result_buf.size(), 18 * record_size);
+    EXPECT_TRUE(log.planFetch({.offset = 24, .max_bytes = 1}).empty());
+}
+
+TEST_F(StorageEngineTests, LogMmapSealedSegments) {
+    std::filesystem::path dir = getDir() / "LogMmapSealedSegments";
+    LogConfig config;
+    config.mmap_sealed_segments = true;
+    auto records = generate_records(8, 25);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    std::vector<uint8_t> expected;
+    for (int restart = 0; restart < 2; ++restart) {
+        // the second round reads segments sealed by recovery
+        Log log(dir, 10 * record_size, config);
+        log.start();
+        if (restart == 0) {
+            for (auto &record : records) {
+                auto bytes = record.to_bytes();
+                log.append(bytes.data(), bytes.size());
+                auto with_len = record.to_bytes_with_len();
+                expected.insert(expected.end(), with_len.begin(),
+                                with_len.end());
+            }
+        }
+
+        auto result = log.fetch({.offset = 3, .max_bytes = 1024 * record_size});
+        EXPECT_TRUE(result.result_buf.empty());
+        // two mapped sealed segments and a copy of the active one
+        ASSERT_EQ(result.slices.size(), 3);
+        EXPECT_EQ(result.slices[0].size, 7 * record_size);
+        EXPECT_EQ(result.slices[1].size, 10 * record_size);
+        EXPECT_EQ(result.slices[2].size, 5 * record_size);
+        std::vector<uint8_t> bytes;
+        for (const auto &slice : result.slices)
+            bytes.insert(bytes.end(), slice.data, slice.data + slice.size);
+        EXPECT_EQ(bytes,
+                  std::vector<uint8_t>(expected.begin() + 3 * record_size,
+                                       expected.end()));
+
+        // record boundaries inside a mapped segment
+        result = log.fetch({.offset = 12, .max_bytes = 3 * record_size - 1});
+        ASSERT_EQ(result.slices.size(), 1);
+        EXPECT_EQ(result.slices[0].size, 2 * record_size);
+        EXPECT_EQ(std::memcmp(result.slices[0].data,
+                              expected.data() + 12 * record_size,
+                              2 * record_size),
+                  0);
+        EXPECT_EQ(result.size(), 2 * record_size);
+    }
+}
+
+TEST_F(StorageEngineTests, LogSegmentCacheLimitsOpenSegments) {
+    std::filesystem::path dir = getDir() / "LogSegmentCacheLimitsOpenSegments";
+    LogConfig config;
+    config.max_open_sealed_segments = 2;
+    config.mmap_sealed_segments = true;
+    auto records = generate_records(8, 50);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    for (int restart = 0; restart < 2; ++restart) {
+        Log log(dir, 5 * record_size, config);
+        log.start();
+        if (restart == 0) {
+            for (auto &record : records) {
+                auto bytes = record.to_bytes();
+                log.append(bytes.data(), bytes.size());
+            }
+        }
+        EXPECT_LE(log.openSealedSegments(), 2);
+
+        // slices of the first segment pin it after it has been closed
+        auto pinned = log.fetch({.offset = 0, .max_bytes = 5 * record_size});
+        ASSERT_EQ(pinned.slices.size(), 1);
+        for (uint64_t offset = 0; offset < records.size(); ++offset) {
+            auto result = log.fetch({.offset = offset, .max_bytes = 1});
+            result = log.fetch({.offset = offset, .max_bytes = record_size});
+            std::vector<uint8_t> bytes = result.result_buf;
+            for (const auto &slice : result.slices)
+                bytes.insert(bytes.end(), slice.data, slice.data + slice.size);
+            auto fetched = RecordManager::extract_records(bytes);
+            ASSERT_EQ(fetched.size(), 1);
+            EXPECT_EQ(fetched[0].payload, records[offset].payload);
+            EXPECT_LE(log.openSealedSegments(), 2);
+        }
+        std::vector<uint8_t> bytes(pinned.slices[0].data,
+                                   pinned.slices[0].data +
+                                       pinned.slices[0].size);
+        auto fetched = RecordManager::extract_records(bytes);
+        ASSERT_EQ(fetched.size(), 5);
+        EXPECT_EQ(fetched[4].payload, records[4].payload);
+    }
+}
+
+TEST_F(StorageEngineTests, LogLazySegmentRecovery) {
+    std::filesystem::path dir = getDir() / "LogLazySegmentRecovery";
+    auto records = generate_records(8, 9);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    {
+        Log log(dir, 2 * record_size);
+        log.start();
+        for (auto &record : records) {
+            auto bytes = record.to_bytes();
+            log.append(bytes.data(), bytes.size());
+        }
+    }
+    // a torn index of a sealed segment is rebuilt on its first read
+    auto base_offsets = getSortedBaseOffsets(dir);
+    ASSERT_EQ(base_offsets.size(), 5);
+    std::filesystem::resize_file(Index::filePath(dir, base_offsets[1]),
+                                 INDEX_HEADER_SIZE + INDEX_ENTRY_SIZE);
+
+    Log log(dir, 2 * record_size);
+    log.start();
+    EXPECT_EQ(log.openSealedSegments(), 0);
+    EXPECT_EQ(log.getPublishedOffset(), records.size() - 1);
+    for (uint64_t offset = 0; offset < records.size(); ++offset) {
+        auto result = log.fetch({.offset = offset, .max_bytes = record_size});
+        auto fetched = RecordManager::extract_records(result.result_buf);
+        ASSERT_EQ(fetched.size(), 1);
+        EXPECT_EQ(fetched[0].payload, records[offset].payload);
+    }
+    EXPECT_EQ(log.openSealedSegments(), base_offsets.size() - 1);
+    // rebuilt and finalized: two entries and the search tree with 3 slots
+    EXPECT_EQ(std::filesystem::file_size(Index::filePath(dir, base_offsets[1])),
+              INDEX_HEADER_SIZE + 5 * INDEX_ENTRY_SIZE);
+}
+
+TEST_F(StorageEngineTests, LogDamagedSealedSegment) {
+    std::filesystem::path dir = getDir() / "LogDamagedSealedSegment";
+    auto records = generate_records(8, 9);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    {
+        Log log(dir, 2 * record_size);
+        log.start();
+        for (auto &record : records) {
+            auto bytes = record.to_bytes();
+            log.append(bytes.data(), bytes.size());
+        }
+    }
+    // damage the second record of a sealed segment whose index is torn
+    auto base_offsets = getSortedBaseOffsets(dir);
+    ASSERT_EQ(base_offsets.size(), 5);
+    std::filesystem::resize_file(Index::filePath(dir, base_offsets[1]),
+                                 INDEX_HEADER_SIZE + INDEX_ENTRY_SIZE);
+    {
+        std::fstream file(Segment::filePath(dir, base_offsets[1]),
+                          std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(2 * record_size - 1);
+        file.put(static_cast<char>(0xFF));
+    }
+
+    Log log(dir, 2 * record_size);
+    log.start();
+    for (uint64_t offset = 0; offset < records.size(); ++offset) {
+        if (offset >= base_offsets[1] && offset < base_offsets[2]) {
+            EXPECT_THROW(
+                log.fetch({.offset = offset, .max_bytes = record_size}),
+                std::runtime_error);
+            continue;
+        }
+        auto result = log.fetch({.offset = offset, .max_bytes = record_size});
+        auto fetched = RecordManager::extract_records(result.result_buf);
+        ASSERT_EQ(fetched.size(), 1);
+        EXPECT_EQ(fetched[0].payload, records[offset].payload);
+    }
+}
+
+TEST_F(StorageEngineTests, LogTieredStorage) {
+    std::filesystem::path dir = getDir() / "LogTieredStorage";
+    auto records = generate_records(8, 40);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    LogConfig config;
+    config.remote_store =
+        std::make_shared<DirectoryRemoteStore>(getDir() / "Remote");
+    // the two newest sealed segments stay local
+    config.local_retention_bytes = 8 * record_size;
+    config.remote_chunk_size = 20;
+    auto check_fetches = [&](Log &log, uint64_t count) {
+        for (uint64_t offset = 0; offset < count; ++offset) {
+            auto result =
+                log.fetch({.offset = offset, .max_bytes = record_size});
+            auto fetched = RecordManager::extract_records(result.result_buf);
+            ASSERT_EQ(fetched.size(), 1);
+            EXPECT_EQ(fetched[0].payload, records[offset].payload);
+        }
+        // across remote and local segments
+        auto result = log.fetch({.offset = 0, .max_bytes = 64 * record_size});
+        auto fetched = RecordManager::extract_records(result.result_buf);
+        ASSERT_EQ(fetched.size(), count);
+        for (uint64_t offset = 0; offset < count; ++offset)
+            EXPECT_EQ(fetched[offset].payload, records[offset].payload);
+    };
+    {
+        Log log(dir, 4 * record_size, config);
+        log.start();
+        for (auto &record : records) {
+            auto bytes = record.to_bytes();
+            log.append(bytes.data(), bytes.size());
+        }
+        log.tierSegments();
+        // 9 sealed segments of 4 records, the 7 oldest are remote only
+        EXPECT_EQ(log.remoteSegments(), 7);
+        EXPECT_EQ(getSortedBaseOffsets(dir).size(), 3);
+        // index and log of each and the newest producer snapshot
+        EXPECT_EQ(config.remote_store->list().size(), 19);
+        check_fetches(log, records.size());
+        log.tierSegments();
+        EXPECT_EQ(log.remoteSegments(), 7);
+    }
+    {
+        Log log(dir, 4 * record_size, config);
+        log.start();
+        EXPECT_EQ(log.remoteSegments(), 7);
+        EXPECT_EQ(log.getPublishedOffset(), records.size() - 1);
+        check_fetches(log, records.size());
+    }
+    // without the local files the log continues after the remote segments
+    std::filesystem::remove_all(dir);
+    Log log(dir, 4 * record_size, config);
+    log.start();
+    EXPECT_EQ(log.remoteSegments(), 9);
+    check_fetches(log, 36);
+    auto bytes = records[0].to_bytes();
+    EXPECT_EQ(log.append(bytes.data(), bytes.size()), 36);
+}
+
+TEST_F(StorageEngineTests, LogTieredSegmentsReleaseFiles) {
+    std::filesystem::path dir = getDir() / "LogTieredSegmentsReleaseFiles";
+    auto records = generate_records(8, 40);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    LogConfig config;
+    config.remote_store =
+        std::make_shared<DirectoryRemoteStore>(getDir() / "Remote");
+    config.local_retention_bytes = 8 * record_size;
+    // the files of the log that are unlinked but still open
+    auto deleted_open_files = [&]() {
+        size_t count = 0;
+        for (auto &fd : std::filesystem::directory_iterator("/proc/self/fd")) {
+            std::error_code ec;
+            auto target = std::filesystem::read_symlink(fd.path(), ec).string();
+            if (!ec && target.starts_with(dir.string()) &&
+                target.ends_with(" (deleted)"))
+                ++count;
+        }
+        return count;
+    };
+    Log log(dir, 4 * record_size, config);
+    log.start();
+    for (auto &record : records) {
+        auto bytes = record.to_bytes();
+        log.append(bytes.data(), bytes.size());
+    }
+    // opens every sealed segment
+    auto result = log.fetch({.offset = 0, .max_bytes = 64 * record_size});
+    ASSERT_EQ(RecordManager::extract_records(result.result_buf).size(),
+              records.size());
+    log.tierSegments();
+    ASSERT_EQ(log.remoteSegments(), 7);
+    EXPECT_EQ(deleted_open_files(), 0);
+}
+
+TEST_F(StorageEngineTests, RemoteSegmentFileLoadsChunks) {
+    std::filesystem::path dir = getDir() / "RemoteSegmentFile";
+    std::vector<uint8_t> data(100);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = i;
+    {
+        Index index(dir, 5, SegmentState::Active);
+        index.append({5, 0});
+    }
+    std::ofstream(Segment::filePath(dir, 5), std::ios::binary)
+        .write(reinterpret_cast<const char *>(data.data()), data.size());
+    auto store = std::make_shared<DirectoryRemoteStore>(getDir() / "Remote");
+    store->upload(Index::filePath(dir, 5).filename(), Index::filePath(dir, 5));
+    store->upload(Segment::filePath(dir, 5).filename(),
+                  Segment::filePath(dir, 5));
+    EXPECT_EQ(store->size(Segment::filePath(dir, 5).filename()), 100);
+    EXPECT_EQ(store->size("missing"), std::nullopt);
+
+    std::filesystem::path cache_dir;
+    {
+        RemoteSegmentFile file(store, getDir() / "Cache", 5, 30);
+        cache_dir = file.dir();
+        EXPECT_EQ(std::filesystem::file_size(Segment::filePath(cache_dir, 5)),
+                  100);
+        EXPECT_EQ(file.loadedChunks(), 0);
+        file.load(25, 10);
+        EXPECT_EQ(file.loadedChunks(), 2);
+        file.load(95, 100);
+        EXPECT_EQ(file.loadedChunks(), 3);
+        std::vector<uint8_t> cached(100);
+        std::ifstream(Segment::filePath(cache_dir, 5), std::ios::binary)
+            .read(reinterpret_cast<char *>(cached.data()), cached.size());
+        EXPECT_EQ(cached[0], 0);
+        EXPECT_EQ(cached[59], 59);
+        EXPECT_EQ(cached[60], 0); // not loaded yet
+        EXPECT_EQ(cached[99], 99);
+        Index index(cache_dir, 5, SegmentState::Sealed);
+        EXPECT_EQ(index.entries(), 1);
+    }
+    EXPECT_FALSE(std::filesystem::exists(cache_dir));
+}
+
+TEST_F(StorageEngineTests, LogMemoryBackend) {
+    std::filesystem::path dir = getDir() / "LogMemoryBackend";
+    auto storage = std::make_shared<MemoryBackend>();
+    LogConfig config;
+    config.storage = storage;
+    config.mmap_sealed_segments = true;
+    auto records = generate_records(8, 40);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    std::vector<uint8_t> expected;
+    for (auto &record : records) {
+        auto with_len = record.to_bytes_with_len();
+        expected.insert(expected.end(), with_len.begin(), with_len.end());
+    }
+    for (int restart = 0; restart < 2; ++restart) {
+        // the second round recovers from the files in memory
+        Log log(dir, 4 * record_size, config);
+        log.start();
+        if (restart == 0) {
+            for (auto &record : records) {
+                auto bytes = record.to_bytes();
+                log.append(bytes.data(), bytes.size());
+            }
+        }
+        EXPECT_EQ(log.getPublishedOffset(), records.size() - 1);
+        EXPECT_EQ(log.firstOffset(), 0);
+        // 9 sealed segments, the active one and two producer snapshots
+        EXPECT_EQ(storage->list(dir).size(), 22);
+        EXPECT_FALSE(std::filesystem::exists(dir));
+
+        auto result = log.fetch({.offset = 2, .max_bytes = 64 * record_size});
+        std::vector<uint8_t> bytes = result.result_buf;
+        for (const auto &slice : result.slices)
+            bytes.insert(bytes.end(), slice.data, slice.data + slice.size);
+        EXPECT_EQ(bytes,
+                  std::vector<uint8_t>(expected.begin() + 2 * record_size,
+                                       expected.end()));
+    }
+    storage->remove(Segment::filePath(dir, 0));
+    EXPECT_FALSE(storage->exists(Segment::filePath(dir, 0)));
+    EXPECT_TRUE(storage->exists(Segment::filePath(dir / "", 4)));
+    EXPECT_EQ(storage->list(dir / "").size(), 21);
+}
+
+TEST_F(StorageEngineTests, LogMemoryBackendEviction) {
+    std::filesystem::path dir = getDir() / "LogMemoryBackendEviction";
+    const uint64_t capacity = 1024;
+    auto storage = std::make_shared<MemoryBackend>(capacity);
+    LogConfig config;
+    config.storage = storage;
+    auto records = generate_records(8, 200);
+    const size_t record_size = SEGMENT_HEADER_SIZE + 12;
+    Log log(dir, 4 * record_size, config);
+    log.start();
+    for (auto &record : records) {
+        auto bytes = record.to_bytes();
+        log.append(bytes.data(), bytes.size());
+        // the active segment comes on top of the capacity
+        EXPECT_LE(storage->usedBytes(), capacity + 8 * record_size);
+    }
+    uint64_t first_offset = log.firstOffset();
+    EXPECT_GT(first_offset, 0);
+    EXPECT_EQ(first_offset % 4, 0);
+    EXPECT_THROW(log.fetch({.offset = first_offset - 1, .max_bytes = 1024}),
+                 std::out_of_range);
+    auto result =
+        log.fetch({.offset = first_offset, .max_bytes = 1024 * record_size});
+    auto fetched = RecordManager::extract_records(result.result_buf);
+    ASSERT_EQ(fetched.size(), records.size() - first_offset);
+    for (size_t i = 0; i < fetched.size(); ++i)
+        EXPECT_EQ(fetched[i].payload, records[first_offset + i].payload);
+}
+
+TEST_F(StorageEngineTests, ProducerSequenceCheck) {
+    EXPECT_EQ(checkSequence(std::nullopt, 0), SequenceCheck::InSequence);
+    EXPECT_EQ(checkSequence(std::nullopt, 1), SequenceCheck::OutOfSequence);
+    EXPECT_EQ(checkSequence(4, 5), SequenceCheck::InSequence);
+    EXPECT_EQ(checkSequence(4, 4), SequenceCheck::Duplicate);
+    EXPECT_EQ(checkSequence(4, 0), SequenceCheck::Duplicate);
+    EXPECT_EQ(checkSequence(4, 6), SequenceCheck::OutOfSequence);
+    // sequences wrap around
+    uint32_t max = std::numeric_limits<uint32_t>::max();
+    EXPECT_EQ(checkSequence(max, 0), SequenceCheck::InSequence);
+    EXPECT_EQ(checkSequence(0, max), SequenceCheck::Duplicate);
+}
+
+TEST_F(StorageEngineTests, LogRecoversProducerState) {
+    std::filesystem::path dir = getDir() / "LogRecoversProducerState";
+    auto check = [](const Log &log) {
+        EXPECT_EQ(log.producers().size(), 2);
+        EXPECT_EQ(log.producers().lastSequence(1), 14);
+        EXPECT_EQ(log.producers().lastSequence(2), 14);
+        EXPECT_EQ(log.producers().lastSequence(3), std::nullopt);
+    };
+    {
+        Log log(dir, 200);
+        log.start();
+        for (uint32_t sequence = 0; sequence < 15; ++sequence) {
+            for (uint64_t producer_id : {1, 2}) {
+                auto batch = RecordManager::create_batch(
+                    {{1, 2, 3}}, CompressionCodec::None,
+                    {.producer_id = producer_id, .sequence = sequence});
+                auto bytes = batch.to_bytes();
+                log.append(bytes.data(), bytes.size(), batch.attributes);
+            }
+            // looks like a producer batch, but is a plain record
+            std::vector<uint8_t> payload(PRODUCER_BATCH_HEADER_SIZE + 8, 3);
+            std::memcpy(payload.data(), "KLPB", 4);
+            auto bytes = RecordManager::create_record(payload).to_bytes();
+            log.append(bytes.data(), bytes.size());
+        }
+        check(log);
+    }
+    std::vector<std::filesystem::path> snapshots;
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == ".producers")
+            snapshots.push_back(entry.path());
+    }
+    std::sort(snapshots.begin(), snapshots.end());
+    // only the two newest are kept
+    ASSERT_EQ(snapshots.size(), 2);
+    {
+        Log log(dir, 200);
+        log.start();
+        check(log);
+    }
+    // a damaged snapshot falls back to the older one
+    std::filesystem::resize_file(snapshots.back(), 10);
+    {
+        Log log(dir, 200);
+        log.start();
+        check(log);
+    }
+    // without snapshots the whole log is replayed, once (the fallback above
+    // has written one at the end offset)
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == ".producers")
+            std::filesystem::remove(entry.path());
+    }
+    Log log(dir, 200);
+    log.start();
+    check(log);
+    EXPECT_TRUE(std::filesystem::exists(
+        ProducerStateTable::filePath(dir, log.endOffset())));
+}
+
+TEST_F(StorageEngineTests, LogRecoversProducerStateFromRemote) {
+    std::filesystem::path dir = getDir() / "LogRecoversProducerStateFromRemote";
+    LogConfig config;
+    config.remote_store =
+        std::make_shared<DirectoryRemoteStore>(getDir() / "Remote");
+    config.local_retention_bytes = 0;
+    {
+        Log log(dir, 200, config);
+        log.start();
+        for (uint32_t sequence = 0; sequence < 15; ++sequence) {
+            auto batch = RecordManager::create_batch(
+                {{1, 2, 3}}, CompressionCodec::None,
+                {.producer_id = 1, .sequence = sequence});
+            auto bytes = batch.to_bytes();
+            log.append(bytes.data(), bytes.size(), batch.attributes);
+        }
+        log.tierSegments();
+        ASSERT_GT(log.remoteSegments(), 0);
+    }
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == ".producers")
+            std::filesystem::remove(entry.path());
+    }
+    Log log(dir, 200, config);
+    log.start();
+    EXPECT_EQ(log.producers().lastSequence(1), 14);
+    // the snapshot uploaded with the tiered segments spares their download
+    EXPECT_EQ(std::filesystem::exists(dir / "remote-cache") &&
+                  !std::filesystem::is_empty(dir / "remote-cache"),
+              false);
+}
+
+TEST_F(StorageEngineTests, LogTailCacheStats) {
+    std::filesystem::path dir = getDir() / "LogTailCacheStats";
+    LogConfig config;
+    config.tail_cache_size = 1024;
+    Log log(dir, 4 * (SEGMENT_HEADER_SIZE + 1), config);
+    log.start();
+    std::vector<uint8_t> data(20);
+    for (uint8_t i = 0; i < 20; ++i) {
+        data[i] = i;
+        ASSERT_EQ(log.append(&data[i], 1), i);
+        // tail fetch right after the append, the record is in the cache
+        auto result = log.fetch({i, 1024});
+        ASSERT_EQ(result.result_buf.size(), SEGMENT_HEADER_SIZE + 1);
+        ASSERT_EQ(result.result_buf.back(), i);
+    }
+    auto stats = log.tailCacheStats();
+    EXPECT_EQ(stats.hits, 20);
+    EXPECT_EQ(stats.misses, 0);
+
+    config.tail_cache_size = 0;
+    Log uncached_log(getDir() / "LogTailCacheStatsUncached", 1024, config);
+    uncached_log.start();
+    uncached_log.append(data.data(), 1);
+    ASSERT_EQ(uncached_log.fetch({0, 1024}).result_buf.size(),
+              SEGMENT_HEADER_SIZE + 1);
+    stats = uncached_log.tailCacheStats();
+    EXPECT_EQ(stats.hits, 0);
+    EXPECT_EQ(stats.misses, 0);
+}
+
 using crc32c_type =
     boost::crc_optimal<32, 0x1EDC6F41, 0xFFFFFFFF, 0xFFFFFFFF, true, true>;
 
@@ -501,7 +1359,6 @@ TEST_F(StorageEngineTests, LogRecoveryNoIndex) {
     std::vector<uint32_t> checksums;
     std::vector<uint64_t> offsets;
     std::vector<uint8_t> buf;
-    uint64_t truncate_pos = 0;
     {
         Log log(dir, 1024);
         log.start();
@@ -563,26 +1420,12 @@ TEST_F(StorageEngineTests, LogRecoveryNoIndex) {
     }
 }
 
-std::vector<uint64_t> getSortedBaseOffsets(const std::filesystem::path &dir) {
-    std::vector<uint64_t> base_offsets;
-    std::string filename;
-    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
-        filename = entry.path().filename().string();
-        if (filename.compare(filename.size() - 4, 4, ".log") == 0)
-            base_offsets.push_back(std::stoll(
-                filename.substr(0, filename.size() - 4), nullptr, 10));
-    }
-    std::sort(base_offsets.begin(), base_offsets.end());
-    return base_offsets;
-}
-
 TEST_F(StorageEngineTests, LogRecoveryAfterRolloverFsync) {
     std::filesystem::path dir = getDir() / "LogRecoveryAfterRolloverFsync";
     crc32c_type crc32c;
     std::vector<uint32_t> checksums;
     std::vector<uint64_t> offsets, base_offsets;
     std::vector<uint8_t> buf;
-    uint64_t truncate_pos = 0;
     {
         Log log(dir, 32);
         log.start();
@@ -634,7 +1477,7 @@ TEST_F(StorageEngineTests, LogRecoveryAfterRolloverFsync) {
     ASSERT_EQ(result.result_buf.size(),
               (offsets.size() - 1) *
                   (SEGMENT_HEADER_SIZE + 10 + sizeof(uint32_t)));
-    for (int i = 0; i < offsets.size() - 1; ++i) {
+    for (size_t i = 0; i + 1 < offsets.size(); ++i) {
         std::memcpy(&checksum,
                     result.result_buf.data() +
                         i * (SEGMENT_HEADER_SIZE + 10 + sizeof(uint32_t)) +
@@ -658,7 +1501,6 @@ TEST_F(StorageEngineTests, LogRolloverTruncateActiveSegment) {
     std::vector<uint32_t> checksums;
     std::vector<uint64_t> offsets, base_offsets;
     std::vector<uint8_t> buf;
-    uint64_t truncate_pos = 0;
     {
         Log log(dir, 32);
         log.start();
@@ -711,7 +1553,7 @@ TEST_F(StorageEngineTests, LogRolloverTruncateActiveSegment) {
     ASSERT_EQ(result.result_buf.size(),
               (offsets.size() - 1) *
                   (SEGMENT_HEADER_SIZE + 10 + sizeof(uint32_t)));
-    for (int i = 0; i < offsets.size() - 1; ++i) {
+    for (size_t i = 0; i + 1 < offsets.size(); ++i) {
         std::memcpy(&checksum,
                     result.result_buf.data() +
                         i * (SEGMENT_HEADER_SIZE + 10 + sizeof(uint32_t)) +
@@ -766,11 +1608,12 @@ TEST_F(StorageEngineTests, IndexRW) {
             ASSERT_TRUE(entry_opt.has_value());
             EXPECT_EQ(entry_opt.value().offset, i);
             EXPECT_EQ(entry_opt.value().file_position, file_pos);
+            EXPECT_EQ(index.entryOf(i)->file_position, file_pos);
             file_pos += 25 * (i % 4 + 1);
         }
+        EXPECT_FALSE(index.entryOf(1000).has_value());
     }
     Index index(dir, 0, SegmentState::Sealed);
-    IndexFileEntry entry;
     std::optional<IndexFileEntry> entry_opt;
     uint32_t file_pos = 0;
     for (uint64_t i = 0; i < 10; ++i) {
@@ -805,7 +1648,6 @@ TEST_F(StorageEngineTests, IndexRWSparse) {
         }
     }
     Index index(dir, 0, SegmentState::Sealed);
-    IndexFileEntry entry;
     std::optional<IndexFileEntry> entry_opt;
     uint32_t file_pos = 0;
     for (uint64_t i = 2; i < 1000; ++i) {
@@ -815,6 +1657,179 @@ TEST_F(StorageEngineTests, IndexRWSparse) {
         EXPECT_EQ(entry_opt.value().file_position, file_pos);
         file_pos += 25 * (i % 4 + 1);
     }
+    // not at its ordinal, only the search finds it
+    EXPECT_FALSE(index.entryOf(9).has_value());
+}
+
+TEST_F(StorageEngineTests, IndexCompactFormat) {
+    std::filesystem::path dir = getDir() / "IndexCompactFormat";
+    const uint64_t base_offset = 1ull << 40;
+    {
+        Index index(dir, base_offset, SegmentState::Active);
+        for (uint64_t i = 0; i < 100; ++i)
+            index.append({base_offset + 2 * i, static_cast<uint32_t>(i * 30)});
+        EXPECT_THROW(index.append({base_offset + (1ull << 32), 3000}),
+                     std::overflow_error);
+    }
+    EXPECT_EQ(std::filesystem::file_size(Index::filePath(dir, base_offset)),
+              INDEX_HEADER_SIZE + 100 * INDEX_ENTRY_SIZE);
+    Index index(dir, base_offset, SegmentState::Sealed);
+    EXPECT_EQ(index.entries(), 100);
+    for (uint64_t i = 0; i < 100; ++i) {
+        auto entry = index.determineClosestIndex(base_offset + 2 * i + 1);
+        ASSERT_TRUE(entry.has_value());
+        EXPECT_EQ(entry->offset, base_offset + 2 * i);
+        EXPECT_EQ(entry->file_position, i * 30);
+    }
+    EXPECT_EQ(index.determineClosestIndex(0)->offset, base_offset);
+    EXPECT_EQ(index.determineClosestIndex(base_offset + (1ull << 33))->offset,
+              base_offset + 198);
+    EXPECT_EQ(index.findByFilePosition(100)->offset, base_offset + 6);
+}
+
+TEST_F(StorageEngineTests, IndexWidePositions) {
+    std::filesystem::path dir = getDir() / "IndexWidePositions";
+    const uint64_t base_offset = 500;
+    {
+        Index index(dir, 0, SegmentState::Active);
+        EXPECT_THROW(index.append({0, 1ull << 32}), std::overflow_error);
+    }
+    {
+        Index index(dir, base_offset, SegmentState::Active, true);
+        for (uint64_t i = 0; i < 100; ++i)
+            index.append({base_offset + 2 * i, i << 28});
+        auto entry = index.findByFilePosition((50ull << 28) + 1);
+        ASSERT_TRUE(entry.has_value());
+        EXPECT_EQ(entry->offset, base_offset + 100);
+        index.seal();
+        EXPECT_EQ(index.determineClosestIndex(base_offset + 199)->file_position,
+                  99ull << 28);
+    }
+    EXPECT_EQ(std::filesystem::file_size(Index::filePath(dir, base_offset)),
+              INDEX_HEADER_SIZE + 100 * INDEX_WIDE_ENTRY_SIZE);
+    Index index(dir, base_offset, SegmentState::Sealed);
+    EXPECT_EQ(index.entries(), 100);
+    for (uint64_t i = 0; i < 100; ++i) {
+        auto entry = index.determineClosestIndex(base_offset + 2 * i + 1);
+        ASSERT_TRUE(entry.has_value());
+        EXPECT_EQ(entry->offset, base_offset + 2 * i);
+        EXPECT_EQ(entry->file_position, i << 28);
+        entry = index.findByFilePosition((i << 28) + 10);
+        ASSERT_TRUE(entry.has_value());
+        EXPECT_EQ(entry->offset, base_offset + 2 * i);
+    }
+    EXPECT_EQ(index.determineClosestIndex(0)->offset, base_offset);
+}
+
+TEST_F(StorageEngineTests, IndexSearchTree) {
+    std::filesystem::path dir = getDir() / "IndexSearchTree";
+    // every shape of the last tree level, up to a few full levels
+    for (uint64_t count = 1; count <= 40; ++count) {
+        const uint64_t base_offset = 1000 * count;
+        {
+            Index index(dir, base_offset, SegmentState::Active);
+            for (uint64_t i = 0; i < count; ++i)
+                index.append({base_offset + 3 * i + 1,
+                              static_cast<uint32_t>(10 * i)});
+            index.finalize();
+        }
+        EXPECT_EQ(std::filesystem::file_size(Index::filePath(dir, base_offset)),
+                  INDEX_HEADER_SIZE + (2 * count + 1) * INDEX_ENTRY_SIZE);
+        Index index(dir, base_offset, SegmentState::Sealed);
+        ASSERT_EQ(index.entries(), count);
+        // before the first entry the first one is returned
+        EXPECT_EQ(index.determineClosestIndex(base_offset)->offset,
+                  base_offset + 1);
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t offset = base_offset + 3 * i + 1;
+            for (uint64_t delta = 0; delta < 3; ++delta) {
+                auto entry = index.determineClosestIndex(offset + delta);
+                ASSERT_TRUE(entry.has_value());
+                EXPECT_EQ(entry->offset, base_offset + 3 * i + 1);
+                EXPECT_EQ(entry->file_position, 10 * i);
+            }
+            auto entry = index.findByFilePosition(10 * i + 9);
+            ASSERT_TRUE(entry.has_value());
+            EXPECT_EQ(entry->offset, base_offset + 3 * i + 1);
+        }
+        auto last = index.determineClosestIndex(base_offset + (1ull << 33));
+        EXPECT_EQ(last->offset, base_offset + 3 * count - 2);
+    }
+}
+
+TEST_F(StorageEngineTests, IndexSearchKernels) {
+    std::vector<SearchKernel> kernels{SearchKernel::Scalar};
+    if (defaultSearchKernel() != SearchKernel::Scalar)
+        kernels.push_back(SearchKernel::Sse2);
+    if (defaultSearchKernel() == SearchKernel::Avx2)
+        kernels.push_back(SearchKernel::Avx2);
+    std::mt19937 rng(7);
+    for (uint64_t count : {0, 1, 2, 3, 5, 31, 32, 33, 67, 1000}) {
+        // offsets in the low, positions in the high half, both increasing
+        std::vector<uint32_t> offsets(count), positions(count);
+        std::vector<uint64_t> entries(count);
+        uint32_t offset = rng() % 3, position = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            offsets[i] = offset;
+            positions[i] = position;
+            // above 2^31 as well, the kernels compare signed
+            position += 1 + rng() % (1u << 22);
+            offset += 1 + rng() % 3;
+            uint64_t raw =
+                static_cast<uint64_t>(positions[i]) << 32 | offsets[i];
+            entries[i] = is_big_endian() ? byteswap64(raw) : raw;
+        }
+        const char *data = reinterpret_cast<const char *>(entries.data());
+        for (int probe = 0; probe < 200; ++probe) {
+            uint32_t offset_key = rng() % (offset + 3);
+            uint32_t position_key = rng() % (position + 10);
+            uint64_t by_offset =
+                std::upper_bound(offsets.begin(), offsets.end(), offset_key) -
+                offsets.begin();
+            uint64_t by_position = std::upper_bound(positions.begin(),
+                                                    positions.end(),
+                                                    position_key) -
+                                   positions.begin();
+            for (auto kernel : kernels) {
+                ASSERT_EQ(searchEntries(data, count, offset_key, 0, kernel),
+                          by_offset);
+                ASSERT_EQ(searchEntries(data, count, position_key, 32, kernel),
+                          by_position);
+            }
+        }
+    }
+}
+
+TEST_F(StorageEngineTests, IndexReadsVersion0) {
+    std::filesystem::path dir = getDir() / "IndexReadsVersion0";
+    std::filesystem::create_directories(dir);
+    // 12 byte entries with absolute offsets, as written by older brokers
+    std::vector<uint8_t> file(10 * INDEX_V0_ENTRY_SIZE);
+    for (uint64_t i = 0; i < 10; ++i) {
+        uint64_t offset = 500 + i;
+        uint32_t file_position = i * 40;
+        if (is_big_endian()) {
+            offset = byteswap64(offset);
+            file_position = byteswap32(file_position);
+        }
+        std::memcpy(file.data() + i * INDEX_V0_ENTRY_SIZE, &offset,
+                    sizeof(offset));
+        std::memcpy(file.data() + i * INDEX_V0_ENTRY_SIZE + sizeof(offset),
+                    &file_position, sizeof(file_position));
+    }
+    {
+        std::ofstream out(Index::filePath(dir, 500), std::ios::binary);
+        out.write(reinterpret_cast<const char *>(file.data()), file.size());
+    }
+    Index index(dir, 500, SegmentState::Sealed);
+    EXPECT_EQ(index.entries(), 10);
+    for (uint64_t i = 0; i < 10; ++i) {
+        auto entry = index.determineClosestIndex(500 + i);
+        ASSERT_TRUE(entry.has_value());
+        EXPECT_EQ(entry->offset, 500 + i);
+        EXPECT_EQ(entry->file_position, i * 40);
+    }
+    EXPECT_EQ(index.findByFilePosition(85)->offset, 502);
 }
 
 TEST_F(StorageEngineTests, IndexMonotonic) {
@@ -844,6 +1859,7 @@ TEST_F(StorageEngineTests, IndexFindWhenEmpty) {
     Index index(dir, 0, SegmentState::Active);
     auto entry = index.determineClosestIndex(0);
     ASSERT_FALSE(entry.has_value());
+    ASSERT_FALSE(index.entryOf(0).has_value());
 }
 
 TEST_F(StorageEngineTests, LogRwLarge) {
@@ -873,10 +1889,10 @@ TEST_F(StorageEngineTests, SegmentReadOffsetInvalid) {
         segment.append(record.to_bytes().data(), record.to_bytes().size());
     }
     uint64_t offset = std::numeric_limits<uint64_t>::max();
-    auto fetch_result = segment.read(offset, 4096);
+    auto fetch_result = readSegment(segment, offset, 4096);
     ASSERT_TRUE(fetch_result.result_buf.empty());
     offset = std::numeric_limits<uint64_t>::min() - 1;
-    fetch_result = segment.read(offset, 4096);
+    fetch_result = readSegment(segment, offset, 4096);
     ASSERT_TRUE(fetch_result.result_buf.empty());
 }
 
@@ -888,16 +1904,16 @@ TEST_F(StorageEngineTests, SegmentReadMaxBytesInvalid) {
         segment.append(record.to_bytes().data(), record.to_bytes().size());
     }
     size_t max_bytes = std::numeric_limits<size_t>::max();
-    EXPECT_ANY_THROW(segment.read(50, max_bytes));
+    EXPECT_ANY_THROW(readSegment(segment, 50, max_bytes));
     max_bytes = std::numeric_limits<size_t>::max() - 1;
-    auto fetch_result = segment.read(50, max_bytes);
+    auto fetch_result = readSegment(segment, 50, max_bytes);
     auto fetched_records =
         RecordManager::extract_records(fetch_result.result_buf);
     EXPECT_EQ(fetched_records.size(), 50);
     max_bytes = std::numeric_limits<size_t>::min() - 1;
-    EXPECT_ANY_THROW(segment.read(50, max_bytes));
+    EXPECT_ANY_THROW(readSegment(segment, 50, max_bytes));
     max_bytes = -1;
-    EXPECT_ANY_THROW(segment.read(50, max_bytes));
+    EXPECT_ANY_THROW(readSegment(segment, 50, max_bytes));
 }
 
 } // namespace broker
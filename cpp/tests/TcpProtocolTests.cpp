@@ -1,5 +1,6 @@
 #include "../include/ByteSwap.h"
 #include "../include/TcpProtocol.h"
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <gtest/gtest.h>
@@ -86,7 +87,7 @@ TEST(TcpProtocolTests, HeaderUnknownFlags) {
     boost::uuids::uuid correlation_id = {{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad,
                                           0x11, 0xd1, 0x80, 0xb4, 0x00, 0xc0,
                                           0x4f, 0xd4, 0x30, 0xc8}};
-    TcpHeaders header_write{correlation_id, 0, RequestType::Append, 1};
+    TcpHeaders header_write{correlation_id, 0, RequestType::Append, 0x0100};
     auto bytes = header_write.to_bytes();
     ASSERT_TRUE(bytes.size() > correlation_id.size() + 1);
     TcpHeaders header_read;
@@ -94,6 +95,74 @@ TEST(TcpProtocolTests, HeaderUnknownFlags) {
     EXPECT_EQ(header_read.getParseError(), ParseError::ERR_UNSUPPORTED_FLAGS);
 }
 
+TEST(TcpProtocolTests, HeaderCodecFlags) {
+    boost::uuids::uuid correlation_id = {{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad,
+                                          0x11, 0xd1, 0x80, 0xb4, 0x00, 0xc0,
+                                          0x4f, 0xd4, 0x30, 0xc8}};
+    TcpHeaders header_write{correlation_id, 0, RequestType::Append,
+                            static_cast<uint16_t>(CompressionCodec::Zstd)};
+    TcpHeaders header_read;
+    ASSERT_TRUE(header_read.from_bytes(header_write.to_bytes()));
+    TcpRequest request{.headers = header_read};
+    auto append = std::get<AppendRequest>(request.to_specialized_type());
+    EXPECT_EQ(append.codec, CompressionCodec::Zstd);
+    // unknown codec
+    header_write = {correlation_id, 0, RequestType::Append, 7};
+    ASSERT_FALSE(header_read.from_bytes(header_write.to_bytes()));
+    EXPECT_EQ(header_read.getParseError(), ParseError::ERR_UNSUPPORTED_FLAGS);
+    // only appends have a codec
+    header_write = {correlation_id, 0, RequestType::Fetch, 1};
+    ASSERT_FALSE(header_read.from_bytes(header_write.to_bytes()));
+    EXPECT_EQ(header_read.getParseError(), ParseError::ERR_UNSUPPORTED_FLAGS);
+}
+
+TEST(TcpProtocolTests, HeaderAcksFlags) {
+    boost::uuids::uuid correlation_id = {{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad,
+                                          0x11, 0xd1, 0x80, 0xb4, 0x00, 0xc0,
+                                          0x4f, 0xd4, 0x30, 0xc8}};
+    TcpHeaders header_read;
+    // no acks bits are leader acks, like before there were acks
+    ASSERT_TRUE(header_read.from_bytes(
+        TcpHeaders{correlation_id, 0, RequestType::Append, 0}.to_bytes()));
+    TcpRequest request{.headers = header_read};
+    auto append = std::get<AppendRequest>(request.to_specialized_type());
+    EXPECT_EQ(append.acks, AppendAcks::Leader);
+    for (auto acks : {AppendAcks::None, AppendAcks::Durable}) {
+        TcpHeaders header_write{
+            correlation_id, 0, RequestType::Append,
+            appendFlags(CompressionCodec::Lz4, acks)};
+        ASSERT_TRUE(header_read.from_bytes(header_write.to_bytes()));
+        request = {.headers = header_read};
+        append = std::get<AppendRequest>(request.to_specialized_type());
+        EXPECT_EQ(append.codec, CompressionCodec::Lz4);
+        EXPECT_EQ(append.acks, acks);
+    }
+    TcpHeaders header_write{correlation_id, 0, RequestType::Append,
+                            3 << APPEND_ACKS_SHIFT};
+    ASSERT_FALSE(header_read.from_bytes(header_write.to_bytes()));
+    EXPECT_EQ(header_read.getParseError(), ParseError::ERR_UNSUPPORTED_FLAGS);
+}
+
+TEST(TcpProtocolTests, HeaderProducerFlag) {
+    boost::uuids::uuid correlation_id = {{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad,
+                                          0x11, 0xd1, 0x80, 0xb4, 0x00, 0xc0,
+                                          0x4f, 0xd4, 0x30, 0xc8}};
+    TcpHeaders header_read;
+    for (bool producer : {false, true}) {
+        TcpHeaders header_write{
+            correlation_id, 0, RequestType::Append,
+            appendFlags(CompressionCodec::None, AppendAcks::Leader, producer)};
+        ASSERT_TRUE(header_read.from_bytes(header_write.to_bytes()));
+        TcpRequest request{.headers = header_read};
+        auto append = std::get<AppendRequest>(request.to_specialized_type());
+        EXPECT_EQ(append.producer, producer);
+    }
+    TcpHeaders header_write{correlation_id, 0, RequestType::Fetch,
+                            APPEND_PRODUCER_FLAG};
+    ASSERT_FALSE(header_read.from_bytes(header_write.to_bytes()));
+    EXPECT_EQ(header_read.getParseError(), ParseError::ERR_UNSUPPORTED_FLAGS);
+}
+
 TEST(TcpProtocolTests, HeaderMissingCorrelationId) {
     boost::uuids::uuid correlation_id = {{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad,
                                           0x11, 0xd1, 0x80, 0xb4, 0x00, 0xc0,
@@ -157,6 +226,79 @@ TEST(TcpProtocolTests, TcpTequestToFetchRequest) {
     }
 }
 
+TEST(TcpProtocolTests, TcpRequestToLongPollFetchRequest) {
+    TcpHeaders headers{{{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad, 0x11, 0xd1, 0x80,
+                         0xb4, 0x00, 0xc0, 0x4f, 0xd4, 0x30, 0xc8}},
+                       0,
+                       RequestType::Fetch,
+                       0};
+    auto payload = TcpRequest::make_payload(200, 1024, 512, 250);
+    ASSERT_EQ(payload.size(), LONG_POLL_FETCH_PAYLOAD_LEN);
+    TcpRequest request{.headers = headers, .payload = payload};
+    auto fetch_request = std::get<FetchRequest>(request.to_specialized_type());
+    EXPECT_EQ(fetch_request.offset, 200);
+    EXPECT_EQ(fetch_request.max_bytes, 1024);
+    EXPECT_EQ(fetch_request.min_bytes, 512);
+    EXPECT_EQ(fetch_request.max_wait_ms, 250);
+
+    // short payloads of older clients do not wait
+    request.payload = TcpRequest::make_payload(200, 1024);
+    fetch_request = std::get<FetchRequest>(request.to_specialized_type());
+    EXPECT_EQ(fetch_request.min_bytes, 0);
+    EXPECT_EQ(fetch_request.max_wait_ms, 0);
+    EXPECT_EQ(fetch_request.session_id, 0);
+
+    request.payload = TcpRequest::make_payload(200, 1024, 0, 0, 0x1122334455);
+    ASSERT_EQ(request.payload.size(), SESSION_FETCH_PAYLOAD_LEN);
+    fetch_request = std::get<FetchRequest>(request.to_specialized_type());
+    EXPECT_EQ(fetch_request.offset, 200);
+    EXPECT_EQ(fetch_request.max_bytes, 1024);
+    EXPECT_EQ(fetch_request.session_id, 0x1122334455);
+}
+
+TEST(TcpProtocolTests, TcpRequestToReplicaSyncRequest) {
+    TcpHeaders headers{{{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad, 0x11, 0xd1, 0x80,
+                         0xb4, 0x00, 0xc0, 0x4f, 0xd4, 0x30, 0xc8}},
+                       0,
+                       RequestType::ReplicaSync,
+                       0};
+    TcpHeaders header_read;
+    ASSERT_TRUE(header_read.from_bytes(headers.to_bytes()));
+    EXPECT_EQ(header_read.type, RequestType::ReplicaSync);
+
+    auto payload = TcpRequest::make_replica_sync_payload(3, 200, 1024, 250);
+    ASSERT_EQ(payload.size(), REPLICA_SYNC_PAYLOAD_LEN);
+    TcpRequest request{.headers = headers, .payload = payload};
+    auto sync_request =
+        std::get<ReplicaSyncRequest>(request.to_specialized_type());
+    EXPECT_EQ(sync_request.correlation_id, headers.correlation_id);
+    EXPECT_EQ(sync_request.replica_id, 3);
+    EXPECT_EQ(sync_request.offset, 200);
+    EXPECT_EQ(sync_request.max_bytes, 1024);
+    EXPECT_EQ(sync_request.max_wait_ms, 250);
+
+    // short payloads get replica id 0, which the server rejects
+    request.payload = TcpRequest::make_payload(200, 1024);
+    sync_request = std::get<ReplicaSyncRequest>(request.to_specialized_type());
+    EXPECT_EQ(sync_request.replica_id, 0);
+
+    // the high watermark comes before the records
+    FetchResult result{.result_buf = {1, 2, 3}};
+    auto response = TcpResponse::makeResponse(headers.correlation_id, 0x0102,
+                                              std::move(result), {});
+    EXPECT_EQ(response.response_code, 0);
+    auto bytes = response.to_bytes();
+    std::vector<uint8_t> expected_payload{0, 0, 0, 0, 0, 0, 1, 2, 1, 2, 3};
+    ASSERT_GE(bytes.size(), expected_payload.size());
+    EXPECT_TRUE(std::equal(expected_payload.begin(), expected_payload.end(),
+                           bytes.end() - expected_payload.size()));
+    EXPECT_EQ(TcpResponse::makeResponse(
+                  headers.correlation_id, 0, FetchResult{},
+                  std::make_error_code(std::errc::operation_not_permitted))
+                  .response_code,
+              0x82);
+}
+
 TEST(TcpProtocolTests, TcpResponseToBytes) {
     std::vector<TcpResponse> responses{
         {.correlation_id = {{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad, 0x11, 0xd1,
@@ -348,5 +490,94 @@ TEST(TcpProtocolTests, TcpResponseFromFetchResultEc) {
     }
 }
 
+TEST(TcpProtocolTests, TcpResponsePrefixToBytes) {
+    std::vector<TcpResponse> responses = {
+        {.correlation_id = {{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad, 0x11, 0xd1,
+                             0x80, 0xb4, 0x00, 0xc0, 0x4f, 0xd4, 0x30, 0xc8}},
+         .response_code = 0,
+         .payload = {{1, 2, 3, 4, 5, 6, 7, 8}}},
+        {.correlation_id = {{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad, 0x11, 0xd1,
+                             0x80, 0xb4, 0x00, 0xc0, 0x4f, 0xd4, 0x30, 0xc8}},
+         .response_code = 0x81,
+         .payload = std::nullopt},
+    };
+    for (const auto &response : responses) {
+        auto prefix = response.prefix_to_bytes();
+        auto bytes = response.to_bytes();
+        ASSERT_GE(bytes.size(), prefix.size());
+        EXPECT_TRUE(std::equal(prefix.begin(), prefix.end(), bytes.begin()));
+        std::vector<uint8_t> payload(bytes.begin() + prefix.size(),
+                                     bytes.end());
+        if (response.payload.has_value())
+            EXPECT_EQ(payload, response.payload.value());
+        else
+            EXPECT_TRUE(payload.empty());
+    }
+}
+
+std::vector<uint8_t> make_frame(const std::vector<uint8_t> &header_bytes,
+                                const std::vector<uint8_t> &payload) {
+    std::vector<uint8_t> frame;
+    auto append_len = [&frame](uint32_t len) {
+        if (!byteswap::is_big_endian())
+            len = byteswap::byteswap32(len);
+        uint8_t len_bytes[sizeof(len)];
+        std::memcpy(len_bytes, &len, sizeof(len));
+        frame.insert(frame.end(), len_bytes, len_bytes + sizeof(len));
+    };
+    append_len(header_bytes.size());
+    frame.insert(frame.end(), MAGIC_BYTES.begin(), MAGIC_BYTES.end());
+    frame.insert(frame.end(), header_bytes.begin(), header_bytes.end());
+    append_len(payload.size());
+    frame.insert(frame.end(), payload.begin(), payload.end());
+    return frame;
+}
+
+TEST(TcpProtocolTests, RequestFrameParse) {
+    TcpHeaders headers{{{0x6b, 0xa7, 0xb8, 0x10, 0x9d, 0xad, 0x11, 0xd1, 0x80,
+                         0xb4, 0x00, 0xc0, 0x4f, 0xd4, 0x30, 0xc8}},
+                       0,
+                       RequestType::Fetch,
+                       0};
+    auto payload = TcpRequest::make_payload(17, 4096);
+    auto header_bytes = headers.to_bytes();
+    auto frame_bytes = make_frame(header_bytes, payload);
+    // two frames back to back, as they would arrive in one read
+    auto bytes = frame_bytes;
+    bytes.insert(bytes.end(), frame_bytes.begin(), frame_bytes.end());
+
+    RequestFrame frame;
+    for (size_t size = 0; size < frame_bytes.size(); ++size) {
+        ASSERT_EQ(RequestFrame::parse(bytes.data(), size, frame),
+                  FrameStatus::Incomplete);
+        if (size >= 4 + MAGIC_BYTES.size() + header_bytes.size() + 4)
+            EXPECT_EQ(frame.frame_len, frame_bytes.size());
+        else
+            EXPECT_EQ(frame.frame_len, 0);
+    }
+    ASSERT_EQ(RequestFrame::parse(bytes.data(), bytes.size(), frame),
+              FrameStatus::Complete);
+    EXPECT_EQ(frame.frame_len, frame_bytes.size());
+    EXPECT_EQ(frame.header_len, header_bytes.size());
+    EXPECT_EQ(frame.payload_len, payload.size());
+    TcpHeaders parsed_headers;
+    ASSERT_TRUE(
+        parsed_headers.from_bytes(bytes.data() + frame.header_pos,
+                                  frame.header_len));
+    EXPECT_EQ(parsed_headers.correlation_id, headers.correlation_id);
+    EXPECT_EQ(std::vector<uint8_t>(bytes.begin() + frame.payload_pos,
+                                   bytes.begin() + frame.frame_len),
+              payload);
+
+    ASSERT_EQ(RequestFrame::parse(bytes.data() + frame.frame_len,
+                                  bytes.size() - frame.frame_len, frame),
+              FrameStatus::Complete);
+    EXPECT_EQ(frame.frame_len, frame_bytes.size());
+
+    bytes[5] = 0;
+    EXPECT_EQ(RequestFrame::parse(bytes.data(), bytes.size(), frame),
+              FrameStatus::Invalid);
+}
+
 } // namespace broker
 } // namespace kafka_lite